@@ -7,11 +7,70 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <limits.h>
 #include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/xattr.h>
+#endif
 #include "imaging.h"
+#include "resample.h"
+#include "jpeg.h"
+#include "pool.h"
+#include "pyramid.h"
+#include "mmap.h"
 #include <openssl/sha.h>
 
+// sigma of the blur unsharp masks subtract.
+#define IMAGING_FILTER_SHARPEN_SIGMA 1.0
+// largest blur, which keeps the filter taps (& the cost) bounded.
+#define IMAGING_FILTER_MAX_SIGMA 20.0
+// longest side of placeholders: the default & the largest one.
+#define IMAGING_PLACEHOLDER_SIZE 32
+#define IMAGING_PLACEHOLDER_MAX 64
+// widest border, which keeps the dimensions of bordered variants bounded.
+#define IMAGING_BORDER_MAX 1000
+// names the original of the variants written beside it (imaging_disk_variant).
+#define IMAGING_VARIANT_XATTR "user.imaging.original"
+
+// resampler used by the thumbnail, resize & scale actions.
+static imaging_resampler_t imaging_resampler = IMAGING_RESAMPLER_DEFAULT;
+// create JPEG variants straight through libjpeg-turbo when possible.
+static int imaging_jpeg_direct = 0;
+// crop JPEGs losslessly when within this many pixels of the iMCU grid (-1: never).
+static long imaging_crop_tolerance = -1;
+// stream thumbnail, resize & scale of JPEG originals this large (0: never).
+static unsigned long imaging_stream_pixels = 0;
+// keep a pyramid of originals this large (0: never).
+static unsigned long imaging_pyramid_pixels = 0;
+// in this directory ("": nowhere, so never either).
+static char imaging_pyramid_path[MaxTextExtent] = "";
+// encoder profiles of JPEG & PNG variants.
+static const imaging_jpeg_profile_t imaging_jpeg_profile_default = {
+    0, 0, IMAGING_SUBSAMPLING_DEFAULT, 0, 0, 0, 0
+};
+static const imaging_png_profile_t imaging_png_profile_default = { -1, -1, 0 };
+static imaging_jpeg_profile_t imaging_jpeg_profile = {
+    0, 0, IMAGING_SUBSAMPLING_DEFAULT, 0, 0, 0, 0
+};
+static imaging_png_profile_t imaging_png_profile = { -1, -1, 0 };
+// why the last variant requested wasn't created.
+static imaging_failure_t imaging_failure = IMAGING_FAILURE_NONE;
+// the context of imgaging_get_image_data (created on first use).
+static imaging_ctx_t *imaging_default_ctx = NULL;
+// the context rendering on this thread, for what can't be handed one (eg:
+// GraphicsMagick's progress monitor, which has no client data).
+static __thread imaging_ctx_t *imaging_active_ctx = NULL;
+
+
+static int imaging_action_syntax(const char *action, const char *end);
+static int imaging_border_width(const char *action, unsigned long *width);
+static imaging_ctx_t * imaging_get_default_ctx(void);
+static imaging_resampler_t imaging_active_resampler(void);
+
 
 /******************************************************************
  * Utils
@@ -126,322 +185,1290 @@ void imaging_explode_file_path(const char *filepath, char **path, char **file, c
     (*path)[len] = '\0';
 }
 
-/******************************************************************
- * Lifecycle
- *****************************************************************/
 /*
- * No internal state to worry about just setting up GraphicsMagick.
+ * Returns a pointer into filepath at the '_' which begins the action string.
+ * The original is the shortest '_' delimited prefix of the filename which
+ * exists on disk.
+ *
+ * Returns NULL if no original exists for the given filepath.
  */
-void imaging_initialize() {
-    InitializeMagick("");
+const char * imaging_find_actions(const char *filepath) {
+    char *action_str;
+    char *path;
+    char *file;
+    char *newfile;
+    const char *ext;
+    const char *actions = NULL;
+    int path_len, ext_len, file_len;
+
+    if (strchr(filepath, '.') == NULL || strchr(filepath, '/') == NULL) {
+        return NULL;
+    }
+    (void) imaging_explode_file_path(filepath, &path, &file, &ext);
+    path_len = strlen(path);
+    ext_len = strlen(ext);
+
+    action_str = strchr(file, '_');
+    while (action_str != NULL) {
+        // build the candidate original's filename
+        file_len = (action_str - file);
+        newfile = malloc(path_len + file_len + ext_len + 1);
+        strcpy(newfile, path);
+        strncat(newfile, file, file_len);
+        newfile[path_len + file_len] = '\0';
+        strcat(newfile, ext);
+
+        if (IsAccessible(newfile)) {
+            actions = filepath + path_len + file_len;
+        }
+        free(newfile);
+
+        if (actions != NULL) {
+            break;
+        }
+        action_str = strchr(action_str + 1, '_');
+    }
+
+    // memory cleanup
+    free(file);
+    free(path);
+    return actions;
 }
 
 /*
- * No internal state to worry about just teardown of GraphicsMagick.
+ * Records original (the file a render read) on the variant filepath it
+ * just wrote beside it, so it's told apart from originals whose names look
+ * like actions (imaging_disk_variant). Without extended attributes (eg: on
+ * a file system which lacks them) the variant stays unmarked: it's served
+ * as it is but never taken for stale or purged.
  */
-void imaging_destory() {
-    DestroyMagick();
+static void imaging_mark_variant(const char *filepath, const char *original) {
+#if defined(__linux__)
+    const char *name;
+
+    name = strrchr(original, '/');
+    name = (name != NULL) ? name + 1 : original;
+    (void) setxattr(filepath, IMAGING_VARIANT_XATTR, name, strlen(name), 0);
+#else
+    (void) filepath;
+    (void) original;
+#endif
 }
 
-/******************************************************************
- * Actions
- *****************************************************************/
-Image * imaging_action_border(Image *image, const char *action)  {
-    char *token;
-    long int val;
-    char *size, *color, *endptr;
-    Image *new_image = (Image *)NULL;
-    RectangleInfo border_info;
-    ExceptionInfo exception;
-    const ColorInfo *border_color_info;
+/*
+ * Writes the variant data to filepath, marked as a variant of original,
+ * through a temporary file renamed into place: readers see either no file
+ * or all of it, never one being written. Nothing is left behind on failure.
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_write_variant(const char *filepath, const char *original,
+    const unsigned char *data, size_t data_length)
+{
+    char tmp[MaxTextExtent];
+    FILE *fp;
+    int status;
 
-    // Parse border size & color from action
-    token = strchr(action, '-');
-    if (token == NULL) {
-        DestroyImage(image);
-        return new_image;
+    if (snprintf(tmp, sizeof(tmp), "%s.%ld", filepath, (long)getpid())
+            >= (int) sizeof(tmp)) {
+        return 0;
     }
-    // parse size int ourt of action.
-    size = malloc(token - action +1);
-    strncpy(size, action, token - action);
-    size[token-action] = '\0';
-    errno = 0;
-    val = strtol(size, &endptr, 10);
-    if (errno != 0 || endptr == size) {
-        // size can't be parsed.
-        DestroyImage(image);
-        free(size);
-        return new_image;
+    // "x": another render of this process is writing it already.
+    fp = fopen(tmp, "wbx");
+    if (fp == NULL) {
+        return 0;
     }
-    border_info.width = border_info.height = val;
-    border_info.x = border_info.y = 1;
-
-    // parse color out of action
-    color = malloc(strlen(token));
-    strcpy(color, token+1);
-    GetExceptionInfo(&exception);
-    border_color_info = GetColorInfo(color, &exception);
-    if (border_color_info == (ColorInfo *)NULL) {
-        // failed to find color.
-        DestroyImage(image);
-        DestroyExceptionInfo(&exception);
-        free(size);
-        free(color);
-        return new_image;
+    status = fwrite(data, 1, data_length, fp) == data_length;
+    status = (fclose(fp) == 0) && status;
+    if (status) {
+        imaging_mark_variant(tmp, original);
+        status = rename(tmp, filepath) == 0;
     }
-    image->border_color = border_color_info->color;
-
-    // apply border
-    GetExceptionInfo(&exception);
-    new_image = BorderImage(image, &border_info, &exception);
-    // free memory
-    free(size);
-    free(color);
-    DestroyImage(image);
-    DestroyExceptionInfo(&exception);
-    return new_image;
+    if (!status) {
+        (void) unlink(tmp);
+    }
+    return status;
 }
 
-Image * imaging_action_crop(Image *image, const char *action)  {
-    Image *new_image = (Image *)NULL;
-    ExceptionInfo exception;
-    RectangleInfo geometry;
-    unsigned long height, width;
-
-    // default to current value
-    height = image->rows;
-    width = image->columns;
+int imaging_disk_variant(const char *filepath, char *original) {
+#if defined(__linux__)
+    char name[MaxTextExtent];
+    const char *dir;
+    ssize_t len;
+    size_t dir_len;
 
-    if (!imaging_parse_size(action, &height, &width)) {
-        DestroyImage(image);
-        return new_image;
+    len = getxattr(filepath, IMAGING_VARIANT_XATTR, name, sizeof(name) - 1);
+    if (len <= 0) {
+        return 0;
     }
-    // clamp size to less than current.
-    height = height < image->rows? height:image->rows;
-    width = width < image->columns? width: image->columns;
-
-    // build geometry of a centered box within the existing image.
-    geometry.x = (image->columns - width) / 2;
-    geometry.y = (image->rows - height) / 2;
-    geometry.width = width;
-    geometry.height = height;
-
-    // crop the image.
-    GetExceptionInfo(&exception);
-    new_image = CropImage(image, &geometry, &exception);
+    name[len] = '\0';
+    // the original lives in the same directory.
+    dir = strrchr(filepath, '/');
+    dir_len = (dir != NULL) ? (size_t) (dir - filepath) + 1 : 0;
+    if (strchr(name, '/') != NULL || dir_len + len >= MaxTextExtent) {
+        return 0;
+    }
+    memcpy(original, filepath, dir_len);
+    (void) strcpy(original + dir_len, name);
+    return 1;
+#else
+    (void) filepath;
+    (void) original;
+    return 0;
+#endif
+}
 
-    // free memory
-    DestroyImage(image);
-    DestroyExceptionInfo(&exception);
+int imaging_find_original(const char *filepath, char *original) {
+    const char *found, *ext;
+    size_t len;
 
-    return new_image;
+    // on disk, it's served as it is unless it's a variant the module wrote.
+    if (IsAccessible(filepath)) {
+        return imaging_disk_variant(filepath, original);
+    }
+    found = imaging_find_actions(filepath);
+    ext = (found != NULL) ? strrchr(found, '.') : NULL;
+    if (ext == NULL || strlen(filepath) >= MaxTextExtent) {
+        return 0;
+    }
+    len = found - filepath;
+    memcpy(original, filepath, len);
+    (void) strcpy(original + len, ext);
+    return 1;
 }
 
-Image * imaging_action_filter(Image *image, const char *action)  {
-    //TODO: Needs implemented. No one really uses this from what I can tell
-    // but still probably should be there for completeness sake.
-    DestroyImage(image);
-    return (Image *)NULL;
+/*
+ * Returns why the last variant requested wasn't created.
+ */
+imaging_failure_t imaging_last_failure(void) {
+    return imaging_failure;
 }
 
-Image * imaging_action_resize(Image *image, const char *action)  {
-    double org_aspect_ratio, cur_aspect_ratio;
-    unsigned long height, width;
-    Image *new_image = (Image *)NULL;
-    Image *thumb_image = (Image *)NULL;
-    RectangleInfo geometry;
-    ExceptionInfo exception;
-
-    // default to current value
-    geometry.x = geometry.y = 0;
-    height = image->rows;
-    width = image->columns;
+/*
+ * Follows the size of a columns x rows image through the actions up to
+ * ext (eg: "_t200_b5-red"), with the geometry the actions themselves use,
+ * adding the pixels each action touches to cost (when given).
+ *
+ * Returns 1 if every action looks valid otherwise 0.
+ */
+static int imaging_walk_actions(const char *actions, const char *ext,
+    unsigned long *columns, unsigned long *rows, double *cost)
+{
+    imaging_geometry_t geometry;
+    const char *end;
+    char action[MaxTextExtent];
+    unsigned long border;
+    size_t len;
+
+    for (actions++; actions < ext; actions = end + 1) {
+        end = actions + strcspn(actions, "_");
+        if (end > ext) {
+            end = ext;
+        }
+        len = end - actions;
+        if (len == 0 || len >= sizeof(action) || !imaging_action_syntax(actions, end)) {
+            return 0;
+        }
+        (void) strncpy(action, actions, len);
+        action[len] = '\0';
 
-    // bail if the size can't be parsed.
-    if (!imaging_parse_size(action, &height, &width)) {
-        DestroyImage(image);
-        return new_image;
+        if (cost != NULL) {
+            *cost += (double)*columns * *rows * (action[0] == 'f' ? 8 : 1);
+        }
+        if (action[0] == 'f') {
+            // the filters imaging_action_filter knows.
+            len = strspn(action + 1, "abcdefghijklmnopqrstuvwxyz");
+            if (!(len == 5 && strncmp(action + 1, "sharp", len) == 0) &&
+                !(len == 4 && strncmp(action + 1, "blur", len) == 0)) {
+                return 0;
+            }
+        } else if (action[0] == 'b') {
+            if (!imaging_border_width(action + 1, &border)) {
+                return 0;
+            }
+            *columns += 2 * border;
+            *rows += 2 * border;
+        } else if (imaging_action_geometry(action[0], action + 1, *columns, *rows, &geometry)) {
+            if (geometry.resize_width != 0 && geometry.resize_height != 0) {
+                *columns = geometry.resize_width;
+                *rows = geometry.resize_height;
+            }
+            if (geometry.crop_width != 0 && geometry.crop_height != 0) {
+                *columns = geometry.crop_width;
+                *rows = geometry.crop_height;
+            }
+        }
     }
+    return 1;
+}
 
-    // clamp size to less than current.
-    height = height < image->rows? height:image->rows;
-    width = width < image->columns? width: image->columns;
-
-    // geometry of crop
-    geometry.height = height;
-    geometry.width = width;
-
-    // height & width will be used to first thumbnail the image
-    // with the original aspect ratio intact.
-    org_aspect_ratio = (double)image->columns / image->rows;
-    cur_aspect_ratio = (double)width / height;
+/*
+ * Estimates the cost of creating the variant filepath: the pixels of the
+ * original (decode) plus the input pixels of every action, with filters
+ * weighted for their taps, plus the output pixels (encode). Only the
+ * header of the original is read (PingImage).
+ */
+double imaging_estimate_cost(const char *filepath) {
+    Image *image;
+    ImageInfo *image_info;
+    ExceptionInfo exception;
+    const char *actions, *ext;
+    unsigned long columns, rows;
+    double cost;
 
-    if (cur_aspect_ratio < org_aspect_ratio) {
-        // thumbnail height & crop width
-        width = height * org_aspect_ratio;
-    } else if (cur_aspect_ratio > org_aspect_ratio) {
-        // thumbnail width & crop height
-        height = width / org_aspect_ratio;
+    actions = imaging_find_actions(filepath);
+    if (actions == NULL || strlen(filepath) >= MaxTextExtent) {
+        return 0.0;
     }
+    ext = strrchr(actions, '.');
 
-    // perform thumb
+    // the original is the variant without its action string.
+    image_info = CloneImageInfo((ImageInfo *) NULL);
+    (void) strncpy(image_info->filename, filepath, actions - filepath);
+    image_info->filename[actions - filepath] = '\0';
+    (void) strcat(image_info->filename, ext);
     GetExceptionInfo(&exception);
-    thumb_image = ThumbnailImage(image, width, height, &exception);
-    if (thumb_image != (Image *)NULL) {
-        // center geometry
-        geometry.x = (thumb_image->columns - geometry.width) / 2;
-        geometry.y = (thumb_image->rows - geometry.height) / 2;
-        // perform crop
-        GetExceptionInfo(&exception);
-        new_image = CropImage(thumb_image, &geometry, &exception);
-        DestroyImage(thumb_image);
+    image = PingImage(image_info, &exception);
+    DestroyImageInfo(image_info);
+    DestroyExceptionInfo(&exception);
+    if (image == (Image *)NULL) {
+        return 0.0;
     }
-
-    // free memory
+    columns = image->columns;
+    rows = image->rows;
     DestroyImage(image);
-    DestroyExceptionInfo(&exception);
-    return new_image;
+
+    cost = (double)columns * rows;
+    (void) imaging_walk_actions(actions, ext, &columns, &rows, &cost);
+    return cost + (double)columns * rows;
 }
 
-Image * imaging_action_scale(Image *image, const char *action)  {
-    Image *new_image = (Image *)NULL;
+/*
+ * Describes the variant (or original) filepath from the header of its
+ * original alone (PingImage): no pixels are decoded and nothing is
+ * created. Performs the same security check as creating it would.
+ */
+imaging_failure_t imaging_get_meta(const char *filepath,
+    const char *salt, const char *hash, const char *white_list,
+    imaging_meta_t *meta)
+{
+    Image *image;
+    ImageInfo *image_info;
     ExceptionInfo exception;
-    unsigned long height, width;
-
-    // default to current value
-    height = image->rows;
-    width = image->columns;
-
-    // bail if the size can't be parsed.
-    if (!imaging_parse_size(action, &height, &width)) {
-        DestroyImage(image);
-        return new_image;
+    const char *actions, *ext;
+    char action_str[MaxTextExtent];
+    struct stat st;
+    int valid;
+
+    memset(meta, 0, sizeof(imaging_meta_t));
+    if (strlen(filepath) >= MaxTextExtent) {
+        return IMAGING_FAILURE_INVALID;
     }
 
-    // clamp size to less than current.
-    height = height < image->rows? height:image->rows;
-    width = width < image->columns? width: image->columns;
+    image_info = CloneImageInfo((ImageInfo *) NULL);
+    actions = imaging_find_actions(filepath);
+    if (actions == NULL) {
+        // maybe a request of the original itself.
+        if (!IsAccessible(filepath)) {
+            DestroyImageInfo(image_info);
+            return IMAGING_FAILURE_MISSING;
+        }
+        (void) strcpy(image_info->filename, filepath);
+        ext = actions = filepath + strlen(filepath);
+    } else {
+        ext = strrchr(actions, '.');
+        (void) strncpy(action_str, actions, ext - actions);
+        action_str[ext - actions] = '\0';
+        if (!imaging_actions_allowed(action_str, salt, hash, white_list)) {
+            DestroyImageInfo(image_info);
+            return IMAGING_FAILURE_FORBIDDEN;
+        }
+        (void) strncpy(image_info->filename, filepath, actions - filepath);
+        image_info->filename[actions - filepath] = '\0';
+        (void) strcat(image_info->filename, ext);
+    }
+    if (stat(image_info->filename, &st) == 0) {
+        meta->mtime = st.st_mtime;
+    }
 
-    // scale the image.
     GetExceptionInfo(&exception);
-    new_image = ResizeImage(image, width, height, BoxFilter, image->blur, &exception);
-
-    // free memory
-    DestroyImage(image);
+    image = PingImage(image_info, &exception);
+    DestroyImageInfo(image_info);
     DestroyExceptionInfo(&exception);
-    return new_image;
+    if (image == (Image *)NULL) {
+        return IMAGING_FAILURE_INVALID;
+    }
+    meta->width = image->columns;
+    meta->height = image->rows;
+    meta->frames = GetImageListLength(image);
+    (void) strcpy(meta->format, image->magick);
+    DestroyImageList(image);
+
+    meta->output_width = meta->width;
+    meta->output_height = meta->height;
+    valid = imaging_walk_actions(actions, ext, &meta->output_width,
+        &meta->output_height, NULL);
+    return valid ? IMAGING_FAILURE_NONE : IMAGING_FAILURE_INVALID;
 }
 
 /*
- * Thumbnails an image to the specified size.
+ * Returns 1 if action (eg: "c5000") leaves a columns x rows image as it
+ * is: a crop, placeholder, resize, scale or thumbnail whose geometry is the
+ * image itself (the crop, resize & scale sizes are clamped to it).
  */
+static int imaging_action_identity(const char *action,
+    unsigned long columns, unsigned long rows)
+{
+    imaging_geometry_t geometry;
 
-Image * imaging_action_thumbnail(Image *image, const char *action) {
-    unsigned long height, width;
-    Image *new_image = (Image *)NULL;
+    if (strchr("cprst", action[0]) == NULL ||
+        !imaging_action_geometry(action[0], action + 1, columns, rows, &geometry)) {
+        return 0;
+    }
+    if (geometry.resize_width != 0 &&
+        (geometry.resize_width != columns || geometry.resize_height != rows)) {
+        return 0;
+    }
+    if (geometry.crop_width != 0 &&
+        (geometry.crop_width != columns || geometry.crop_height != rows ||
+         geometry.crop_x != 0 || geometry.crop_y != 0)) {
+        return 0;
+    }
+    return 1;
+}
+
+int imaging_passthrough(const char *filepath,
+    const char *salt, const char *hash, const char *white_list,
+    char *original)
+{
+    Image *image;
+    ImageInfo *image_info;
     ExceptionInfo exception;
-    GetExceptionInfo(&exception);
+    const char *actions, *ext, *end;
+    char action[MaxTextExtent];
+    unsigned long columns, rows, frames;
+    size_t len;
 
-    // default to 0 (we'll treat this like NULL).
-    height = 0;
-    width = 0;
-    // bail if the size can't be parsed.
-    if (!imaging_parse_size(action, &height, &width)) {
-        DestroyImage(image);
-        return new_image;
+    actions = imaging_find_actions(filepath);
+    if (actions == NULL || strlen(filepath) >= MaxTextExtent) {
+        return 0;
     }
-
-    // if only one dimension was specified compute the other one
-    // preserving the aspect ratio.
-    double aspect_ratio = (double)image->columns / image->rows;
-    if (height == 0) {
-        height = width / aspect_ratio;
-    } else if (width == 0) {
-        width = height * aspect_ratio;
-    } else if (width / height != aspect_ratio) {
-        // PIL enforces aspect ratio even if you define width & height.
-        // for backwards compatibility, do the same.
-        // IMHO: This is probably an error in PIL's implementation.
-        height = width / aspect_ratio;
+    ext = strrchr(actions, '.');
+    len = ext - actions;
+    (void) strncpy(action, actions, len);
+    action[len] = '\0';
+    if (!imaging_actions_allowed(action, salt, hash, white_list)) {
+        return 0;
     }
 
-    // perform thumbnail.
-    new_image = ThumbnailImage(image, width, height, &exception);
+    // the original is the variant without its action string.
+    (void) strncpy(original, filepath, actions - filepath);
+    original[actions - filepath] = '\0';
+    (void) strcat(original, ext);
 
-    // free memory
-    DestroyImage(image);
+    image_info = CloneImageInfo((ImageInfo *) NULL);
+    (void) strcpy(image_info->filename, original);
+    GetExceptionInfo(&exception);
+    image = PingImage(image_info, &exception);
+    DestroyImageInfo(image_info);
     DestroyExceptionInfo(&exception);
-    return new_image;
-}
-
+    if (image == (Image *)NULL) {
+        return 0;
+    }
+    columns = image->columns;
+    rows = image->rows;
+    frames = GetImageListLength(image);
+    DestroyImageList(image);
 
-Image * imaging_action_echo(Image *image, const char *action) {
-    printf("In imaging_action_func: args: %s\n", action);
-    return image;
+    // renders only keep the first frame of animations.
+    if (frames != 1) {
+        return 0;
+    }
+    for (actions++; actions < ext; actions = end + 1) {
+        end = actions + strcspn(actions, "_");
+        if (end > ext) {
+            end = ext;
+        }
+        len = end - actions;
+        if (len == 0 || !imaging_action_syntax(actions, end)) {
+            return 0;
+        }
+        (void) strncpy(action, actions, len);
+        action[len] = '\0';
+        if (!imaging_action_identity(action, columns, rows)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-/******************************************************************
- * Core
- *****************************************************************/
 /*
- * Returns a pointer to a function or NULL no function is found.
- * The returned function has a type of:
- *      Image * func(Image *image, const char *action);
+ * Returns 1 if the single action from action up to end looks like one of
+ * the actions (eg: "t200", "c400x300", "b5-red", "fsharp1.0") otherwise 0.
  */
-imaging_action_func_ptr imaging_get_action_func(const char *code) {
-    static const char action_codes[] = "b c f r s t ";
-    static imaging_action_func_ptr action_funcs[6] = {
-        imaging_action_border,      // border
-        imaging_action_crop,        // crop
-        imaging_action_filter,      // filter
-        imaging_action_resize,      // resize
-        imaging_action_scale,       // scale
-        imaging_action_thumbnail,   // thumbnail
-    };
-    int offset;
-    char *cmdptr;
-    // get offset of the action code
-    cmdptr = strpbrk(action_codes, code);
-    if (cmdptr != NULL) {
-        // compute array offset and index into action_funcs with it.
-        offset = (cmdptr - action_codes) / 2;
-        return (*action_funcs[offset]);
+static int imaging_action_syntax(const char *action, const char *end) {
+    const char *p = action + 1;
+    int digits = 0;
+
+    if (action == end) {
+        return 0;
     }
-    return NULL;
-}
+    switch (*action) {
+    case 'c':
+    case 'r':
+    case 's':
+    case 't':
+        // WIDTHxHEIGHT, either can be left out.
+        for (; p < end; p++) {
+            if (*p >= '0' && *p <= '9') {
+                digits++;
+            } else if (*p != 'x') {
+                return 0;
+            }
+        }
+        return digits > 0;
 
-int
-imaging_actions_allowed(const char *action, const char *salt,
-    const char *hash,const char *white_list)
-{
-    int i, passed_sec = 1;
-    unsigned char result[SHA_DIGEST_LENGTH];
-    char computed_hash[(SHA_DIGEST_LENGTH * 2) + 1];
-    char *string;
+    case 'p':
+        // [SIZE]
+        for (; p < end; p++) {
+            if (*p < '0' || *p > '9') {
+                return 0;
+            }
+        }
+        return 1;
 
-    // if salt is defined then do security checks
-    if (salt != NULL && strlen(salt) > 0) {
-        // see if action string in in white_list
-        passed_sec = (strstr(white_list, action + 1) != NULL);
-        // if action wasn't in white_list and a hash was passed in
-        // see if the hash is valid.
-        if (!passed_sec && hash != NULL && strlen(hash) > 0) {
-            // compute hash out of own (action_string + salt)
-            string = malloc(strlen(salt) + strlen(action) + 1);
-            strcpy(string, action);
-            strcat(string, salt);
-            string[strlen(salt) + strlen(action)] = '\0';
-            SHA1((const unsigned char *)string, strlen(string), result);
-            free(string);
-            // expand the sha1 hash into hex format.
-            for(i = 0; i < SHA_DIGEST_LENGTH; i++) {
-                sprintf(computed_hash + i*2, "%02x", result[i]);
+    case 'b':
+        // SIZE-COLOR
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            digits++;
+        }
+        if (digits == 0 || p == end || *p++ != '-' || p == end) {
+            return 0;
+        }
+        for (; p < end; p++) {
+            if (!isalnum((unsigned char)*p)) {
+                return 0;
             }
-            passed_sec = (strcmp(hash, computed_hash) == 0);
         }
-    }
-    return passed_sec;
-}
+        return 1;
+
+    case 'f':
+        // NAME[AMOUNT]
+        if (p == end || !isalpha((unsigned char)*p)) {
+            return 0;
+        }
+        for (; p < end; p++) {
+            if (!isalnum((unsigned char)*p) && *p != '.') {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Returns a pointer into filepath at the '_' which begins the action string
+ * judged by the syntax of the actions alone, for originals which aren't on
+ * disk (eg: fetched from an origin). The action string is the longest run
+ * of '_' delimited segments before the extension which all look like
+ * actions, so "my_photo_t200.jpg" is "my_photo.jpg" with "_t200".
+ *
+ * Returns NULL if filepath has no actions.
+ */
+const char * imaging_parse_actions(const char *filepath) {
+    const char *file, *ext, *actions, *action, *end;
+
+    file = strrchr(filepath, '/');
+    file = (file != NULL) ? file + 1 : filepath;
+    ext = strrchr(file, '.');
+    if (ext == NULL) {
+        return NULL;
+    }
+
+    // the original's name can't be empty.
+    for (actions = strchr(file + 1, '_'); actions != NULL && actions < ext;
+         actions = strchr(actions + 1, '_'))
+    {
+        // every segment up to the extension has to be an action.
+        for (action = actions + 1; ; action = end + 1) {
+            end = strchr(action, '_');
+            if (end == NULL || end > ext) {
+                end = ext;
+            }
+            if (!imaging_action_syntax(action, end)) {
+                break;
+            }
+            if (end == ext) {
+                return actions;
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Rounds size up to the nearest of the n (ascending) buckets, down to the
+ * largest one when it's larger than them all.
+ */
+static unsigned long imaging_snap_size(unsigned long size,
+    const unsigned long *buckets, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (buckets[i] >= size) {
+            return buckets[i];
+        }
+    }
+    return buckets[n - 1];
+}
+
+size_t imaging_snap_actions(const char *actions, size_t length,
+    const unsigned long *buckets, size_t n, char *snapped, size_t size)
+{
+    const char *p, *end;
+    char *next;
+    unsigned long value;
+    double factor = 0, scaled;
+    size_t len = 0;
+    int resamples = 0, written;
+
+    if (n == 0) {
+        return 0;
+    }
+    for (p = actions, end = actions + length; p < end; p++) {
+        // a new action: only thumbnail, resize & scale sizes are snapped.
+        if (p > actions && p[-1] == '_') {
+            resamples = (*p == 't' || *p == 'r' || *p == 's');
+            factor = 0;
+        }
+        if (resamples && *p >= '0' && *p <= '9') {
+            value = strtoul(p, &next, 10);
+            if (factor == 0) {
+                // the first size given (the width, or the height alone) is
+                // snapped, out of range values (ULONG_MAX) to the largest
+                // bucket.
+                scaled = imaging_snap_size(value, buckets, n);
+                factor = value > 0 ? scaled / value : 1;
+            } else {
+                // the other follows by the same factor, keeping the aspect.
+                scaled = value * factor + 0.5;
+                if (scaled < 1) {
+                    scaled = 1;
+                } else if (scaled > ULONG_MAX) {
+                    scaled = ULONG_MAX;
+                }
+            }
+            written = snprintf(snapped + len, size - len, "%lu",
+                (unsigned long) scaled);
+            if (written < 0 || (size_t) written >= size - len) {
+                return 0;
+            }
+            len += written;
+            p = next - 1;
+            continue;
+        }
+        if (len + 1 >= size) {
+            return 0;
+        }
+        snapped[len++] = *p;
+    }
+    if (len >= size) {
+        return 0;
+    }
+    snapped[len] = '\0';
+    return len;
+}
+
+/*
+ * Copies the pixels of image into a newly allocated 8-bit RGBO buffer.
+ * Returns NULL if the pixels couldn't be read.
+ */
+static unsigned char * imaging_export_pixels(const Image *image, ExceptionInfo *exception) {
+    unsigned char *pixels, *q;
+    const PixelPacket *p;
+    unsigned long x;
+    long y;
+
+    pixels = imaging_pool_alloc(image->columns * image->rows * IMAGING_RESAMPLE_CHANNELS);
+    if (pixels == NULL) {
+        return NULL;
+    }
+    q = pixels;
+    for (y = 0; y < (long)image->rows; y++) {
+        p = AcquireImagePixels(image, 0, y, image->columns, 1, exception);
+        if (p == (const PixelPacket *)NULL) {
+            imaging_pool_free(pixels);
+            return NULL;
+        }
+        for (x = 0; x < image->columns; x++, p++) {
+            *q++ = ScaleQuantumToChar(p->red);
+            *q++ = ScaleQuantumToChar(p->green);
+            *q++ = ScaleQuantumToChar(p->blue);
+            *q++ = ScaleQuantumToChar(p->opacity);
+        }
+    }
+    return pixels;
+}
+
+/*
+ * Creates a width x height copy of image (keeping its attributes) with its
+ * pixels set from the 8-bit RGBO buffer. Returns (Image *)NULL on failure.
+ */
+static Image * imaging_import_pixels(const Image *image, const unsigned char *pixels,
+    const unsigned long width, const unsigned long height, ExceptionInfo *exception)
+{
+    Image *new_image;
+    PixelPacket *q;
+    unsigned long x;
+    long y;
+
+    new_image = CloneImage(image, width, height, 1, exception);
+    if (new_image == (Image *)NULL) {
+        return new_image;
+    }
+    new_image->storage_class = DirectClass;
+    for (y = 0; y < (long)height; y++) {
+        q = SetImagePixels(new_image, 0, y, width, 1);
+        if (q == (PixelPacket *)NULL) {
+            DestroyImage(new_image);
+            return (Image *)NULL;
+        }
+        for (x = 0; x < width; x++, q++) {
+            q->red = ScaleCharToQuantum(*pixels++);
+            q->green = ScaleCharToQuantum(*pixels++);
+            q->blue = ScaleCharToQuantum(*pixels++);
+            q->opacity = ScaleCharToQuantum(*pixels++);
+        }
+        if (!SyncImagePixels(new_image)) {
+            DestroyImage(new_image);
+            return (Image *)NULL;
+        }
+    }
+    return new_image;
+}
+
+/*
+ * Resamples image to width x height with the built-in 8-bit resampler.
+ * Returns (Image *)NULL on failure, image is left untouched.
+ */
+static Image * imaging_resample_image(const Image *image,
+    const unsigned long width, const unsigned long height,
+    imaging_filter_t filter, ExceptionInfo *exception)
+{
+    Image *new_image = (Image *)NULL;
+    unsigned char *src, *dst;
+
+    if (width == 0 || height == 0) {
+        return new_image;
+    }
+    src = imaging_export_pixels(image, exception);
+    dst = imaging_pool_alloc(width * height * IMAGING_RESAMPLE_CHANNELS);
+    if (src != NULL && dst != NULL &&
+        imaging_resample(src, image->columns, image->rows, dst, width, height, filter)) {
+        new_image = imaging_import_pixels(image, dst, width, height, exception);
+    }
+    imaging_pool_free(src);
+    imaging_pool_free(dst);
+    return new_image;
+}
+
+/******************************************************************
+ * Lifecycle
+ *****************************************************************/
+/*
+ * No internal state to worry about just setting up GraphicsMagick.
+ */
+void imaging_initialize() {
+    InitializeMagick("");
+}
+
+/*
+ * No internal state to worry about just teardown of GraphicsMagick.
+ */
+void imaging_destory() {
+    imaging_ctx_destroy(imaging_default_ctx);
+    imaging_default_ctx = NULL;
+    DestroyMagick();
+}
+
+/*
+ * Routes GraphicsMagick's allocations through the pixel buffer pool.
+ */
+void imaging_use_pool(size_t max_cached, int huge_pages) {
+    imaging_pool_init(max_cached, huge_pages);
+    MagickAllocFunctions(imaging_pool_free, imaging_pool_alloc, imaging_pool_realloc);
+}
+
+/*
+ * Makes originals be read through memory mappings (see mmap.c).
+ */
+void imaging_use_mmap(size_t max_cached) {
+    imaging_mmap_init(max_cached);
+}
+
+/*
+ * Frees the data & content_type returned by imgaging_get_image_data.
+ */
+void imaging_free(void *ptr) {
+    imaging_pool_free(ptr);
+}
+
+/*
+ * Selects the resampler used by the thumbnail, resize & scale actions.
+ */
+void imaging_set_resampler(imaging_resampler_t resampler) {
+    imaging_resampler = resampler;
+}
+
+/*
+ * Enables/disables the direct libjpeg-turbo pipeline for JPEG variants.
+ */
+void imaging_set_jpeg_direct(int enabled) {
+    imaging_jpeg_direct = enabled;
+}
+
+/*
+ * Sets how far (in pixels) a crop box may move to be made losslessly.
+ */
+void imaging_set_crop_tolerance(long tolerance) {
+    imaging_crop_tolerance = tolerance;
+}
+
+/*
+ * Sets how large (in pixels) JPEG originals have to be to get streamed.
+ */
+void imaging_set_stream_pixels(unsigned long pixels) {
+    imaging_stream_pixels = pixels;
+}
+
+/*
+ * Sets how large (in pixels) originals have to be to get a pyramid.
+ */
+void imaging_set_pyramid_pixels(unsigned long pixels) {
+    imaging_pyramid_pixels = pixels;
+}
+
+/*
+ * Sets the directory pyramid levels are kept in.
+ */
+void imaging_set_pyramid_path(const char *path) {
+    (void) snprintf(imaging_pyramid_path, sizeof(imaging_pyramid_path), "%s",
+        path != NULL ? path : "");
+}
+
+/*
+ * Sets the JPEG encoder profile (NULL: the defaults).
+ */
+void imaging_set_jpeg_profile(const imaging_jpeg_profile_t *profile) {
+    imaging_jpeg_profile = (profile != NULL) ? *profile : imaging_jpeg_profile_default;
+}
+
+/*
+ * Sets the PNG encoder profile (NULL: the defaults).
+ */
+void imaging_set_png_profile(const imaging_png_profile_t *profile) {
+    imaging_png_profile = (profile != NULL) ? *profile : imaging_png_profile_default;
+}
+
+/*
+ * GraphicsMagick's progress monitor, called every few rows of a decode,
+ * resample or encode: fails the operation once the render has to stop.
+ */
+static MagickPassFail imaging_monitor(const char *text, const magick_int64_t quantum,
+    const magick_uint64_t span, ExceptionInfo *exception)
+{
+    (void) text;
+    (void) quantum;
+    (void) span;
+
+    if (!imaging_abort_check()) {
+        return MagickPass;
+    }
+    ThrowException(exception, MonitorError, "render aborted", NULL);
+    return MagickFail;
+}
+
+/*
+ * Returns the JPEG encoder profile in use.
+ */
+const imaging_jpeg_profile_t * imaging_get_jpeg_profile(void) {
+    return &imaging_jpeg_profile;
+}
+
+/*
+ * Picks the quality of a columns x rows JPEG from the profile's size classes.
+ */
+unsigned long imaging_jpeg_quality(unsigned long quality,
+    unsigned long columns, unsigned long rows)
+{
+    double pixels = (double)columns * rows;
+
+    if (imaging_jpeg_profile.small_pixels > 0 &&
+        pixels <= imaging_jpeg_profile.small_pixels) {
+        return imaging_jpeg_profile.small_quality;
+    }
+    if (imaging_jpeg_profile.large_pixels > 0 &&
+        pixels >= imaging_jpeg_profile.large_pixels) {
+        return imaging_jpeg_profile.large_quality;
+    }
+    return quality;
+}
+
+/******************************************************************
+ * Actions
+ *****************************************************************/
+/*
+ * Parses the width of a border out of action (eg: "5-red"): a number of
+ * pixels, up to IMAGING_BORDER_MAX, followed by the color.
+ *
+ * Returns an int SUCCESS status which is 1 of successful otherwise its 0.
+ */
+static int imaging_border_width(const char *action, unsigned long *width) {
+    char *endptr;
+    long val;
+
+    errno = 0;
+    val = strtol(action, &endptr, 10);
+    if (errno != 0 || endptr == action || *endptr != '-' ||
+        val < 0 || val > IMAGING_BORDER_MAX) {
+        return 0;
+    }
+    *width = val;
+    return 1;
+}
+
+Image * imaging_action_border(Image *image, const char *action)  {
+    char *token;
+    unsigned long val;
+    char *color;
+    Image *new_image = (Image *)NULL;
+    RectangleInfo border_info;
+    ExceptionInfo exception;
+    const ColorInfo *border_color_info;
+
+    // Parse border size & color from action
+    token = strchr(action, '-');
+    if (token == NULL || !imaging_border_width(action, &val)) {
+        // size can't be parsed (or is too wide).
+        DestroyImage(image);
+        return new_image;
+    }
+    border_info.width = border_info.height = val;
+    border_info.x = border_info.y = 1;
+
+    // parse color out of action
+    color = malloc(strlen(token));
+    strcpy(color, token+1);
+    GetExceptionInfo(&exception);
+    border_color_info = GetColorInfo(color, &exception);
+    if (border_color_info == (ColorInfo *)NULL) {
+        // failed to find color.
+        DestroyImage(image);
+        DestroyExceptionInfo(&exception);
+        free(color);
+        return new_image;
+    }
+    image->border_color = border_color_info->color;
+
+    // apply border
+    GetExceptionInfo(&exception);
+    new_image = BorderImage(image, &border_info, &exception);
+    // free memory
+    free(color);
+    DestroyImage(image);
+    DestroyExceptionInfo(&exception);
+    return new_image;
+}
+
+/*
+ * Computes the geometry of a crop, placeholder, resize, scale or thumbnail
+ * action (code) applied to a columns x rows image, without touching any
+ * pixels.
+ *
+ * Returns an int SUCCESS status which is 1 of successful otherwise its 0.
+ */
+int imaging_action_geometry(char code, const char *size,
+    unsigned long columns, unsigned long rows, imaging_geometry_t *geometry)
+{
+    double org_aspect_ratio, cur_aspect_ratio, aspect_ratio;
+    unsigned long height, width;
+    char *endptr;
+
+    geometry->resize_width = geometry->resize_height = 0;
+    geometry->crop_width = geometry->crop_height = 0;
+    geometry->crop_x = geometry->crop_y = 0;
+
+    if (columns == 0 || rows == 0) {
+        return 0;
+    }
+
+    switch (code) {
+    case 'c':
+        // default to current value
+        height = rows;
+        width = columns;
+        if (!imaging_parse_size(size, &height, &width)) {
+            return 0;
+        }
+        // clamp size to less than current (& at least a pixel).
+        height = height < rows? height:rows;
+        width = width < columns? width: columns;
+        height = height > 0? height: 1;
+        width = width > 0? width: 1;
+
+        // build geometry of a centered box within the existing image.
+        geometry->crop_x = (columns - width) / 2;
+        geometry->crop_y = (rows - height) / 2;
+        geometry->crop_width = width;
+        geometry->crop_height = height;
+        return 1;
+
+    case 'p':
+        // the longest side, never larger than the image.
+        width = IMAGING_PLACEHOLDER_SIZE;
+        if (*size != '\0') {
+            errno = 0;
+            width = strtoul(size, &endptr, 10);
+            if (errno != 0 || *endptr != '\0') {
+                return 0;
+            }
+        }
+        if (width == 0 || width > IMAGING_PLACEHOLDER_MAX) {
+            return 0;
+        }
+        if (columns >= rows) {
+            width = width < columns? width: columns;
+            height = (double)width * rows / columns + 0.5;
+        } else {
+            height = width < rows? width: rows;
+            width = (double)height * columns / rows + 0.5;
+        }
+        geometry->resize_width = width > 0? width: 1;
+        geometry->resize_height = height > 0? height: 1;
+        return 1;
+
+    case 'r':
+        // default to current value
+        height = rows;
+        width = columns;
+        if (!imaging_parse_size(size, &height, &width)) {
+            return 0;
+        }
+        // clamp size to less than current (& at least a pixel).
+        height = height < rows? height:rows;
+        width = width < columns? width: columns;
+        height = height > 0? height: 1;
+        width = width > 0? width: 1;
+
+        // geometry of crop
+        geometry->crop_height = height;
+        geometry->crop_width = width;
+
+        // height & width will be used to first thumbnail the image
+        // with the original aspect ratio intact.
+        org_aspect_ratio = (double)columns / rows;
+        cur_aspect_ratio = (double)width / height;
+
+        if (cur_aspect_ratio < org_aspect_ratio) {
+            // thumbnail height & crop width
+            width = height * org_aspect_ratio;
+        } else if (cur_aspect_ratio > org_aspect_ratio) {
+            // thumbnail width & crop height
+            height = width / org_aspect_ratio;
+        }
+        geometry->resize_width = width > 0? width: 1;
+        geometry->resize_height = height > 0? height: 1;
+
+        // center the crop within the thumbnail
+        geometry->crop_x = (width - geometry->crop_width) / 2;
+        geometry->crop_y = (height - geometry->crop_height) / 2;
+        return 1;
+
+    case 's':
+        // default to current value
+        height = rows;
+        width = columns;
+        if (!imaging_parse_size(size, &height, &width)) {
+            return 0;
+        }
+        // clamp size to less than current (& at least a pixel).
+        height = height < rows? height:rows;
+        width = width < columns? width: columns;
+        geometry->resize_height = height > 0? height: 1;
+        geometry->resize_width = width > 0? width: 1;
+        return 1;
+
+    case 't':
+        // default to 0 (we'll treat this like NULL).
+        height = 0;
+        width = 0;
+        if (!imaging_parse_size(size, &height, &width)) {
+            return 0;
+        }
+
+        // if only one dimension was specified compute the other one
+        // preserving the aspect ratio.
+        aspect_ratio = (double)columns / rows;
+        if (height == 0) {
+            height = width / aspect_ratio;
+        } else if (width == 0) {
+            width = height * aspect_ratio;
+        } else if (width / height != aspect_ratio) {
+            // PIL enforces aspect ratio even if you define width & height.
+            // for backwards compatibility, do the same.
+            // IMHO: This is probably an error in PIL's implementation.
+            height = width / aspect_ratio;
+        }
+        // eg: "t1" of a wide image would be 0 rows high.
+        geometry->resize_width = width > 0? width: 1;
+        geometry->resize_height = height > 0? height: 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Applies the geometry of a crop, resize, scale or thumbnail action (code)
+ * to image: resamples it to the resize size, then crops the centered box.
+ * The geometry may have been computed against a larger image than this one
+ * (eg: the original of a pyramid level). Destroys image.
+ */
+static Image * imaging_apply_geometry(Image *image, char code,
+    const imaging_geometry_t *geometry)
+{
+    Image *new_image = image;
+    Image *tmp_image;
+    RectangleInfo box;
+    ExceptionInfo exception;
+
+    GetExceptionInfo(&exception);
+    if (geometry->resize_width != 0 || geometry->resize_height != 0) {
+        if (imaging_active_resampler() == IMAGING_RESAMPLER_FAST) {
+            new_image = imaging_resample_image(image,
+                geometry->resize_width, geometry->resize_height,
+                code == 's' ? IMAGING_FILTER_BOX : IMAGING_FILTER_LANCZOS, &exception);
+        } else if (code == 's') {
+            new_image = ResizeImage(image,
+                geometry->resize_width, geometry->resize_height,
+                BoxFilter, image->blur, &exception);
+        } else {
+            new_image = ThumbnailImage(image,
+                geometry->resize_width, geometry->resize_height, &exception);
+        }
+        DestroyImage(image);
+    }
+
+    if (new_image != (Image *)NULL && geometry->crop_width != 0) {
+        box.x = geometry->crop_x;
+        box.y = geometry->crop_y;
+        box.width = geometry->crop_width;
+        box.height = geometry->crop_height;
+        tmp_image = CropImage(new_image, &box, &exception);
+        DestroyImage(new_image);
+        new_image = tmp_image;
+    }
+
+    // free memory
+    DestroyExceptionInfo(&exception);
+    return new_image;
+}
+
+Image * imaging_action_crop(Image *image, const char *action)  {
+    imaging_geometry_t action_geometry;
+
+    if (!imaging_action_geometry('c', action, image->columns, image->rows, &action_geometry)) {
+        DestroyImage(image);
+        return (Image *)NULL;
+    }
+    return imaging_apply_geometry(image, 'c', &action_geometry);
+}
+
+/*
+ * Filters an image, action is NAME[AMOUNT]:
+ *  sharp[AMOUNT]   unsharp mask of the given amount (default 1.0, up to 16)
+ *  blur[SIGMA]     gaussian blur of the given sigma in pixels (default 1.0,
+ *                  up to IMAGING_FILTER_MAX_SIGMA)
+ * Eg: "fsharp1.5", "fblur2". Filters run on 8-bit pixels with the same SIMD
+ * kernels as the fast resampler.
+ */
+Image * imaging_action_filter(Image *image, const char *action)  {
+    Image *new_image = (Image *)NULL;
+    ExceptionInfo exception;
+    const char *name = action;
+    char *endptr;
+    double amount = 1.0;
+    size_t name_len;
+    unsigned char *src, *dst = NULL;
+    int status = 0;
+
+    // split the name from the amount.
+    name_len = strspn(action, "abcdefghijklmnopqrstuvwxyz");
+    if (action[name_len] != '\0') {
+        errno = 0;
+        amount = strtod(action + name_len, &endptr);
+        if (errno != 0 || endptr == action + name_len || *endptr != '\0') {
+            DestroyImage(image);
+            return new_image;
+        }
+    }
+
+    GetExceptionInfo(&exception);
+    src = imaging_export_pixels(image, &exception);
+    if (src != NULL) {
+        dst = imaging_pool_alloc(image->columns * image->rows * IMAGING_RESAMPLE_CHANNELS);
+    }
+    if (dst != NULL) {
+        if (name_len == 5 && strncmp(name, "sharp", name_len) == 0) {
+            status = imaging_sharpen(src, dst, image->columns, image->rows,
+                IMAGING_FILTER_SHARPEN_SIGMA, amount);
+        } else if (name_len == 4 && strncmp(name, "blur", name_len) == 0) {
+            status = amount <= IMAGING_FILTER_MAX_SIGMA &&
+                imaging_blur(src, dst, image->columns, image->rows, amount);
+        }
+    }
+    if (status) {
+        new_image = imaging_import_pixels(image, dst,
+            image->columns, image->rows, &exception);
+    }
+
+    // free memory
+    imaging_pool_free(src);
+    imaging_pool_free(dst);
+    DestroyImage(image);
+    DestroyExceptionInfo(&exception);
+    return new_image;
+}
+
+/*
+ * Shrinks an image into a placeholder (eg: for LQIP) whose longest side is
+ * action pixels (default 32, up to 64). Originals read for one are only
+ * decoded at the smallest DCT scale which is still large enough.
+ */
+Image * imaging_action_placeholder(Image *image, const char *action) {
+    imaging_geometry_t action_geometry;
+
+    if (!imaging_action_geometry('p', action, image->columns, image->rows, &action_geometry)) {
+        DestroyImage(image);
+        return (Image *)NULL;
+    }
+    return imaging_apply_geometry(image, 'p', &action_geometry);
+}
+
+Image * imaging_action_resize(Image *image, const char *action)  {
+    imaging_geometry_t action_geometry;
+
+    // bail if the size can't be parsed.
+    if (!imaging_action_geometry('r', action, image->columns, image->rows, &action_geometry)) {
+        DestroyImage(image);
+        return (Image *)NULL;
+    }
+    // thumbnail, then crop the centered box.
+    return imaging_apply_geometry(image, 'r', &action_geometry);
+}
+
+Image * imaging_action_scale(Image *image, const char *action)  {
+    imaging_geometry_t action_geometry;
+
+    // bail if the size can't be parsed.
+    if (!imaging_action_geometry('s', action, image->columns, image->rows, &action_geometry)) {
+        DestroyImage(image);
+        return (Image *)NULL;
+    }
+    return imaging_apply_geometry(image, 's', &action_geometry);
+}
+
+/*
+ * Thumbnails an image to the specified size.
+ */
+
+Image * imaging_action_thumbnail(Image *image, const char *action) {
+    imaging_geometry_t action_geometry;
+
+    // bail if the size can't be parsed.
+    if (!imaging_action_geometry('t', action, image->columns, image->rows, &action_geometry)) {
+        DestroyImage(image);
+        return (Image *)NULL;
+    }
+    return imaging_apply_geometry(image, 't', &action_geometry);
+}
+
+
+Image * imaging_action_echo(Image *image, const char *action) {
+    printf("In imaging_action_func: args: %s\n", action);
+    return image;
+}
+
+/******************************************************************
+ * Core
+ *****************************************************************/
+/*
+ * Returns a pointer to a function or NULL no function is found.
+ * The returned function has a type of:
+ *      Image * func(Image *image, const char *action);
+ */
+imaging_action_func_ptr imaging_get_action_func(const char *code) {
+    static const char action_codes[] = "b c f p r s t ";
+    static imaging_action_func_ptr action_funcs[7] = {
+        imaging_action_border,      // border
+        imaging_action_crop,        // crop
+        imaging_action_filter,      // filter
+        imaging_action_placeholder, // placeholder
+        imaging_action_resize,      // resize
+        imaging_action_scale,       // scale
+        imaging_action_thumbnail,   // thumbnail
+    };
+    int offset;
+    char *cmdptr;
+    // get offset of the action code (its first character only, "fblur"
+    // isn't a border).
+    cmdptr = (code[0] != '\0' && code[0] != ' ') ? strchr(action_codes, code[0]) : NULL;
+    if (cmdptr != NULL) {
+        // compute array offset and index into action_funcs with it.
+        offset = (cmdptr - action_codes) / 2;
+        return (*action_funcs[offset]);
+    }
+    return NULL;
+}
+
+void imaging_actions_hash(const char *action, const char *salt, char *hash) {
+    int i;
+    unsigned char result[SHA_DIGEST_LENGTH];
+    char *string;
+
+    // hash out of (action_string + salt)
+    string = malloc(strlen(salt) + strlen(action) + 1);
+    strcpy(string, action);
+    strcat(string, salt);
+    string[strlen(salt) + strlen(action)] = '\0';
+    SHA1((const unsigned char *)string, strlen(string), result);
+    free(string);
+    // expand the sha1 hash into hex format.
+    for(i = 0; i < SHA_DIGEST_LENGTH; i++) {
+        sprintf(hash + i*2, "%02x", result[i]);
+    }
+}
+
+int
+imaging_actions_allowed(const char *action, const char *salt,
+    const char *hash,const char *white_list)
+{
+    int passed_sec = 1;
+    char computed_hash[IMAGING_HASH_LENGTH + 1];
+
+    // if salt is defined then do security checks
+    if (salt != NULL && strlen(salt) > 0) {
+        // see if action string in in white_list
+        passed_sec = (strstr(white_list, action + 1) != NULL);
+        // if action wasn't in white_list and a hash was passed in
+        // see if the hash is valid.
+        if (!passed_sec && hash != NULL && strlen(hash) > 0) {
+            imaging_actions_hash(action, salt, computed_hash);
+            passed_sec = (strcmp(hash, computed_hash) == 0);
+        }
+    }
+    return passed_sec;
+}
 
 
 /**
@@ -462,9 +1489,12 @@ void imaging_apply_actions(Image **image, char *actions) {
         action[len] = '\0';
 
         imaging_action_func_ptr func = imaging_get_action_func(action);
-        // apply action or bail if none existed.
+        // apply action or bail if none existed (or the render has to stop).
         if (func == NULL) {
             (*image) = (Image *)NULL; // break out of loop next time around
+        } else if (imaging_abort_check()) {
+            DestroyImage(*image);
+            (*image) = (Image *)NULL;
         } else {
             (*image) = func(*image, action+1);
             // cleanup the memory of the current_image
@@ -476,102 +1506,768 @@ void imaging_apply_actions(Image **image, char *actions) {
 }
 
 /*
- * Returns an Image * (which can point to NULL) along with updating image_info
- * and exception (if there was an exception encountered).
+ * Reads image_info->filename, decoding it straight from a memory mapping
+ * when imaging_use_mmap was called.
+ */
+Image * imaging_read_image(const ImageInfo *image_info, ExceptionInfo *exception) {
+    Image *image;
+    const unsigned char *data;
+    size_t length;
+
+    data = imaging_mmap_open(image_info->filename, &length);
+    if (data == NULL) {
+        return ReadImage(image_info, exception);
+    }
+    image = BlobToImage(image_info, data, length, exception);
+    imaging_mmap_close(data);
+    return image;
+}
+
+/*
+ * Reads image_info->filename, a JPEG, with a size hint so the decoder only
+ * decodes it at the smallest DCT scale (1/2, 1/4 or 1/8) which is still at
+ * least columns x rows.
+ */
+static Image * imaging_read_scaled(ImageInfo *image_info,
+    unsigned long columns, unsigned long rows, ExceptionInfo *exception)
+{
+    Image *image;
+    char size[MaxTextExtent];
+
+    (void) snprintf(size, sizeof(size), "%lux%lu", columns, rows);
+    (void) CloneString(&image_info->size, size);
+    image = imaging_read_image(image_info, exception);
+    (void) CloneString(&image_info->size, (const char *) NULL);
+    return image;
+}
+
+/*
+ * Reads the original image_info->filename which actions (eg: "t200_b5-red")
+ * are applied to. When the original is at least imaging_pyramid_pixels
+ * large & the first action is a placeholder, thumbnail, resize or scale,
+ * that action is applied to the smallest level of the original's pyramid
+ * which is still at least its size instead, & applied is set to the length
+ * of that action. Otherwise JPEG originals of placeholders are decoded at a
+ * reduced DCT scale.
+ */
+static Image * imaging_read_original(ImageInfo *image_info, const char *actions,
+    size_t *applied, ExceptionInfo *exception)
+{
+    Image *image;
+    ExceptionInfo pyramid_exception;
+    imaging_geometry_t geometry;
+    char action[MaxTextExtent];
+    char magick[MaxTextExtent];
+    unsigned long columns, rows;
+    size_t len;
+    int have_geometry, pyramids;
+
+    *applied = 0;
+    pyramids = imaging_pyramid_pixels > 0 && imaging_pyramid_path[0] != '\0';
+    len = strcspn(actions, "_");
+    if (len == 0 || len >= sizeof(action) || strchr("prst", actions[0]) == NULL ||
+        (!pyramids && actions[0] != 'p')) {
+        return imaging_read_image(image_info, exception);
+    }
+    (void) strncpy(action, actions, len);
+    action[len] = '\0';
+
+    // only the header is needed for the size of the original.
+    GetExceptionInfo(&pyramid_exception);
+    image = PingImage(image_info, &pyramid_exception);
+    if (image == (Image *)NULL) {
+        DestroyExceptionInfo(&pyramid_exception);
+        return imaging_read_image(image_info, exception);
+    }
+    columns = image->columns;
+    rows = image->rows;
+    (void) strcpy(magick, image->magick);
+    DestroyImage(image);
+
+    image = (Image *)NULL;
+    have_geometry = imaging_action_geometry(action[0], action + 1, columns, rows, &geometry);
+    if (have_geometry && pyramids &&
+        (double)columns * rows >= (double)imaging_pyramid_pixels) {
+        image = imaging_pyramid_level(image_info, imaging_pyramid_path,
+            columns, rows, geometry.resize_width, geometry.resize_height,
+            &pyramid_exception);
+    }
+    DestroyExceptionInfo(&pyramid_exception);
+    if (image == (Image *)NULL) {
+        // the placeholder itself is applied to whatever is decoded.
+        if (have_geometry && action[0] == 'p' && LocaleCompare(magick, "JPEG") == 0) {
+            return imaging_read_scaled(image_info,
+                geometry.resize_width, geometry.resize_height, exception);
+        }
+        return imaging_read_image(image_info, exception);
+    }
+
+    // the variant is encoded in the original's format, not the level's.
+    (void) strcpy(image->magick, magick);
+    image = imaging_apply_geometry(image, action[0], &geometry);
+    if (image == (Image *)NULL) {
+        // callers tell a failed read by its exception.
+        ThrowException(exception, OptionError, "unable to apply action", action);
+        return image;
+    }
+    *applied = len;
+    return image;
+}
+
+/*
+ * Tries creating the JPEG variant filepath through libjpeg-turbo, without
+ * GraphicsMagick: either as a lossless crop, streamed when the original is
+ * large enough or, with the direct pipeline, for crop, resize, scale &
+ * thumbnail actions on JPEG originals.
  *
- * Tries to create an image by decoding image_info->filename into an original
- * image & a series of operations to perform on that image.
+ * Returns 1 if it was created (data is set) otherwise 0, in which case the
+ * GraphicsMagick path should be used.
  */
-Image * imgaging_create_image(
-    ImageInfo *image_info, ExceptionInfo *exception,
+static int imaging_create_jpeg_data(
+    const char *filepath,
+    unsigned char **data, size_t *data_length,
     const char *salt, const char *hash,
     const unsigned long quality,
     const char *white_list,
     const int write_to_disk)
 {
-    Image *image = (Image *)NULL;
-    char *action_str;
-    char *path;
-    char *file;
-    char *newfile;
-    const char *ext;
-    char *orginal_filename = strdup(image_info->filename);
-    (void) imaging_explode_file_path(image_info->filename, &path, &file, &ext);
-    int path_len = strlen(path), ext_len = strlen(ext);
-    int file_len;
-    int passed_sec = 1;
+    const char *actions, *ext;
+    char *action_str, *original;
+    size_t actions_len, original_len;
+    int status = 0;
 
-    // split file on '_'
-    action_str = strchr(file, '_');
-    while(action_str != NULL) {
-        // build image filename
-        file_len = (action_str - file);
-        newfile = malloc(path_len + file_len + ext_len + 1);
-        strcpy(newfile, path);
-        strncat(newfile, file, file_len);
-        newfile[path_len + file_len] = '\0';
-        strcat(newfile, ext);
-        (void) strcpy(image_info->filename, newfile);
-        free(newfile);
+    ext = strrchr(filepath, '.');
+    if (ext == NULL || (strcasecmp(ext, ".jpg") != 0 && strcasecmp(ext, ".jpeg") != 0)) {
+        return 0;
+    }
+    actions = imaging_find_actions(filepath);
+    if (actions == NULL || actions >= ext) {
+        return 0;
+    }
 
-        if (IsAccessible(image_info->filename)) {
-            // try loading the image
-            GetExceptionInfo(exception);
-            image = ReadImage(image_info, exception);
-            if (exception->severity != UndefinedException) {
-                break;
-            }
-        } else {
-            // add one more action_str segment to the filename.
-            action_str = strchr(action_str + 1, '_');
+    // split filepath into the action string & the original's filename.
+    actions_len = ext - actions;
+    action_str = malloc(actions_len + 1);
+    strncpy(action_str, actions, actions_len);
+    action_str[actions_len] = '\0';
+    original_len = actions - filepath;
+    original = malloc(original_len + strlen(ext) + 1);
+    strncpy(original, filepath, original_len);
+    strcpy(original + original_len, ext);
+
+    if (imaging_actions_allowed(action_str, salt, hash, white_list)) {
+        if (imaging_crop_tolerance >= 0) {
+            status = imaging_jpeg_crop(original, action_str + 1,
+                imaging_crop_tolerance, data, data_length);
+        }
+        if (!status && imaging_stream_pixels > 0) {
+            status = imaging_jpeg_stream(original, action_str + 1,
+                imaging_stream_pixels, quality, data, data_length);
+        }
+        if (!status && imaging_jpeg_direct && imaging_jpeg_supports(action_str + 1)) {
+            status = imaging_jpeg_create(original, action_str + 1, quality, data, data_length);
         }
+    }
+    if (status && write_to_disk != 0) {
+        (void) imaging_write_variant(filepath, original, *data, *data_length);
+    }
 
-        // stop if file was found and opened it.
-        if (image != (Image *)NULL) {
-            break;
+    // memory cleanup
+    free(action_str);
+    free(original);
+    return status;
+}
+
+/******************************************************************
+ * Public API
+ *****************************************************************/
+/*
+ * Applies the encoder profile of image's format to image_info (& image).
+ */
+static void imaging_apply_profile(ImageInfo *image_info, Image *image,
+    ExceptionInfo *exception)
+{
+    char definition[MaxTextExtent];
+    static const char *sampling_factors[] = { NULL, "1x1", "2x1", "2x2" };
+
+    if (LocaleCompare(image->magick, "JPEG") == 0) {
+        image_info->quality = imaging_jpeg_quality(image_info->quality,
+            image->columns, image->rows);
+        if (imaging_jpeg_profile.progressive) {
+            image_info->interlace = LineInterlace;
+        }
+        if (imaging_jpeg_profile.optimize) {
+            (void) AddDefinitions(image_info, "jpeg:optimize-coding=true", exception);
+        }
+        if (imaging_jpeg_profile.subsampling != IMAGING_SUBSAMPLING_DEFAULT) {
+            (void) CloneString(&image_info->sampling_factor,
+                sampling_factors[imaging_jpeg_profile.subsampling]);
+        }
+    } else if (LocaleCompare(image->magick, "PNG") == 0) {
+        // GraphicsMagick takes the zlib level from the tens of the quality.
+        if (imaging_png_profile.level >= 0) {
+            image_info->quality = imaging_png_profile.level * 10 + image_info->quality % 10;
+        }
+        if (imaging_png_profile.strategy >= 0) {
+            (void) snprintf(definition, sizeof(definition),
+                "png:compression-strategy=%d", imaging_png_profile.strategy);
+            (void) AddDefinitions(image_info, definition, exception);
+        }
+        // few enough colors for a palette, so reducing to one is lossless.
+        if (imaging_png_profile.palette && image->storage_class != PseudoClass &&
+            GetNumberColors(image, (FILE *) NULL, exception) <= 256) {
+            (void) SetImageType(image, image->matte ? PaletteMatteType : PaletteType);
         }
     }
+}
+
+/*
+ * Encodes image into data, in the format image_info/image name, and sets
+ * the content_type of it. Destroys image.
+ */
+static void imaging_encode_image(ImageInfo *image_info, Image *image,
+    unsigned char **data, size_t *data_length,
+    char **content_type, size_t *content_type_length,
+    ExceptionInfo *exception)
+{
+    imaging_apply_profile(image_info, image, exception);
+    *content_type = MagickToMime(image->magick);
+    *content_type_length = strlen(*content_type);
+    *data = ImageToBlob(image_info, image, data_length, exception);
+    DestroyImage(image);
+}
 
-    passed_sec = imaging_actions_allowed(action_str, salt, hash, white_list);
+/******************************************************************
+ * Render contexts
+ *****************************************************************/
+struct imaging_ctx_s {
+    ImageInfo *image_info;
+    unsigned long default_quality;
+    ExceptionInfo exception;
+    // scratch: the variant, its original & action string, nul terminated.
+    char filepath[MaxTextExtent];
+    char original[MaxTextExtent];
+    char actions[MaxTextExtent];
+    char *hash;
+    size_t hash_size;
+    // the render's (imaging_params_t), read by the actions.
+    imaging_resampler_t resampler;
+    char content_type[MaxTextExtent];
+    char message[MaxTextExtent];
+    // see imaging_ctx_set_abort, aborted sticks until the next render.
+    imaging_abort_handler_t abort_handler;
+    void *abort_data;
+    int aborted;
+};
+
+static double imaging_now(void) {
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
 
-    // if security failed and we have an image release it now.
-    if (!passed_sec && image != (Image *)NULL) {
-        DestroyImage(image);
-        image = (Image *)NULL;
+/*
+ * Undoes what the last render changed in ctx's ImageInfo (imaging_apply_profile)
+ * & clears its exception.
+ */
+static void imaging_ctx_reset(imaging_ctx_t *ctx) {
+    ImageInfo *image_info = ctx->image_info;
+
+    image_info->quality = ctx->default_quality;
+    image_info->interlace = NoInterlace;
+    (void) CloneString(&image_info->sampling_factor, (const char *) NULL);
+    (void) RemoveDefinitions(image_info, "jpeg:optimize-coding");
+    (void) RemoveDefinitions(image_info, "png:compression-strategy");
+
+    DestroyExceptionInfo(&ctx->exception);
+    GetExceptionInfo(&ctx->exception);
+    ctx->message[0] = '\0';
+    ctx->aborted = 0;
+}
+
+/*
+ * Returns 1 if the variant ctx->filepath, which is on disk, is older than
+ * its original otherwise 0. Replacing the original (eg: renaming a new file
+ * over it) moves its ctime even when its mtime is older, so both count.
+ *
+ * Only variants the module wrote have an original (imaging_disk_variant):
+ * with "my.jpg" beside it, "my_photo.jpg" is an original of its own.
+ */
+static int imaging_ctx_stale(imaging_ctx_t *ctx) {
+    struct stat variant_stat, original_stat;
+
+    if (!imaging_disk_variant(ctx->filepath, ctx->original) ||
+        stat(ctx->filepath, &variant_stat) != 0) {
+        return 0;
+    }
+
+    return stat(ctx->original, &original_stat) == 0 &&
+           (original_stat.st_mtime > variant_stat.st_mtime ||
+            original_stat.st_ctime > variant_stat.st_mtime);
+}
+
+/*
+ * Keeps GraphicsMagick's reason of a failure in ctx->message.
+ */
+static imaging_error_t imaging_ctx_fail(imaging_ctx_t *ctx, imaging_error_t error) {
+    if (ctx->exception.severity != UndefinedException) {
+        (void) snprintf(ctx->message, sizeof(ctx->message), "%s%s%s",
+            ctx->exception.reason ? ctx->exception.reason : "",
+            ctx->exception.description ? ": " : "",
+            ctx->exception.description ? ctx->exception.description : "");
     }
+    return error;
+}
 
-    // Apply transformations if image exists
-    if (image != (Image *)NULL) {
-        imaging_apply_actions(&image, ++action_str); // remove '_' prefix.
+/*
+ * Encodes image (which is destroyed) into result.
+ */
+static imaging_error_t imaging_ctx_encode(imaging_ctx_t *ctx, Image *image,
+    imaging_result_t *result)
+{
+    char *content_type;
+    size_t content_type_length;
+
+    imaging_encode_image(ctx->image_info, image,
+        &result->data, &result->data_length,
+        &content_type, &content_type_length, &ctx->exception);
+    if (content_type != NULL) {
+        (void) snprintf(ctx->content_type, sizeof(ctx->content_type), "%s", content_type);
+        imaging_free(content_type);
+    }
+    if (result->data == NULL) {
+        return imaging_ctx_fail(ctx, ctx->aborted ? IMAGING_ERROR_ABORTED :
+            IMAGING_ERROR_ENCODE);
     }
+    result->content_type = ctx->content_type;
+    result->content_type_length = strlen(ctx->content_type);
+    return IMAGING_OK;
+}
 
+imaging_ctx_t * imaging_ctx_create(void) {
+    imaging_ctx_t *ctx;
 
-    if (image != (Image *)NULL) {
-        // set the filename back to its original
-        strcpy(image_info->filename, orginal_filename);
-        strcpy(image->filename, orginal_filename);
-        // write the image to disk
-        image_info->quality = quality;
-        // Remove any profile data (stuff like EXIF) before writing to disk.
-        ProfileImage(image, "*", 0, 0, 0);
-        if (write_to_disk != 0) {
-            WriteImage(image_info, image);
+    ctx = calloc(1, sizeof(imaging_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    ctx->image_info = CloneImageInfo((ImageInfo *) NULL);
+    ctx->hash_size = 64;
+    ctx->hash = malloc(ctx->hash_size);
+    if (ctx->image_info == (ImageInfo *) NULL || ctx->hash == NULL) {
+        if (ctx->image_info != (ImageInfo *) NULL) {
+            DestroyImageInfo(ctx->image_info);
         }
+        free(ctx->hash);
+        free(ctx);
+        return NULL;
     }
+    ctx->default_quality = ctx->image_info->quality;
+    GetExceptionInfo(&ctx->exception);
+    return ctx;
+}
 
-    // memory cleanup
-    free(file);
-    free(path);
-    free(orginal_filename);
-    return image;
+void imaging_ctx_destroy(imaging_ctx_t *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    DestroyImageInfo(ctx->image_info);
+    DestroyExceptionInfo(&ctx->exception);
+    free(ctx->hash);
+    free(ctx);
+}
+
+const char * imaging_ctx_message(const imaging_ctx_t *ctx) {
+    return ctx->message;
+}
+
+/*
+ * GraphicsMagick's progress monitor is per process, so it stays installed
+ * once a context has a handler; renders without one pass right through.
+ */
+void imaging_ctx_set_abort(imaging_ctx_t *ctx, imaging_abort_handler_t handler,
+    void *data)
+{
+    ctx->abort_handler = handler;
+    ctx->abort_data = data;
+    ctx->aborted = 0;
+    if (handler != NULL) {
+        (void) SetMonitorHandler(imaging_monitor);
+    }
+}
+
+const char * imaging_error_string(imaging_error_t error) {
+    static const char *strings[] = {
+        "ok", "invalid path", "no original", "forbidden", "decode failed",
+        "action failed", "encode failed", "out of memory", "aborted"
+    };
+
+    if ((unsigned) error >= sizeof(strings) / sizeof(strings[0])) {
+        return "unknown error";
+    }
+    return strings[error];
+}
+
+/*
+ * Sets what renders on the default context check to stop early (NULL:
+ * nothing).
+ */
+void imaging_set_abort(imaging_abort_handler_t handler, void *data) {
+    imaging_ctx_t *ctx;
+
+    ctx = imaging_get_default_ctx();
+    if (ctx != NULL) {
+        imaging_ctx_set_abort(ctx, handler, data);
+    }
+}
+
+/*
+ * Asks the abort handler of the context rendering on this thread, once the
+ * render wasn't told to stop yet.
+ */
+int imaging_abort_check(void) {
+    imaging_ctx_t *ctx = imaging_active_ctx;
+
+    if (ctx == NULL) {
+        return 0;
+    }
+    if (!ctx->aborted && ctx->abort_handler != NULL &&
+        ctx->abort_handler(ctx->abort_data)) {
+        ctx->aborted = 1;
+    }
+    return ctx->aborted;
+}
+
+/*
+ * The resampler of the render on this thread (the process' one outside of
+ * renders).
+ */
+static imaging_resampler_t imaging_active_resampler(void) {
+    return (imaging_active_ctx != NULL) ? imaging_active_ctx->resampler :
+        imaging_resampler;
+}
+
+/*
+ * Readies ctx for a render of filepath: clears what the last one left &
+ * copies filepath, hash & the resampler into it.
+ */
+static imaging_error_t imaging_ctx_start(imaging_ctx_t *ctx,
+    const char *filepath, size_t filepath_length,
+    const char *hash, size_t hash_length,
+    const imaging_params_t *params, imaging_result_t *result)
+{
+    char *hash_buf;
+
+    memset(result, 0, sizeof(imaging_result_t));
+    imaging_ctx_reset(ctx);
+    ctx->resampler = params->resampler;
+
+    if (filepath_length == 0 || filepath_length >= sizeof(ctx->filepath)) {
+        return IMAGING_ERROR_PATH;
+    }
+    memcpy(ctx->filepath, filepath, filepath_length);
+    ctx->filepath[filepath_length] = '\0';
+
+    if (hash_length >= ctx->hash_size) {
+        hash_buf = realloc(ctx->hash, hash_length + 1);
+        if (hash_buf == NULL) {
+            return IMAGING_ERROR_MEMORY;
+        }
+        ctx->hash = hash_buf;
+        ctx->hash_size = hash_length + 1;
+    }
+    if (hash_length > 0) {
+        memcpy(ctx->hash, hash, hash_length);
+    }
+    ctx->hash[hash_length] = '\0';
+
+    // eg: the client left while the render was queued.
+    if (imaging_abort_check()) {
+        return IMAGING_ERROR_ABORTED;
+    }
+    return IMAGING_OK;
+}
+
+/*
+ * The pipeline of imgaging_get_image_data on a context: the variant itself
+ * if it's on disk (& not older than its original), a libjpeg-turbo pipeline or
+ * GraphicsMagick.
+ */
+static imaging_error_t imaging_ctx_run(imaging_ctx_t *ctx,
+    const char *filepath, size_t filepath_length,
+    const char *hash, size_t hash_length,
+    const imaging_params_t *params, imaging_result_t *result)
+{
+    Image *image;
+    char *actions;
+    const char *found, *ext;
+    size_t applied, len;
+    double start, mark;
+    imaging_error_t error;
+
+    start = imaging_now();
+    error = imaging_ctx_start(ctx, filepath, filepath_length, hash, hash_length,
+        params, result);
+    if (error != IMAGING_OK) {
+        return error;
+    }
+
+    // the variant is on disk already (& its original didn't change since).
+    if (IsAccessible(ctx->filepath) && !imaging_ctx_stale(ctx)) {
+        (void) strcpy(ctx->image_info->filename, ctx->filepath);
+        image = imaging_read_image(ctx->image_info, &ctx->exception);
+        mark = imaging_now();
+        result->timings.read = mark - start;
+        if (image == (Image *)NULL) {
+            error = imaging_ctx_fail(ctx, IMAGING_ERROR_DECODE);
+        } else {
+            error = imaging_ctx_encode(ctx, image, result);
+            result->timings.encode = imaging_now() - mark;
+        }
+        result->timings.total = imaging_now() - start;
+        return error;
+    }
+
+    // created straight through libjpeg-turbo, no Image involved.
+    if ((imaging_jpeg_direct || imaging_crop_tolerance >= 0 || imaging_stream_pixels > 0) &&
+        imaging_create_jpeg_data(ctx->filepath, &result->data, &result->data_length,
+            params->salt, ctx->hash, params->quality, params->white_list,
+            params->write_to_disk)) {
+        (void) strcpy(ctx->content_type, "image/jpeg");
+        result->content_type = ctx->content_type;
+        result->content_type_length = strlen(ctx->content_type);
+        result->timings.total = imaging_now() - start;
+        return IMAGING_OK;
+    }
+    if (ctx->aborted) {
+        result->timings.total = imaging_now() - start;
+        return IMAGING_ERROR_ABORTED;
+    }
+
+    // split the variant into its original & action string.
+    found = imaging_find_actions(ctx->filepath);
+    ext = (found != NULL) ? strrchr(found, '.') : NULL;
+    if (found == NULL || ext == NULL) {
+        result->timings.total = imaging_now() - start;
+        return IMAGING_ERROR_MISSING;
+    }
+    len = ext - found;
+    memcpy(ctx->actions, found, len);
+    ctx->actions[len] = '\0';
+    len = found - ctx->filepath;
+    memcpy(ctx->original, ctx->filepath, len);
+    (void) strcpy(ctx->original + len, ext);
+
+    if (!imaging_actions_allowed(ctx->actions, params->salt, ctx->hash,
+            params->white_list)) {
+        result->timings.total = imaging_now() - start;
+        return IMAGING_ERROR_FORBIDDEN;
+    }
+
+    (void) strcpy(ctx->image_info->filename, ctx->original);
+    image = imaging_read_original(ctx->image_info, ctx->actions + 1, &applied,
+        &ctx->exception);
+    mark = imaging_now();
+    result->timings.read = mark - start;
+    if (image == (Image *)NULL) {
+        result->timings.total = result->timings.read;
+        return imaging_ctx_fail(ctx, ctx->aborted ? IMAGING_ERROR_ABORTED :
+            IMAGING_ERROR_DECODE);
+    }
+
+    // skip the '_' prefix & any action already applied to a pyramid level.
+    actions = ctx->actions + 1 + applied;
+    if (*actions == '_') {
+        actions++;
+    }
+    if (*actions != '\0') {
+        imaging_apply_actions(&image, actions);
+    }
+    result->timings.actions = imaging_now() - mark;
+    mark += result->timings.actions;
+    if (image == (Image *)NULL) {
+        result->timings.total = imaging_now() - start;
+        return imaging_ctx_fail(ctx, ctx->aborted ? IMAGING_ERROR_ABORTED :
+            IMAGING_ERROR_ACTION);
+    }
+
+    // name it after the variant & drop profiles (eg: EXIF).
+    (void) strcpy(ctx->image_info->filename, ctx->filepath);
+    (void) strcpy(image->filename, ctx->filepath);
+    ctx->image_info->quality = params->quality;
+    ProfileImage(image, "*", 0, 0, 0);
+    error = imaging_ctx_encode(ctx, image, result);
+    // what is served, only once it's complete (an aborted encode isn't).
+    if (error == IMAGING_OK && params->write_to_disk != 0) {
+        (void) imaging_write_variant(ctx->filepath, ctx->original,
+            result->data, result->data_length);
+    }
+    result->timings.encode = imaging_now() - mark;
+    result->timings.total = imaging_now() - start;
+    return error;
+}
+
+/*
+ * Renders on ctx, which is the one abort checks ask while it does.
+ */
+imaging_error_t imaging_ctx_render(imaging_ctx_t *ctx,
+    const char *filepath, size_t filepath_length,
+    const char *hash, size_t hash_length,
+    const imaging_params_t *params, imaging_result_t *result)
+{
+    imaging_ctx_t *active;
+    imaging_error_t error;
+
+    active = imaging_active_ctx;
+    imaging_active_ctx = ctx;
+    error = imaging_ctx_run(ctx, filepath, filepath_length, hash, hash_length,
+        params, result);
+    imaging_active_ctx = active;
+    return error;
+}
+
+/*
+ * The pipeline of imaging_ctx_render_blob: GraphicsMagick on the original
+ * in memory.
+ */
+static imaging_error_t imaging_ctx_run_blob(imaging_ctx_t *ctx,
+    const char *filepath, size_t filepath_length,
+    const unsigned char *original, size_t original_length,
+    const char *hash, size_t hash_length,
+    const imaging_params_t *params, imaging_result_t *result)
+{
+    Image *image;
+    const char *found, *ext;
+    size_t len;
+    double start, mark;
+    imaging_error_t error;
+
+    start = imaging_now();
+    error = imaging_ctx_start(ctx, filepath, filepath_length, hash, hash_length,
+        params, result);
+    if (error != IMAGING_OK) {
+        return error;
+    }
+
+    found = imaging_parse_actions(ctx->filepath);
+    ext = (found != NULL) ? strrchr(found, '.') : NULL;
+    if (found == NULL || ext == NULL) {
+        return IMAGING_ERROR_PATH;
+    }
+    len = ext - found;
+    memcpy(ctx->actions, found, len);
+    ctx->actions[len] = '\0';
+
+    if (!imaging_actions_allowed(ctx->actions, params->salt, ctx->hash,
+            params->white_list)) {
+        result->timings.total = imaging_now() - start;
+        return IMAGING_ERROR_FORBIDDEN;
+    }
+
+    // the format comes from the blob's magic bytes, not a previous render.
+    ctx->image_info->filename[0] = '\0';
+    ctx->image_info->magick[0] = '\0';
+    image = BlobToImage(ctx->image_info, original, original_length,
+        &ctx->exception);
+    mark = imaging_now();
+    result->timings.read = mark - start;
+    if (image == (Image *)NULL) {
+        result->timings.total = result->timings.read;
+        return imaging_ctx_fail(ctx, ctx->aborted ? IMAGING_ERROR_ABORTED :
+            IMAGING_ERROR_DECODE);
+    }
+
+    imaging_apply_actions(&image, ctx->actions + 1); // skip the '_' prefix.
+    result->timings.actions = imaging_now() - mark;
+    mark += result->timings.actions;
+    if (image == (Image *)NULL) {
+        result->timings.total = imaging_now() - start;
+        return imaging_ctx_fail(ctx, ctx->aborted ? IMAGING_ERROR_ABORTED :
+            IMAGING_ERROR_ACTION);
+    }
+
+    // name it after the variant & drop profiles (eg: EXIF).
+    (void) strcpy(ctx->image_info->filename, ctx->filepath);
+    (void) strcpy(image->filename, ctx->filepath);
+    ctx->image_info->quality = params->quality;
+    ProfileImage(image, "*", 0, 0, 0);
+    error = imaging_ctx_encode(ctx, image, result);
+    result->timings.encode = imaging_now() - mark;
+    result->timings.total = imaging_now() - start;
+    return error;
+}
+
+imaging_error_t imaging_ctx_render_blob(imaging_ctx_t *ctx,
+    const char *filepath, size_t filepath_length,
+    const unsigned char *original, size_t original_length,
+    const char *hash, size_t hash_length,
+    const imaging_params_t *params, imaging_result_t *result)
+{
+    imaging_ctx_t *active;
+    imaging_error_t error;
+
+    active = imaging_active_ctx;
+    imaging_active_ctx = ctx;
+    error = imaging_ctx_run_blob(ctx, filepath, filepath_length,
+        original, original_length, hash, hash_length, params, result);
+    imaging_active_ctx = active;
+    return error;
+}
+
+/*
+ * Returns the context of imgaging_get_image_data, created on first use, or
+ * NULL when out of memory.
+ */
+static imaging_ctx_t * imaging_get_default_ctx(void) {
+    if (imaging_default_ctx == NULL) {
+        imaging_default_ctx = imaging_ctx_create();
+    }
+    return imaging_default_ctx;
+}
+
+/*
+ * Hands the result of a render on the default context to the callers of
+ * imgaging_get_image_data & imaging_get_image_data_from_blob, keeping why
+ * it failed for imaging_last_failure.
+ */
+static void imaging_default_result(imaging_error_t error,
+    imaging_result_t *result,
+    unsigned char **data, size_t *data_length,
+    char **content_type, size_t *content_type_length)
+{
+    switch (error) {
+    case IMAGING_OK:
+        *content_type = strdup(result->content_type);
+        if (*content_type == NULL) {
+            imaging_free(result->data);
+            imaging_failure = IMAGING_FAILURE_INVALID;
+            return;
+        }
+        *content_type_length = result->content_type_length;
+        *data = result->data;
+        *data_length = result->data_length;
+        imaging_failure = IMAGING_FAILURE_NONE;
+        break;
+    case IMAGING_ERROR_MISSING:
+        imaging_failure = IMAGING_FAILURE_MISSING;
+        break;
+    case IMAGING_ERROR_FORBIDDEN:
+        imaging_failure = IMAGING_FAILURE_FORBIDDEN;
+        break;
+    case IMAGING_ERROR_ABORTED:
+        imaging_failure = IMAGING_FAILURE_ABORTED;
+        break;
+    default:
+        imaging_failure = IMAGING_FAILURE_INVALID;
+    }
 }
 
-/******************************************************************
- * Public API
- *****************************************************************/
 /*
  * ngx_imaging_module interface. This method provides an easy to use
- * interface from the context of an nginx handler module.
+ * interface from the context of an nginx handler module: a render on the
+ * process' default context which reports failures through
+ * imaging_last_failure.
  */
 void
 imgaging_get_image_data(
@@ -583,41 +2279,62 @@ imgaging_get_image_data(
     const char *white_list,
     const int write_to_disk)
 {
-    // locals
-    Image *image = (Image *)NULL;
-    ImageInfo *image_info;
-    ExceptionInfo exception;
-
-    // create ImageInfo and set filepath
-    image_info = CloneImageInfo((ImageInfo *) NULL);
-    (void) strcpy(image_info->filename, filepath);
+    imaging_params_t params;
+    imaging_result_t result;
+    imaging_error_t error;
 
-    // try to load/create the image.
-    GetExceptionInfo(&exception);
-    if (IsAccessible(filepath)) {
-        image = ReadImage(image_info, &exception);
-    } else {
-        // the file did not exist on disk. try creating it.
-        image = imgaging_create_image(
-            image_info, &exception,
-            salt, hash, quality, white_list, write_to_disk
-        );
-    }
-
-    // if we got an image extract the data from it.
-    if (image != (Image *)NULL) {
-        *content_type = MagickToMime(image->magick);
-        *content_type_length = strlen(*content_type) - 1;
-        *data = ImageToBlob(image_info, image, data_length, &exception);
-        DestroyImage(image);
+    if (imaging_get_default_ctx() == NULL) {
+        imaging_failure = IMAGING_FAILURE_INVALID;
+        return;
     }
 
-    // cleanup
-    if (image_info != (ImageInfo *)NULL) {
-        DestroyImageInfo(image_info);
-    }
-    if (&exception != (ExceptionInfo *) NULL) {
-        DestroyExceptionInfo(&exception);
-    }
+    params.salt = salt;
+    params.white_list = white_list;
+    params.quality = quality;
+    params.write_to_disk = write_to_disk;
+    params.resampler = imaging_resampler;
+
+    error = imaging_ctx_render(imaging_default_ctx, filepath, strlen(filepath),
+        hash, hash != NULL ? strlen(hash) : 0, &params, &result);
+    imaging_default_result(error, &result, data, data_length,
+        content_type, content_type_length);
 }
 
+/*
+ * Like imgaging_get_image_data for originals which aren't on disk: a
+ * imaging_ctx_render_blob on the process' default context.
+ *
+ * data == NULL if there was a problem.
+ */
+void
+imaging_get_image_data_from_blob(
+    const char *filepath,
+    const unsigned char *original, size_t original_length,
+    unsigned char **data, size_t *data_length,
+    char **content_type, size_t *content_type_length,
+    const char *salt, const char *hash,
+    const unsigned long quality,
+    const char *white_list)
+{
+    imaging_params_t params;
+    imaging_result_t result;
+    imaging_error_t error;
+
+    *data = NULL;
+    if (imaging_get_default_ctx() == NULL) {
+        imaging_failure = IMAGING_FAILURE_INVALID;
+        return;
+    }
+
+    params.salt = salt;
+    params.white_list = white_list;
+    params.quality = quality;
+    params.write_to_disk = 0;
+    params.resampler = imaging_resampler;
+
+    error = imaging_ctx_render_blob(imaging_default_ctx, filepath,
+        strlen(filepath), original, original_length,
+        hash, hash != NULL ? strlen(hash) : 0, &params, &result);
+    imaging_default_result(error, &result, data, data_length,
+        content_type, content_type_length);
+}
@@ -7,12 +7,122 @@
 #define _IMAGING_H_INCLUDED_
 
 #define MAGICK_IMPLEMENTATION 1
+#include <time.h>
 #include <magick/api.h>
 
 #ifdef  __cplusplus
 extern "C" {
 #endif
 
+// hex sha1 of an action string & the salt (see imaging_actions_hash)
+#define IMAGING_HASH_LENGTH 40
+
+// resamplers used by the thumbnail, resize & scale actions
+typedef enum {
+    IMAGING_RESAMPLER_DEFAULT,  // GraphicsMagick ThumbnailImage/ResizeImage
+    IMAGING_RESAMPLER_FAST      // built-in 8-bit separable resampler
+} imaging_resampler_t;
+
+// geometry of a crop, placeholder, resize, scale or thumbnail action.
+typedef struct {
+    // size to resample to (0 when the action doesn't resample)
+    unsigned long resize_width, resize_height;
+    // centered box cropped after resampling (0 when the action doesn't crop)
+    unsigned long crop_width, crop_height;
+    long crop_x, crop_y;
+} imaging_geometry_t;
+
+// what imaging_get_meta tells about a variant.
+typedef struct {
+    // of the original
+    unsigned long width, height;
+    unsigned long frames;
+    char format[MaxTextExtent];   // eg: "JPEG"
+    time_t mtime;
+    // once the action chain is applied
+    unsigned long output_width, output_height;
+} imaging_meta_t;
+
+// chroma subsampling of JPEG variants.
+typedef enum {
+    IMAGING_SUBSAMPLING_DEFAULT,  // the encoder's default (4:2:0)
+    IMAGING_SUBSAMPLING_444,
+    IMAGING_SUBSAMPLING_422,
+    IMAGING_SUBSAMPLING_420
+} imaging_subsampling_t;
+
+// how JPEG variants are encoded.
+typedef struct {
+    int progressive;                    // progressive scans
+    int optimize;                       // optimized Huffman tables
+    imaging_subsampling_t subsampling;
+    // variants of up to small_pixels pixels use small_quality (0: off)
+    unsigned long small_pixels, small_quality;
+    // variants of at least large_pixels pixels use large_quality (0: off)
+    unsigned long large_pixels, large_quality;
+} imaging_jpeg_profile_t;
+
+// how PNG variants are encoded.
+typedef struct {
+    int level;                          // zlib level 0-9 (-1: default)
+    int strategy;                       // zlib strategy 0-4 (-1: default)
+    int palette;                        // palette when there are <= 256 colors
+} imaging_png_profile_t;
+
+// why a variant couldn't be created (see imaging_last_failure).
+typedef enum {
+    IMAGING_FAILURE_NONE,
+    IMAGING_FAILURE_MISSING,    // no original was found for it
+    IMAGING_FAILURE_FORBIDDEN,  // its actions failed the salt/white_list check
+    IMAGING_FAILURE_INVALID,    // the original or one of the actions failed
+    IMAGING_FAILURE_ABORTED     // stopped by the abort handler (imaging_set_abort)
+} imaging_failure_t;
+
+// what went wrong in an imaging_ctx_render call.
+typedef enum {
+    IMAGING_OK,
+    IMAGING_ERROR_PATH,         // the path is empty or too long
+    IMAGING_ERROR_MISSING,      // no original was found for it
+    IMAGING_ERROR_FORBIDDEN,    // its actions failed the salt/white_list check
+    IMAGING_ERROR_DECODE,       // the original couldn't be read
+    IMAGING_ERROR_ACTION,       // an action is unknown or failed
+    IMAGING_ERROR_ENCODE,       // the variant couldn't be encoded
+    IMAGING_ERROR_MEMORY,
+    IMAGING_ERROR_ABORTED       // stopped by the abort handler (imaging_ctx_set_abort)
+} imaging_error_t;
+
+// how a variant is checked & written by imaging_ctx_render.
+typedef struct {
+    const char *salt;           // NULL or "": no salt/white_list check
+    const char *white_list;     // space separated actions allowed without hash
+    unsigned long quality;
+    int write_to_disk;          // write the variant beside its original
+    imaging_resampler_t resampler; // of the thumbnail, resize & scale actions
+} imaging_params_t;
+
+// microseconds spent in each stage of an imaging_ctx_render call.
+typedef struct {
+    double read;                // finding & decoding the original
+    double actions;             // applying the action chain
+    double encode;              // encoding (& writing to disk)
+    double total;               // the libjpeg-turbo pipelines only count here
+} imaging_timings_t;
+
+// a variant created by imaging_ctx_render.
+typedef struct {
+    unsigned char *data;        // free with imaging_free
+    size_t data_length;
+    const char *content_type;   // the context's, valid until its next render
+    size_t content_type_length;
+    imaging_timings_t timings;
+} imaging_result_t;
+
+// tells a render in progress to stop when it returns non zero.
+typedef int (*imaging_abort_handler_t)(void *data);
+
+// reusable state of renders, see imaging_ctx_create.
+typedef struct imaging_ctx_s imaging_ctx_t;
+
 // typedef for a pointer to a image action function
 typedef Image * (*imaging_action_func_ptr)(Image *, const char *);
 
@@ -22,6 +132,12 @@ Image * imaging_action_crop(Image *image, const char *action);
 
 Image * imaging_action_filter(Image *image, const char *action);
 
+/*
+ * Shrinks an image into a placeholder whose longest side is action pixels
+ * (default 32, up to 64).
+ */
+Image * imaging_action_placeholder(Image *image, const char *action);
+
 Image * imaging_action_resize(Image *image, const char *action);
 
 Image * imaging_action_scale(Image *image, const char *action);
@@ -41,6 +157,111 @@ void imaging_initialize(void);
  */
 void imaging_destory(void);
 
+/*
+ * Makes GraphicsMagick (& the built-in pipelines) allocate large pixel
+ * buffers from a per process pool which keeps up to max_cached bytes of
+ * freed buffers for reuse, optionally backed by huge pages. Call before
+ * imaging_initialize.
+ */
+void imaging_use_pool(size_t max_cached, int huge_pages);
+
+/*
+ * Makes originals be decoded (BlobToImage) straight from read-only memory
+ * mappings instead of read through stdio. Mappings are kept for reuse
+ * while they map no more than max_cached bytes.
+ */
+void imaging_use_mmap(size_t max_cached);
+
+/*
+ * Reads image_info->filename like ReadImage, from its memory mapping when
+ * imaging_use_mmap was called.
+ */
+Image * imaging_read_image(const ImageInfo *image_info, ExceptionInfo *exception);
+
+/*
+ * Frees the data & content_type returned by imgaging_get_image_data, which
+ * may come from the pool.
+ */
+void imaging_free(void *ptr);
+
+/*
+ * Selects the resampler used by the thumbnail, resize & scale actions.
+ */
+void imaging_set_resampler(imaging_resampler_t resampler);
+
+/*
+ * Enables/disables creating JPEG variants (crop, placeholder, resize, scale
+ * & thumbnail actions only) straight through libjpeg-turbo instead of
+ * GraphicsMagick.
+ */
+void imaging_set_jpeg_direct(int enabled);
+
+/*
+ * Crops of JPEG originals which are the only action are made losslessly,
+ * on the DCT coefficients, when the crop box moved onto the closest iMCU
+ * boundary is within tolerance pixels of the requested one. A negative
+ * tolerance (the default) disables lossless crops.
+ */
+void imaging_set_crop_tolerance(long tolerance);
+
+/*
+ * JPEG originals of at least pixels pixels whose first action is a
+ * thumbnail, resize or scale are streamed through libjpeg-turbo a scanline
+ * at a time instead of being decoded whole. 0 (the default) disables it.
+ */
+void imaging_set_stream_pixels(unsigned long pixels);
+
+/*
+ * Originals of at least pixels pixels get a persistent pyramid (1/2, 1/4
+ * ... levels, kept in the imaging_set_pyramid_path directory) which
+ * thumbnail, resize & scale actions start from instead of the full size
+ * original. 0 (the default) disables it.
+ */
+void imaging_set_pyramid_pixels(unsigned long pixels);
+
+/*
+ * Sets the directory (which has to exist) pyramid levels are kept in; it
+ * shouldn't be served. NULL or "" (the default) disables pyramids.
+ */
+void imaging_set_pyramid_path(const char *path);
+
+/*
+ * Sets how JPEG variants are encoded, NULL restores the defaults (baseline,
+ * the quality given for every size).
+ */
+void imaging_set_jpeg_profile(const imaging_jpeg_profile_t *profile);
+
+/*
+ * Sets how PNG variants are encoded, NULL restores GraphicsMagick's
+ * defaults.
+ */
+void imaging_set_png_profile(const imaging_png_profile_t *profile);
+
+/*
+ * imaging_ctx_set_abort on the context of imgaging_get_image_data (& of
+ * imaging_get_image_data_from_blob).
+ */
+void imaging_set_abort(imaging_abort_handler_t handler, void *data);
+
+/*
+ * Returns 1 when the render in progress on this thread has to stop (the
+ * abort handler of its context said so, now or earlier in the render)
+ * otherwise 0.
+ */
+int imaging_abort_check(void);
+
+/*
+ * Returns the JPEG profile in use.
+ */
+const imaging_jpeg_profile_t * imaging_get_jpeg_profile(void);
+
+/*
+ * Returns the quality a columns x rows JPEG variant is encoded with, given
+ * the quality asked for & the size classes of the JPEG profile.
+ */
+unsigned long imaging_jpeg_quality(unsigned long quality,
+    unsigned long columns, unsigned long rows);
+
 /**
  * Given a char * filepath will extract the (path, filename, extension)
  */
@@ -51,11 +272,163 @@ void imgaging_explode_file_path(const char *filepath, char **path, char **file,
  */
 int imaging_parse_size(const char *size, unsigned long *height, unsigned long *width);
 
+/*
+ * Computes the geometry of a crop, placeholder, resize, scale or thumbnail
+ * action applied to a columns x rows image.
+ */
+int imaging_action_geometry(char code, const char *size,
+    unsigned long columns, unsigned long rows, imaging_geometry_t *geometry);
+
 /*
  *
  */
 int imaging_actions_allowed(const char *action, const char *salt, const char *hash, const char *white_list);
 
+/*
+ * Writes the hash a url needs for the action string action (eg: "_t200")
+ * with salt, IMAGING_HASH_LENGTH chars & a nul, into hash.
+ */
+void imaging_actions_hash(const char *action, const char *salt, char *hash);
+
+/*
+ * Returns a pointer to the '_' which starts the action string of filepath
+ * or NULL if no original could be found for it.
+ */
+const char * imaging_find_actions(const char *filepath);
+
+/*
+ * Returns a pointer to the '_' which starts the action string of filepath,
+ * judged by the action syntax alone (no original on disk is needed), or
+ * NULL if filepath has no actions.
+ */
+const char * imaging_parse_actions(const char *filepath);
+
+/*
+ * Returns 1 if the file at filepath is a variant imaging wrote beside its
+ * original (imaging_write_to_disk), setting original (MaxTextExtent chars)
+ * to the original's path, otherwise 0: an original itself, whatever its
+ * name looks like.
+ */
+int imaging_disk_variant(const char *filepath, char *original);
+
+/*
+ * Sets original (MaxTextExtent chars) to the original the variant at
+ * filepath is created from, the way a render finds it: the one recorded
+ * by imaging_disk_variant when filepath is on disk, otherwise the
+ * shortest '_' delimited prefix on disk (imaging_find_actions).
+ * Returns 1 if filepath is a variant of such an original otherwise 0.
+ */
+int imaging_find_original(const char *filepath, char *original);
+
+/*
+ * Copies the length chars of the action string actions (eg: "_t197x150_c50",
+ * followed by a non digit) into snapped, with the first size of its
+ * thumbnail, resize & scale actions (the width, or the height when it's
+ * alone) rounded up to the nearest of the n (ascending) buckets, down to
+ * the largest one when it's larger than them all. The other size is scaled
+ * by the same factor, so the aspect is kept: "_t197x150" is "_t200x152".
+ * Returns the length of snapped (nul terminated) or 0 if it didn't fit
+ * size chars or there are no buckets.
+ */
+size_t imaging_snap_actions(const char *actions, size_t length,
+    const unsigned long *buckets, size_t n, char *snapped, size_t size);
+
+/*
+ * Returns why the last imgaging_get_image_data (or
+ * imaging_get_image_data_from_blob) call didn't create a variant, or
+ * IMAGING_FAILURE_NONE if it did.
+ */
+imaging_failure_t imaging_last_failure(void);
+
+/*
+ * Estimates the cost (roughly the pixels touched) of creating the variant
+ * filepath, from the header of its original & its action chain, without
+ * decoding anything. Returns 0 if filepath has no original on disk.
+ */
+double imaging_estimate_cost(const char *filepath);
+
+/*
+ * Fills meta with the dimensions, format & frame count of the original of
+ * the variant filepath, and the dimensions the variant would have, from
+ * headers alone (no pixels are decoded). filepath may be an original.
+ * Returns IMAGING_FAILURE_NONE or why the variant couldn't be created.
+ */
+imaging_failure_t imaging_get_meta(const char *filepath,
+    const char *salt, const char *hash, const char *white_list,
+    imaging_meta_t *meta);
+
+/*
+ * Returns 1 if the variant filepath would be its original as it is: every
+ * action is a crop, placeholder, resize, scale or thumbnail to the size the
+ * image already has (eg: "c5000" of a 1200x800 original, whose crop is
+ * clamped to it), judged by the original's header alone (PingImage).
+ * original (MaxTextExtent chars) is set to the original's path. Variants
+ * which fail the salt/white_list check are never passed through.
+ */
+int imaging_passthrough(const char *filepath,
+    const char *salt, const char *hash, const char *white_list,
+    char *original);
+
+/*
+ * Creates a render context: the ImageInfo, ExceptionInfo & scratch buffers
+ * a render needs, allocated once & reused by every imaging_ctx_render on
+ * it. Contexts aren't shared, use one per thread; renders on different
+ * contexts may run concurrently. What a render takes from its params
+ * (imaging_params_t) is its own, the other imaging_set_* settings are per
+ * process: make them before renders start. Returns NULL when out of memory.
+ */
+imaging_ctx_t * imaging_ctx_create(void);
+
+/*
+ * Frees ctx.
+ */
+void imaging_ctx_destroy(imaging_ctx_t *ctx);
+
+/*
+ * Creates the variant filepath (not nul terminated) like
+ * imgaging_get_image_data, hash is the request's hash (may be NULL).
+ * Fills result, including the time each stage took, on success.
+ */
+imaging_error_t imaging_ctx_render(imaging_ctx_t *ctx,
+    const char *filepath, size_t filepath_length,
+    const char *hash, size_t hash_length,
+    const imaging_params_t *params, imaging_result_t *result);
+
+/*
+ * Creates the variant filepath (not nul terminated) like imaging_ctx_render
+ * but from the encoded original in memory (eg: fetched from an origin):
+ * filepath only names the variant, whose actions are found with
+ * imaging_parse_actions. params->write_to_disk is ignored.
+ * Returns IMAGING_ERROR_PATH if filepath has no actions.
+ */
+imaging_error_t imaging_ctx_render_blob(imaging_ctx_t *ctx,
+    const char *filepath, size_t filepath_length,
+    const unsigned char *original, size_t original_length,
+    const char *hash, size_t hash_length,
+    const imaging_params_t *params, imaging_result_t *result);
+
+/*
+ * Returns GraphicsMagick's reason for the last failed render on ctx, or ""
+ * when there is none.
+ */
+const char * imaging_ctx_message(const imaging_ctx_t *ctx);
+
+/*
+ * Makes renders on ctx call handler(data) before each stage, between
+ * actions & every few rows (GraphicsMagick's progress monitor, the
+ * scanlines of the libjpeg-turbo pipelines), and stop as soon as it
+ * returns non zero: what they allocated is freed & nothing is written to
+ * disk. NULL (the default) lets renders run to completion. Renders on
+ * other contexts aren't affected.
+ */
+void imaging_ctx_set_abort(imaging_ctx_t *ctx, imaging_abort_handler_t handler,
+    void *data);
+
+/*
+ * Returns a short description of error (eg: "no original").
+ */
+const char * imaging_error_string(imaging_error_t error);
+
 /*
  * Returns a pointer to an action function for the given action code.
  */
@@ -68,11 +441,18 @@ imaging_action_func_ptr imaging_get_action_func(const char *code);
 void imaging_apply_actions(Image **image, char *actions);
 
 /**
- * Returns an Image created from the filename specified in the passed image_info.
- * Return (Image *)NULL if it was unable to create the image.
+ * Main api for the ngx_imaging_module
+ *
+ * data == NULL if there was a problem.
  */
-Image * imgaging_create_image(
-    ImageInfo *image_info, ExceptionInfo *exception,
+void imgaging_get_image_data(
+    /* file being requested */
+    const char *filepath,
+    /* data returned & its length */
+    unsigned char **data, size_t *data_length,
+    /* mime type and its length */
+    char **content_type, size_t *content_type_length,
+    /* security salt & the current hash */
     const char *salt, const char *hash,
     /* image quality */
     const unsigned long quality,
@@ -84,13 +464,16 @@ Image * imgaging_create_image(
 );
 
 /**
- * Main api for the ngx_imaging_module
+ * Like imgaging_get_image_data for originals which aren't on disk (eg:
+ * fetched from an origin); filepath only names the variant.
  *
  * data == NULL if there was a problem.
  */
-void imgaging_get_image_data(
-    /* file being requested */
+void imaging_get_image_data_from_blob(
+    /* variant being requested (eg: "/img/test_t200.jpg") */
     const char *filepath,
+    /* encoded original & its length */
+    const unsigned char *original, size_t original_length,
     /* data returned & its length */
     unsigned char **data, size_t *data_length,
     /* mime type and its length */
@@ -101,9 +484,7 @@ void imgaging_get_image_data(
     const unsigned long quality,
     /* space separated list of the allowed actions when
      * salt is defined but no hash is given. */
-    const char *white_list,
-    /* flag: write created images to disk? */
-    const int write_to_disk
+    const char *white_list
 );
 
 #ifdef  __cplusplus
@@ -0,0 +1,685 @@
+/*
+ * jpeg.c
+ *
+ * JPEG -> JPEG pipeline which bypasses GraphicsMagick.
+ *
+ * The original is decoded by libjpeg-turbo straight into an 8-bit RGBX
+ * buffer, using DCT scaling when the first action shrinks the image, then
+ * the crop, resize, scale & thumbnail actions are applied to that buffer
+ * and it is encoded by libjpeg-turbo again.
+ *
+ * When the first action resamples, the original is streamed instead: each
+ * decoded scanline is fed to a rolling window resampler and the output rows
+ * inside the action's crop box are encoded (or, when more actions follow,
+ * kept) as soon as they are complete. Only a few rows of the original are
+ * ever held in memory.
+ *
+ * Crops of JPEG originals can also be made losslessly (like jpegtran -crop)
+ * by copying the DCT coefficients of the blocks inside the crop box, which
+ * skips both the IDCT & the encode.
+ */
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include "imaging.h"
+#include "resample.h"
+#include "jpeg.h"
+#include "pool.h"
+
+// longest single action (eg: "t1024x768") handled.
+#define IMAGING_JPEG_MAX_ACTION 64
+
+// ICC profiles are kept by lossless crops.
+#define IMAGING_JPEG_ICC_MARKER (JPEG_APP0 + 2)
+
+// renders are asked whether to stop (imaging_ctx_set_abort) every 16 scanlines.
+#define IMAGING_JPEG_ABORT(scanline) \
+    (((scanline) & 15) == 0 && imaging_abort_check())
+
+typedef struct {
+    struct jpeg_error_mgr   pub;
+    jmp_buf                 setjmp_buffer;
+} imaging_jpeg_error_t;
+
+// 4 channel (RGBX) pixels.
+typedef struct {
+    unsigned char  *pixels;
+    unsigned long   width, height;
+} imaging_jpeg_buffer_t;
+
+/******************************************************************
+ * Utils
+ *****************************************************************/
+static void imaging_jpeg_error_exit(j_common_ptr cinfo) {
+    imaging_jpeg_error_t *err = (imaging_jpeg_error_t *)cinfo->err;
+    longjmp(err->setjmp_buffer, 1);
+}
+
+static void imaging_jpeg_output_message(j_common_ptr cinfo) {
+    // failures fall back to GraphicsMagick, don't spam stderr.
+}
+
+/*
+ * Sets the quality & the encoder profile (imaging_set_jpeg_profile) on
+ * cinfo, once its size is set & jpeg_set_defaults was called.
+ */
+static void imaging_jpeg_set_profile(j_compress_ptr cinfo, unsigned long quality) {
+    const imaging_jpeg_profile_t *profile = imaging_get_jpeg_profile();
+
+    jpeg_set_quality(cinfo, imaging_jpeg_quality(quality,
+        cinfo->image_width, cinfo->image_height), TRUE);
+    if (profile->optimize) {
+        cinfo->optimize_coding = TRUE;
+    }
+    switch (profile->subsampling) {
+    case IMAGING_SUBSAMPLING_444:
+        cinfo->comp_info[0].h_samp_factor = 1;
+        cinfo->comp_info[0].v_samp_factor = 1;
+        break;
+    case IMAGING_SUBSAMPLING_422:
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 1;
+        break;
+    case IMAGING_SUBSAMPLING_420:
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 2;
+        break;
+    default:
+        break;
+    }
+    if (profile->progressive) {
+        jpeg_simple_progression(cinfo);
+    }
+}
+
+/*
+ * Copies the next '_' separated action out of actions into action.
+ * Returns a pointer to the rest of the actions or NULL when done.
+ */
+static const char * imaging_jpeg_next_action(const char *actions, char *action) {
+    size_t len = strcspn(actions, "_");
+    if (len == 0 || len >= IMAGING_JPEG_MAX_ACTION) {
+        return NULL;
+    }
+    memcpy(action, actions, len);
+    action[len] = '\0';
+    return actions + len;
+}
+
+static imaging_filter_t imaging_jpeg_filter(char code) {
+    // same filters the fast resampler uses for the GraphicsMagick actions.
+    return code == 's' ? IMAGING_FILTER_BOX : IMAGING_FILTER_LANCZOS;
+}
+
+/******************************************************************
+ * Decode/Encode
+ *****************************************************************/
+/*
+ * When action resamples, computes its geometry against the full size image
+ * (into geometry) and sets the smallest DCT scale which still decodes at
+ * least that large.
+ *
+ * Returns 1 if action resamples otherwise 0.
+ */
+static int imaging_jpeg_scale(j_decompress_ptr cinfo, const char *action,
+    imaging_geometry_t *geometry)
+{
+    unsigned int num;
+
+    if (action[0] == 'c' ||
+        !imaging_action_geometry(action[0], action + 1,
+            cinfo->image_width, cinfo->image_height, geometry) ||
+        geometry->resize_width == 0 || geometry->resize_height == 0) {
+        return 0;
+    }
+    // smallest DCT scale (num / 8) which is still at least the target.
+    for (num = 1; num < 8; num++) {
+        if ((cinfo->image_width * num + 7) / 8 >= geometry->resize_width &&
+            (cinfo->image_height * num + 7) / 8 >= geometry->resize_height) {
+            break;
+        }
+    }
+    cinfo->scale_num = num;
+    cinfo->scale_denom = 8;
+    return 1;
+}
+
+/*
+ * Decodes the JPEG in fp into buffer. When the first action resamples, its
+ * geometry is computed against the full size image (into geometry) and the
+ * image is only decoded as large as that needs through DCT scaling.
+ *
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_jpeg_decode(FILE *fp, const char *action,
+    imaging_jpeg_buffer_t *buffer, imaging_geometry_t *geometry, int *have_geometry)
+{
+    struct jpeg_decompress_struct cinfo;
+    imaging_jpeg_error_t jerr;
+    JSAMPROW row;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = imaging_jpeg_error_exit;
+    jerr.pub.output_message = imaging_jpeg_output_message;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_decompress(&cinfo);
+        imaging_pool_free(buffer->pixels);
+        buffer->pixels = NULL;
+        return 0;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    (void) jpeg_read_header(&cinfo, TRUE);
+
+    // leave CMYK & grayscale originals to GraphicsMagick.
+    if (cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_RGB) {
+        jpeg_destroy_decompress(&cinfo);
+        return 0;
+    }
+
+    *have_geometry = imaging_jpeg_scale(&cinfo, action, geometry);
+    cinfo.out_color_space = JCS_EXT_RGBX;
+
+    jpeg_start_decompress(&cinfo);
+    buffer->width = cinfo.output_width;
+    buffer->height = cinfo.output_height;
+    buffer->pixels = imaging_pool_alloc(buffer->width * buffer->height * 4);
+    if (buffer->pixels == NULL) {
+        jpeg_destroy_decompress(&cinfo);
+        return 0;
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        if (IMAGING_JPEG_ABORT(cinfo.output_scanline)) {
+            longjmp(jerr.setjmp_buffer, 1);
+        }
+        row = buffer->pixels + (size_t)cinfo.output_scanline * buffer->width * 4;
+        (void) jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    (void) jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return 1;
+}
+
+/*
+ * Streams the JPEG in fp through action, which has to resample: scanlines
+ * are decoded (DCT scaled) one at a time into a rolling window resampler
+ * and the output rows inside the action's crop box are encoded into data
+ * (allocated with malloc) as they complete, or copied into buffer instead
+ * when buffer isn't NULL. Originals of fewer than min_pixels are left alone.
+ *
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_jpeg_stream_action(FILE *fp, const char *action,
+    unsigned long min_pixels, unsigned long quality, imaging_jpeg_buffer_t *buffer,
+    unsigned char **data, unsigned long *data_length)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_compress_struct cinfo;
+    imaging_jpeg_error_t jerr;
+    imaging_geometry_t geometry;
+    imaging_resample_stream_t * volatile stream = NULL;
+    unsigned char * volatile src = NULL;
+    unsigned char * volatile dst = NULL;
+    unsigned long y, crop_width, crop_height;
+    long crop_x, crop_y;
+    JSAMPROW row;
+
+    memset(&dinfo, 0, sizeof(dinfo));
+    memset(&cinfo, 0, sizeof(cinfo));
+    dinfo.err = cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = imaging_jpeg_error_exit;
+    jerr.pub.output_message = imaging_jpeg_output_message;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&dinfo);
+        imaging_resample_stream_destroy(stream);
+        imaging_pool_free(src);
+        imaging_pool_free(dst);
+        if (buffer != NULL) {
+            imaging_pool_free(buffer->pixels);
+            buffer->pixels = NULL;
+        } else {
+            free(*data);
+            *data = NULL;
+        }
+        return 0;
+    }
+
+    jpeg_create_decompress(&dinfo);
+    jpeg_stdio_src(&dinfo, fp);
+    (void) jpeg_read_header(&dinfo, TRUE);
+
+    // leave CMYK & grayscale originals to GraphicsMagick.
+    if ((dinfo.jpeg_color_space != JCS_YCbCr && dinfo.jpeg_color_space != JCS_RGB) ||
+        (double)dinfo.image_width * dinfo.image_height < (double)min_pixels ||
+        !imaging_jpeg_scale(&dinfo, action, &geometry)) {
+        jpeg_destroy_decompress(&dinfo);
+        return 0;
+    }
+    dinfo.out_color_space = JCS_EXT_RGBX;
+    jpeg_start_decompress(&dinfo);
+
+    // the rows & columns of the resampled image which are kept.
+    crop_x = crop_y = 0;
+    crop_width = geometry.resize_width;
+    crop_height = geometry.resize_height;
+    if (geometry.crop_width != 0) {
+        crop_x = geometry.crop_x;
+        crop_y = geometry.crop_y;
+        crop_width = geometry.crop_width;
+        crop_height = geometry.crop_height;
+    }
+    if (crop_x < 0 || crop_y < 0 ||
+        crop_x + crop_width > geometry.resize_width ||
+        crop_y + crop_height > geometry.resize_height) {
+        jpeg_destroy_decompress(&dinfo);
+        return 0;
+    }
+
+    stream = imaging_resample_stream_create(dinfo.output_width, dinfo.output_height,
+        geometry.resize_width, geometry.resize_height, imaging_jpeg_filter(action[0]));
+    src = imaging_pool_alloc(dinfo.output_width * 4);
+    dst = imaging_pool_alloc(geometry.resize_width * 4);
+    if (stream == NULL || src == NULL || dst == NULL) {
+        longjmp(jerr.setjmp_buffer, 1);
+    }
+
+    if (buffer != NULL) {
+        buffer->width = crop_width;
+        buffer->height = crop_height;
+        buffer->pixels = imaging_pool_alloc(crop_width * crop_height * 4);
+        if (buffer->pixels == NULL) {
+            longjmp(jerr.setjmp_buffer, 1);
+        }
+    } else {
+        jpeg_create_compress(&cinfo);
+        jpeg_mem_dest(&cinfo, data, data_length);
+        cinfo.image_width = crop_width;
+        cinfo.image_height = crop_height;
+        cinfo.input_components = 4;
+        cinfo.in_color_space = JCS_EXT_RGBX;
+        jpeg_set_defaults(&cinfo);
+        imaging_jpeg_set_profile(&cinfo, quality);
+        jpeg_start_compress(&cinfo, TRUE);
+    }
+
+    // stop decoding once the last row of the crop box is out.
+    y = 0;
+    while (y < crop_y + crop_height && dinfo.output_scanline < dinfo.output_height) {
+        if (IMAGING_JPEG_ABORT(dinfo.output_scanline)) {
+            longjmp(jerr.setjmp_buffer, 1);
+        }
+        row = src;
+        (void) jpeg_read_scanlines(&dinfo, &row, 1);
+        if (!imaging_resample_stream_write(stream, src)) {
+            longjmp(jerr.setjmp_buffer, 1);
+        }
+        for (; y < crop_y + crop_height && imaging_resample_stream_read(stream, dst); y++) {
+            if (y < (unsigned long)crop_y) {
+                continue;
+            }
+            row = dst + crop_x * 4;
+            if (buffer != NULL) {
+                memcpy(buffer->pixels + (y - crop_y) * crop_width * 4, row, crop_width * 4);
+            } else {
+                (void) jpeg_write_scanlines(&cinfo, &row, 1);
+            }
+        }
+    }
+    if (y < crop_y + crop_height) {
+        longjmp(jerr.setjmp_buffer, 1);
+    }
+
+    if (buffer == NULL) {
+        jpeg_finish_compress(&cinfo);
+        jpeg_destroy_compress(&cinfo);
+    }
+    // skips whatever is left of the original.
+    jpeg_destroy_decompress(&dinfo);
+    imaging_resample_stream_destroy(stream);
+    imaging_pool_free(src);
+    imaging_pool_free(dst);
+    return 1;
+}
+
+/*
+ * Encodes buffer as a JPEG into data (allocated with malloc).
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_jpeg_encode(const imaging_jpeg_buffer_t *buffer,
+    unsigned long quality, unsigned char **data, unsigned long *data_length)
+{
+    struct jpeg_compress_struct cinfo;
+    imaging_jpeg_error_t jerr;
+    JSAMPROW row;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = imaging_jpeg_error_exit;
+    jerr.pub.output_message = imaging_jpeg_output_message;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_compress(&cinfo);
+        free(*data);
+        *data = NULL;
+        return 0;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, data, data_length);
+    cinfo.image_width = buffer->width;
+    cinfo.image_height = buffer->height;
+    cinfo.input_components = 4;
+    cinfo.in_color_space = JCS_EXT_RGBX;
+    jpeg_set_defaults(&cinfo);
+    imaging_jpeg_set_profile(&cinfo, quality);
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height) {
+        if (IMAGING_JPEG_ABORT(cinfo.next_scanline)) {
+            longjmp(jerr.setjmp_buffer, 1);
+        }
+        row = buffer->pixels + (size_t)cinfo.next_scanline * buffer->width * 4;
+        (void) jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 1;
+}
+
+/*
+ * Offset of the iMCU aligned crop box closest to offset, keeping a box of
+ * size within total. Returns -1 if it's further than tolerance away.
+ */
+static long imaging_jpeg_align(long offset, unsigned long size,
+    unsigned long total, unsigned long mcu_size, long tolerance)
+{
+    long down = offset - offset % (long)mcu_size;
+    long up = down + (long)mcu_size;
+
+    if (offset - down > up - offset && up + size <= total) {
+        down = up;
+    }
+    return labs(offset - down) <= tolerance ? down : -1;
+}
+
+/*
+ * Copies the coefficients of the blocks starting at the iMCU aligned x, y
+ * of src into every block of dst.
+ */
+static void imaging_jpeg_copy_blocks(j_decompress_ptr srcinfo, jvirt_barray_ptr *src,
+    j_compress_ptr dstinfo, jvirt_barray_ptr *dst, long x, long y)
+{
+    jpeg_component_info *comp;
+    JBLOCKARRAY src_rows, dst_rows;
+    JDIMENSION blk_y, x_blocks, y_blocks;
+    int ci, row;
+
+    for (ci = 0; ci < dstinfo->num_components; ci++) {
+        comp = dstinfo->comp_info + ci;
+        x_blocks = x / (srcinfo->max_h_samp_factor * DCTSIZE) * comp->h_samp_factor;
+        y_blocks = y / (srcinfo->max_v_samp_factor * DCTSIZE) * comp->v_samp_factor;
+        for (blk_y = 0; blk_y < comp->height_in_blocks; blk_y += comp->v_samp_factor) {
+            dst_rows = (*dstinfo->mem->access_virt_barray)((j_common_ptr)dstinfo,
+                dst[ci], blk_y, comp->v_samp_factor, TRUE);
+            src_rows = (*srcinfo->mem->access_virt_barray)((j_common_ptr)srcinfo,
+                src[ci], blk_y + y_blocks, comp->v_samp_factor, FALSE);
+            for (row = 0; row < comp->v_samp_factor; row++) {
+                memcpy(dst_rows[row], src_rows[row] + x_blocks,
+                       comp->width_in_blocks * sizeof(JBLOCK));
+            }
+        }
+    }
+}
+
+/******************************************************************
+ * Actions
+ *****************************************************************/
+/*
+ * Applies the geometry of one action to buffer.
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_jpeg_apply(imaging_jpeg_buffer_t *buffer, char code,
+    const imaging_geometry_t *geometry)
+{
+    unsigned char *pixels;
+    unsigned long y;
+
+    if (geometry->resize_width != 0) {
+        pixels = imaging_pool_alloc(geometry->resize_width * geometry->resize_height * 4);
+        if (pixels == NULL ||
+            !imaging_resample(buffer->pixels, buffer->width, buffer->height,
+                pixels, geometry->resize_width, geometry->resize_height,
+                imaging_jpeg_filter(code))) {
+            imaging_pool_free(pixels);
+            return 0;
+        }
+        imaging_pool_free(buffer->pixels);
+        buffer->pixels = pixels;
+        buffer->width = geometry->resize_width;
+        buffer->height = geometry->resize_height;
+    }
+
+    if (geometry->crop_width != 0) {
+        if (geometry->crop_x < 0 || geometry->crop_y < 0 ||
+            geometry->crop_x + geometry->crop_width > buffer->width ||
+            geometry->crop_y + geometry->crop_height > buffer->height) {
+            return 0;
+        }
+        pixels = imaging_pool_alloc(geometry->crop_width * geometry->crop_height * 4);
+        if (pixels == NULL) {
+            return 0;
+        }
+        for (y = 0; y < geometry->crop_height; y++) {
+            memcpy(pixels + y * geometry->crop_width * 4,
+                   buffer->pixels + ((geometry->crop_y + y) * buffer->width + geometry->crop_x) * 4,
+                   geometry->crop_width * 4);
+        }
+        imaging_pool_free(buffer->pixels);
+        buffer->pixels = pixels;
+        buffer->width = geometry->crop_width;
+        buffer->height = geometry->crop_height;
+    }
+    return 1;
+}
+
+/*
+ * Applies actions to the JPEG original. A resampling first action is
+ * streamed, straight into the encoder when it's the only action. With
+ * min_pixels only originals that large whose first action resamples are
+ * handled, otherwise the original is decoded whole when it has to be.
+ *
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_jpeg_transform(const char *original, const char *actions,
+    unsigned long quality, unsigned long min_pixels,
+    unsigned char **data, size_t *data_length)
+{
+    FILE *fp;
+    char action[IMAGING_JPEG_MAX_ACTION];
+    const char *rest;
+    imaging_jpeg_buffer_t buffer;
+    imaging_geometry_t geometry;
+    unsigned long length = 0;
+    int have_geometry = 0;
+    int status;
+
+    *data = NULL;
+    *data_length = 0;
+    if (!imaging_jpeg_supports(actions) ||
+        (rest = imaging_jpeg_next_action(actions, action)) == NULL) {
+        return 0;
+    }
+    rest = (*rest == '_') ? rest + 1 : NULL;
+
+    fp = fopen(original, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+    buffer.pixels = NULL;
+    status = imaging_jpeg_stream_action(fp, action, min_pixels, quality,
+        rest != NULL ? &buffer : NULL, data, &length);
+    if (status && rest == NULL) {
+        fclose(fp);
+        *data_length = length;
+        return 1;
+    }
+
+    if (status) {
+        actions = rest;
+    } else if (min_pixels == 0) {
+        rewind(fp);
+        status = imaging_jpeg_decode(fp, action, &buffer, &geometry, &have_geometry);
+        // the first action's geometry was computed against the full size image.
+        if (status && have_geometry) {
+            status = imaging_jpeg_apply(&buffer, action[0], &geometry);
+            actions = rest;
+        }
+    }
+    fclose(fp);
+
+    while (status && actions != NULL) {
+        actions = imaging_jpeg_next_action(actions, action);
+        status = (actions != NULL) &&
+            imaging_action_geometry(action[0], action + 1,
+                buffer.width, buffer.height, &geometry) &&
+            imaging_jpeg_apply(&buffer, action[0], &geometry);
+        if (actions != NULL) {
+            actions = (*actions == '_') ? actions + 1 : NULL;
+        }
+    }
+
+    if (status) {
+        status = imaging_jpeg_encode(&buffer, quality, data, &length);
+        *data_length = length;
+    }
+    imaging_pool_free(buffer.pixels);
+    return status;
+}
+
+/******************************************************************
+ * Public API
+ *****************************************************************/
+int imaging_jpeg_supports(const char *actions) {
+    char action[IMAGING_JPEG_MAX_ACTION];
+
+    while (actions != NULL && *actions != '\0') {
+        actions = imaging_jpeg_next_action(actions, action);
+        if (actions == NULL || strchr("cprst", action[0]) == NULL) {
+            return 0;
+        }
+        if (*actions == '_') {
+            actions++;
+        }
+    }
+    return actions != NULL;
+}
+
+int imaging_jpeg_create(const char *original, const char *actions,
+    unsigned long quality, unsigned char **data, size_t *data_length)
+{
+    return imaging_jpeg_transform(original, actions, quality, 0, data, data_length);
+}
+
+int imaging_jpeg_stream(const char *original, const char *actions,
+    unsigned long min_pixels, unsigned long quality,
+    unsigned char **data, size_t *data_length)
+{
+    return imaging_jpeg_transform(original, actions, quality, min_pixels, data, data_length);
+}
+
+int imaging_jpeg_crop(const char *original, const char *actions, long tolerance,
+    unsigned char **data, size_t *data_length)
+{
+    struct jpeg_decompress_struct srcinfo;
+    struct jpeg_compress_struct dstinfo;
+    imaging_jpeg_error_t jerr;
+    jvirt_barray_ptr *src_coefs, dst_coefs[MAX_COMPONENTS];
+    jpeg_component_info *comp;
+    jpeg_saved_marker_ptr marker;
+    imaging_geometry_t geometry;
+    unsigned long length = 0;
+    long x, y;
+    int ci, h_blocks, v_blocks;
+    FILE *fp;
+
+    *data = NULL;
+    *data_length = 0;
+    // a single crop action only.
+    if (actions[0] != 'c' || strchr(actions, '_') != NULL) {
+        return 0;
+    }
+    fp = fopen(original, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    memset(&srcinfo, 0, sizeof(srcinfo));
+    memset(&dstinfo, 0, sizeof(dstinfo));
+    srcinfo.err = dstinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = imaging_jpeg_error_exit;
+    jerr.pub.output_message = imaging_jpeg_output_message;
+    if (setjmp(jerr.setjmp_buffer)) {
+        jpeg_destroy_compress(&dstinfo);
+        jpeg_destroy_decompress(&srcinfo);
+        fclose(fp);
+        free(*data);
+        *data = NULL;
+        return 0;
+    }
+
+    jpeg_create_decompress(&srcinfo);
+    jpeg_stdio_src(&srcinfo, fp);
+    jpeg_save_markers(&srcinfo, IMAGING_JPEG_ICC_MARKER, 0xFFFF);
+    (void) jpeg_read_header(&srcinfo, TRUE);
+
+    // only crop boxes within tolerance of the iMCU grid.
+    x = y = -1;
+    if (imaging_action_geometry('c', actions + 1,
+            srcinfo.image_width, srcinfo.image_height, &geometry)) {
+        x = imaging_jpeg_align(geometry.crop_x, geometry.crop_width,
+            srcinfo.image_width, srcinfo.max_h_samp_factor * DCTSIZE, tolerance);
+        y = imaging_jpeg_align(geometry.crop_y, geometry.crop_height,
+            srcinfo.image_height, srcinfo.max_v_samp_factor * DCTSIZE, tolerance);
+    }
+    if (x < 0 || y < 0) {
+        jpeg_destroy_decompress(&srcinfo);
+        fclose(fp);
+        return 0;
+    }
+
+    src_coefs = jpeg_read_coefficients(&srcinfo);
+    jpeg_create_compress(&dstinfo);
+    jpeg_copy_critical_parameters(&srcinfo, &dstinfo);
+    dstinfo.image_width = geometry.crop_width;
+    dstinfo.image_height = geometry.crop_height;
+    for (ci = 0; ci < dstinfo.num_components; ci++) {
+        comp = dstinfo.comp_info + ci;
+        h_blocks = (geometry.crop_width * comp->h_samp_factor +
+            srcinfo.max_h_samp_factor * DCTSIZE - 1) / (srcinfo.max_h_samp_factor * DCTSIZE);
+        v_blocks = (geometry.crop_height * comp->v_samp_factor +
+            srcinfo.max_v_samp_factor * DCTSIZE - 1) / (srcinfo.max_v_samp_factor * DCTSIZE);
+        // whole MCUs, as the coefficient controller accesses them.
+        dst_coefs[ci] = (*dstinfo.mem->request_virt_barray)((j_common_ptr)&dstinfo,
+            JPOOL_IMAGE, FALSE,
+            (h_blocks + comp->h_samp_factor - 1) / comp->h_samp_factor * comp->h_samp_factor,
+            (v_blocks + comp->v_samp_factor - 1) / comp->v_samp_factor * comp->v_samp_factor,
+            comp->v_samp_factor);
+    }
+
+    jpeg_mem_dest(&dstinfo, data, &length);
+    jpeg_write_coefficients(&dstinfo, dst_coefs);
+    for (marker = srcinfo.marker_list; marker != NULL; marker = marker->next) {
+        jpeg_write_marker(&dstinfo, marker->marker, marker->data, marker->data_length);
+    }
+    imaging_jpeg_copy_blocks(&srcinfo, src_coefs, &dstinfo, dst_coefs, x, y);
+
+    jpeg_finish_compress(&dstinfo);
+    jpeg_destroy_compress(&dstinfo);
+    (void) jpeg_finish_decompress(&srcinfo);
+    jpeg_destroy_decompress(&srcinfo);
+    fclose(fp);
+    *data_length = length;
+    return 1;
+}
@@ -0,0 +1,62 @@
+/**
+ *  jpeg.h
+ *
+ *  Contains function prototypes for the direct libjpeg-turbo pipeline.
+ */
+#ifndef _IMAGING_JPEG_H_INCLUDED_
+#define _IMAGING_JPEG_H_INCLUDED_
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Returns 1 if every action in actions (eg: "t200_c100x100") can be
+ * handled by imaging_jpeg_create otherwise 0.
+ */
+int imaging_jpeg_supports(const char *actions);
+
+/*
+ * Creates a JPEG by applying actions to the JPEG original entirely
+ * through libjpeg-turbo. data is allocated with malloc.
+ *
+ * Returns 1 if successful otherwise 0 (eg: the original isn't a JPEG
+ * libjpeg-turbo can decode to RGB), in which case the caller should fall
+ * back to GraphicsMagick.
+ */
+int imaging_jpeg_create(const char *original, const char *actions,
+    unsigned long quality, unsigned char **data, size_t *data_length);
+
+/*
+ * Like imaging_jpeg_create for originals of at least min_pixels (> 0)
+ * pixels whose first action resamples (thumbnail, resize or scale). The
+ * original is decoded a scanline at a time through a rolling window
+ * resampler, so only a few of its rows are held in memory at once.
+ *
+ * Returns 1 if successful otherwise 0, in which case the caller should fall
+ * back to another path.
+ */
+int imaging_jpeg_stream(const char *original, const char *actions,
+    unsigned long min_pixels, unsigned long quality,
+    unsigned char **data, size_t *data_length);
+
+/*
+ * Creates a JPEG from the JPEG original for a single crop action (eg:
+ * "c400x400") by copying DCT coefficients, without decoding or re-encoding
+ * (like jpegtran -crop). The centered crop box is moved onto the closest
+ * iMCU (8 or 16 pixel) boundary; crops whose box would move by more than
+ * tolerance pixels aren't handled. data is allocated with malloc.
+ *
+ * Returns 1 if successful otherwise 0, in which case the caller should fall
+ * back to another path.
+ */
+int imaging_jpeg_crop(const char *original, const char *actions, long tolerance,
+    unsigned char **data, size_t *data_length);
+
+#ifdef  __cplusplus
+    }
+#endif
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * mmap.c
+ *
+ * Memory mapped originals for a worker process.
+ *
+ * ReadImage reads an original through GraphicsMagick's stdio blob layer,
+ * many small reads copied out of the page cache. Here an original is opened
+ * once, mapped read-only & decoded with BlobToImage straight from the
+ * mapping. Closed mappings are kept (most recently used first) so repeated
+ * decodes of a hot original skip the open & map; a stat tells whether the
+ * file changed since it was mapped.
+ *
+ * A file truncated while it is mapped makes reading past its new end raise
+ * SIGBUS, so only use this for originals which are replaced (renamed over)
+ * rather than rewritten in place.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mmap.h"
+
+typedef struct imaging_mmap_s imaging_mmap_t;
+
+struct imaging_mmap_s {
+    imaging_mmap_t         *prev, *next;
+    char                   *filename;
+    dev_t                   dev;
+    ino_t                   ino;
+    off_t                   size;
+    time_t                  mtime;
+    unsigned char          *data;
+    int                     refs;
+};
+
+typedef struct {
+    int                     enabled;
+    imaging_mmap_t         *head, *tail;   // most recently used first
+    imaging_mmap_stats_t    stats;
+    pthread_mutex_t         lock;
+} imaging_mmap_cache_t;
+
+static imaging_mmap_cache_t imaging_mmap_cache = {
+    0, NULL, NULL, { 0 }, PTHREAD_MUTEX_INITIALIZER
+};
+
+/******************************************************************
+ * Utils
+ *****************************************************************/
+static void imaging_mmap_unlink(imaging_mmap_t *map) {
+    if (map->prev != NULL) {
+        map->prev->next = map->next;
+    } else {
+        imaging_mmap_cache.head = map->next;
+    }
+    if (map->next != NULL) {
+        map->next->prev = map->prev;
+    } else {
+        imaging_mmap_cache.tail = map->prev;
+    }
+    map->prev = map->next = NULL;
+}
+
+static void imaging_mmap_push(imaging_mmap_t *map) {
+    map->prev = NULL;
+    map->next = imaging_mmap_cache.head;
+    if (imaging_mmap_cache.head != NULL) {
+        imaging_mmap_cache.head->prev = map;
+    } else {
+        imaging_mmap_cache.tail = map;
+    }
+    imaging_mmap_cache.head = map;
+}
+
+/*
+ * Unmaps map, which must not be in use, & forgets it.
+ */
+static void imaging_mmap_destroy(imaging_mmap_t *map) {
+    imaging_mmap_unlink(map);
+    (void) munmap(map->data, map->size);
+    imaging_mmap_cache.stats.bytes_mapped -= map->size;
+    imaging_mmap_cache.stats.unmaps++;
+    free(map->filename);
+    free(map);
+}
+
+/*
+ * Unmaps the least recently used mappings not in use until no more than
+ * max_cached bytes are mapped.
+ */
+static void imaging_mmap_trim(void) {
+    imaging_mmap_t *map, *prev;
+
+    for (map = imaging_mmap_cache.tail;
+         map != NULL && imaging_mmap_cache.stats.bytes_mapped > imaging_mmap_cache.stats.max_cached;
+         map = prev) {
+        prev = map->prev;
+        if (map->refs == 0) {
+            imaging_mmap_destroy(map);
+        }
+    }
+}
+
+/*
+ * Maps filename, or reuses its mapping, with the cache locked.
+ */
+static const unsigned char * imaging_mmap_open_locked(const char *filename,
+    size_t *length)
+{
+    imaging_mmap_t *map, *next;
+    struct stat st;
+    void *data;
+    int fd;
+
+    imaging_mmap_cache.stats.opens++;
+
+    if (stat(filename, &st) != 0) {
+        return NULL;
+    }
+
+    for (map = imaging_mmap_cache.head; map != NULL; map = next) {
+        next = map->next;
+        if (strcmp(map->filename, filename) != 0) {
+            continue;
+        }
+        if (map->dev == st.st_dev && map->ino == st.st_ino &&
+            map->size == st.st_size && map->mtime == st.st_mtime) {
+            imaging_mmap_unlink(map);
+            imaging_mmap_push(map);
+            map->refs++;
+            imaging_mmap_cache.stats.hits++;
+            *length = map->size;
+            return map->data;
+        }
+        // the file changed, its mapping is dropped once no longer used.
+        if (map->refs == 0) {
+            imaging_mmap_destroy(map);
+        }
+    }
+
+    if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+        return NULL;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        imaging_mmap_cache.stats.failures++;
+        return NULL;
+    }
+    // the file may have been replaced since the stat.
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        imaging_mmap_cache.stats.failures++;
+        return NULL;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping outlives the descriptor.
+    close(fd);
+    if (data == MAP_FAILED) {
+        imaging_mmap_cache.stats.failures++;
+        return NULL;
+    }
+    (void) madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    map = calloc(1, sizeof(imaging_mmap_t));
+    if (map == NULL || (map->filename = strdup(filename)) == NULL) {
+        free(map);
+        (void) munmap(data, st.st_size);
+        imaging_mmap_cache.stats.failures++;
+        return NULL;
+    }
+    map->dev = st.st_dev;
+    map->ino = st.st_ino;
+    map->size = st.st_size;
+    map->mtime = st.st_mtime;
+    map->data = data;
+    map->refs = 1;
+    imaging_mmap_push(map);
+
+    imaging_mmap_cache.stats.maps++;
+    imaging_mmap_cache.stats.bytes_mapped += map->size;
+
+    *length = map->size;
+    return map->data;
+}
+
+/******************************************************************
+ * Public API
+ *****************************************************************/
+void imaging_mmap_init(size_t max_cached) {
+    pthread_mutex_lock(&imaging_mmap_cache.lock);
+    imaging_mmap_cache.stats.max_cached = max_cached;
+    imaging_mmap_cache.enabled = 1;
+    pthread_mutex_unlock(&imaging_mmap_cache.lock);
+}
+
+const unsigned char * imaging_mmap_open(const char *filename, size_t *length) {
+    const unsigned char *data;
+
+    if (!imaging_mmap_cache.enabled) {
+        return NULL;
+    }
+    pthread_mutex_lock(&imaging_mmap_cache.lock);
+    data = imaging_mmap_open_locked(filename, length);
+    pthread_mutex_unlock(&imaging_mmap_cache.lock);
+    return data;
+}
+
+void imaging_mmap_close(const unsigned char *data) {
+    imaging_mmap_t *map;
+
+    pthread_mutex_lock(&imaging_mmap_cache.lock);
+    for (map = imaging_mmap_cache.head; map != NULL; map = map->next) {
+        if (map->data == data) {
+            map->refs--;
+            break;
+        }
+    }
+    imaging_mmap_trim();
+    pthread_mutex_unlock(&imaging_mmap_cache.lock);
+}
+
+int imaging_mmap_stats(imaging_mmap_stats_t *stats) {
+    if (!imaging_mmap_cache.enabled) {
+        return 0;
+    }
+    pthread_mutex_lock(&imaging_mmap_cache.lock);
+    *stats = imaging_mmap_cache.stats;
+    pthread_mutex_unlock(&imaging_mmap_cache.lock);
+    return 1;
+}
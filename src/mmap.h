@@ -0,0 +1,60 @@
+/**
+ *  mmap.h
+ *
+ *  Contains function prototypes for memory mapped originals.
+ */
+#ifndef _IMAGING_MMAP_H_INCLUDED_
+#define _IMAGING_MMAP_H_INCLUDED_
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Counters of the (per process) mappings. */
+typedef struct {
+    unsigned long   opens;          // imaging_mmap_open calls
+    unsigned long   hits;           // ... served by a kept mapping
+    unsigned long   maps;           // files mapped
+    unsigned long   unmaps;         // mappings unmapped (stale/cache full)
+    unsigned long   failures;       // files which couldn't be mapped
+    size_t          bytes_mapped;   // bytes of all current mappings
+    size_t          max_cached;     // limit of bytes_mapped
+} imaging_mmap_stats_t;
+
+/*
+ * Enables mapping originals for this process. Mappings are kept for reuse
+ * once closed, the least recently used are unmapped when they map more
+ * than max_cached bytes (0 unmaps every mapping once closed).
+ *
+ * Until this is called imaging_mmap_open returns NULL.
+ */
+void imaging_mmap_init(size_t max_cached);
+
+/*
+ * Maps filename read-only (with MADV_SEQUENTIAL) & sets length to its size,
+ * reusing the mapping of an earlier open while the file (its inode, size &
+ * mtime) is unchanged.
+ *
+ * Returns NULL if mapping is disabled or the file can't be mapped (eg: it's
+ * empty), in which case the caller should read it instead.
+ */
+const unsigned char * imaging_mmap_open(const char *filename, size_t *length);
+
+/*
+ * Releases data returned by imaging_mmap_open.
+ */
+void imaging_mmap_close(const unsigned char *data);
+
+/*
+ * Copies the counters of this process' mappings into stats.
+ * Returns 1 if mapping is enabled otherwise 0.
+ */
+int imaging_mmap_stats(imaging_mmap_stats_t *stats);
+
+#ifdef  __cplusplus
+    }
+#endif
+
+#endif
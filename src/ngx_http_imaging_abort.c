@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Aborting renders nobody waits for anymore (see imaging_render_timeout).
+ *
+ * Renders block the worker, so a client which gave up (closed the
+ * connection, or a CDN which times out after 10s) isn't noticed until the
+ * render is over, and its retries pile more renders on top. While a render
+ * runs the imaging library asks (imaging_set_abort) before each stage,
+ * between actions & every few rows whether to go on: not when the client
+ * closed the connection (peeked at the socket, like
+ * ngx_http_test_reading, at most every 50ms) or the request is older than
+ * imaging_render_timeout. The render then stops, freeing what it
+ * allocated, & the request is answered with 499 or 503. Render helpers
+ * only know about the deadline.
+ *
+ * Eg:
+ *  imaging_render_timeout 8s;
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+/* ms between peeks at the client's socket */
+#define NGX_HTTP_IMAGING_ABORT_PEEK  50
+
+
+static int ngx_http_imaging_abort_handler(void *data);
+static ngx_uint_t ngx_http_imaging_abort_closed(ngx_http_request_t *r);
+static ngx_msec_t ngx_http_imaging_abort_now(void);
+
+
+/* per worker */
+static ngx_http_imaging_abort_stats_t  ngx_http_imaging_abort_stat;
+
+
+/*
+ * Returns the deadline (wall clock msec) of renders of r, 0 when there is
+ * none.
+ */
+ngx_msec_t
+ngx_http_imaging_abort_deadline(ngx_http_request_t *r)
+{
+    ngx_http_imaging_loc_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+
+    if (conf->render_timeout == 0) {
+        return 0;
+    }
+
+    /* the client's clock started with the request, not with the render */
+    return (ngx_msec_t) r->start_sec * 1000 + r->start_msec
+           + conf->render_timeout;
+}
+
+
+/*
+ * Returns the deadline (wall clock msec) of a render with no request (eg: a
+ * prerender) starting now, 0 when there is none.
+ */
+ngx_msec_t
+ngx_http_imaging_abort_after(ngx_http_imaging_loc_conf_t *conf)
+{
+    if (conf->render_timeout == 0) {
+        return 0;
+    }
+
+    return ngx_http_imaging_abort_now() + conf->render_timeout;
+}
+
+
+/*
+ * Makes the renders which follow stop once the client of r (NULL: no
+ * client to watch) closed its connection or deadline (0: none) passed.
+ */
+void
+ngx_http_imaging_abort_start(ngx_http_imaging_abort_t *abort,
+    ngx_http_request_t *r, ngx_msec_t deadline)
+{
+#if (NGX_HTTP_V2)
+    /* the connection is shared by the streams, one closing isn't seen */
+    if (r != NULL && r->stream) {
+        r = NULL;
+    }
+#endif
+
+    abort->request = r;
+    abort->deadline = deadline;
+    abort->started = ngx_http_imaging_abort_now();
+    abort->peeked = 0;
+    abort->reason = NGX_HTTP_IMAGING_ABORT_NONE;
+    abort->wasted = 0;
+
+    /* nothing could stop the render, nothing to ask */
+    if (r == NULL && deadline == 0) {
+        return;
+    }
+
+    imaging_set_abort(ngx_http_imaging_abort_handler, abort);
+}
+
+
+/*
+ * Ends what ngx_http_imaging_abort_start started. Returns the status to
+ * answer an aborted render with, otherwise NGX_OK.
+ */
+ngx_int_t
+ngx_http_imaging_abort_finish(ngx_http_imaging_abort_t *abort)
+{
+    imaging_set_abort(NULL, NULL);
+
+    switch (abort->reason) {
+
+    case NGX_HTTP_IMAGING_ABORT_CLOSED:
+        abort->wasted = ngx_http_imaging_abort_now() - abort->started;
+        return NGX_HTTP_CLIENT_CLOSED_REQUEST;
+
+    case NGX_HTTP_IMAGING_ABORT_TIMEOUT:
+        abort->wasted = ngx_http_imaging_abort_now() - abort->started;
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+
+    default:
+        return NGX_OK;
+    }
+}
+
+
+/*
+ * Counts an aborted render, in this worker or in one of its helpers.
+ */
+void
+ngx_http_imaging_abort_count(ngx_log_t *log, ngx_str_t *path,
+    ngx_uint_t reason, ngx_msec_t wasted)
+{
+    if (reason == NGX_HTTP_IMAGING_ABORT_CLOSED) {
+        ngx_http_imaging_abort_stat.closed++;
+
+    } else {
+        ngx_http_imaging_abort_stat.timeouts++;
+    }
+
+    ngx_http_imaging_abort_stat.wasted += wasted;
+
+    ngx_log_error(NGX_LOG_INFO, log, 0,
+                  "imaging render of \"%V\" aborted after %Mms: %s", path,
+                  wasted, reason == NGX_HTTP_IMAGING_ABORT_CLOSED
+                          ? "client closed connection" : "timed out");
+}
+
+
+/*
+ * Copies the abort counters of this worker into stats.
+ */
+void
+ngx_http_imaging_abort_stats(ngx_http_imaging_abort_stats_t *stats)
+{
+    *stats = ngx_http_imaging_abort_stat;
+}
+
+
+/*
+ * imaging_set_abort handler, asked while a render runs.
+ */
+static int
+ngx_http_imaging_abort_handler(void *data)
+{
+    ngx_http_imaging_abort_t *abort = data;
+
+    ngx_msec_t  now;
+
+    if (abort->reason != NGX_HTTP_IMAGING_ABORT_NONE) {
+        return 1;
+    }
+
+    now = ngx_http_imaging_abort_now();
+
+    if (abort->deadline && now >= abort->deadline) {
+        abort->reason = NGX_HTTP_IMAGING_ABORT_TIMEOUT;
+        return 1;
+    }
+
+    /* asked every few rows: a syscall each time costs more than it saves */
+    if (abort->request == NULL
+        || now - abort->peeked < NGX_HTTP_IMAGING_ABORT_PEEK)
+    {
+        return 0;
+    }
+
+    abort->peeked = now;
+
+    if (ngx_http_imaging_abort_closed(abort->request)) {
+        abort->reason = NGX_HTTP_IMAGING_ABORT_CLOSED;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Tells whether the client of r closed its connection. The event loop
+ * doesn't run during a render, so the socket is peeked at.
+ */
+static ngx_uint_t
+ngx_http_imaging_abort_closed(ngx_http_request_t *r)
+{
+    u_char             buf[1];
+    ssize_t            n;
+    ngx_err_t          err;
+    ngx_connection_t  *c;
+
+    c = r->connection;
+
+    if (c->error) {
+        return 1;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    if (n == 0) {
+        return 1;
+    }
+
+    if (n == -1) {
+        err = ngx_socket_errno;
+
+        if (err != NGX_EAGAIN && err != NGX_EINTR) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * ngx_current_msec isn't updated during a render, the wall clock is read
+ * instead (as r->start_sec & r->start_msec are).
+ */
+static ngx_msec_t
+ngx_http_imaging_abort_now(void)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
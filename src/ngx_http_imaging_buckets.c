@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Size buckets (see imaging_size_buckets).
+ *
+ * The size a thumbnail, resize or scale action asks for (its width, or its
+ * height when it's alone) is rounded up to the nearest bucket (down to the
+ * largest one when it's larger than them all) before anything is looked up
+ * or rendered, so "t197", "t199" & "t200" are all served as "t200": one
+ * render & one cache entry instead of one per size asked for. The other
+ * size is scaled by the same factor, keeping the aspect. The variant is
+ * served under its bucketed uri, or the client is redirected (301) to it.
+ *
+ * With imaging_salt the bucketed url only needs the hash of the requested
+ * one: once that passes the check, the bucketed one is signed here.
+ *
+ * Eg:
+ *  imaging_size_buckets 64 120 200 320 480 640 960 1280;
+ *
+ *  GET /img/photo_t197.jpg -> /img/photo_t200.jpg
+ *  GET /img/photo_r500x300_fsharpen.jpg -> /img/photo_r640x384_fsharpen.jpg
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+static ngx_int_t ngx_http_imaging_buckets_redirect(ngx_http_request_t *r,
+    ngx_str_t *uri, char *hash);
+static int ngx_libc_cdecl ngx_http_imaging_buckets_cmp(const void *one,
+    const void *two);
+
+
+/*
+ * imaging_size_buckets size ... [redirect] | off;
+ */
+char *
+ngx_http_imaging_size_buckets(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_imaging_loc_conf_t *ilcf = conf;
+
+    ngx_str_t      *value;
+    ngx_int_t       n;
+    ngx_uint_t      i;
+    unsigned long  *bucket, *buckets;
+
+    if (ilcf->size_buckets != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    ilcf->size_buckets_redirect = 0;
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        ilcf->size_buckets = NULL;
+        return NGX_CONF_OK;
+    }
+
+    ilcf->size_buckets = ngx_array_create(cf->pool, cf->args->nelts,
+                                          sizeof(unsigned long));
+    if (ilcf->size_buckets == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strcmp(value[i].data, "redirect") == 0) {
+            ilcf->size_buckets_redirect = 1;
+            continue;
+        }
+
+        n = ngx_atoi(value[i].data, value[i].len);
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid size bucket \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        bucket = ngx_array_push(ilcf->size_buckets);
+        if (bucket == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *bucket = n;
+    }
+
+    if (ilcf->size_buckets->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "no size buckets");
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_qsort(ilcf->size_buckets->elts, ilcf->size_buckets->nelts,
+              sizeof(unsigned long), ngx_http_imaging_buckets_cmp);
+
+    buckets = ilcf->size_buckets->elts;
+
+    for (i = 1; i < ilcf->size_buckets->nelts; i++) {
+        if (buckets[i] == buckets[i - 1]) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate size bucket \"%ul\"", buckets[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * Rounds the sizes of the variant r asks for to conf's buckets, rewriting
+ * its uri, path & hash (*hash, with imaging_salt) to the bucketed variant.
+ *
+ * Returns NGX_OK (rewritten or not), NGX_HTTP_MOVED_PERMANENTLY once the
+ * redirect to the bucketed variant is set up or NGX_ERROR.
+ */
+ngx_int_t
+ngx_http_imaging_buckets_snap(ngx_http_request_t *r,
+    ngx_http_imaging_loc_conf_t *conf, ngx_str_t *path, char **hash)
+{
+    u_char       *p, *last, *ext;
+    char         *actions, *signature;
+    size_t        root, len, tail, snapped_len;
+    ngx_str_t     uri;
+    const char   *found;
+    u_char        snapped[NGX_MAX_PATH_LEN];
+
+    found = imaging_parse_actions((const char *) path->data);
+
+    if (found == NULL) {
+        return NGX_OK;
+    }
+
+    /* the action string ends the uri as it ends the path, before the ext */
+    tail = path->data + path->len - (u_char *) found;
+
+    if (tail > r->uri.len || r->uri.data[r->uri.len - tail] != '_') {
+        return NGX_OK;
+    }
+
+    ext = (u_char *) strrchr(found, '.');
+
+    if (ext == NULL) {
+        return NGX_OK;
+    }
+
+    len = ext - (u_char *) found;
+
+    snapped_len = imaging_snap_actions(found, len,
+                                       conf->size_buckets->elts,
+                                       conf->size_buckets->nelts,
+                                       (char *) snapped, sizeof(snapped));
+
+    if (snapped_len == 0
+        || (snapped_len == len && ngx_strncmp(snapped, found, len) == 0))
+    {
+        return NGX_OK;
+    }
+
+    /* a requested variant which fails the security check stays as it is */
+    if (conf->salt.len) {
+        actions = ngx_pnalloc(r->pool, len + 1);
+        signature = ngx_pnalloc(r->pool, IMAGING_HASH_LENGTH + 1);
+        if (actions == NULL || signature == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_cpystrn((u_char *) actions, (u_char *) found, len + 1);
+
+        if (!imaging_actions_allowed(actions, (const char *) conf->salt.data,
+                                     *hash,
+                                     (const char *) conf->white_list.data))
+        {
+            return NGX_OK;
+        }
+
+        imaging_actions_hash((const char *) snapped,
+                             (const char *) conf->salt.data, signature);
+        *hash = signature;
+    }
+
+    /* photo_t197.jpg -> photo_t200.jpg */
+    uri.len = r->uri.len - len + snapped_len;
+    uri.data = ngx_pnalloc(r->pool, uri.len);
+    if (uri.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(uri.data, r->uri.data, r->uri.len - tail);
+    p = ngx_cpymem(p, snapped, snapped_len);
+    ngx_memcpy(p, r->uri.data + r->uri.len - tail + len, tail - len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "imaging size bucket \"%V\" -> \"%V\"", &r->uri, &uri);
+
+    if (conf->size_buckets_redirect) {
+        return ngx_http_imaging_buckets_redirect(r, &uri,
+                                                 conf->salt.len ? *hash : NULL);
+    }
+
+    r->uri = uri;
+
+    last = ngx_http_map_uri_to_path(r, path, &root, 0);
+    if (last == NULL) {
+        return NGX_ERROR;
+    }
+
+    path->len = last - path->data;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Redirects r to uri, with hash (when not NULL) in place of its args.
+ */
+static ngx_int_t
+ngx_http_imaging_buckets_redirect(ngx_http_request_t *r, ngx_str_t *uri,
+    char *hash)
+{
+    u_char           *p;
+    ngx_str_t         args;
+    ngx_table_elt_t  *location;
+
+    if (hash != NULL) {
+        args.data = (u_char *) hash;
+        args.len = ngx_strlen(hash);
+
+    } else {
+        args = r->args;
+    }
+
+    ngx_http_clear_location(r);
+
+    location = ngx_list_push(&r->headers_out.headers);
+    if (location == NULL) {
+        return NGX_ERROR;
+    }
+
+    location->hash = 1;
+    ngx_str_set(&location->key, "Location");
+
+    location->value.len = uri->len + (args.len ? 1 + args.len : 0);
+    location->value.data = ngx_pnalloc(r->pool, location->value.len);
+    if (location->value.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(location->value.data, uri->data, uri->len);
+
+    if (args.len) {
+        *p++ = '?';
+        ngx_memcpy(p, args.data, args.len);
+    }
+
+    r->headers_out.location = location;
+
+    return NGX_HTTP_MOVED_PERMANENTLY;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_imaging_buckets_cmp(const void *one, const void *two)
+{
+    const unsigned long  *first = one;
+    const unsigned long  *second = two;
+
+    if (*first == *second) {
+        return 0;
+    }
+
+    return (*first < *second) ? -1 : 1;
+}
@@ -0,0 +1,1125 @@
+
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * On disk cache for created images (variants).
+ *
+ * Variants are stored under a hashed directory layout (like proxy_cache)
+ * named after the md5 of the request uri. A shared memory index tracks the
+ * size and last access time of every entry, which the nginx cache manager
+ * uses to evict the least recently used variants once they are inactive or
+ * the cache grows beyond max_size. Originals are never stored here.
+ *
+ * Entries also remember the md5 of their original's uri, so every variant
+ * of an original can be purged at once.
+ *
+ * Files are only ever deleted with the zone unlocked. Temp files of workers
+ * which died writing them are deleted by the cache loader once they weren't
+ * written to for inactive.
+ */
+#include "ngx_http_imaging_module.h"
+
+
+#define ngx_http_imaging_cache_name_len(cache)                               \
+    ((cache)->path->name.len + 1 + (cache)->path->len                        \
+     + 2 * NGX_HTTP_IMAGING_CACHE_KEY_LEN)
+
+/* entries evicted at most to make room for a new one */
+#define NGX_HTTP_IMAGING_CACHE_EVICT  20
+
+static ngx_int_t ngx_http_imaging_cache_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_http_imaging_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_http_imaging_cache_node_t *ngx_http_imaging_cache_find_locked(
+    ngx_http_imaging_cache_t *cache, u_char *key);
+static ngx_http_imaging_cache_node_t *ngx_http_imaging_cache_insert_locked(
+    ngx_http_imaging_cache_t *cache, u_char *key, off_t size, time_t accessed,
+    u_char *expired, ngx_uint_t *nexpired);
+static void ngx_http_imaging_cache_remove_locked(
+    ngx_http_imaging_cache_t *cache, ngx_http_imaging_cache_node_t *node);
+static void ngx_http_imaging_cache_expire_locked(
+    ngx_http_imaging_cache_t *cache, u_char *key);
+static void ngx_http_imaging_cache_delete(ngx_http_imaging_cache_t *cache,
+    ngx_log_t *log, u_char *keys, ngx_uint_t n);
+static void ngx_http_imaging_cache_file_name(ngx_http_imaging_cache_t *cache,
+    u_char *key, u_char *name);
+static ngx_uint_t ngx_http_imaging_cache_temp_file(ngx_str_t *path);
+static ngx_msec_t ngx_http_imaging_cache_manager(void *data);
+static void ngx_http_imaging_cache_loader(void *data);
+static ngx_int_t ngx_http_imaging_cache_add_file(ngx_tree_ctx_t *ctx,
+    ngx_str_t *path);
+static ngx_int_t ngx_http_imaging_cache_noop(ngx_tree_ctx_t *ctx,
+    ngx_str_t *path);
+
+
+/*
+ * imaging_cache_path /path [levels=1:2] [keys_zone=name:size]
+ *     [inactive=time] [max_size=size];
+ *
+ * Also used by imaging_origin_cache_path; the cache is stored at cmd->offset
+ * of the main conf and its zone is named after the directive by default.
+ */
+char *
+ngx_http_imaging_cache_path(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    char  *mcf = conf;
+
+    off_t                      max_size;
+    u_char                    *last, *p;
+    time_t                     inactive;
+    ssize_t                    size;
+    ngx_str_t                  s, name, *value;
+    ngx_int_t                  n;
+    ngx_uint_t                 i;
+    ngx_http_imaging_cache_t  *cache, **cachep;
+
+    cachep = (ngx_http_imaging_cache_t **) (mcf + cmd->offset);
+
+    if (*cachep != NULL) {
+        return "is duplicate";
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_imaging_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+    if (cache->path == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    inactive = 600;
+    max_size = NGX_MAX_OFF_T_VALUE;
+    /* "imaging_cache" or "imaging_origin_cache" */
+    name.data = cmd->name.data;
+    name.len = cmd->name.len - (sizeof("_path") - 1);
+    size = 10 * 1024 * 1024;
+
+    value = cf->args->elts;
+
+    cache->path->name = value[1];
+
+    if (cache->path->name.data[cache->path->name.len - 1] == '/') {
+        cache->path->name.len--;
+    }
+
+    if (ngx_conf_full_name(cf->cycle, &cache->path->name, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "levels=", 7) == 0) {
+
+            p = value[i].data + 7;
+            last = value[i].data + value[i].len;
+
+            for (n = 0; n < NGX_MAX_PATH_LEVEL && p < last; n++) {
+
+                if (*p > '0' && *p < '3') {
+
+                    cache->path->level[n] = *p++ - '0';
+                    cache->path->len += cache->path->level[n] + 1;
+
+                    if (p == last) {
+                        break;
+                    }
+
+                    if (*p++ == ':' && n < NGX_MAX_PATH_LEVEL - 1 && p < last) {
+                        continue;
+                    }
+
+                    goto invalid_levels;
+                }
+
+                goto invalid_levels;
+            }
+
+            if (cache->path->len < 10 + NGX_MAX_PATH_LEVEL) {
+                continue;
+            }
+
+        invalid_levels:
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid \"levels\" \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
+
+            name.data = value[i].data + 10;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid keys zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid keys zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (2 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "keys zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            inactive = ngx_parse_time(&s, 1);
+            if (inactive == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid inactive value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            max_size = ngx_parse_offset(&s);
+            if (max_size < 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid max_size value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    cache->inactive = inactive;
+    cache->max_size = max_size;
+
+    cache->path->manager = ngx_http_imaging_cache_manager;
+    cache->path->loader = ngx_http_imaging_cache_loader;
+    cache->path->data = cache;
+    cache->path->conf_file = cf->conf_file->file.name.data;
+    cache->path->line = cf->conf_file->line;
+
+    if (ngx_add_path(cf, &cache->path) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
+    if (cache->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cache->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    cache->shm_zone->init = ngx_http_imaging_cache_init_zone;
+    cache->shm_zone->data = cache;
+
+    *cachep = cache;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Sets up the shared memory index, reusing the old one across reloads.
+ */
+static ngx_int_t
+ngx_http_imaging_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_imaging_cache_t  *ocache = data;
+
+    size_t                     len;
+    ngx_http_imaging_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool,
+                               sizeof(ngx_http_imaging_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_imaging_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    cache->sh->size = 0;
+    cache->sh->count = 0;
+
+    len = sizeof(" in imaging cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in imaging cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_imaging_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t              **p;
+    ngx_http_imaging_cache_node_t   *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_imaging_cache_node_t *) node;
+            cnt = (ngx_http_imaging_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key, sizeof(cn->key)) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/*
+ * Fills in the cache key, the key of its original & file name (allocated
+ * from pool) of the entry for uri (eg: the variant being requested).
+ */
+ngx_int_t
+ngx_http_imaging_cache_init_entry(ngx_pool_t *pool,
+    ngx_http_imaging_cache_t *cache, ngx_http_imaging_cache_entry_t *entry,
+    ngx_str_t *uri)
+{
+    u_char      *name, *ext;
+    ngx_md5_t    md5;
+    const char  *actions;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, uri->data, uri->len);
+    ngx_md5_final(entry->key, &md5);
+
+    /* the original's uri is the variant's without the action string */
+    name = ngx_pnalloc(pool, uri->len + 1);
+    if (name == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(name, uri->data, uri->len + 1);
+
+    actions = imaging_parse_actions((const char *) name);
+
+    if (actions != NULL) {
+        for (ext = name + uri->len - 1; *ext != '.'; ext--) {
+            /* void */
+        }
+
+        ngx_md5_init(&md5);
+        ngx_md5_update(&md5, name, (u_char *) actions - name);
+        ngx_md5_update(&md5, ext, name + uri->len - ext);
+        ngx_md5_final(entry->original, &md5);
+
+    } else {
+        ngx_memcpy(entry->original, entry->key, NGX_HTTP_IMAGING_CACHE_KEY_LEN);
+    }
+
+    entry->file.len = ngx_http_imaging_cache_name_len(cache);
+    entry->file.data = ngx_pnalloc(pool, entry->file.len + 1);
+    if (entry->file.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_imaging_cache_file_name(cache, entry->key, entry->file.data);
+
+    entry->actions_len = 0;
+    entry->fd = NGX_INVALID_FILE;
+    entry->size = 0;
+    entry->mtime = 0;
+
+    return NGX_OK;
+}
+
+/*
+ * Opens the cached variant for the entry.
+ *
+ * Returns NGX_OK on a hit (entry->fd is open & closed with the request
+ * pool), NGX_DECLINED on a miss or NGX_ERROR.
+ */
+ngx_int_t
+ngx_http_imaging_cache_lookup(ngx_http_request_t *r,
+    ngx_http_imaging_cache_t *cache, ngx_http_imaging_cache_entry_t *entry)
+{
+    u_char                          expired[NGX_HTTP_IMAGING_CACHE_EVICT
+                                            * NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    ngx_err_t                       err;
+    ngx_uint_t                      nexpired;
+    ngx_file_info_t                 fi;
+    ngx_pool_cleanup_t             *cln;
+    ngx_pool_cleanup_file_t        *clnf;
+    ngx_http_imaging_cache_node_t  *node;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    entry->fd = ngx_open_file(entry->file.data, NGX_FILE_RDONLY,
+                              NGX_FILE_OPEN, 0);
+
+    if (entry->fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT && err != NGX_ENOTDIR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%s\" failed", entry->file.data);
+        }
+
+        /* forget about entries which have vanished from disk */
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        node = ngx_http_imaging_cache_find_locked(cache, entry->key);
+        if (node != NULL) {
+            ngx_http_imaging_cache_remove_locked(cache, node);
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = entry->fd;
+    clnf->name = entry->file.data;
+    clnf->log = r->pool->log;
+
+    if (ngx_fd_info(entry->fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", entry->file.data);
+        return NGX_ERROR;
+    }
+
+    entry->size = ngx_file_size(&fi);
+    entry->mtime = ngx_file_mtime(&fi);
+
+    nexpired = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_imaging_cache_find_locked(cache, entry->key);
+
+    if (node == NULL) {
+        node = ngx_http_imaging_cache_insert_locked(cache, entry->key,
+                                                    entry->size, ngx_time(),
+                                                    expired, &nexpired);
+    }
+
+    if (node != NULL) {
+        node->accessed = ngx_time();
+
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+        entry->actions_len = node->actions_len;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_imaging_cache_delete(cache, r->connection->log, expired,
+                                  nexpired);
+
+    return NGX_OK;
+}
+
+/*
+ * Tells whether the variant of entry is in the cache index, without
+ * touching its access time.
+ */
+ngx_uint_t
+ngx_http_imaging_cache_exists(ngx_http_imaging_cache_t *cache,
+    ngx_http_imaging_cache_entry_t *entry)
+{
+    ngx_http_imaging_cache_node_t  *node;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+    node = ngx_http_imaging_cache_find_locked(cache, entry->key);
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return node != NULL;
+}
+
+/*
+ * Writes a created variant into the cache (via a temp file + rename so
+ * readers never see partial files) and indexes it.
+ */
+ngx_int_t
+ngx_http_imaging_cache_store(ngx_pool_t *pool, ngx_log_t *log,
+    ngx_http_imaging_cache_t *cache, ngx_http_imaging_cache_entry_t *entry,
+    u_char *data, size_t len)
+{
+    u_char                         *temp;
+    u_char                          expired[NGX_HTTP_IMAGING_CACHE_EVICT
+                                            * NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    size_t                          written;
+    ssize_t                         n;
+    ngx_fd_t                        fd;
+    ngx_uint_t                      nexpired;
+    ngx_http_imaging_cache_node_t  *node;
+
+    temp = ngx_pnalloc(pool, entry->file.len + 1 + NGX_INT64_LEN + 1);
+    if (temp == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(temp, "%V.%P%Z", &entry->file, ngx_pid);
+
+    fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE && ngx_errno == NGX_ENOPATH) {
+        /* the level directories don't exist yet */
+        if (ngx_create_full_path(temp, 0700) == 0) {
+            fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                               NGX_FILE_DEFAULT_ACCESS);
+        }
+    }
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp);
+        return NGX_ERROR;
+    }
+
+    for (written = 0; written < len; written += n) {
+        n = ngx_write_fd(fd, data + written, len - written);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_write_fd_n " \"%s\" failed", temp);
+            (void) ngx_close_file(fd);
+            (void) ngx_delete_file(temp);
+            return NGX_ERROR;
+        }
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+    if (ngx_rename_file(temp, entry->file.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      temp, entry->file.data);
+        (void) ngx_delete_file(temp);
+        return NGX_ERROR;
+    }
+
+    nexpired = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_imaging_cache_find_locked(cache, entry->key);
+
+    if (node == NULL) {
+        node = ngx_http_imaging_cache_insert_locked(cache, entry->key,
+                                                    len, ngx_time(),
+                                                    expired, &nexpired);
+
+    } else {
+        cache->sh->size += (off_t) len - node->size;
+        node->size = len;
+        node->accessed = ngx_time();
+
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+    }
+
+    if (node != NULL) {
+        node->actions_len = (u_short) entry->actions_len;
+        ngx_memcpy(node->original, entry->original,
+                   NGX_HTTP_IMAGING_CACHE_KEY_LEN);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_imaging_cache_delete(cache, log, expired, nexpired);
+
+    return NGX_OK;
+}
+
+/*
+ * Removes the variant of entry (eg: one which went stale) from the cache.
+ */
+void
+ngx_http_imaging_cache_remove(ngx_log_t *log, ngx_http_imaging_cache_t *cache,
+    ngx_http_imaging_cache_entry_t *entry)
+{
+    ngx_http_imaging_cache_node_t  *node;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_imaging_cache_find_locked(cache, entry->key);
+    if (node != NULL) {
+        ngx_http_imaging_cache_remove_locked(cache, node);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    if (ngx_delete_file(entry->file.data) == NGX_FILE_ERROR
+        && ngx_errno != NGX_ENOENT)
+    {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", entry->file.data);
+    }
+}
+
+/*
+ * Removes every variant of the original whose key is given from the cache.
+ * Entries found by the loader don't know their original & are left to
+ * expire.
+ *
+ * Returns the number of variants removed.
+ */
+ngx_uint_t
+ngx_http_imaging_cache_purge(ngx_pool_t *pool, ngx_log_t *log,
+    ngx_http_imaging_cache_t *cache, u_char *original)
+{
+    u_char                         *name, *key;
+    ngx_uint_t                      i;
+    ngx_array_t                    *keys;
+    ngx_queue_t                    *q, *next;
+    ngx_http_imaging_cache_node_t  *node;
+
+    keys = ngx_array_create(pool, 8, NGX_HTTP_IMAGING_CACHE_KEY_LEN);
+    if (keys == NULL) {
+        return 0;
+    }
+
+    name = ngx_pnalloc(pool, ngx_http_imaging_cache_name_len(cache) + 1);
+    if (name == NULL) {
+        return 0;
+    }
+
+    /* files are deleted once the zone is unlocked */
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (q = ngx_queue_head(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        node = ngx_queue_data(q, ngx_http_imaging_cache_node_t, queue);
+
+        if (ngx_memcmp(node->original, original,
+                       NGX_HTTP_IMAGING_CACHE_KEY_LEN) != 0)
+        {
+            continue;
+        }
+
+        key = ngx_array_push(keys);
+        if (key == NULL) {
+            break;
+        }
+
+        ngx_memcpy(key, &node->node.key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], node->key,
+                   NGX_HTTP_IMAGING_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_http_imaging_cache_remove_locked(cache, node);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    key = keys->elts;
+
+    for (i = 0; i < keys->nelts; i++) {
+        ngx_http_imaging_cache_file_name(cache,
+            &key[i * NGX_HTTP_IMAGING_CACHE_KEY_LEN], name);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "imaging cache purge: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+    }
+
+    return keys->nelts;
+}
+
+static ngx_http_imaging_cache_node_t *
+ngx_http_imaging_cache_find_locked(ngx_http_imaging_cache_t *cache,
+    u_char *key)
+{
+    ngx_int_t                       rc;
+    ngx_rbtree_key_t                node_key;
+    ngx_rbtree_node_t              *node, *sentinel;
+    ngx_http_imaging_cache_node_t  *cn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        cn = (ngx_http_imaging_cache_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], cn->key,
+                        NGX_HTTP_IMAGING_CACHE_KEY_LEN
+                        - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * Adds a node to the index, evicting the least recently used entries when
+ * the zone runs out of memory. The keys of those are added to expired
+ * (room for NGX_HTTP_IMAGING_CACHE_EVICT keys, *nexpired counts them), their
+ * files are for the caller to delete once the zone is unlocked.
+ */
+static ngx_http_imaging_cache_node_t *
+ngx_http_imaging_cache_insert_locked(ngx_http_imaging_cache_t *cache,
+    u_char *key, off_t size, time_t accessed, u_char *expired,
+    ngx_uint_t *nexpired)
+{
+    ngx_uint_t                      tries;
+    ngx_http_imaging_cache_node_t  *node;
+
+    for (tries = 0; /* void */ ; tries++) {
+        node = ngx_slab_alloc_locked(cache->shpool,
+                                     sizeof(ngx_http_imaging_cache_node_t));
+        if (node != NULL) {
+            break;
+        }
+
+        if (tries == NGX_HTTP_IMAGING_CACHE_EVICT
+            || ngx_queue_empty(&cache->sh->queue))
+        {
+            return NULL;
+        }
+
+        ngx_http_imaging_cache_expire_locked(cache,
+            &expired[(*nexpired)++ * NGX_HTTP_IMAGING_CACHE_KEY_LEN]);
+    }
+
+    ngx_memcpy((u_char *) &node->node.key, key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(node->key, &key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_IMAGING_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    node->actions_len = 0;
+    ngx_memzero(node->original, NGX_HTTP_IMAGING_CACHE_KEY_LEN);
+    node->accessed = accessed;
+    node->size = size;
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&cache->sh->queue, &node->queue);
+
+    cache->sh->size += size;
+    cache->sh->count++;
+
+    return node;
+}
+
+static void
+ngx_http_imaging_cache_remove_locked(ngx_http_imaging_cache_t *cache,
+    ngx_http_imaging_cache_node_t *node)
+{
+    ngx_rbtree_delete(&cache->sh->rbtree, &node->node);
+    ngx_queue_remove(&node->queue);
+
+    cache->sh->size -= node->size;
+    cache->sh->count--;
+
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+/*
+ * Drops the least recently used entry to free up memory in the zone and
+ * sets key to its key: its file is deleted once the zone is unlocked
+ * (ngx_http_imaging_cache_delete).
+ */
+static void
+ngx_http_imaging_cache_expire_locked(ngx_http_imaging_cache_t *cache,
+    u_char *key)
+{
+    ngx_queue_t                    *q;
+    ngx_http_imaging_cache_node_t  *node;
+
+    q = ngx_queue_last(&cache->sh->queue);
+    node = ngx_queue_data(q, ngx_http_imaging_cache_node_t, queue);
+
+    ngx_memcpy(key, &node->node.key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], node->key,
+               NGX_HTTP_IMAGING_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    ngx_http_imaging_cache_remove_locked(cache, node);
+}
+
+/*
+ * Deletes the files of the n keys (expired from the zone).
+ */
+static void
+ngx_http_imaging_cache_delete(ngx_http_imaging_cache_t *cache, ngx_log_t *log,
+    u_char *keys, ngx_uint_t n)
+{
+    u_char      *name;
+    ngx_uint_t   i;
+
+    if (n == 0) {
+        return;
+    }
+
+    name = ngx_alloc(ngx_http_imaging_cache_name_len(cache) + 1, log);
+    if (name == NULL) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        ngx_http_imaging_cache_file_name(cache,
+            &keys[i * NGX_HTTP_IMAGING_CACHE_KEY_LEN], name);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "imaging cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+    }
+
+    ngx_free(name);
+}
+
+/*
+ * Builds the full path of the file for key into name, which must hold
+ * ngx_http_imaging_cache_name_len(cache) + 1 bytes.
+ */
+static void
+ngx_http_imaging_cache_file_name(ngx_http_imaging_cache_t *cache, u_char *key,
+    u_char *name)
+{
+    u_char  *p;
+
+    ngx_memcpy(name, cache->path->name.data, cache->path->name.len);
+
+    p = name + cache->path->name.len + 1 + cache->path->len;
+    p = ngx_hex_dump(p, key, NGX_HTTP_IMAGING_CACHE_KEY_LEN);
+    *p = '\0';
+
+    ngx_create_hashed_filename(cache->path, name, p - name);
+}
+
+/*
+ * Called periodically by the cache manager process. Evicts entries from the
+ * tail of the LRU queue while they are inactive or the cache is too big.
+ */
+static ngx_msec_t
+ngx_http_imaging_cache_manager(void *data)
+{
+    ngx_http_imaging_cache_t       *cache = data;
+
+    u_char                          key[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    u_char                         *name;
+    time_t                          now;
+    ngx_queue_t                    *q;
+    ngx_http_imaging_cache_node_t  *node;
+
+    name = ngx_alloc(ngx_http_imaging_cache_name_len(cache) + 1,
+                     ngx_cycle->log);
+    if (name == NULL) {
+        return 10000;
+    }
+
+    now = ngx_time();
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            break;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+        node = ngx_queue_data(q, ngx_http_imaging_cache_node_t, queue);
+
+        if (cache->sh->size <= cache->max_size
+            && now - node->accessed < cache->inactive)
+        {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            break;
+        }
+
+        ngx_memcpy(key, &node->node.key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], node->key,
+                   NGX_HTTP_IMAGING_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_http_imaging_cache_remove_locked(cache, node);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_http_imaging_cache_file_name(cache, key, name);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "imaging cache evict: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+    }
+
+    ngx_free(name);
+
+    return 10000;
+}
+
+/*
+ * Called once by the cache loader process; indexes variants which are
+ * already on disk (eg: after a restart).
+ */
+static void
+ngx_http_imaging_cache_loader(void *data)
+{
+    ngx_http_imaging_cache_t  *cache = data;
+
+    ngx_tree_ctx_t  tree;
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_imaging_cache_add_file;
+    tree.pre_tree_handler = ngx_http_imaging_cache_noop;
+    tree.post_tree_handler = ngx_http_imaging_cache_noop;
+    tree.spec_handler = ngx_http_imaging_cache_noop;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "imaging cache \"%V\": %ui files, %O bytes",
+                  &cache->path->name, cache->sh->count, cache->sh->size);
+}
+
+static ngx_int_t
+ngx_http_imaging_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_imaging_cache_t  *cache = ctx->data;
+
+    u_char                          key[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    u_char                          expired[NGX_HTTP_IMAGING_CACHE_EVICT
+                                            * NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    u_char                         *p;
+    ngx_int_t                       n;
+    ngx_uint_t                      i, nexpired;
+    ngx_http_imaging_cache_node_t  *node;
+
+    if (ngx_http_imaging_cache_temp_file(path)) {
+
+        /* a worker died writing it (renames are immediate otherwise) */
+        if (ngx_time() - ctx->mtime < cache->inactive) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "imaging cache: deleting stale temp file \"%V\"",
+                      path);
+
+        if (ngx_delete_file(path->data) == NGX_FILE_ERROR
+            && ngx_errno != NGX_ENOENT)
+        {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%V\" failed", path);
+        }
+
+        return NGX_OK;
+    }
+
+    if (path->len < 2 * NGX_HTTP_IMAGING_CACHE_KEY_LEN + 1) {
+        return NGX_OK;
+    }
+
+    /* skip anything which isn't named after a key (eg: temp files) */
+    p = &path->data[path->len - 2 * NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+
+    if (p[-1] != '/') {
+        return NGX_OK;
+    }
+
+    for (i = 0; i < NGX_HTTP_IMAGING_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_OK;
+        }
+
+        p += 2;
+
+        key[i] = (u_char) n;
+    }
+
+    nexpired = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    node = ngx_http_imaging_cache_find_locked(cache, key);
+
+    if (node == NULL) {
+        node = ngx_http_imaging_cache_insert_locked(cache, key, ctx->size,
+                                                    ctx->mtime, expired,
+                                                    &nexpired);
+
+        /* entries found on disk are the first candidates for eviction */
+        if (node != NULL) {
+            ngx_queue_remove(&node->queue);
+            ngx_queue_insert_tail(&cache->sh->queue, &node->queue);
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_imaging_cache_delete(cache, ngx_cycle->log, expired, nexpired);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Tells whether path is a temp file of ngx_http_imaging_cache_store: the
+ * name of a key followed by ".pid".
+ */
+static ngx_uint_t
+ngx_http_imaging_cache_temp_file(ngx_str_t *path)
+{
+    u_char  *p, *dot, *last;
+
+    last = path->data + path->len;
+
+    for (dot = last; dot > path->data && dot[-1] != '.'; dot--) {
+        if (dot[-1] < '0' || dot[-1] > '9') {
+            return 0;
+        }
+    }
+
+    /* at least one digit after the dot */
+    if (dot == last || dot == path->data) {
+        return 0;
+    }
+
+    dot--;
+
+    if ((size_t) (dot - path->data) < 2 * NGX_HTTP_IMAGING_CACHE_KEY_LEN + 1) {
+        return 0;
+    }
+
+    p = dot - 2 * NGX_HTTP_IMAGING_CACHE_KEY_LEN;
+
+    if (p[-1] != '/') {
+        return 0;
+    }
+
+    for ( /* void */ ; p < dot; p++) {
+        if (ngx_hextoi(p, 1) == NGX_ERROR) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static ngx_int_t
+ngx_http_imaging_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
@@ -0,0 +1,1048 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Render helper processes (see imaging_helpers).
+ *
+ * Each worker forks a few helpers when it starts and hands renders to them
+ * instead of calling GraphicsMagick itself, so a crash, leak or huge
+ * allocation while decoding costs a helper (and the one request it was
+ * rendering) rather than the worker & all of its connections, and the
+ * worker never blocks on a render.
+ *
+ * A worker & its helper share a unix socket and a shared memory buffer.
+ * The worker writes the variant's path & hash into the buffer and sends a
+ * small job over the socket; the helper renders, writes the encoded image
+ * into the buffer & replies. The worker serves (and caches) the image
+ * straight out of the buffer, the helper takes the next job once the
+ * image was sent (or the request is freed).
+ *
+ * Helpers exit after 'jobs' renders or once their RSS peaked over 'rss',
+ * & are respawned, as are those which crash. Since a helper is a fork of
+ * its worker it shares the worker's configuration; the job only points
+ * at the location's.
+ *
+ * Renders on behalf of no request (prerenders) go through the same queue
+ * & are cached (or written beside the original) by the worker, which then
+ * lets their owner know.
+ *
+ * Eg:
+ *  imaging_helpers 4 buffer=16m jobs=1000 rss=512m;
+ */
+#include "ngx_http_imaging_module.h"
+
+#include <sys/resource.h>
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+typedef struct ngx_http_imaging_helper_job_s  ngx_http_imaging_helper_job_t;
+
+typedef struct {
+    ngx_pid_t                        pid;
+    ngx_connection_t                *connection;
+    ngx_shm_t                        shm;
+
+    /* the job being rendered or sent out of shm */
+    ngx_http_imaging_helper_job_t   *job;
+
+    unsigned                         busy:1;
+    unsigned                         retiring:1;
+} ngx_http_imaging_helper_t;
+
+struct ngx_http_imaging_helper_job_s {
+    ngx_queue_t                      queue;
+    /* NULL for background jobs (see ngx_http_imaging_helpers_background) */
+    ngx_http_request_t              *request;
+    ngx_http_imaging_helper_t       *helper;
+
+    ngx_http_imaging_loc_conf_t     *conf;
+    ngx_pool_t                      *pool;
+    ngx_log_t                       *log;
+    /* of the render (see imaging_render_timeout), 0: none */
+    ngx_msec_t                       deadline;
+
+    /* background jobs: called once the render is over */
+    ngx_http_imaging_helpers_done_pt done;
+    void                            *data;
+
+    ngx_str_t                        path;
+    char                            *hash;
+    /* the variant in the variant cache (when cache_variant is set) */
+    ngx_http_imaging_cache_entry_t   entry;
+
+    unsigned                         cache_variant:1;
+    unsigned                         waiting:1;
+    unsigned                         running:1;
+    /* the response still references shm */
+    unsigned                         pinned:1;
+};
+
+/* worker -> helper, the path & hash are in shm */
+typedef struct {
+    ngx_http_imaging_loc_conf_t     *conf;
+    size_t                           path_len;
+    size_t                           hash_len;
+    ngx_flag_t                       write_to_disk;
+    /* of the render (see imaging_render_timeout), 0: none */
+    ngx_msec_t                       deadline;
+} ngx_http_imaging_helper_msg_t;
+
+/* helper -> worker, the image & its mime type are in shm */
+typedef struct {
+    /* NGX_OK, NGX_DECLINED (see failure) or NGX_ERROR (didn't fit shm) */
+    ngx_int_t                        rc;
+    imaging_failure_t                failure;
+    size_t                           data_len;
+    size_t                           mime_len;
+    ngx_uint_t                       retiring;
+    /* why & after how long the render was aborted */
+    ngx_uint_t                       aborted;
+    ngx_msec_t                       wasted;
+} ngx_http_imaging_helper_reply_t;
+
+
+static ngx_int_t ngx_http_imaging_helpers_spawn(ngx_cycle_t *cycle,
+    ngx_http_imaging_helper_t *helper);
+static void ngx_http_imaging_helpers_cycle(ngx_cycle_t *cycle,
+    ngx_http_imaging_helper_t *helper, ngx_socket_t fd);
+static void ngx_http_imaging_helpers_dispatch(void);
+static void ngx_http_imaging_helpers_read(ngx_event_t *rev);
+static void ngx_http_imaging_helpers_lost(ngx_http_imaging_helper_t *helper);
+static void ngx_http_imaging_helpers_finish(ngx_http_imaging_helper_job_t *job,
+    ngx_http_imaging_helper_reply_t *reply);
+static ngx_int_t ngx_http_imaging_helpers_send(
+    ngx_http_imaging_helper_job_t *job,
+    ngx_http_imaging_helper_reply_t *reply);
+static void ngx_http_imaging_helpers_finish_background(
+    ngx_http_imaging_helper_job_t *job,
+    ngx_http_imaging_helper_reply_t *reply);
+static void ngx_http_imaging_helpers_queue(ngx_http_imaging_helper_job_t *job);
+static void ngx_http_imaging_helpers_release(
+    ngx_http_imaging_helper_t *helper);
+static void ngx_http_imaging_helpers_cleanup(void *data);
+
+
+/* per worker */
+static ngx_http_imaging_helper_t        *ngx_http_imaging_helpers_all;
+static ngx_uint_t                        ngx_http_imaging_helpers_n;
+static ngx_queue_t                       ngx_http_imaging_helper_jobs;
+static ngx_http_imaging_helpers_stats_t  ngx_http_imaging_helpers_stat;
+
+/* limits of a helper */
+static ngx_uint_t                        ngx_http_imaging_helper_jobs_max;
+static size_t                            ngx_http_imaging_helper_rss_max;
+
+
+/*
+ * imaging_helpers number [buffer=size] [jobs=number] [rss=size];
+ */
+char *
+ngx_http_imaging_helpers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_imaging_main_conf_t *imcf = conf;
+
+    ssize_t      size;
+    ngx_str_t   *value, s;
+    ngx_int_t    n;
+    ngx_uint_t   i;
+
+    if (imcf->helpers) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of helpers \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    imcf->helpers = n;
+    imcf->helper_buffer = 16 * 1024 * 1024;
+    imcf->helper_jobs = 1000;
+    imcf->helper_rss = 512 * 1024 * 1024;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "buffer=", 7) == 0) {
+
+            s.len = value[i].len - 7;
+            s.data = value[i].data + 7;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR || size < (ssize_t) ngx_pagesize) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid buffer value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            imcf->helper_buffer = size;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "jobs=", 5) == 0) {
+
+            n = ngx_atoi(value[i].data + 5, value[i].len - 5);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid jobs value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            imcf->helper_jobs = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rss=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            size = ngx_parse_size(&s);
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rss value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            imcf->helper_rss = size;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * Forks the worker's helpers (from the init process handler, once the
+ * imaging library is initialized).
+ */
+ngx_int_t
+ngx_http_imaging_helpers_init(ngx_cycle_t *cycle,
+    ngx_http_imaging_main_conf_t *imcf)
+{
+    ngx_uint_t                  i;
+    ngx_http_imaging_helper_t  *helper;
+
+    /* not for the cache manager & loader */
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    ngx_queue_init(&ngx_http_imaging_helper_jobs);
+
+    ngx_http_imaging_helper_jobs_max = imcf->helper_jobs;
+    ngx_http_imaging_helper_rss_max = imcf->helper_rss;
+
+    helper = ngx_pcalloc(cycle->pool,
+                         imcf->helpers * sizeof(ngx_http_imaging_helper_t));
+    if (helper == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_http_imaging_helpers_all = helper;
+    ngx_http_imaging_helpers_n = imcf->helpers;
+
+    for (i = 0; i < imcf->helpers; i++) {
+        helper[i].pid = NGX_INVALID_PID;
+
+        helper[i].shm.size = imcf->helper_buffer;
+        ngx_str_set(&helper[i].shm.name, "imaging_helper");
+        helper[i].shm.log = cycle->log;
+
+        if (ngx_shm_alloc(&helper[i].shm) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_imaging_helpers_spawn(cycle, &helper[i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_imaging_helpers_stat.helpers = imcf->helpers;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Queues the render of the variant at path for a helper. entry is the
+ * variant's (missed) entry in the variant cache or NULL.
+ *
+ * Returns NGX_DONE, the request is finished once a helper rendered it.
+ */
+ngx_int_t
+ngx_http_imaging_helpers_render(ngx_http_request_t *r, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry, char *hash)
+{
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_imaging_helper_job_t  *job;
+
+    if (path->len + ngx_strlen(hash) + 2
+        > ngx_http_imaging_helpers_all[0].shm.size)
+    {
+        return NGX_HTTP_REQUEST_URI_TOO_LARGE;
+    }
+
+    job = ngx_pcalloc(r->pool, sizeof(ngx_http_imaging_helper_job_t));
+    if (job == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_imaging_helpers_cleanup;
+    cln->data = job;
+
+    job->request = r;
+    job->conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+    job->pool = r->pool;
+    job->log = r->connection->log;
+    job->deadline = ngx_http_imaging_abort_deadline(r);
+    job->path = *path;
+    job->hash = hash;
+
+    if (entry != NULL) {
+        job->entry = *entry;
+        job->cache_variant = 1;
+    }
+
+    r->main->count++;
+
+    ngx_http_imaging_helpers_queue(job);
+
+    return NGX_DONE;
+}
+
+
+/*
+ * Queues the render of the variant at path for a helper on behalf of no
+ * request (eg: a prerender), into the variant cache when entry isn't NULL
+ * or beside its original otherwise. done(data, rc) is called with NGX_OK
+ * or NGX_ERROR once it's over; path, hash & entry have to live until then
+ * as does the job, which is allocated from pool.
+ *
+ * Returns NGX_OK if queued, otherwise NGX_ERROR & done isn't called.
+ */
+ngx_int_t
+ngx_http_imaging_helpers_background(ngx_pool_t *pool, ngx_log_t *log,
+    ngx_http_imaging_loc_conf_t *conf, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry, char *hash, ngx_msec_t deadline,
+    ngx_http_imaging_helpers_done_pt done, void *data)
+{
+    ngx_http_imaging_helper_job_t  *job;
+
+    if (path->len + ngx_strlen(hash) + 2
+        > ngx_http_imaging_helpers_all[0].shm.size)
+    {
+        return NGX_ERROR;
+    }
+
+    job = ngx_pcalloc(pool, sizeof(ngx_http_imaging_helper_job_t));
+    if (job == NULL) {
+        return NGX_ERROR;
+    }
+
+    job->conf = conf;
+    job->pool = pool;
+    job->log = log;
+    job->deadline = deadline;
+    job->done = done;
+    job->data = data;
+    job->path = *path;
+    job->hash = hash;
+
+    if (entry != NULL) {
+        job->entry = *entry;
+        job->cache_variant = 1;
+    }
+
+    ngx_http_imaging_helpers_queue(job);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Fills stats with the worker's helper counters.
+ *
+ * Returns 0 if the worker has no helpers.
+ */
+ngx_uint_t
+ngx_http_imaging_helpers_stats(ngx_http_imaging_helpers_stats_t *stats)
+{
+    if (ngx_http_imaging_helpers_n == 0) {
+        return 0;
+    }
+
+    *stats = ngx_http_imaging_helpers_stat;
+
+    return 1;
+}
+
+
+static ngx_int_t
+ngx_http_imaging_helpers_spawn(ngx_cycle_t *cycle,
+    ngx_http_imaging_helper_t *helper)
+{
+    int                fds[2];
+    ngx_pid_t          pid;
+    ngx_connection_t  *c;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      "socketpair() for an imaging helper failed");
+        return NGX_ERROR;
+    }
+
+    pid = fork();
+
+    switch (pid) {
+
+    case -1:
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "fork() of an imaging helper failed");
+        close(fds[0]);
+        close(fds[1]);
+        return NGX_ERROR;
+
+    case 0:
+        close(fds[0]);
+        ngx_http_imaging_helpers_cycle(cycle, helper, fds[1]);
+        /* unreachable */
+    }
+
+    close(fds[1]);
+
+    if (ngx_nonblocking(fds[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed");
+        close(fds[0]);
+        kill(pid, SIGKILL);
+        return NGX_ERROR;
+    }
+
+    c = ngx_get_connection(fds[0], cycle->log);
+    if (c == NULL) {
+        close(fds[0]);
+        kill(pid, SIGKILL);
+        return NGX_ERROR;
+    }
+
+    c->data = helper;
+    c->log = cycle->log;
+    c->read->log = cycle->log;
+    c->write->log = cycle->log;
+    c->read->handler = ngx_http_imaging_helpers_read;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        kill(pid, SIGKILL);
+        return NGX_ERROR;
+    }
+
+    helper->pid = pid;
+    helper->connection = c;
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                  "started imaging helper %P", pid);
+
+    return NGX_OK;
+}
+
+
+/*
+ * The helper process: renders jobs until the worker goes away or it has
+ * done its share.
+ */
+static void
+ngx_http_imaging_helpers_cycle(ngx_cycle_t *cycle,
+    ngx_http_imaging_helper_t *helper, ngx_socket_t fd)
+{
+    char                             *path, *hash, *mime_type;
+    size_t                            data_length, mime_len;
+    ssize_t                           n;
+    ngx_uint_t                        i, jobs;
+    struct rusage                     usage;
+    unsigned char                    *data;
+    ngx_connection_t                 *c;
+    ngx_http_imaging_abort_t          abort;
+    ngx_http_imaging_loc_conf_t      *conf;
+    ngx_http_imaging_helper_msg_t     msg;
+    ngx_http_imaging_helper_reply_t   reply;
+
+    /*
+     * the worker's sockets (clients, listeners & other helpers) have to
+     * close once the worker closes them
+     */
+    c = cycle->connections;
+
+    for (i = 0; i < cycle->connection_n; i++) {
+        if (c[i].fd != (ngx_socket_t) -1) {
+            close(c[i].fd);
+        }
+    }
+
+    /* nginx' handlers would act as if this was the worker */
+    (void) signal(SIGHUP, SIG_DFL);
+    (void) signal(SIGINT, SIG_DFL);
+    (void) signal(SIGTERM, SIG_DFL);
+    (void) signal(SIGQUIT, SIG_DFL);
+    (void) signal(SIGUSR1, SIG_DFL);
+    (void) signal(SIGUSR2, SIG_DFL);
+    (void) signal(SIGWINCH, SIG_DFL);
+    (void) signal(SIGCHLD, SIG_DFL);
+
+    ngx_setproctitle("imaging helper process");
+
+    for (jobs = 0; /* void */ ; /* void */) {
+
+        n = read(fd, &msg, sizeof(msg));
+
+        if (n == -1 && ngx_errno == NGX_EINTR) {
+            continue;
+        }
+
+        if (n != (ssize_t) sizeof(msg)) {
+            /* the worker is gone */
+            break;
+        }
+
+        conf = msg.conf;
+        path = (char *) helper->shm.addr;
+        hash = path + msg.path_len + 1;
+
+        data = NULL;
+        mime_type = NULL;
+        data_length = mime_len = 0;
+
+        ngx_http_imaging_set_options(conf);
+        /* the client's connection is the worker's, only the deadline counts */
+        ngx_http_imaging_abort_start(&abort, NULL, msg.deadline);
+        imgaging_get_image_data(
+            path,
+            &data, &data_length,
+            &mime_type, &mime_len,
+            (const char *) conf->salt.data,
+            hash,
+            conf->quality,
+            (const char *) conf->white_list.data,
+            msg.write_to_disk
+        );
+
+        ngx_memzero(&reply, sizeof(ngx_http_imaging_helper_reply_t));
+
+        if (ngx_http_imaging_abort_finish(&abort) != NGX_OK) {
+            reply.aborted = abort.reason;
+            reply.wasted = abort.wasted;
+        }
+
+        if (data == NULL) {
+            reply.rc = NGX_DECLINED;
+            reply.failure = imaging_last_failure();
+
+        } else if (data_length + mime_len > helper->shm.size) {
+            reply.rc = NGX_ERROR;
+            reply.data_len = data_length;
+
+        } else {
+            /* the path & hash aren't needed anymore */
+            ngx_memcpy(helper->shm.addr, data, data_length);
+            ngx_memcpy(helper->shm.addr + data_length, mime_type, mime_len);
+
+            reply.rc = NGX_OK;
+            reply.data_len = data_length;
+            reply.mime_len = mime_len;
+        }
+
+        imaging_free(data);
+        imaging_free(mime_type);
+
+        /* freed memory isn't returned to the system, the peak is what counts */
+        if (++jobs >= ngx_http_imaging_helper_jobs_max
+            || (getrusage(RUSAGE_SELF, &usage) == 0
+                && (size_t) usage.ru_maxrss * 1024
+                   > ngx_http_imaging_helper_rss_max))
+        {
+            reply.retiring = 1;
+        }
+
+        do {
+            n = write(fd, &reply, sizeof(reply));
+        } while (n == -1 && ngx_errno == NGX_EINTR);
+
+        if (n != (ssize_t) sizeof(reply) || reply.retiring) {
+            break;
+        }
+    }
+
+    /* not exit(), nginx' stdio buffers & atexit handlers are the worker's */
+    _exit(0);
+}
+
+
+/*
+ * Queues job & hands it to a helper if one is idle.
+ */
+static void
+ngx_http_imaging_helpers_queue(ngx_http_imaging_helper_job_t *job)
+{
+    job->waiting = 1;
+    ngx_queue_insert_tail(&ngx_http_imaging_helper_jobs, &job->queue);
+    ngx_http_imaging_helpers_stat.queued++;
+    ngx_http_imaging_helpers_stat.waiting++;
+
+    ngx_http_imaging_helpers_dispatch();
+}
+
+
+/*
+ * Hands queued jobs to idle helpers.
+ */
+static void
+ngx_http_imaging_helpers_dispatch(void)
+{
+    u_char                         *p;
+    ssize_t                         n;
+    ngx_uint_t                      i;
+    ngx_queue_t                    *q;
+    ngx_http_imaging_helper_t      *helper;
+    ngx_http_imaging_helper_msg_t   msg;
+    ngx_http_imaging_helper_job_t  *job;
+
+    for (i = 0;
+         i < ngx_http_imaging_helpers_n
+         && !ngx_queue_empty(&ngx_http_imaging_helper_jobs);
+         i++)
+    {
+        helper = &ngx_http_imaging_helpers_all[i];
+
+        if (helper->busy) {
+            continue;
+        }
+
+        /* its respawn failed earlier */
+        if (helper->pid == NGX_INVALID_PID
+            && ngx_http_imaging_helpers_spawn((ngx_cycle_t *) ngx_cycle,
+                                              helper)
+               != NGX_OK)
+        {
+            continue;
+        }
+
+        q = ngx_queue_head(&ngx_http_imaging_helper_jobs);
+        job = ngx_queue_data(q, ngx_http_imaging_helper_job_t, queue);
+
+        ngx_queue_remove(q);
+        job->waiting = 0;
+        ngx_http_imaging_helpers_stat.waiting--;
+
+        p = ngx_cpymem(helper->shm.addr, job->path.data, job->path.len);
+        *p++ = '\0';
+        p = ngx_cpymem(p, job->hash, ngx_strlen(job->hash));
+        *p = '\0';
+
+        msg.conf = job->conf;
+        msg.path_len = job->path.len;
+        msg.hash_len = ngx_strlen(job->hash);
+        /* variants live in the cache (not beside the originals) when used */
+        msg.write_to_disk = job->cache_variant ? 0 : job->conf->write_to_disk;
+        msg.deadline = job->deadline;
+
+        job->running = 1;
+        job->helper = helper;
+        helper->job = job;
+        helper->busy = 1;
+
+        ngx_http_imaging_helpers_stat.busy++;
+
+        n = write(helper->connection->fd, &msg, sizeof(msg));
+
+        if (n != (ssize_t) sizeof(msg)) {
+            ngx_log_error(NGX_LOG_ALERT, job->log, ngx_socket_errno,
+                          "write() to imaging helper %P failed", helper->pid);
+
+            /* the job fails once its socket closes */
+            (void) kill(helper->pid, SIGKILL);
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, job->log, 0,
+                       "imaging helper %P renders \"%V\"",
+                       helper->pid, &job->path);
+    }
+}
+
+
+static void
+ngx_http_imaging_helpers_read(ngx_event_t *rev)
+{
+    ssize_t                           n;
+    ngx_err_t                         err;
+    ngx_connection_t                 *c;
+    ngx_http_imaging_helper_t        *helper;
+    ngx_http_imaging_helper_job_t    *job;
+    ngx_http_imaging_helper_reply_t   reply;
+
+    c = rev->data;
+    helper = c->data;
+
+    for ( ;; ) {
+        n = recv(c->fd, &reply, sizeof(reply), 0);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                    ngx_http_imaging_helpers_lost(helper);
+                }
+
+                return;
+            }
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+        }
+
+        if (n != (ssize_t) sizeof(reply)) {
+            /* it exited or crashed */
+            ngx_http_imaging_helpers_lost(helper);
+            return;
+        }
+
+        ngx_http_imaging_helpers_stat.rendered++;
+
+        if (reply.retiring) {
+            helper->retiring = 1;
+        }
+
+        job = helper->job;
+
+        if (job == NULL) {
+            /* the request was freed meanwhile */
+            ngx_http_imaging_helpers_release(helper);
+            continue;
+        }
+
+        ngx_http_imaging_helpers_finish(job, &reply);
+    }
+}
+
+
+/*
+ * Replaces a helper which exited, failing the job it was rendering.
+ */
+static void
+ngx_http_imaging_helpers_lost(ngx_http_imaging_helper_t *helper)
+{
+    ngx_http_request_t             *r;
+    ngx_http_imaging_helper_job_t  *job;
+
+    ngx_close_connection(helper->connection);
+    helper->connection = NULL;
+
+    if (helper->retiring) {
+        ngx_http_imaging_helpers_stat.recycled++;
+
+    } else {
+        ngx_http_imaging_helpers_stat.crashes++;
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "imaging helper %P exited unexpectedly", helper->pid);
+    }
+
+    helper->pid = NGX_INVALID_PID;
+    helper->retiring = 0;
+
+    /* its buffer is only written once it's given a job */
+    (void) ngx_http_imaging_helpers_spawn((ngx_cycle_t *) ngx_cycle, helper);
+
+    job = helper->job;
+
+    if (job != NULL && job->running) {
+        r = job->request;
+
+        ngx_log_error(NGX_LOG_ERR, job->log, 0,
+                      "imaging helper failed to render \"%V\"", &job->path);
+
+        job->running = 0;
+        ngx_http_imaging_helpers_release(helper);
+
+        if (r == NULL) {
+            job->done(job->data, NGX_ERROR);
+            return;
+        }
+
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+        ngx_http_run_posted_requests(r->connection);
+        return;
+    }
+
+    if (job == NULL && helper->busy) {
+        /* its request was freed while it rendered */
+        ngx_http_imaging_helpers_release(helper);
+        return;
+    }
+
+    /* a response may still be sent out of its buffer */
+    ngx_http_imaging_helpers_dispatch();
+}
+
+
+/*
+ * Finishes the request once its helper replied.
+ */
+static void
+ngx_http_imaging_helpers_finish(ngx_http_imaging_helper_job_t *job,
+    ngx_http_imaging_helper_reply_t *reply)
+{
+    ngx_int_t                      rc;
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_imaging_helper_t     *helper;
+    ngx_http_imaging_main_conf_t  *imcf;
+
+    if (job->request == NULL) {
+        ngx_http_imaging_helpers_finish_background(job, reply);
+        return;
+    }
+
+    r = job->request;
+    c = r->connection;
+    helper = job->helper;
+
+    job->running = 0;
+
+    switch (reply->rc) {
+
+    case NGX_OK:
+        rc = ngx_http_imaging_helpers_send(job, reply);
+        break;
+
+    case NGX_DECLINED:
+        if (reply->aborted) {
+            ngx_http_imaging_abort_count(c->log, &job->path, reply->aborted,
+                                         reply->wasted);
+
+            rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "failed to create: \"%V\"", &job->path);
+
+        imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+        if (imcf->negative != NULL) {
+            ngx_http_imaging_negative_store(r, imcf->negative,
+                                            reply->failure);
+        }
+
+        rc = NGX_HTTP_NOT_FOUND;
+        break;
+
+    default:
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "imaging helper result of %uz bytes for \"%V\" "
+                      "doesn't fit its buffer", reply->data_len, &job->path);
+
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!job->pinned) {
+        ngx_http_imaging_helpers_release(helper);
+    }
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+/*
+ * Sends the image straight out of the helper's buffer, storing it in the
+ * variant cache first when the request has an entry. The helper stays
+ * busy until the response no longer references its buffer.
+ */
+static ngx_int_t
+ngx_http_imaging_helpers_send(ngx_http_imaging_helper_job_t *job,
+    ngx_http_imaging_helper_reply_t *reply)
+{
+    u_char                        *data;
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_chain_t                    out;
+    const char                    *actions, *ext;
+    ngx_http_request_t            *r;
+    ngx_http_imaging_main_conf_t  *imcf;
+
+    r = job->request;
+    data = job->helper->shm.addr;
+
+    if (job->cache_variant) {
+        /* remember the action string so cache hits can be security checked */
+        actions = imaging_find_actions((const char *) job->path.data);
+        ext = (actions != NULL) ? strrchr(actions, '.') : NULL;
+        job->entry.actions_len = (ext != NULL) ? (size_t) (ext - actions) : 0;
+
+        imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+        /* originals are never cached */
+        if (job->entry.actions_len != 0) {
+            (void) ngx_http_imaging_cache_store(r->pool, r->connection->log,
+                                                imcf->cache, &job->entry,
+                                                data, reply->data_len);
+        }
+    }
+
+    r->headers_out.content_type.data = ngx_pnalloc(r->pool, reply->mime_len);
+    if (r->headers_out.content_type.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_memcpy(r->headers_out.content_type.data, data + reply->data_len,
+               reply->mime_len);
+    r->headers_out.content_type.len = reply->mime_len;
+    r->headers_out.content_type_len = reply->mime_len;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = reply->data_len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = data;
+    b->last = data + reply->data_len;
+    b->memory = 1;
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    rc = ngx_http_output_filter(r, &out);
+
+    /* not all of it was written yet, released with the request */
+    if (rc != NGX_ERROR && (r->buffered || r->connection->buffered)) {
+        job->pinned = 1;
+    }
+
+    return rc;
+}
+
+
+/*
+ * Caches (or leaves beside its original) the image of a background job,
+ * then lets its owner know.
+ */
+static void
+ngx_http_imaging_helpers_finish_background(ngx_http_imaging_helper_job_t *job,
+    ngx_http_imaging_helper_reply_t *reply)
+{
+    ngx_int_t                      rc;
+    const char                    *actions, *ext;
+    ngx_http_imaging_main_conf_t  *imcf;
+
+    job->running = 0;
+    rc = NGX_ERROR;
+
+    if (reply->rc == NGX_OK) {
+        rc = NGX_OK;
+
+        actions = imaging_find_actions((const char *) job->path.data);
+        ext = (actions != NULL) ? strrchr(actions, '.') : NULL;
+        job->entry.actions_len = (ext != NULL) ? (size_t) (ext - actions) : 0;
+
+        imcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                                   ngx_http_imaging_module);
+
+        /* originals are never cached */
+        if (job->cache_variant && job->entry.actions_len != 0) {
+            (void) ngx_http_imaging_cache_store(job->pool, job->log,
+                                                imcf->cache, &job->entry,
+                                                job->helper->shm.addr,
+                                                reply->data_len);
+        }
+
+    } else if (reply->aborted) {
+        ngx_http_imaging_abort_count(job->log, &job->path, reply->aborted,
+                                     reply->wasted);
+    }
+
+    ngx_http_imaging_helpers_release(job->helper);
+
+    job->done(job->data, rc);
+}
+
+
+/*
+ * Makes a helper available for the next job.
+ */
+static void
+ngx_http_imaging_helpers_release(ngx_http_imaging_helper_t *helper)
+{
+    if (helper->job != NULL) {
+        helper->job->helper = NULL;
+        helper->job = NULL;
+    }
+
+    helper->busy = 0;
+    ngx_http_imaging_helpers_stat.busy--;
+
+    ngx_http_imaging_helpers_dispatch();
+}
+
+
+/*
+ * Forgets the job of a request which is freed.
+ */
+static void
+ngx_http_imaging_helpers_cleanup(void *data)
+{
+    ngx_http_imaging_helper_job_t *job = data;
+
+    if (job->waiting) {
+        ngx_queue_remove(&job->queue);
+        job->waiting = 0;
+        ngx_http_imaging_helpers_stat.waiting--;
+        return;
+    }
+
+    if (job->helper == NULL) {
+        return;
+    }
+
+    if (job->running) {
+        /* its reply is dropped */
+        job->helper->job = NULL;
+        job->helper = NULL;
+        return;
+    }
+
+    if (job->pinned) {
+        ngx_http_imaging_helpers_release(job->helper);
+    }
+}
@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Client Hints driven size selection (see imaging_client_hints).
+ *
+ * A request for an original which carries Sec-CH-Width (or
+ * Sec-CH-Viewport-Width & Sec-CH-DPR) is turned into a request for the
+ * variant of the smallest size in imaging_white_list which is at least the
+ * hinted width (the largest one when none is), so the number of variants
+ * stays bounded by the white list.
+ *
+ * Eg:
+ *  imaging_white_list "t320 t640 t1280";
+ *  imaging_client_hints on;
+ *
+ *  GET /img/photo.jpg, Sec-CH-Width: 500 -> /img/photo_t640.jpg
+ */
+#include "ngx_http_imaging_module.h"
+
+
+#define NGX_HTTP_IMAGING_HINTS                                               \
+    "Sec-CH-DPR, Sec-CH-Width, Sec-CH-Viewport-Width"
+
+static ngx_table_elt_t *ngx_http_imaging_hints_header(ngx_http_request_t *r,
+    const char *name);
+static ngx_int_t ngx_http_imaging_hints_width(ngx_http_request_t *r);
+static ngx_int_t ngx_http_imaging_hints_add_header(ngx_http_request_t *r,
+    const char *name);
+static int ngx_libc_cdecl ngx_http_imaging_hints_cmp(const void *one,
+    const void *two);
+
+
+/*
+ * Builds the sizes client hints choose from out of conf's white list: its
+ * entries which are a single thumbnail, resize or scale action with a
+ * width (eg: "t640", "r800x600"), ordered by width.
+ */
+ngx_int_t
+ngx_http_imaging_hints_init(ngx_conf_t *cf, ngx_http_imaging_loc_conf_t *conf)
+{
+    u_char                        *p, *last, *start, *x;
+    ngx_int_t                      width;
+    ngx_http_imaging_hint_size_t  *size;
+
+    conf->hint_sizes = ngx_array_create(cf->pool, 4,
+                                        sizeof(ngx_http_imaging_hint_size_t));
+    if (conf->hint_sizes == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = conf->white_list.data;
+    last = p + conf->white_list.len;
+
+    while (p < last) {
+
+        while (p < last && *p == ' ') {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last && *p != ' ') {
+            p++;
+        }
+
+        if (p - start < 2 || ngx_strlchr(start, p, '_') != NULL
+            || (*start != 't' && *start != 'r' && *start != 's'))
+        {
+            continue;
+        }
+
+        /* "t640" or "t640x480", not "tx480" */
+        x = ngx_strlchr(start + 1, p, 'x');
+        width = ngx_atoi(start + 1, (x ? x : p) - start - 1);
+
+        if (width == NGX_ERROR || width == 0) {
+            continue;
+        }
+
+        size = ngx_array_push(conf->hint_sizes);
+        if (size == NULL) {
+            return NGX_ERROR;
+        }
+
+        size->width = width;
+        size->action.data = start;
+        size->action.len = p - start;
+    }
+
+    if (conf->hint_sizes->nelts == 0) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "imaging_client_hints: imaging_white_list "
+                           "has no sizes to choose from");
+        return NGX_OK;
+    }
+
+    ngx_qsort(conf->hint_sizes->elts, conf->hint_sizes->nelts,
+              sizeof(ngx_http_imaging_hint_size_t),
+              ngx_http_imaging_hints_cmp);
+
+    return NGX_OK;
+}
+
+
+/*
+ * For a request of an original (path has no action string): announces &
+ * varies on the hints and, when the request carries them, rewrites its uri
+ * & path to the chosen variant.
+ *
+ * Returns NGX_OK or NGX_ERROR.
+ */
+ngx_int_t
+ngx_http_imaging_hints_select(ngx_http_request_t *r,
+    ngx_http_imaging_loc_conf_t *conf, ngx_str_t *path)
+{
+    u_char                        *p, *dot, *last;
+    size_t                         root;
+    ngx_str_t                      uri;
+    ngx_int_t                      width;
+    ngx_uint_t                     i;
+    ngx_http_imaging_hint_size_t  *sizes, *size;
+
+    if (conf->hint_sizes == NULL || conf->hint_sizes->nelts == 0
+        || imaging_parse_actions((const char *) path->data) != NULL)
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_imaging_hints_add_header(r, "Accept-CH") != NGX_OK
+        || ngx_http_imaging_hints_add_header(r, "Vary") != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    width = ngx_http_imaging_hints_width(r);
+
+    if (width <= 0) {
+        return NGX_OK;
+    }
+
+    /* the smallest size at least as wide, else the largest */
+    sizes = conf->hint_sizes->elts;
+    size = &sizes[conf->hint_sizes->nelts - 1];
+
+    for (i = 0; i < conf->hint_sizes->nelts; i++) {
+        if (sizes[i].width >= (ngx_uint_t) width) {
+            size = &sizes[i];
+            break;
+        }
+    }
+
+    /* photo.jpg -> photo_t640.jpg */
+    for (dot = r->uri.data + r->uri.len - 1;
+         dot > r->uri.data && *dot != '.' && *dot != '/';
+         dot--)
+    {
+        /* void */
+    }
+
+    if (*dot != '.') {
+        return NGX_OK;
+    }
+
+    uri.len = r->uri.len + 1 + size->action.len;
+    uri.data = ngx_pnalloc(r->pool, uri.len);
+    if (uri.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(uri.data, r->uri.data, dot - r->uri.data);
+    *p++ = '_';
+    p = ngx_cpymem(p, size->action.data, size->action.len);
+    ngx_memcpy(p, dot, r->uri.data + r->uri.len - dot);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "imaging client hints width: %i \"%V\" -> \"%V\"",
+                   width, &r->uri, &uri);
+
+    r->uri = uri;
+
+    last = ngx_http_map_uri_to_path(r, path, &root, 0);
+    if (last == NULL) {
+        return NGX_ERROR;
+    }
+
+    path->len = last - path->data;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Wanted width in pixels: Sec-CH-Width or Sec-CH-Viewport-Width times
+ * Sec-CH-DPR, 0 without hints.
+ */
+static ngx_int_t
+ngx_http_imaging_hints_width(ngx_http_request_t *r)
+{
+    ngx_int_t         width, dpr;
+    ngx_table_elt_t  *h;
+
+    h = ngx_http_imaging_hints_header(r, "Sec-CH-Width");
+
+    if (h != NULL) {
+        width = ngx_atoi(h->value.data, h->value.len);
+        return (width == NGX_ERROR) ? 0 : width;
+    }
+
+    h = ngx_http_imaging_hints_header(r, "Sec-CH-Viewport-Width");
+
+    if (h == NULL) {
+        return 0;
+    }
+
+    width = ngx_atoi(h->value.data, h->value.len);
+    if (width == NGX_ERROR) {
+        return 0;
+    }
+
+    /* in thousandths */
+    dpr = 1000;
+
+    h = ngx_http_imaging_hints_header(r, "Sec-CH-DPR");
+
+    if (h != NULL) {
+        dpr = ngx_atofp(h->value.data, h->value.len, 3);
+        if (dpr <= 0 || dpr > 10000) {
+            dpr = 1000;
+        }
+    }
+
+    return (width * dpr + 999) / 1000;
+}
+
+
+static ngx_table_elt_t *
+ngx_http_imaging_hints_header(ngx_http_request_t *r, const char *name)
+{
+    size_t            len;
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    len = ngx_strlen(name);
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                return NULL;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == len
+            && ngx_strncasecmp(h[i].key.data, (u_char *) name, len) == 0)
+        {
+            return &h[i];
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_imaging_hints_add_header(ngx_http_request_t *r, const char *name)
+{
+    ngx_table_elt_t  *h;
+
+    h = ngx_list_push(&r->headers_out.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    h->key.data = (u_char *) name;
+    h->key.len = ngx_strlen(name);
+    ngx_str_set(&h->value, NGX_HTTP_IMAGING_HINTS);
+
+    return NGX_OK;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_imaging_hints_cmp(const void *one, const void *two)
+{
+    const ngx_http_imaging_hint_size_t  *first = one;
+    const ngx_http_imaging_hint_size_t  *second = two;
+
+    if (first->width == second->width) {
+        return 0;
+    }
+
+    return (first->width < second->width) ? -1 : 1;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Metadata of variants (see imaging_meta).
+ *
+ * A request for a variant with ".json" appended is answered with the
+ * dimensions, format & frame count of its original and the dimensions the
+ * variant has, read from the original's header (PingImage) & computed with
+ * the geometry the actions use, so layout doesn't need the image itself.
+ * Nothing is decoded or rendered. The ETag & Last-Modified follow the
+ * original, like nginx's for static files.
+ *
+ * Eg:
+ *  GET /img/photo_t200.jpg.json
+ *  {"width":1280,"height":1024,"format":"JPEG","frames":1,
+ *   "output_width":200,"output_height":160}
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+#define NGX_HTTP_IMAGING_META_JSON                                          \
+    "{\"width\":%ul,\"height\":%ul,\"format\":\"%s\",\"frames\":%ul,"        \
+    "\"output_width\":%ul,\"output_height\":%ul}\n"
+
+
+/*
+ * Answers the request for path (ending in ".json") with the metadata of
+ * the variant it names.
+ */
+ngx_int_t
+ngx_http_imaging_meta_handler(ngx_http_request_t *r, ngx_str_t *path,
+    char *hash)
+{
+    u_char                       *p;
+    ngx_int_t                     rc;
+    ngx_buf_t                    *b;
+    ngx_chain_t                   out;
+    imaging_meta_t                meta;
+    imaging_failure_t             failure;
+    ngx_http_imaging_loc_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+
+    /* photo_t200.jpg.json -> photo_t200.jpg */
+    path->len -= sizeof(".json") - 1;
+    path->data[path->len] = '\0';
+
+    failure = imaging_get_meta((const char *) path->data,
+                               (const char *) conf->salt.data,
+                               (const char *) hash,
+                               (const char *) conf->white_list.data,
+                               &meta);
+
+    if (failure != IMAGING_FAILURE_NONE) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "imaging meta of \"%V\" failed: %V", path,
+                       ngx_http_imaging_negative_reason(failure));
+
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    /* keep the format (eg: "JPEG") safe inside a JSON string */
+    for (p = (u_char *) meta.format; *p; p++) {
+        if (!((*p >= '0' && *p <= '9') || (*p >= 'A' && *p <= 'Z')
+              || (*p >= 'a' && *p <= 'z') || *p == '-'))
+        {
+            *p = '_';
+        }
+    }
+
+    b = ngx_create_temp_buf(r->pool, sizeof(NGX_HTTP_IMAGING_META_JSON)
+                                     + 5 * NGX_INT64_LEN
+                                     + ngx_strlen(meta.format));
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, NGX_HTTP_IMAGING_META_JSON,
+                          meta.width, meta.height, meta.format, meta.frames,
+                          meta.output_width, meta.output_height);
+
+    ngx_str_set(&r->headers_out.content_type, "application/json");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    r->headers_out.last_modified_time = meta.mtime;
+
+    if (ngx_http_set_etag(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (r->method == NGX_HTTP_HEAD || r->header_only
+        || rc == NGX_ERROR || rc > NGX_OK)
+    {
+        return rc;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
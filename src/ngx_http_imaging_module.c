@@ -15,9 +15,7 @@
  * docroot/img/test_r400x400.jpg
  * docroot/img/test_r220.jpg
  */
-#include <ngx_config.h>
-#include <ngx_core.h>
-#include <ngx_http.h>
+#include "ngx_http_imaging_module.h"
 
 /* strtok */
 #include <string.h>
@@ -25,23 +23,46 @@
 /* Graphics Magick API Wrapper */
 #include "imaging.h"
 
-/* Configuration options type */
-typedef struct {
-    ngx_str_t   salt;
-    ngx_uint_t  quality;
-    ngx_str_t   white_list;
-    ngx_flag_t  write_to_disk;
-
-} ngx_http_imaging_loc_conf_t;
-
 /* Functions prototypes. */
 static char *ngx_http_imaging(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_imaging_buffer_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_imaging_mmap(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_imaging_encoder_profile(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_imaging_parse_quality_class(ngx_str_t *value,
+    unsigned long *pixels, unsigned long *quality);
+static ngx_int_t ngx_http_imaging_cached_allowed(ngx_http_request_t *request,
+    ngx_http_imaging_loc_conf_t *conf, ngx_http_imaging_cache_entry_t *entry,
+    char *hash);
+static void *ngx_http_imaging_create_main_conf(ngx_conf_t *cf);
 static void *ngx_http_imaging_create_conf(ngx_conf_t *cf);
 static char *ngx_http_imaging_merge_conf(ngx_conf_t *cf, void *parent,
     void *child);
 ngx_int_t ngx_http_imaging_at_init(ngx_cycle_t *cycle);
 void ngx_http_imaging_at_exit(ngx_cycle_t *cycle);
 
+/* Resamplers for the thumbnail, resize & scale actions */
+static ngx_conf_enum_t ngx_http_imaging_resamplers[] = {
+    { ngx_string("default"), IMAGING_RESAMPLER_DEFAULT },
+    { ngx_string("fast"), IMAGING_RESAMPLER_FAST },
+    { ngx_null_string, 0 }
+};
+
+/* What imaging_passthrough does with variants which are their original */
+static ngx_conf_enum_t ngx_http_imaging_passthroughs[] = {
+    { ngx_string("off"), NGX_HTTP_IMAGING_PASSTHROUGH_OFF },
+    { ngx_string("on"), NGX_HTTP_IMAGING_PASSTHROUGH_ON },
+    { ngx_string("redirect"), NGX_HTTP_IMAGING_PASSTHROUGH_REDIRECT },
+    { ngx_null_string, 0 }
+};
+
+/* Pyramid levels are kept out of the docroot, under the prefix by default */
+static ngx_path_init_t ngx_http_imaging_pyramid_path = {
+    ngx_string("imaging_pyramids"), { 0, 0, 0 }
+};
+
 /* Available configuration parameters */
 static ngx_command_t ngx_http_imaging_commands[] = {
     { ngx_string("imaging"),
@@ -80,6 +101,174 @@ static ngx_command_t ngx_http_imaging_commands[] = {
       offsetof(ngx_http_imaging_loc_conf_t, write_to_disk),
       NULL },
 
+    { ngx_string("imaging_resampler"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, resampler),
+      &ngx_http_imaging_resamplers },
+
+    { ngx_string("imaging_jpeg_direct"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, jpeg_direct),
+      NULL },
+
+    { ngx_string("imaging_crop_tolerance"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, crop_tolerance),
+      NULL },
+
+    { ngx_string("imaging_stream_pixels"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, stream_pixels),
+      NULL },
+
+    { ngx_string("imaging_pyramid_pixels"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, pyramid_pixels),
+      NULL },
+
+    { ngx_string("imaging_pyramid_path"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_path_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, pyramid_path),
+      NULL },
+
+    { ngx_string("imaging_encoder_profile"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_imaging_encoder_profile,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("imaging_client_hints"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, client_hints),
+      NULL },
+
+    { ngx_string("imaging_meta"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, meta),
+      NULL },
+
+    { ngx_string("imaging_purge"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, purge),
+      NULL },
+
+    { ngx_string("imaging_render_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, render_timeout),
+      NULL },
+
+    { ngx_string("imaging_size_buckets"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_http_imaging_size_buckets,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("imaging_passthrough"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, passthrough),
+      &ngx_http_imaging_passthroughs },
+
+    { ngx_string("imaging_cache_path"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_imaging_cache_path,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_imaging_main_conf_t, cache),
+      &ngx_http_imaging_module },
+
+    { ngx_string("imaging_origin"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_str_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_imaging_loc_conf_t, origin),
+      NULL },
+
+    { ngx_string("imaging_peers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+      ngx_http_imaging_peers,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("imaging_origin_cache_path"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_imaging_cache_path,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_imaging_main_conf_t, origin_cache),
+      &ngx_http_imaging_module },
+
+    { ngx_string("imaging_negative_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_imaging_negative_cache,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      &ngx_http_imaging_module },
+
+    { ngx_string("imaging_prerender"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_ANY,
+      ngx_http_imaging_prerender,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      &ngx_http_imaging_module },
+
+    { ngx_string("imaging_buffer_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_imaging_buffer_pool,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("imaging_mmap"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_imaging_mmap,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("imaging_scheduler"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_imaging_scheduler,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("imaging_helpers"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_imaging_helpers,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("imaging_status"),
+      NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_imaging_status,
+      0,
+      0,
+      NULL },
+
     ngx_null_command
 };
 
@@ -90,7 +279,7 @@ static ngx_http_module_t ngx_http_imaging_module_ctx = {
     NULL,                          /* pre-configuration */
     NULL,                          /* post-configuration */
 
-    NULL,                          /* create main configuration */
+    ngx_http_imaging_create_main_conf, /* create main configuration */
     NULL,                          /* init main configuration */
 
     NULL,                          /* create server configuration */
@@ -133,22 +322,26 @@ ngx_http_imaging_handler(ngx_http_request_t *request)
     size_t                         root;
     ngx_str_t                      path;
     ngx_int_t                      rc;   
-    ngx_buf_t                     *buffer;
-    ngx_chain_t                    out;
     ngx_http_imaging_loc_conf_t   *conf;
-    unsigned char                 *buf_data;
-    unsigned char                 *data;
-    unsigned char                 *content_type;
-    char                          *mime_type;
+    ngx_http_imaging_main_conf_t  *imcf;
+    ngx_http_imaging_cache_entry_t entry;
     char                          *hash;
-    size_t                         data_length;
-    size_t                         content_type_len;
+    ngx_uint_t                     purge;
 #if (NGX_DEBUG)    
     ngx_log_t                     *log;
 #endif
 
+    /* load configs */
+    conf = ngx_http_get_module_loc_conf(request, ngx_http_imaging_module);
+    imcf = ngx_http_get_module_main_conf(request, ngx_http_imaging_module);
+
+    /* PURGE removes every variant of an original (see imaging_purge) */
+    purge = conf->purge && request->method_name.len == sizeof("PURGE") - 1
+            && ngx_strncmp(request->method_name.data, "PURGE",
+                           sizeof("PURGE") - 1) == 0;
+
     /* only respond to 'GET' and 'HEAD' requests. */
-    if (!(request->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+    if (!purge && !(request->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
         return NGX_HTTP_NOT_ALLOWED;
     }
 
@@ -174,10 +367,6 @@ ngx_http_imaging_handler(ngx_http_request_t *request)
                     "image filename: \"%s\"", path.data);
 #endif
 
-    /* load configs */
-    conf = ngx_http_get_module_loc_conf(request, ngx_http_imaging_module);
-
-
     /* discard request body, since we'll be creating it don't need it here */
     rc = ngx_http_discard_request_body(request);
 
@@ -185,46 +374,298 @@ ngx_http_imaging_handler(ngx_http_request_t *request)
         return rc;
     }
 
+    if (purge) {
+        return ngx_http_imaging_purge_handler(request, &path);
+    }
+
+    /* requests of originals may be for a variant chosen by client hints */
+    if (conf->client_hints
+        && ngx_http_imaging_hints_select(request, conf, &path) != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* pull hash out of request args */
+    hash = ngx_pnalloc(request->pool, request->args.len + 1);
+    if (hash == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_cpystrn((u_char *) hash, request->args.data, request->args.len + 1);
+
+    /* photo_t200.jpg.json describes photo_t200.jpg, from headers alone */
+    if (conf->meta && path.len > sizeof(".json") - 1
+        && ngx_strncmp(path.data + path.len - (sizeof(".json") - 1),
+                       ".json", sizeof(".json") - 1) == 0)
+    {
+        return ngx_http_imaging_meta_handler(request, &path, hash);
+    }
+
+    /* t197 & t199 are the t200 of imaging_size_buckets 120 200 ... */
+    if (conf->size_buckets != NULL) {
+        rc = ngx_http_imaging_buckets_snap(request, conf, &path, &hash);
+
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    /* answer urls which failed recently without trying them again */
+    if (imcf->negative != NULL
+        && ngx_http_imaging_negative_lookup(request, imcf->negative) == NGX_OK)
+    {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    /* popular variants (& siblings) are rendered ahead of their requests */
+    if (imcf->prerender != NULL) {
+        ngx_http_imaging_prerender_track(request, imcf->prerender, &path,
+                                         hash);
+    }
+
+    /* serve the variant out of the cache if it was already created */
+    if (imcf->cache != NULL) {
+        if (ngx_http_imaging_cache_init_entry(request->pool, imcf->cache,
+                                              &entry, &request->uri)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        rc = ngx_http_imaging_cache_lookup(request, imcf->cache, &entry);
+
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* the original was modified or replaced since; create it again */
+        if (rc == NGX_OK && conf->origin.len == 0
+            && ngx_http_imaging_purge_stale(request, &path, &entry))
+        {
+            ngx_http_imaging_cache_remove(request->connection->log,
+                                          imcf->cache, &entry);
+            rc = NGX_DECLINED;
+        }
+
+        if (rc == NGX_OK) {
+            rc = ngx_http_imaging_cached_allowed(request, conf, &entry, hash);
+
+            if (rc == NGX_OK) {
+                return ngx_http_imaging_send_cached(request, &entry);
+            }
+
+            if (rc == NGX_HTTP_NOT_FOUND && imcf->negative != NULL) {
+                ngx_http_imaging_negative_store(request, imcf->negative,
+                                                IMAGING_FAILURE_FORBIDDEN);
+            }
+
+            if (rc != NGX_DECLINED) {
+                return rc;
+            }
+
+            /* the action string isn't known; create it again. */
+        }
+    }
+
+    /* the variant may be another node's to render */
+    if (conf->peers != NULL) {
+        rc = ngx_http_imaging_peers_handler(request, &path,
+                 imcf->cache != NULL ? &entry : NULL, hash);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    return ngx_http_imaging_create(request, &path,
+               imcf->cache != NULL ? &entry : NULL, hash);
+}
+
+/*
+ * Creates the variant at path locally, from the origin, in a helper
+ * process, through the scheduler or right away (unless it is its original,
+ * see imaging_passthrough). entry is the variant's (missed) entry in the
+ * variant cache or NULL.
+ */
+ngx_int_t
+ngx_http_imaging_create(ngx_http_request_t *request, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry, char *hash)
+{
+    ngx_int_t                      rc;
+    ngx_http_imaging_loc_conf_t   *conf;
+    ngx_http_imaging_main_conf_t  *imcf;
+
+    conf = ngx_http_get_module_loc_conf(request, ngx_http_imaging_module);
+    imcf = ngx_http_get_module_main_conf(request, ngx_http_imaging_module);
+
+    /* the original lives behind imaging_origin, not on disk */
+    if (conf->origin.len) {
+        return ngx_http_imaging_origin_handler(request, entry, hash);
+    }
+
+    /* "c5000" of a 1200x800 original is the original itself */
+    if (conf->passthrough != NGX_HTTP_IMAGING_PASSTHROUGH_OFF) {
+        rc = ngx_http_imaging_passthrough(request, path, hash);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
+    if (imcf->helpers) {
+        return ngx_http_imaging_helpers_render(request, path, entry, hash);
+    }
+
+    if (imcf->scheduler) {
+        return ngx_http_imaging_schedule(request, path, entry, hash);
+    }
+
+    return ngx_http_imaging_render(request, path, entry, hash);
+}
+
+/*
+ * Creates & sends the variant at path (the request's file). entry is the
+ * variant's (missed) entry in the variant cache or NULL.
+ */
+ngx_int_t
+ngx_http_imaging_render(ngx_http_request_t *request, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry, char *hash)
+{
+    size_t                         actions_len;
+    ngx_int_t                      rc;
+    ngx_http_imaging_abort_t       abort;
+    ngx_http_imaging_loc_conf_t   *conf;
+    ngx_http_imaging_main_conf_t  *imcf;
+    const char                    *actions, *ext;
+    unsigned char                 *data;
+    char                          *mime_type;
+    size_t                         data_length;
+    size_t                         content_type_len;
+#if (NGX_DEBUG)
+    ngx_log_t                     *log;
+
+    log = request->connection->log;
+#endif
+
+    conf = ngx_http_get_module_loc_conf(request, ngx_http_imaging_module);
+
     /* init locals */
-    data = buf_data = content_type = NULL;
-    hash = mime_type = NULL;
+    data = NULL;
+    mime_type = NULL;
     content_type_len = data_length = 0;
-    /* pull hash out of request args */
-    hash = malloc(request->args.len + 1);
-    strncpy(hash, (char *)request->args.data, request->args.len);
-    hash[request->args.len] = '\0';
+
+    ngx_http_imaging_set_options(conf);
+    ngx_http_imaging_abort_start(&abort, request,
+                                 ngx_http_imaging_abort_deadline(request));
     imgaging_get_image_data(
-        (const char *)path.data,
+        (const char *)path->data,
         &data, &data_length,
         &mime_type, &content_type_len,
         (const char *)conf->salt.data,
         (const char *)hash,
         conf->quality,
         (const char *)conf->white_list.data,
-        conf->write_to_disk
+        /* variants live in the cache (not beside the originals) when used */
+        entry != NULL ? 0 : conf->write_to_disk
     );
 
+    rc = ngx_http_imaging_abort_finish(&abort);
+
+    /* nobody waits for it anymore, nothing to remember about it either */
+    if (data == NULL && rc != NGX_OK) {
+        ngx_http_imaging_abort_count(request->connection->log, path,
+                                     abort.reason, abort.wasted);
+        return rc;
+    }
+
     // if we failed to create the image log about it.
     if (data == NULL) {
 #if (NGX_DEBUG)    
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "failed to create: %s", path.data);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "failed to create: %s", path->data);
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "salt: '%s'", conf->salt.data);
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "hash: '%s'", hash);
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "quality: '%d'", conf->quality);
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "write_to_disk: '%s'", conf->write_to_disk?"true":"false");
 #endif
-        free(hash);
+        imcf = ngx_http_get_module_main_conf(request, ngx_http_imaging_module);
+
+        if (imcf->negative != NULL) {
+            ngx_http_imaging_negative_store(request, imcf->negative,
+                                            imaging_last_failure());
+        }
+
         return NGX_HTTP_NOT_FOUND;
     }
 
 #if (NGX_DEBUG)
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "created: \"%s\"", path.data);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0, "created: \"%s\"", path->data);
 #endif
 
+    /* remember the action string so cache hits can be security checked */
+    actions = imaging_find_actions((const char *) path->data);
+    ext = (actions != NULL) ? strrchr(actions, '.') : NULL;
+    actions_len = (ext != NULL) ? (size_t) (ext - actions) : 0;
+
+    return ngx_http_imaging_send_image(request, entry, actions_len,
+               data, data_length, mime_type, content_type_len);
+}
+
+/*
+ * Applies the location's settings to the imaging library before creating
+ * an image.
+ */
+void
+ngx_http_imaging_set_options(ngx_http_imaging_loc_conf_t *conf)
+{
+    imaging_set_resampler(conf->resampler);
+    imaging_set_jpeg_direct(conf->jpeg_direct);
+    imaging_set_crop_tolerance(conf->crop_tolerance);
+    imaging_set_stream_pixels(conf->stream_pixels);
+    imaging_set_pyramid_pixels(conf->pyramid_pixels);
+    imaging_set_pyramid_path(conf->pyramid_path != NULL
+                             ? (const char *) conf->pyramid_path->name.data
+                             : NULL);
+    imaging_set_jpeg_profile(conf->jpeg_profile);
+    imaging_set_png_profile(conf->png_profile);
+}
+
+/*
+ * Sends an image created by the imaging library (data & mime_type are
+ * freed here), storing it in the variant cache first when entry is given
+ * & it is a variant.
+ */
+ngx_int_t
+ngx_http_imaging_send_image(ngx_http_request_t *request,
+    ngx_http_imaging_cache_entry_t *entry, size_t actions_len,
+    unsigned char *data, size_t data_length,
+    char *mime_type, size_t content_type_len)
+{
+    ngx_int_t                      rc;
+    ngx_buf_t                     *buffer;
+    ngx_chain_t                    out;
+    ngx_http_imaging_main_conf_t  *imcf;
+    unsigned char                 *buf_data;
+    unsigned char                 *content_type;
+
+    imcf = ngx_http_get_module_main_conf(request, ngx_http_imaging_module);
+
+    /* originals (no action string) are never cached, they change in place */
+    if (entry != NULL && actions_len != 0) {
+        entry->actions_len = actions_len;
+
+        (void) ngx_http_imaging_cache_store(request->pool,
+                                            request->connection->log,
+                                            imcf->cache, entry,
+                                            data, data_length);
+    }
+
     // put data under the request pools memory management.
     buf_data = ngx_pcalloc(request->pool, data_length);
     ngx_memcpy(buf_data, data, data_length);
-    free(data);
+    imaging_free(data);
 
     // create buffer
     buffer = ngx_pcalloc(request->pool, sizeof(ngx_buf_t));
@@ -245,7 +686,7 @@ ngx_http_imaging_handler(ngx_http_request_t *request)
     // put mime_type/content_type  under the request pools memory management.
     content_type = ngx_pcalloc(request->pool, content_type_len);
     ngx_memcpy(content_type, mime_type, content_type_len);
-    free(mime_type);
+    imaging_free(mime_type);
 
     /* set the 'Content-type' header */
     request->headers_out.content_type_len = content_type_len;
@@ -271,6 +712,110 @@ ngx_http_imaging_handler(ngx_http_request_t *request)
     return ngx_http_output_filter(request, &out);
 }
 
+/*
+ * Performs the same security check imaging_ctx_render does for a variant
+ * which is being served from the cache.
+ *
+ * Returns NGX_OK if allowed, NGX_HTTP_NOT_FOUND if not or NGX_DECLINED when
+ * the action string of the cached variant isn't known.
+ */
+static ngx_int_t
+ngx_http_imaging_cached_allowed(ngx_http_request_t *request,
+    ngx_http_imaging_loc_conf_t *conf, ngx_http_imaging_cache_entry_t *entry,
+    char *hash)
+{
+    u_char  *ext, *actions;
+
+    if (conf->salt.len == 0) {
+        return NGX_OK;
+    }
+
+    for (ext = request->uri.data + request->uri.len - 1;
+         ext > request->uri.data && *ext != '.';
+         ext--)
+    {
+        /* void */
+    }
+
+    if (entry->actions_len == 0
+        || entry->actions_len > (size_t) (ext - request->uri.data))
+    {
+        return NGX_DECLINED;
+    }
+
+    actions = ngx_pnalloc(request->pool, entry->actions_len + 1);
+    if (actions == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_cpystrn(actions, ext - entry->actions_len, entry->actions_len + 1);
+
+    if (!imaging_actions_allowed((const char *) actions,
+                                 (const char *) conf->salt.data,
+                                 (const char *) hash,
+                                 (const char *) conf->white_list.data))
+    {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Sends a cached variant (or a passed through original) straight from its
+ * file.
+ */
+ngx_int_t
+ngx_http_imaging_send_cached(ngx_http_request_t *request,
+    ngx_http_imaging_cache_entry_t *entry)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *buffer;
+    ngx_chain_t   out;
+
+    buffer = ngx_calloc_buf(request->pool);
+    if (buffer == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    buffer->file = ngx_pcalloc(request->pool, sizeof(ngx_file_t));
+    if (buffer->file == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* set the 'Content-type' header from the variants extension */
+    if (ngx_http_set_content_type(request) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    request->headers_out.status = NGX_HTTP_OK;
+    request->headers_out.content_length_n = entry->size;
+    request->headers_out.last_modified_time = entry->mtime;
+
+    rc = ngx_http_send_header(request);
+
+    if (request->method == NGX_HTTP_HEAD || request->header_only ||
+        rc == NGX_ERROR || rc > NGX_OK) {
+        return rc;
+    }
+
+    buffer->file_pos = 0;
+    buffer->file_last = entry->size;
+
+    buffer->in_file = buffer->file_last ? 1 : 0;
+    buffer->last_buf = 1;
+    buffer->last_in_chain = 1;
+
+    buffer->file->fd = entry->fd;
+    buffer->file->name = entry->file;
+    buffer->file->log = request->connection->log;
+
+    out.buf = buffer;
+    out.next = NULL;
+
+    return ngx_http_output_filter(request, &out);
+}
+
 /*
  * Register `ngx_http_imaging_handler` with the local configuration.
  */
@@ -285,6 +830,318 @@ ngx_http_imaging(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     return NGX_CONF_OK;
 }
 
+/*
+ * imaging_buffer_pool size [huge_pages];
+ */
+static char *
+ngx_http_imaging_buffer_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_imaging_main_conf_t *imcf = conf;
+    ngx_str_t *value;
+    ssize_t size;
+
+    if (imcf->pool_size) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid pool size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+    imcf->pool_size = size;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strcmp(value[2].data, "huge_pages") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        imcf->pool_huge_pages = 1;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * imaging_mmap on|off [cache=size];
+ */
+static char *
+ngx_http_imaging_mmap(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_imaging_main_conf_t *imcf = conf;
+    ngx_str_t *value, s;
+    ssize_t size;
+
+    if (imcf->mmap != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "on") == 0) {
+        imcf->mmap = 1;
+
+    } else if (ngx_strcmp(value[1].data, "off") == 0) {
+        imcf->mmap = 0;
+
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "cache=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 6;
+        s.data = value[2].data + 6;
+
+        size = ngx_parse_size(&s);
+        if (size == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid cache size \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        imcf->mmap_cache = size;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * imaging_encoder_profile jpeg [progressive] [optimize]
+ *     [subsampling=444|422|420] [small=pixels:quality]
+ *     [large=pixels:quality];
+ * imaging_encoder_profile png [level=0-9]
+ *     [strategy=default|filtered|huffman|rle|fixed] [palette];
+ */
+static char *
+ngx_http_imaging_encoder_profile(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_imaging_loc_conf_t *ilcf = conf;
+
+    ngx_str_t               *value;
+    ngx_int_t                n;
+    ngx_uint_t               i;
+    imaging_jpeg_profile_t  *jpeg;
+    imaging_png_profile_t   *png;
+
+    static ngx_str_t  strategies[] = {
+        ngx_string("default"),
+        ngx_string("filtered"),
+        ngx_string("huffman"),
+        ngx_string("rle"),
+        ngx_string("fixed")
+    };
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "jpeg") == 0) {
+
+        if (ilcf->jpeg_profile != NGX_CONF_UNSET_PTR) {
+            return "is duplicate";
+        }
+
+        jpeg = ngx_pcalloc(cf->pool, sizeof(imaging_jpeg_profile_t));
+        if (jpeg == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        for (i = 2; i < cf->args->nelts; i++) {
+
+            if (ngx_strcmp(value[i].data, "progressive") == 0) {
+                jpeg->progressive = 1;
+                continue;
+            }
+
+            if (ngx_strcmp(value[i].data, "optimize") == 0) {
+                jpeg->optimize = 1;
+                continue;
+            }
+
+            if (ngx_strcmp(value[i].data, "subsampling=444") == 0) {
+                jpeg->subsampling = IMAGING_SUBSAMPLING_444;
+                continue;
+            }
+
+            if (ngx_strcmp(value[i].data, "subsampling=422") == 0) {
+                jpeg->subsampling = IMAGING_SUBSAMPLING_422;
+                continue;
+            }
+
+            if (ngx_strcmp(value[i].data, "subsampling=420") == 0) {
+                jpeg->subsampling = IMAGING_SUBSAMPLING_420;
+                continue;
+            }
+
+            if (ngx_strncmp(value[i].data, "small=", 6) == 0) {
+                if (ngx_http_imaging_parse_quality_class(&value[i],
+                        &jpeg->small_pixels, &jpeg->small_quality)
+                    != NGX_OK)
+                {
+                    goto invalid;
+                }
+                continue;
+            }
+
+            if (ngx_strncmp(value[i].data, "large=", 6) == 0) {
+                if (ngx_http_imaging_parse_quality_class(&value[i],
+                        &jpeg->large_pixels, &jpeg->large_quality)
+                    != NGX_OK)
+                {
+                    goto invalid;
+                }
+                continue;
+            }
+
+            goto invalid;
+        }
+
+        ilcf->jpeg_profile = jpeg;
+
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[1].data, "png") == 0) {
+
+        if (ilcf->png_profile != NGX_CONF_UNSET_PTR) {
+            return "is duplicate";
+        }
+
+        png = ngx_pcalloc(cf->pool, sizeof(imaging_png_profile_t));
+        if (png == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        png->level = -1;
+        png->strategy = -1;
+
+        for (i = 2; i < cf->args->nelts; i++) {
+
+            if (ngx_strncmp(value[i].data, "level=", 6) == 0) {
+                n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+                if (n == NGX_ERROR || n > 9) {
+                    goto invalid;
+                }
+                png->level = n;
+                continue;
+            }
+
+            if (ngx_strncmp(value[i].data, "strategy=", 9) == 0) {
+                for (n = 0; n < (ngx_int_t) (sizeof(strategies)
+                                             / sizeof(ngx_str_t)); n++)
+                {
+                    if (value[i].len - 9 == strategies[n].len
+                        && ngx_strncmp(value[i].data + 9, strategies[n].data,
+                                       strategies[n].len) == 0)
+                    {
+                        png->strategy = n;
+                        break;
+                    }
+                }
+
+                if (png->strategy == -1) {
+                    goto invalid;
+                }
+                continue;
+            }
+
+            if (ngx_strcmp(value[i].data, "palette") == 0) {
+                png->palette = 1;
+                continue;
+            }
+
+            goto invalid;
+        }
+
+        ilcf->png_profile = png;
+
+        return NGX_CONF_OK;
+    }
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "unknown format \"%V\"", &value[1]);
+    return NGX_CONF_ERROR;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/*
+ * Parses the "pixels:quality" of a small= or large= size class.
+ */
+static ngx_int_t
+ngx_http_imaging_parse_quality_class(ngx_str_t *value, unsigned long *pixels,
+    unsigned long *quality)
+{
+    u_char     *p, *last;
+    ngx_int_t   n;
+
+    p = value->data + 6;
+    last = value->data + value->len;
+
+    while (p < last && *p != ':') {
+        p++;
+    }
+
+    if (p == last) {
+        return NGX_ERROR;
+    }
+
+    n = ngx_atoi(value->data + 6, p - value->data - 6);
+    if (n == NGX_ERROR || n == 0) {
+        return NGX_ERROR;
+    }
+    *pixels = n;
+
+    n = ngx_atoi(p + 1, last - p - 1);
+    if (n == NGX_ERROR || n == 0 || n > 100) {
+        return NGX_ERROR;
+    }
+    *quality = n;
+
+    return NGX_OK;
+}
+
+/*
+ * Create ngx_http_imaging_main_conf_t instance.
+ */
+static void *
+ngx_http_imaging_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_imaging_main_conf_t *imcf;
+    imcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_imaging_main_conf_t));
+    if (imcf == NULL) {
+        return NULL;
+    }
+
+    /* set by ngx_pcalloc
+     * imcf->cache = NULL;
+     * imcf->origin_cache = NULL;
+     * imcf->negative = NULL;
+     * imcf->prerender = NULL;
+     * imcf->pool_size = 0;
+     * imcf->pool_huge_pages = 0;
+     * imcf->scheduler = 0;
+     * imcf->helpers = 0;
+     * imcf->mmap_cache = 0;
+     */
+    imcf->mmap = NGX_CONF_UNSET;
+    return imcf;
+}
+
 /*
  * Create ngx_http_imaging_loc_conf_t instance.
  */
@@ -300,9 +1157,27 @@ ngx_http_imaging_create_conf(ngx_conf_t *cf)
     /* set by ngx_pcalloc
      * conf->salt = {0, NULL};
      * conf->white_list = {0, NULL};
+     * conf->origin = {0, NULL};
+     * conf->hint_sizes = NULL;
+     * conf->pyramid_path = NULL;
      */
     conf->quality = NGX_CONF_UNSET_UINT;
     conf->write_to_disk = NGX_CONF_UNSET;
+    conf->resampler = NGX_CONF_UNSET_UINT;
+    conf->jpeg_direct = NGX_CONF_UNSET;
+    conf->crop_tolerance = NGX_CONF_UNSET;
+    conf->stream_pixels = NGX_CONF_UNSET_SIZE;
+    conf->pyramid_pixels = NGX_CONF_UNSET_SIZE;
+    conf->client_hints = NGX_CONF_UNSET;
+    conf->meta = NGX_CONF_UNSET;
+    conf->purge = NGX_CONF_UNSET;
+    conf->render_timeout = NGX_CONF_UNSET_MSEC;
+    conf->size_buckets = NGX_CONF_UNSET_PTR;
+    conf->size_buckets_redirect = NGX_CONF_UNSET;
+    conf->passthrough = NGX_CONF_UNSET_UINT;
+    conf->peers = NGX_CONF_UNSET_PTR;
+    conf->jpeg_profile = NGX_CONF_UNSET_PTR;
+    conf->png_profile = NGX_CONF_UNSET_PTR;
     return conf;
 }
 
@@ -318,7 +1193,50 @@ ngx_http_imaging_merge_conf(ngx_conf_t *cf, void *parent,void *child)
     ngx_conf_merge_str_value(conf->salt, prev->salt, "");
     ngx_conf_merge_uint_value(conf->quality, prev->quality, 70);
     ngx_conf_merge_str_value(conf->white_list, prev->white_list, "");
+    ngx_conf_merge_str_value(conf->origin, prev->origin, "");
     ngx_conf_merge_value(conf->write_to_disk, prev->write_to_disk, 1);
+    ngx_conf_merge_uint_value(conf->resampler, prev->resampler,
+                              IMAGING_RESAMPLER_DEFAULT);
+    ngx_conf_merge_value(conf->jpeg_direct, prev->jpeg_direct, 0);
+    /* lossless crops are off unless a tolerance is set */
+    ngx_conf_merge_value(conf->crop_tolerance, prev->crop_tolerance, -1);
+    /* streaming is off unless a size is set */
+    ngx_conf_merge_size_value(conf->stream_pixels, prev->stream_pixels, 0);
+    /* so are pyramids */
+    ngx_conf_merge_size_value(conf->pyramid_pixels, prev->pyramid_pixels, 0);
+
+    /* the directory is only created for locations which keep pyramids */
+    if (conf->pyramid_pixels) {
+        if (ngx_conf_merge_path_value(cf, &conf->pyramid_path,
+                                      prev->pyramid_path,
+                                      &ngx_http_imaging_pyramid_path)
+            != NGX_CONF_OK)
+        {
+            return NGX_CONF_ERROR;
+        }
+
+    } else if (conf->pyramid_path == NULL) {
+        conf->pyramid_path = prev->pyramid_path;
+    }
+
+    ngx_conf_merge_ptr_value(conf->jpeg_profile, prev->jpeg_profile, NULL);
+    ngx_conf_merge_ptr_value(conf->png_profile, prev->png_profile, NULL);
+    ngx_conf_merge_value(conf->client_hints, prev->client_hints, 0);
+    ngx_conf_merge_value(conf->meta, prev->meta, 0);
+    ngx_conf_merge_value(conf->purge, prev->purge, 0);
+    ngx_conf_merge_msec_value(conf->render_timeout, prev->render_timeout, 0);
+    ngx_conf_merge_ptr_value(conf->size_buckets, prev->size_buckets, NULL);
+    ngx_conf_merge_value(conf->size_buckets_redirect,
+                         prev->size_buckets_redirect, 0);
+    ngx_conf_merge_uint_value(conf->passthrough, prev->passthrough,
+                              NGX_HTTP_IMAGING_PASSTHROUGH_OFF);
+    ngx_conf_merge_ptr_value(conf->peers, prev->peers, NULL);
+
+    if (conf->client_hints) {
+        if (ngx_http_imaging_hints_init(cf, conf) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
 
     return NGX_CONF_OK;
 }
@@ -327,7 +1245,37 @@ ngx_http_imaging_merge_conf(ngx_conf_t *cf, void *parent,void *child)
 ngx_int_t
 ngx_http_imaging_at_init(ngx_cycle_t *cycle)
 {
+    ngx_http_imaging_main_conf_t *imcf = NULL;
+
+    if (ngx_get_conf(cycle->conf_ctx, ngx_http_module)) {
+        imcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_imaging_module);
+    }
+
+    /* every worker gets its own pool, installed before GraphicsMagick starts */
+    if (imcf != NULL && imcf->pool_size) {
+        imaging_use_pool(imcf->pool_size, imcf->pool_huge_pages);
+    }
+
+    if (imcf != NULL && imcf->mmap == 1) {
+        imaging_use_mmap(imcf->mmap_cache);
+    }
+
+    if (imcf != NULL && imcf->scheduler) {
+        ngx_http_imaging_scheduler_init(cycle, imcf);
+    }
     imaging_initialize();
+
+    /* helpers are forks of the worker, with the library ready */
+    if (imcf != NULL && imcf->helpers
+        && ngx_http_imaging_helpers_init(cycle, imcf) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (imcf != NULL && imcf->prerender != NULL) {
+        ngx_http_imaging_prerender_init(cycle, imcf);
+    }
+
     return NGX_OK;
 }
 
@@ -0,0 +1,464 @@
+
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Types and prototypes shared between the source files of the
+ * ngx_http_imaging_module.
+ */
+#ifndef _NGX_HTTP_IMAGING_MODULE_H_INCLUDED_
+#define _NGX_HTTP_IMAGING_MODULE_H_INCLUDED_
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_md5.h>
+
+/* encoder profiles */
+#include "imaging.h"
+
+
+#define NGX_HTTP_IMAGING_CACHE_KEY_LEN  16
+
+/* imaging_passthrough */
+#define NGX_HTTP_IMAGING_PASSTHROUGH_OFF       0
+#define NGX_HTTP_IMAGING_PASSTHROUGH_ON        1
+#define NGX_HTTP_IMAGING_PASSTHROUGH_REDIRECT  2
+
+/* A variant on disk, indexed in shared memory by the md5 of its uri. */
+typedef struct {
+    ngx_rbtree_node_t               node;
+    ngx_queue_t                     queue;
+
+    u_char                          key[NGX_HTTP_IMAGING_CACHE_KEY_LEN
+                                        - sizeof(ngx_rbtree_key_t)];
+
+    /* length of the action string (0 if unknown, eg: found by the loader) */
+    u_short                         actions_len;
+    /* md5 of the original's uri (zeroes if unknown, like actions_len) */
+    u_char                          original[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+
+    time_t                          accessed;
+    off_t                           size;
+} ngx_http_imaging_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t                    rbtree;
+    ngx_rbtree_node_t               sentinel;
+    /* least recently used entries live at the tail */
+    ngx_queue_t                     queue;
+    off_t                           size;
+    ngx_uint_t                      count;
+} ngx_http_imaging_cache_sh_t;
+
+typedef struct {
+    ngx_http_imaging_cache_sh_t    *sh;
+    ngx_slab_pool_t                *shpool;
+    ngx_shm_zone_t                 *shm_zone;
+    ngx_path_t                     *path;
+
+    off_t                           max_size;
+    time_t                          inactive;
+} ngx_http_imaging_cache_t;
+
+/* A single lookup/store against the cache. */
+typedef struct {
+    u_char                          key[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    /* key of the original, see ngx_http_imaging_cache_purge */
+    u_char                          original[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    ngx_str_t                       file;
+    size_t                          actions_len;
+
+    ngx_fd_t                        fd;
+    off_t                           size;
+    time_t                          mtime;
+} ngx_http_imaging_cache_entry_t;
+
+/* imaging_failure_t values */
+#define NGX_HTTP_IMAGING_FAILURES       (IMAGING_FAILURE_INVALID + 1)
+
+typedef struct {
+    ngx_uint_t                      count;
+    /* by reason (imaging_failure_t) */
+    ngx_uint_t                      stored[NGX_HTTP_IMAGING_FAILURES];
+    ngx_uint_t                      hits[NGX_HTTP_IMAGING_FAILURES];
+} ngx_http_imaging_negative_stats_t;
+
+typedef struct {
+    ngx_rbtree_t                    rbtree;
+    ngx_rbtree_node_t               sentinel;
+    /* oldest entries live at the tail */
+    ngx_queue_t                     queue;
+    ngx_http_imaging_negative_stats_t  stats;
+} ngx_http_imaging_negative_sh_t;
+
+/* Failed variants, see imaging_negative_cache */
+typedef struct {
+    ngx_http_imaging_negative_sh_t *sh;
+    ngx_slab_pool_t                *shpool;
+    ngx_shm_zone_t                 *shm_zone;
+
+    /* by reason (imaging_failure_t), 0 doesn't store that reason */
+    time_t                          ttl[NGX_HTTP_IMAGING_FAILURES];
+} ngx_http_imaging_negative_t;
+
+/* count-min sketch of imaging_prerender: rows of counters */
+#define NGX_HTTP_IMAGING_SKETCH_DEPTH   4
+#define NGX_HTTP_IMAGING_SKETCH_WIDTH   4096
+
+/* A popular variant (or original, for its siblings) to render ahead */
+typedef struct {
+    /* indexed by the md5 of its uri, like the variant cache */
+    ngx_rbtree_node_t               node;
+    u_char                          key[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    /* requests, per the sketch */
+    ngx_uint_t                      count;
+
+    /* uri, path & args, nul terminated, in one slab allocation */
+    u_char                         *uri;
+    size_t                          uri_len;
+    u_char                         *path;
+    size_t                          path_len;
+    u_char                         *args;
+    size_t                          args_len;
+
+    /* the location's (ngx_http_imaging_loc_conf_t), only valid in the
+     * workers of that cycle */
+    ngx_cycle_t                    *cycle;
+    void                           *conf;
+
+    /* next white listed sibling of an original to look at */
+    ngx_uint_t                      sibling;
+    /* not looked at again until then (eg: while a worker renders it) */
+    time_t                          next_try;
+
+    unsigned                        original:1;
+} ngx_http_imaging_prerender_candidate_t;
+
+typedef struct {
+    ngx_uint_t                      tracked;
+    ngx_uint_t                      prerendered;
+    ngx_uint_t                      siblings;
+    ngx_uint_t                      failures;
+} ngx_http_imaging_prerender_stats_t;
+
+typedef struct {
+    uint32_t                        sketch[NGX_HTTP_IMAGING_SKETCH_DEPTH]
+                                          [NGX_HTTP_IMAGING_SKETCH_WIDTH];
+    /* counters are halved every minute */
+    time_t                          decayed;
+    ngx_uint_t                      ncandidates;
+    ngx_uint_t                      top;
+    ngx_http_imaging_prerender_candidate_t  *candidates;
+    ngx_rbtree_t                    rbtree;
+    ngx_rbtree_node_t               sentinel;
+    /* the least requested candidate, NULL once it may have changed */
+    ngx_http_imaging_prerender_candidate_t  *min;
+    ngx_http_imaging_prerender_stats_t  stats;
+} ngx_http_imaging_prerender_sh_t;
+
+/* Popularity tracking & rendering ahead, see imaging_prerender */
+typedef struct {
+    ngx_http_imaging_prerender_sh_t  *sh;
+    ngx_slab_pool_t                *shpool;
+    ngx_shm_zone_t                 *shm_zone;
+
+    ngx_uint_t                      top;
+    /* percent of a worker's time spent rendering ahead */
+    ngx_uint_t                      budget;
+    /* requests per minute which make an original's siblings rendered */
+    ngx_uint_t                      hot;
+} ngx_http_imaging_prerender_t;
+
+/* A node of imaging_peers, eg: "10.0.0.2:80" */
+typedef struct {
+    ngx_str_t                       name;
+    /* its addresses, X-Imaging-Peer is only trusted from them */
+    ngx_addr_t                     *addrs;
+    ngx_uint_t                      naddrs;
+    /* failed, the worker renders its variants until then */
+    time_t                          down_until;
+} ngx_http_imaging_peer_t;
+
+typedef struct {
+    uint32_t                        hash;
+    ngx_http_imaging_peer_t        *peer;
+} ngx_http_imaging_peer_point_t;
+
+/* Cluster of nodes sharing renders, see imaging_peers */
+typedef struct {
+    /* of ngx_http_imaging_peer_t */
+    ngx_array_t                     peers;
+    ngx_http_imaging_peer_t        *self;
+    /* the hash ring, by hash */
+    ngx_http_imaging_peer_point_t  *points;
+    ngx_uint_t                      npoints;
+
+    ngx_str_t                       via;
+    time_t                          fail_timeout;
+} ngx_http_imaging_peers_t;
+
+/* Main (http) configuration */
+typedef struct {
+    ngx_http_imaging_cache_t       *cache;
+    /* originals fetched through imaging_origin */
+    ngx_http_imaging_cache_t       *origin_cache;
+    ngx_http_imaging_negative_t    *negative;
+    ngx_http_imaging_prerender_t   *prerender;
+
+    /* free pixel buffers kept per worker (0 disables the pool) */
+    size_t                          pool_size;
+    ngx_flag_t                      pool_huge_pages;
+
+    /* originals are decoded from memory mappings (see imaging_mmap) */
+    ngx_flag_t                      mmap;
+    size_t                          mmap_cache;
+
+    /* renders run in helper processes (see imaging_helpers) */
+    ngx_uint_t                      helpers;
+    size_t                          helper_buffer;
+    ngx_uint_t                      helper_jobs;
+    size_t                          helper_rss;
+
+    /* renders are queued & run cheapest first (see imaging_scheduler) */
+    ngx_flag_t                      scheduler;
+    ngx_msec_t                      scheduler_aging;
+    ngx_uint_t                      scheduler_backlog;
+} ngx_http_imaging_main_conf_t;
+
+/* A white listed size client hints choose from (eg: "t640") */
+typedef struct {
+    ngx_uint_t                      width;
+    ngx_str_t                       action;
+} ngx_http_imaging_hint_size_t;
+
+/* Location configuration */
+typedef struct {
+    ngx_str_t                       salt;
+    ngx_uint_t                      quality;
+    ngx_str_t                       white_list;
+    ngx_flag_t                      write_to_disk;
+    ngx_uint_t                      resampler;
+    ngx_flag_t                      jpeg_direct;
+    ngx_int_t                       crop_tolerance;
+    size_t                          stream_pixels;
+    size_t                          pyramid_pixels;
+    /* where pyramid levels are kept (NULL: no pyramids) */
+    ngx_path_t                     *pyramid_path;
+    /* imaging_encoder_profile (NULL: the encoder's defaults) */
+    imaging_jpeg_profile_t         *jpeg_profile;
+    imaging_png_profile_t          *png_profile;
+    ngx_flag_t                      client_hints;
+    /* "<variant>.json" is answered with its metadata */
+    ngx_flag_t                      meta;
+    /* PURGE removes every variant of an original */
+    ngx_flag_t                      purge;
+    /* renders of requests older than this are aborted (0: never) */
+    ngx_msec_t                      render_timeout;
+    /* of unsigned long, ascending (NULL: sizes aren't bucketed) */
+    ngx_array_t                    *size_buckets;
+    /* redirect to the bucketed variant instead of serving it */
+    ngx_flag_t                      size_buckets_redirect;
+    /* NGX_HTTP_IMAGING_PASSTHROUGH_* */
+    ngx_uint_t                      passthrough;
+    /* of ngx_http_imaging_hint_size_t, by width */
+    ngx_array_t                    *hint_sizes;
+    ngx_http_imaging_peers_t       *peers;
+    /* uri prefix of the (internal) location originals are fetched from */
+    ngx_str_t                       origin;
+} ngx_http_imaging_loc_conf_t;
+
+/* Scheduler counters of a worker */
+typedef struct {
+    ngx_uint_t                      queued;
+    ngx_uint_t                      rendered;
+    ngx_uint_t                      depth;
+    ngx_uint_t                      max_depth;
+    ngx_msec_t                      wait_total;
+    ngx_msec_t                      wait_max;
+} ngx_http_imaging_scheduler_stats_t;
+
+/* Why a render was aborted, see imaging_render_timeout */
+#define NGX_HTTP_IMAGING_ABORT_NONE     0
+#define NGX_HTTP_IMAGING_ABORT_CLOSED   1
+#define NGX_HTTP_IMAGING_ABORT_TIMEOUT  2
+
+/* A render which may be aborted */
+typedef struct {
+    /* whose client is watched (NULL: none, eg: in a helper) */
+    ngx_http_request_t             *request;
+    /* wall clock msec (0: none) */
+    ngx_msec_t                      deadline;
+    ngx_msec_t                      started;
+    /* wall clock msec the client's socket was last peeked at */
+    ngx_msec_t                      peeked;
+    ngx_uint_t                      reason;
+    /* msec rendered before it was aborted */
+    ngx_msec_t                      wasted;
+} ngx_http_imaging_abort_t;
+
+/* Aborted render counters of a worker */
+typedef struct {
+    ngx_uint_t                      closed;
+    ngx_uint_t                      timeouts;
+    ngx_msec_t                      wasted;
+} ngx_http_imaging_abort_stats_t;
+
+/* Render helper counters of a worker */
+typedef struct {
+    ngx_uint_t                      helpers;
+    ngx_uint_t                      busy;
+    ngx_uint_t                      queued;
+    /* jobs queued which no helper took yet */
+    ngx_uint_t                      waiting;
+    ngx_uint_t                      rendered;
+    ngx_uint_t                      crashes;
+    /* exited after their share of jobs or memory */
+    ngx_uint_t                      recycled;
+} ngx_http_imaging_helpers_stats_t;
+
+/* Called once a render helper is done with a background job */
+typedef void (*ngx_http_imaging_helpers_done_pt)(void *data, ngx_int_t rc);
+
+/* Peer counters of a worker */
+typedef struct {
+    /* variants which are ours */
+    ngx_uint_t                      owned;
+    /* ... requested by peers */
+    ngx_uint_t                      from_peers;
+    /* ... requested from their owner */
+    ngx_uint_t                      forwarded;
+    ngx_uint_t                      fetched;
+    /* ... rendered locally since their owner was down or failed */
+    ngx_uint_t                      fallbacks;
+} ngx_http_imaging_peers_stats_t;
+
+
+extern ngx_module_t  ngx_http_imaging_module;
+
+
+/* ngx_http_imaging_module.c */
+void ngx_http_imaging_set_options(ngx_http_imaging_loc_conf_t *conf);
+ngx_int_t ngx_http_imaging_create(ngx_http_request_t *request,
+    ngx_str_t *path, ngx_http_imaging_cache_entry_t *entry, char *hash);
+ngx_int_t ngx_http_imaging_render(ngx_http_request_t *request,
+    ngx_str_t *path, ngx_http_imaging_cache_entry_t *entry, char *hash);
+ngx_int_t ngx_http_imaging_send_cached(ngx_http_request_t *request,
+    ngx_http_imaging_cache_entry_t *entry);
+ngx_int_t ngx_http_imaging_send_image(ngx_http_request_t *request,
+    ngx_http_imaging_cache_entry_t *entry, size_t actions_len,
+    unsigned char *data, size_t data_length,
+    char *mime_type, size_t content_type_len);
+
+/* ngx_http_imaging_cache.c */
+char *ngx_http_imaging_cache_path(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_imaging_cache_init_entry(ngx_pool_t *pool,
+    ngx_http_imaging_cache_t *cache, ngx_http_imaging_cache_entry_t *entry,
+    ngx_str_t *uri);
+ngx_int_t ngx_http_imaging_cache_lookup(ngx_http_request_t *r,
+    ngx_http_imaging_cache_t *cache, ngx_http_imaging_cache_entry_t *entry);
+ngx_uint_t ngx_http_imaging_cache_exists(ngx_http_imaging_cache_t *cache,
+    ngx_http_imaging_cache_entry_t *entry);
+ngx_int_t ngx_http_imaging_cache_store(ngx_pool_t *pool, ngx_log_t *log,
+    ngx_http_imaging_cache_t *cache, ngx_http_imaging_cache_entry_t *entry,
+    u_char *data, size_t len);
+void ngx_http_imaging_cache_remove(ngx_log_t *log,
+    ngx_http_imaging_cache_t *cache, ngx_http_imaging_cache_entry_t *entry);
+ngx_uint_t ngx_http_imaging_cache_purge(ngx_pool_t *pool, ngx_log_t *log,
+    ngx_http_imaging_cache_t *cache, u_char *original);
+
+/* ngx_http_imaging_origin.c */
+ngx_int_t ngx_http_imaging_origin_handler(ngx_http_request_t *r,
+    ngx_http_imaging_cache_entry_t *entry, char *hash);
+
+/* ngx_http_imaging_peers.c */
+char *ngx_http_imaging_peers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+ngx_int_t ngx_http_imaging_peers_handler(ngx_http_request_t *r,
+    ngx_str_t *path, ngx_http_imaging_cache_entry_t *entry, char *hash);
+ngx_uint_t ngx_http_imaging_peers_stats(ngx_http_imaging_peers_stats_t *stats);
+
+/* ngx_http_imaging_hints.c */
+ngx_int_t ngx_http_imaging_hints_init(ngx_conf_t *cf,
+    ngx_http_imaging_loc_conf_t *conf);
+ngx_int_t ngx_http_imaging_hints_select(ngx_http_request_t *r,
+    ngx_http_imaging_loc_conf_t *conf, ngx_str_t *path);
+
+/* ngx_http_imaging_buckets.c */
+char *ngx_http_imaging_size_buckets(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_imaging_buckets_snap(ngx_http_request_t *r,
+    ngx_http_imaging_loc_conf_t *conf, ngx_str_t *path, char **hash);
+
+/* ngx_http_imaging_passthrough.c */
+ngx_int_t ngx_http_imaging_passthrough(ngx_http_request_t *r,
+    ngx_str_t *path, char *hash);
+
+/* ngx_http_imaging_meta.c */
+ngx_int_t ngx_http_imaging_meta_handler(ngx_http_request_t *r,
+    ngx_str_t *path, char *hash);
+
+/* ngx_http_imaging_purge.c */
+ngx_int_t ngx_http_imaging_purge_handler(ngx_http_request_t *r,
+    ngx_str_t *path);
+ngx_uint_t ngx_http_imaging_purge_stale(ngx_http_request_t *r,
+    ngx_str_t *path, ngx_http_imaging_cache_entry_t *entry);
+
+/* ngx_http_imaging_abort.c */
+ngx_msec_t ngx_http_imaging_abort_deadline(ngx_http_request_t *r);
+ngx_msec_t ngx_http_imaging_abort_after(ngx_http_imaging_loc_conf_t *conf);
+void ngx_http_imaging_abort_start(ngx_http_imaging_abort_t *abort,
+    ngx_http_request_t *r, ngx_msec_t deadline);
+ngx_int_t ngx_http_imaging_abort_finish(ngx_http_imaging_abort_t *abort);
+void ngx_http_imaging_abort_count(ngx_log_t *log, ngx_str_t *path,
+    ngx_uint_t reason, ngx_msec_t wasted);
+void ngx_http_imaging_abort_stats(ngx_http_imaging_abort_stats_t *stats);
+
+/* ngx_http_imaging_negative.c */
+char *ngx_http_imaging_negative_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_imaging_negative_lookup(ngx_http_request_t *r,
+    ngx_http_imaging_negative_t *negative);
+void ngx_http_imaging_negative_store(ngx_http_request_t *r,
+    ngx_http_imaging_negative_t *negative, imaging_failure_t reason);
+void ngx_http_imaging_negative_stats(ngx_http_imaging_negative_t *negative,
+    ngx_http_imaging_negative_stats_t *stats);
+ngx_str_t *ngx_http_imaging_negative_reason(imaging_failure_t reason);
+
+/* ngx_http_imaging_prerender.c */
+char *ngx_http_imaging_prerender(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+void ngx_http_imaging_prerender_init(ngx_cycle_t *cycle,
+    ngx_http_imaging_main_conf_t *imcf);
+void ngx_http_imaging_prerender_track(ngx_http_request_t *r,
+    ngx_http_imaging_prerender_t *prerender, ngx_str_t *path, char *hash);
+void ngx_http_imaging_prerender_stats(ngx_http_imaging_prerender_t *prerender,
+    ngx_http_imaging_prerender_stats_t *stats);
+
+/* ngx_http_imaging_scheduler.c */
+char *ngx_http_imaging_scheduler(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+void ngx_http_imaging_scheduler_init(ngx_cycle_t *cycle,
+    ngx_http_imaging_main_conf_t *imcf);
+ngx_int_t ngx_http_imaging_schedule(ngx_http_request_t *r, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry, char *hash);
+ngx_uint_t ngx_http_imaging_scheduler_stats(
+    ngx_http_imaging_scheduler_stats_t *stats);
+
+/* ngx_http_imaging_helpers.c */
+char *ngx_http_imaging_helpers(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+ngx_int_t ngx_http_imaging_helpers_init(ngx_cycle_t *cycle,
+    ngx_http_imaging_main_conf_t *imcf);
+ngx_int_t ngx_http_imaging_helpers_render(ngx_http_request_t *r,
+    ngx_str_t *path, ngx_http_imaging_cache_entry_t *entry, char *hash);
+ngx_int_t ngx_http_imaging_helpers_background(ngx_pool_t *pool,
+    ngx_log_t *log, ngx_http_imaging_loc_conf_t *conf, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry, char *hash, ngx_msec_t deadline,
+    ngx_http_imaging_helpers_done_pt done, void *data);
+ngx_uint_t ngx_http_imaging_helpers_stats(
+    ngx_http_imaging_helpers_stats_t *stats);
+
+/* ngx_http_imaging_status.c */
+char *ngx_http_imaging_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+#endif /* _NGX_HTTP_IMAGING_MODULE_H_INCLUDED_ */
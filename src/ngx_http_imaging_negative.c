@@ -0,0 +1,463 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Negative cache of variants which couldn't be created.
+ *
+ * Junk urls (eg: crawled "foo_t9999_b5-chartreuse.jpg") each cost the
+ * probing for an original, a hash check & sometimes a decode before they
+ * fail. Their failures are remembered in shared memory, keyed by the md5 of
+ * the uri & its args (the hash), for a short time per reason so repeats are
+ * answered with a 404 straight away. Entries which don't fit are evicted
+ * least recently stored first.
+ *
+ * Eg:
+ *  imaging_negative_cache keys_zone=imaging_negative:1m missing=10s;
+ */
+#include "ngx_http_imaging_module.h"
+
+
+typedef struct {
+    ngx_rbtree_node_t               node;
+    ngx_queue_t                     queue;
+
+    u_char                          key[NGX_HTTP_IMAGING_CACHE_KEY_LEN
+                                        - sizeof(ngx_rbtree_key_t)];
+
+    u_char                          reason;
+    time_t                          expires;
+} ngx_http_imaging_negative_node_t;
+
+
+static ngx_int_t ngx_http_imaging_negative_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_http_imaging_negative_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static void ngx_http_imaging_negative_key(ngx_http_request_t *r, u_char *key);
+static ngx_http_imaging_negative_node_t *ngx_http_imaging_negative_find_locked(
+    ngx_http_imaging_negative_t *negative, u_char *key);
+static void ngx_http_imaging_negative_remove_locked(
+    ngx_http_imaging_negative_t *negative,
+    ngx_http_imaging_negative_node_t *node);
+
+
+/* names of the reasons (imaging_failure_t) */
+static ngx_str_t  ngx_http_imaging_negative_reasons[] = {
+    ngx_null_string,
+    ngx_string("missing"),
+    ngx_string("forbidden"),
+    ngx_string("invalid"),
+    ngx_string("aborted")
+};
+
+
+/*
+ * imaging_negative_cache keys_zone=name:size [missing=time]
+ *     [forbidden=time] [invalid=time];
+ */
+char *
+ngx_http_imaging_negative_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_imaging_main_conf_t *imcf = conf;
+
+    u_char                       *p;
+    time_t                        ttl;
+    ssize_t                       size;
+    ngx_str_t                     s, name, *value;
+    ngx_uint_t                    i, n;
+    ngx_http_imaging_negative_t  *negative;
+
+    if (imcf->negative != NULL) {
+        return "is duplicate";
+    }
+
+    negative = ngx_pcalloc(cf->pool, sizeof(ngx_http_imaging_negative_t));
+    if (negative == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    negative->ttl[IMAGING_FAILURE_MISSING] = 10;
+    negative->ttl[IMAGING_FAILURE_FORBIDDEN] = 60;
+    negative->ttl[IMAGING_FAILURE_INVALID] = 60;
+
+    ngx_str_set(&name, "imaging_negative");
+    size = 1024 * 1024;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
+
+            name.data = value[i].data + 10;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid keys zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid keys zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (2 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "keys zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        for (n = IMAGING_FAILURE_MISSING; n <= IMAGING_FAILURE_INVALID; n++) {
+            s = ngx_http_imaging_negative_reasons[n];
+
+            if (value[i].len > s.len
+                && ngx_strncmp(value[i].data, s.data, s.len) == 0
+                && value[i].data[s.len] == '=')
+            {
+                break;
+            }
+        }
+
+        if (n > IMAGING_FAILURE_INVALID) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[i].data + s.len + 1;
+        s.len = value[i].len - (s.data - value[i].data);
+
+        ttl = ngx_parse_time(&s, 1);
+        if (ttl == (time_t) NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid time \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        negative->ttl[n] = ttl;
+    }
+
+    negative->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
+    if (negative->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (negative->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    negative->shm_zone->init = ngx_http_imaging_negative_init_zone;
+    negative->shm_zone->data = negative;
+
+    imcf->negative = negative;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Sets up the shared memory index, reusing the old one across reloads.
+ */
+static ngx_int_t
+ngx_http_imaging_negative_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_imaging_negative_t  *onegative = data;
+
+    size_t                        len;
+    ngx_http_imaging_negative_t  *negative;
+
+    negative = shm_zone->data;
+
+    if (onegative) {
+        negative->sh = onegative->sh;
+        negative->shpool = onegative->shpool;
+        return NGX_OK;
+    }
+
+    negative->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        negative->sh = negative->shpool->data;
+        return NGX_OK;
+    }
+
+    negative->sh = ngx_slab_alloc(negative->shpool,
+                                  sizeof(ngx_http_imaging_negative_sh_t));
+    if (negative->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    negative->shpool->data = negative->sh;
+
+    ngx_memzero(negative->sh, sizeof(ngx_http_imaging_negative_sh_t));
+
+    ngx_rbtree_init(&negative->sh->rbtree, &negative->sh->sentinel,
+                    ngx_http_imaging_negative_rbtree_insert_value);
+
+    ngx_queue_init(&negative->sh->queue);
+
+    len = sizeof(" in imaging negative cache zone \"\"")
+          + shm_zone->shm.name.len;
+
+    negative->shpool->log_ctx = ngx_slab_alloc(negative->shpool, len);
+    if (negative->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(negative->shpool->log_ctx,
+                " in imaging negative cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+static void
+ngx_http_imaging_negative_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                 **p;
+    ngx_http_imaging_negative_node_t   *nn, *nnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            nn = (ngx_http_imaging_negative_node_t *) node;
+            nnt = (ngx_http_imaging_negative_node_t *) temp;
+
+            p = (ngx_memcmp(nn->key, nnt->key, sizeof(nn->key)) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/*
+ * Returns NGX_OK if the request's variant failed recently (it should be
+ * answered with a 404) otherwise NGX_DECLINED.
+ */
+ngx_int_t
+ngx_http_imaging_negative_lookup(ngx_http_request_t *r,
+    ngx_http_imaging_negative_t *negative)
+{
+    u_char                             key[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    ngx_int_t                          rc;
+    ngx_http_imaging_negative_node_t  *node;
+
+    ngx_http_imaging_negative_key(r, key);
+
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&negative->shpool->mutex);
+
+    node = ngx_http_imaging_negative_find_locked(negative, key);
+
+    if (node != NULL) {
+
+        if (node->expires > ngx_time()) {
+            negative->sh->stats.hits[node->reason]++;
+            rc = NGX_OK;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "imaging negative cache hit: %V",
+                           &ngx_http_imaging_negative_reasons[node->reason]);
+
+        } else {
+            ngx_http_imaging_negative_remove_locked(negative, node);
+        }
+    }
+
+    ngx_shmtx_unlock(&negative->shpool->mutex);
+
+    return rc;
+}
+
+/*
+ * Remembers that the request's variant couldn't be created because of
+ * reason, for that reason's ttl.
+ */
+void
+ngx_http_imaging_negative_store(ngx_http_request_t *r,
+    ngx_http_imaging_negative_t *negative, imaging_failure_t reason)
+{
+    u_char                             key[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    ngx_uint_t                         tries;
+    ngx_queue_t                       *q;
+    ngx_http_imaging_negative_node_t  *node;
+
+    /* aborted renders (IMAGING_FAILURE_ABORTED) may well succeed next time */
+    if (reason == IMAGING_FAILURE_NONE || reason >= NGX_HTTP_IMAGING_FAILURES
+        || negative->ttl[reason] == 0)
+    {
+        return;
+    }
+
+    ngx_http_imaging_negative_key(r, key);
+
+    ngx_shmtx_lock(&negative->shpool->mutex);
+
+    node = ngx_http_imaging_negative_find_locked(negative, key);
+
+    if (node != NULL) {
+        ngx_http_imaging_negative_remove_locked(negative, node);
+    }
+
+    for (tries = 0; /* void */ ; tries++) {
+        node = ngx_slab_alloc_locked(negative->shpool,
+                                     sizeof(ngx_http_imaging_negative_node_t));
+        if (node != NULL) {
+            break;
+        }
+
+        if (tries == 20 || ngx_queue_empty(&negative->sh->queue)) {
+            ngx_shmtx_unlock(&negative->shpool->mutex);
+            return;
+        }
+
+        /* evict the oldest entry */
+        q = ngx_queue_last(&negative->sh->queue);
+        ngx_http_imaging_negative_remove_locked(negative,
+            ngx_queue_data(q, ngx_http_imaging_negative_node_t, queue));
+    }
+
+    ngx_memcpy((u_char *) &node->node.key, key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(node->key, &key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_IMAGING_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+    node->reason = (u_char) reason;
+    node->expires = ngx_time() + negative->ttl[reason];
+
+    ngx_rbtree_insert(&negative->sh->rbtree, &node->node);
+    ngx_queue_insert_head(&negative->sh->queue, &node->queue);
+
+    negative->sh->stats.count++;
+    negative->sh->stats.stored[reason]++;
+
+    ngx_shmtx_unlock(&negative->shpool->mutex);
+}
+
+/*
+ * Copies the counters of the zone into stats.
+ */
+void
+ngx_http_imaging_negative_stats(ngx_http_imaging_negative_t *negative,
+    ngx_http_imaging_negative_stats_t *stats)
+{
+    ngx_shmtx_lock(&negative->shpool->mutex);
+    *stats = negative->sh->stats;
+    ngx_shmtx_unlock(&negative->shpool->mutex);
+}
+
+/*
+ * Name of a reason, for logs & the status page.
+ */
+ngx_str_t *
+ngx_http_imaging_negative_reason(imaging_failure_t reason)
+{
+    return &ngx_http_imaging_negative_reasons[reason];
+}
+
+/*
+ * md5 of the uri & args (the hash), a wrong hash mustn't shadow the
+ * right one.
+ */
+static void
+ngx_http_imaging_negative_key(ngx_http_request_t *r, u_char *key)
+{
+    ngx_md5_t  md5;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->uri.data, r->uri.len);
+    ngx_md5_update(&md5, "?", 1);
+    ngx_md5_update(&md5, r->args.data, r->args.len);
+    ngx_md5_final(key, &md5);
+}
+
+static ngx_http_imaging_negative_node_t *
+ngx_http_imaging_negative_find_locked(ngx_http_imaging_negative_t *negative,
+    u_char *key)
+{
+    ngx_int_t                          rc;
+    ngx_rbtree_key_t                   node_key;
+    ngx_rbtree_node_t                 *node, *sentinel;
+    ngx_http_imaging_negative_node_t  *nn;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = negative->sh->rbtree.root;
+    sentinel = negative->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        nn = (ngx_http_imaging_negative_node_t *) node;
+
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], nn->key,
+                        NGX_HTTP_IMAGING_CACHE_KEY_LEN
+                        - sizeof(ngx_rbtree_key_t));
+
+        if (rc == 0) {
+            return nn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+static void
+ngx_http_imaging_negative_remove_locked(ngx_http_imaging_negative_t *negative,
+    ngx_http_imaging_negative_node_t *node)
+{
+    ngx_rbtree_delete(&negative->sh->rbtree, &node->node);
+    ngx_queue_remove(&node->queue);
+
+    negative->sh->stats.count--;
+
+    ngx_slab_free_locked(negative->shpool, node);
+}
@@ -0,0 +1,441 @@
+
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Originals fetched from an origin (eg: an object store behind HTTP)
+ * instead of the local filesystem.
+ *
+ * The original's uri is the variant's without its action string, which is
+ * requested from the (internal) location named by imaging_origin through
+ * an in memory subrequest. The body is decoded straight from memory and,
+ * when imaging_origin_cache_path is set, kept in a local LRU cache so hot
+ * originals aren't fetched again.
+ *
+ * Eg:
+ *  location /img/ { imaging on; imaging_origin /origin; }
+ *  location /origin/ { internal; proxy_pass http://objects/; }
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+typedef struct {
+    /* the variant in the variant cache (when cache_variant is set) */
+    ngx_http_imaging_cache_entry_t   entry;
+    /* the original in the origin cache */
+    ngx_http_imaging_cache_entry_t   original;
+
+    char                            *hash;
+    u_char                          *filepath;
+    ngx_str_t                        original_uri;
+    size_t                           actions_len;
+
+    /* the fetched original */
+    ngx_uint_t                       status;
+    u_char                          *data;
+    size_t                           len;
+
+    unsigned                         cache_variant:1;
+    unsigned                         done:1;
+} ngx_http_imaging_origin_ctx_t;
+
+
+static ngx_int_t ngx_http_imaging_origin_read(ngx_http_request_t *r,
+    ngx_http_imaging_origin_ctx_t *ctx);
+static ngx_int_t ngx_http_imaging_origin_done(ngx_http_request_t *sr,
+    void *data, ngx_int_t rc);
+static void ngx_http_imaging_origin_resume(ngx_http_request_t *r);
+static ngx_int_t ngx_http_imaging_origin_render(ngx_http_request_t *r,
+    ngx_http_imaging_origin_ctx_t *ctx);
+static ngx_int_t ngx_http_imaging_origin_send_original(ngx_http_request_t *r,
+    ngx_http_imaging_origin_ctx_t *ctx);
+
+
+/*
+ * Creates the variant being requested from an original on the origin.
+ * entry is the variant's (missed) entry in the variant cache or NULL.
+ *
+ * Either renders straight away (the original was in the origin cache) or
+ * fetches the original & returns NGX_DONE, the request is finished once
+ * the subrequest is done.
+ */
+ngx_int_t
+ngx_http_imaging_origin_handler(ngx_http_request_t *r,
+    ngx_http_imaging_cache_entry_t *entry, char *hash)
+{
+    u_char                         *p;
+    ngx_int_t                       rc;
+    ngx_str_t                       uri;
+    const char                     *actions, *ext;
+    ngx_http_request_t             *sr;
+    ngx_http_post_subrequest_t     *ps;
+    ngx_http_imaging_origin_ctx_t  *ctx;
+    ngx_http_imaging_loc_conf_t    *conf;
+    ngx_http_imaging_main_conf_t   *imcf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+    imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_imaging_origin_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (entry != NULL) {
+        ctx->entry = *entry;
+        ctx->cache_variant = 1;
+    }
+
+    ctx->hash = hash;
+
+    /* the variant's name (its uri) is all the library needs */
+    ctx->filepath = ngx_pnalloc(r->pool, r->uri.len + 1);
+    if (ctx->filepath == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_cpystrn(ctx->filepath, r->uri.data, r->uri.len + 1);
+
+    actions = imaging_parse_actions((const char *) ctx->filepath);
+
+    if (actions != NULL) {
+        ext = strrchr(actions, '.');
+        ctx->actions_len = ext - actions;
+
+        /* the original is the variant without the action string */
+        ctx->original_uri.len = ngx_strlen(ctx->filepath) - ctx->actions_len;
+        ctx->original_uri.data = ngx_pnalloc(r->pool, ctx->original_uri.len);
+        if (ctx->original_uri.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        p = ngx_cpymem(ctx->original_uri.data, ctx->filepath,
+                       (u_char *) actions - ctx->filepath);
+        ngx_memcpy(p, ext, ngx_strlen(ext));
+
+    } else {
+        /* the original itself is being requested */
+        ctx->original_uri = r->uri;
+    }
+
+    if (imcf->origin_cache != NULL) {
+        if (ngx_http_imaging_cache_init_entry(r->pool, imcf->origin_cache,
+                                              &ctx->original,
+                                              &ctx->original_uri)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        rc = ngx_http_imaging_cache_lookup(r, imcf->origin_cache,
+                                           &ctx->original);
+
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (rc == NGX_OK) {
+            rc = ngx_http_imaging_origin_read(r, ctx);
+
+            if (rc == NGX_OK) {
+                return ngx_http_imaging_origin_render(r, ctx);
+            }
+
+            if (rc != NGX_DECLINED) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            /* it changed while being read; fetch it again. */
+        }
+    }
+
+    /* fetch <imaging_origin><original uri> into memory */
+    uri.len = conf->origin.len + ctx->original_uri.len;
+    uri.data = ngx_pnalloc(r->pool, uri.len);
+    if (uri.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_cpymem(uri.data, conf->origin.data, conf->origin.len);
+    ngx_memcpy(p, ctx->original_uri.data, ctx->original_uri.len);
+
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if (ps == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ps->handler = ngx_http_imaging_origin_done;
+    ps->data = ctx;
+
+    if (ngx_http_subrequest(r, &uri, NULL, &sr, ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY
+                            |NGX_HTTP_SUBREQUEST_WAITED)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_set_ctx(r, ctx, ngx_http_imaging_module);
+
+    /* continued by ngx_http_imaging_origin_resume once sr is done */
+    r->write_event_handler = ngx_http_imaging_origin_resume;
+
+    return NGX_DONE;
+}
+
+
+/*
+ * Reads the original out of the origin cache into memory.
+ *
+ * Returns NGX_OK, NGX_DECLINED if the file was cut short or NGX_ERROR.
+ */
+static ngx_int_t
+ngx_http_imaging_origin_read(ngx_http_request_t *r,
+    ngx_http_imaging_origin_ctx_t *ctx)
+{
+    size_t   got;
+    ssize_t  n;
+
+    ctx->len = (size_t) ctx->original.size;
+    ctx->data = ngx_pnalloc(r->pool, ctx->len);
+    if (ctx->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (got = 0; got < ctx->len; got += n) {
+        n = ngx_read_fd(ctx->original.fd, ctx->data + got, ctx->len - got);
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                          ngx_read_fd_n " \"%s\" failed",
+                          ctx->original.file.data);
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            return NGX_DECLINED;
+        }
+    }
+
+    ctx->status = NGX_HTTP_OK;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Post subrequest handler, collects the original fetched into memory.
+ */
+static ngx_int_t
+ngx_http_imaging_origin_done(ngx_http_request_t *sr, void *data, ngx_int_t rc)
+{
+    ngx_http_imaging_origin_ctx_t *ctx = data;
+
+    u_char       *p;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    if (ctx->done) {
+        return rc;
+    }
+
+    ctx->done = 1;
+    ctx->status = sr->headers_out.status;
+
+    if (rc == NGX_ERROR || ctx->status == 0) {
+        /* eg: the body didn't fit subrequest_output_buffer_size */
+        ctx->status = NGX_HTTP_BAD_GATEWAY;
+    }
+
+    if (ctx->status != NGX_HTTP_OK || sr->out == NULL) {
+        return rc;
+    }
+
+    /* usually one buffer; reference it rather than copy */
+    if (sr->out->next == NULL) {
+        b = sr->out->buf;
+        ctx->data = b->pos;
+        ctx->len = b->last - b->pos;
+        return rc;
+    }
+
+    for (cl = sr->out; cl; cl = cl->next) {
+        ctx->len += cl->buf->last - cl->buf->pos;
+    }
+
+    ctx->data = ngx_pnalloc(sr->pool, ctx->len);
+    if (ctx->data == NULL) {
+        ctx->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        return rc;
+    }
+
+    p = ctx->data;
+
+    for (cl = sr->out; cl; cl = cl->next) {
+        p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Finishes the request once the original was fetched.
+ */
+static void
+ngx_http_imaging_origin_resume(ngx_http_request_t *r)
+{
+    ngx_http_imaging_origin_ctx_t  *ctx;
+    ngx_http_imaging_main_conf_t   *imcf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_imaging_module);
+
+    if (ctx == NULL || !ctx->done) {
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (ctx->status != NGX_HTTP_OK || ctx->len == 0) {
+
+        if (ctx->status == NGX_HTTP_NOT_FOUND) {
+            imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+            if (imcf->negative != NULL) {
+                ngx_http_imaging_negative_store(r, imcf->negative,
+                                                IMAGING_FAILURE_MISSING);
+            }
+
+            ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "imaging origin returned %ui for \"%V\"",
+                      ctx->status, &ctx->original_uri);
+
+        ngx_http_finalize_request(r, NGX_HTTP_BAD_GATEWAY);
+        return;
+    }
+
+    imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+    if (imcf->origin_cache != NULL) {
+        (void) ngx_http_imaging_cache_store(r->pool, r->connection->log,
+                                            imcf->origin_cache,
+                                            &ctx->original,
+                                            ctx->data, ctx->len);
+    }
+
+    ngx_http_finalize_request(r, ngx_http_imaging_origin_render(r, ctx));
+}
+
+
+/*
+ * Creates & sends the variant from the original in memory.
+ */
+static ngx_int_t
+ngx_http_imaging_origin_render(ngx_http_request_t *r,
+    ngx_http_imaging_origin_ctx_t *ctx)
+{
+    unsigned char                 *data;
+    char                          *mime_type;
+    size_t                         data_length;
+    size_t                         content_type_len;
+    ngx_int_t                      rc;
+    ngx_http_imaging_abort_t       abort;
+    ngx_http_imaging_loc_conf_t   *conf;
+    ngx_http_imaging_main_conf_t  *imcf;
+
+    if (ctx->actions_len == 0) {
+        return ngx_http_imaging_origin_send_original(r, ctx);
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+
+    data = NULL;
+    mime_type = NULL;
+    data_length = content_type_len = 0;
+
+    ngx_http_imaging_set_options(conf);
+    ngx_http_imaging_abort_start(&abort, r, ngx_http_imaging_abort_deadline(r));
+    imaging_get_image_data_from_blob(
+        (const char *) ctx->filepath,
+        ctx->data, ctx->len,
+        &data, &data_length,
+        &mime_type, &content_type_len,
+        (const char *) conf->salt.data,
+        (const char *) ctx->hash,
+        conf->quality,
+        (const char *) conf->white_list.data
+    );
+
+    rc = ngx_http_imaging_abort_finish(&abort);
+
+    if (data == NULL && rc != NGX_OK) {
+        ngx_http_imaging_abort_count(r->connection->log, &r->uri,
+                                     abort.reason, abort.wasted);
+        return rc;
+    }
+
+    if (data == NULL) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "failed to create: \"%s\"", ctx->filepath);
+
+        imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+        if (imcf->negative != NULL) {
+            ngx_http_imaging_negative_store(r, imcf->negative,
+                                            imaging_last_failure());
+        }
+
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    return ngx_http_imaging_send_image(r,
+               ctx->cache_variant ? &ctx->entry : NULL, ctx->actions_len,
+               data, data_length, mime_type, content_type_len);
+}
+
+
+/*
+ * Sends the original as it came from the origin.
+ */
+static ngx_int_t
+ngx_http_imaging_origin_send_original(ngx_http_request_t *r,
+    ngx_http_imaging_origin_ctx_t *ctx)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t   out;
+
+    if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = ctx->data;
+    b->last = ctx->data + ctx->len;
+    b->memory = 1;
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = ctx->len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Passing originals through (see imaging_passthrough).
+ *
+ * Crops, resizes & scales are clamped to the size of the image, so a
+ * variant like "photo_c5000.jpg" of a 1200x800 original (or "t1200" of
+ * it) would decode, process & encode the very same image again. Before
+ * such a variant is created, the original's header (PingImage) is checked:
+ * when every action leaves the image as it is, the original's bytes are
+ * sent as they are (sendfile) or the client is redirected (302) to the
+ * original, with nothing decoded or encoded.
+ *
+ * Eg:
+ *  imaging_passthrough on;
+ *
+ *  GET /img/photo_c5000.jpg -> the bytes of /img/photo.jpg
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+static ngx_int_t ngx_http_imaging_passthrough_redirect(ngx_http_request_t *r,
+    ngx_str_t *path, u_char *original);
+
+
+/*
+ * Answers the request for the variant at path with its original when
+ * creating it would change nothing.
+ *
+ * Returns NGX_DECLINED when the variant has to be created, otherwise the
+ * status of the response.
+ */
+ngx_int_t
+ngx_http_imaging_passthrough(ngx_http_request_t *r, ngx_str_t *path,
+    char *hash)
+{
+    u_char                          *original;
+    ngx_err_t                        err;
+    ngx_file_info_t                  fi;
+    ngx_pool_cleanup_t              *cln;
+    ngx_pool_cleanup_file_t         *clnf;
+    ngx_http_imaging_loc_conf_t     *conf;
+    ngx_http_imaging_cache_entry_t   entry;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+
+    original = ngx_pnalloc(r->pool, MaxTextExtent);
+    if (original == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (!imaging_passthrough((const char *) path->data,
+                             (const char *) conf->salt.data,
+                             (const char *) hash,
+                             (const char *) conf->white_list.data,
+                             (char *) original))
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "imaging passthrough \"%V\" -> \"%s\"", path, original);
+
+    if (conf->passthrough == NGX_HTTP_IMAGING_PASSTHROUGH_REDIRECT) {
+        return ngx_http_imaging_passthrough_redirect(r, path, original);
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_memzero(&entry, sizeof(ngx_http_imaging_cache_entry_t));
+
+    entry.file.data = original;
+    entry.file.len = ngx_strlen(original);
+
+    entry.fd = ngx_open_file(original, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (entry.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* eg: removed since it was looked at, create it as usual */
+        if (err != NGX_ENOENT && err != NGX_ENOTDIR) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%s\" failed", original);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = entry.fd;
+    clnf->name = original;
+    clnf->log = r->pool->log;
+
+    if (ngx_fd_info(entry.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", original);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    entry.size = ngx_file_size(&fi);
+    entry.mtime = ngx_file_mtime(&fi);
+
+    return ngx_http_imaging_send_cached(r, &entry);
+}
+
+
+/*
+ * Redirects r (whose file is path) to the uri of original: its own uri
+ * without the action string, & without args (originals need no hash).
+ */
+static ngx_int_t
+ngx_http_imaging_passthrough_redirect(ngx_http_request_t *r, ngx_str_t *path,
+    u_char *original)
+{
+    u_char           *p, *ext;
+    size_t            len, ext_len;
+    ngx_table_elt_t  *location;
+
+    /* "_c5000" is what the path has more than the original, before ".jpg" */
+    len = path->len - ngx_strlen(original);
+
+    ext = (u_char *) strrchr((char *) original, '.');
+    ext_len = ngx_strlen(ext);
+
+    if (len + ext_len >= r->uri.len
+        || r->uri.data[r->uri.len - ext_len - len] != '_'
+        || ngx_strncmp(r->uri.data + r->uri.len - ext_len, ext, ext_len) != 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_http_clear_location(r);
+
+    location = ngx_list_push(&r->headers_out.headers);
+    if (location == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    location->hash = 1;
+    ngx_str_set(&location->key, "Location");
+
+    location->value.len = r->uri.len - len;
+    location->value.data = ngx_pnalloc(r->pool, location->value.len);
+    if (location->value.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* photo_c5000.jpg -> photo.jpg */
+    p = ngx_cpymem(location->value.data, r->uri.data,
+                   r->uri.len - ext_len - len);
+    ngx_memcpy(p, ext, ext_len);
+
+    r->headers_out.location = location;
+
+    /* not 301: a larger original replacing this one makes "c5000" a crop */
+    return NGX_HTTP_MOVED_TEMPORARILY;
+}
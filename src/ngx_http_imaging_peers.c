@@ -0,0 +1,722 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Render ownership across a cluster of nodes (see imaging_peers).
+ *
+ * Variant uris are hashed onto a consistent hash ring of the peers (160
+ * points each, so adding or removing a node only moves its share of the
+ * variants). A node which misses a variant it doesn't own fetches it from
+ * the owner through an in memory subrequest instead of rendering it, so
+ * each variant is rendered & cached by a single node. The subrequest goes
+ * to "<via>/<owner><uri>", an internal location proxying to the owner,
+ * and carries an X-Imaging-Peer header: requests with it (from one of the
+ * peers' addresses, clients can't set it) are always rendered locally, so
+ * a request makes at most one hop even when the nodes' peer lists
+ * disagree. Conditional & range headers aren't forwarded, the owner
+ * always answers with the whole variant.
+ *
+ * When the owner fails (a 5xx or no response) it's marked down for
+ * fail_timeout by the worker & its variants are rendered locally until
+ * then.
+ *
+ * Eg:
+ *  imaging_peers self=10.0.0.1:80 10.0.0.1:80 10.0.0.2:80 10.0.0.3:80;
+ *
+ *  location ~ ^/imaging_peer/([^/]+)(/.*)$ {
+ *      internal;
+ *      subrequest_output_buffer_size 4m;
+ *      proxy_pass http://$1$2$is_args$args;
+ *  }
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+#define NGX_HTTP_IMAGING_PEER_POINTS  160
+
+
+typedef struct {
+    /* the variant in the variant cache (when cache_variant is set) */
+    ngx_http_imaging_cache_entry_t   entry;
+
+    ngx_str_t                        path;
+    char                            *hash;
+    ngx_http_imaging_peer_t         *owner;
+
+    /* the fetched variant */
+    ngx_uint_t                       status;
+    ngx_str_t                        content_type;
+    u_char                          *data;
+    size_t                           len;
+
+    unsigned                         cache_variant:1;
+    unsigned                         done:1;
+} ngx_http_imaging_peers_ctx_t;
+
+
+static ngx_http_imaging_peer_t *ngx_http_imaging_peers_owner(
+    ngx_http_imaging_peers_t *peers, ngx_str_t *uri);
+static ngx_uint_t ngx_http_imaging_peers_from_peer(ngx_http_request_t *r);
+static ngx_int_t ngx_http_imaging_peers_mark(ngx_http_request_t *r,
+    ngx_http_request_t *sr);
+static ngx_uint_t ngx_http_imaging_peers_skip(ngx_table_elt_t *h);
+static ngx_int_t ngx_http_imaging_peers_done(ngx_http_request_t *sr,
+    void *data, ngx_int_t rc);
+static void ngx_http_imaging_peers_resume(ngx_http_request_t *r);
+static ngx_int_t ngx_http_imaging_peers_send(ngx_http_request_t *r,
+    ngx_http_imaging_peers_ctx_t *ctx);
+static int ngx_libc_cdecl ngx_http_imaging_peers_cmp(const void *one,
+    const void *two);
+
+
+static ngx_str_t  ngx_http_imaging_peer_header = ngx_string("X-Imaging-Peer");
+
+/* request headers peers aren't asked with */
+static ngx_str_t  ngx_http_imaging_peer_skipped[] = {
+    ngx_string("If-Modified-Since"),
+    ngx_string("If-Unmodified-Since"),
+    ngx_string("If-Match"),
+    ngx_string("If-None-Match"),
+    ngx_string("If-Range"),
+    ngx_string("Range"),
+    /* a client's own, ours is added */
+    ngx_string("X-Imaging-Peer"),
+    ngx_null_string
+};
+
+/* per worker */
+static ngx_http_imaging_peers_stats_t  ngx_http_imaging_peers_stat;
+static ngx_uint_t                      ngx_http_imaging_peers_on;
+
+
+/*
+ * imaging_peers self=peer [via=/location] [fail_timeout=time] peer ...;
+ */
+char *
+ngx_http_imaging_peers(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_imaging_loc_conf_t *ilcf = conf;
+
+    u_char                          *p;
+    u_char                           buf[NGX_SOCKADDR_STRLEN + NGX_INT_T_LEN];
+    time_t                           fail_timeout;
+    ngx_str_t                       *value, s, self;
+    ngx_url_t                        u;
+    ngx_uint_t                       i, j, n;
+    ngx_http_imaging_peer_t         *peer;
+    ngx_http_imaging_peers_t        *peers;
+    ngx_http_imaging_peer_point_t   *point;
+
+    if (ilcf->peers != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    peers = ngx_pcalloc(cf->pool, sizeof(ngx_http_imaging_peers_t));
+    if (peers == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_array_init(&peers->peers, cf->pool, 4,
+                       sizeof(ngx_http_imaging_peer_t))
+        != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_str_set(&peers->via, "/imaging_peer");
+    peers->fail_timeout = 10;
+
+    ngx_str_null(&self);
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "self=", 5) == 0) {
+
+            self.len = value[i].len - 5;
+            self.data = value[i].data + 5;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "via=", 4) == 0) {
+
+            peers->via.len = value[i].len - 4;
+            peers->via.data = value[i].data + 4;
+
+            if (peers->via.len < 2 || peers->via.data[0] != '/') {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid via value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fail_timeout=", 13) == 0) {
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            fail_timeout = ngx_parse_time(&s, 1);
+            if (fail_timeout == (time_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid fail_timeout value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            peers->fail_timeout = fail_timeout;
+
+            continue;
+        }
+
+        if (value[i].len > NGX_SOCKADDR_STRLEN
+            || ngx_strlchr(value[i].data, value[i].data + value[i].len, '/'))
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid peer \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&u, sizeof(ngx_url_t));
+
+        u.url = value[i];
+        u.default_port = 80;
+
+        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+            if (u.err) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "%s in peer \"%V\"", u.err, &value[i]);
+            }
+
+            return NGX_CONF_ERROR;
+        }
+
+        peer = ngx_array_push(&peers->peers);
+        if (peer == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        peer->name = value[i];
+        peer->addrs = u.addrs;
+        peer->naddrs = u.naddrs;
+        peer->down_until = 0;
+    }
+
+    peer = peers->peers.elts;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        if (peer[i].name.len == self.len
+            && ngx_strncmp(peer[i].name.data, self.data, self.len) == 0)
+        {
+            peers->self = &peer[i];
+            break;
+        }
+    }
+
+    if (peers->self == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"self=\" must name one of the peers");
+        return NGX_CONF_ERROR;
+    }
+
+    /* the ring */
+    n = peers->peers.nelts * NGX_HTTP_IMAGING_PEER_POINTS;
+
+    peers->points = ngx_palloc(cf->pool,
+                               n * sizeof(ngx_http_imaging_peer_point_t));
+    if (peers->points == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    point = peers->points;
+
+    for (i = 0; i < peers->peers.nelts; i++) {
+        for (j = 0; j < NGX_HTTP_IMAGING_PEER_POINTS; j++) {
+            p = ngx_sprintf(buf, "%V-%ui", &peer[i].name, j);
+
+            point->hash = ngx_crc32_long(buf, p - buf);
+            point->peer = &peer[i];
+            point++;
+        }
+    }
+
+    peers->npoints = n;
+
+    ngx_qsort(peers->points, n, sizeof(ngx_http_imaging_peer_point_t),
+              ngx_http_imaging_peers_cmp);
+
+    ilcf->peers = peers;
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * Fetches the variant being requested from the peer which owns it. path,
+ * entry & hash are what the local render would use; entry is the
+ * variant's (missed) entry in the variant cache or NULL.
+ *
+ * Returns NGX_DECLINED if the variant should be created locally (it's
+ * ours, a peer asked for it or its owner is down), otherwise NGX_DONE &
+ * the request is finished once the subrequest is done.
+ */
+ngx_int_t
+ngx_http_imaging_peers_handler(ngx_http_request_t *r, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry, char *hash)
+{
+    u_char                        *p;
+    ngx_str_t                      uri;
+    ngx_http_request_t            *sr;
+    ngx_http_imaging_peer_t       *owner;
+    ngx_http_imaging_peers_t      *peers;
+    ngx_http_post_subrequest_t    *ps;
+    ngx_http_imaging_peers_ctx_t  *ctx;
+    ngx_http_imaging_loc_conf_t   *conf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+    peers = conf->peers;
+
+    ngx_http_imaging_peers_on = 1;
+
+    /* originals aren't rendered, there's nothing to share */
+    if (imaging_parse_actions((const char *) path->data) == NULL) {
+        return NGX_DECLINED;
+    }
+
+    /* never more than one hop */
+    if (ngx_http_imaging_peers_from_peer(r)) {
+        ngx_http_imaging_peers_stat.from_peers++;
+        return NGX_DECLINED;
+    }
+
+    owner = ngx_http_imaging_peers_owner(peers, &r->uri);
+
+    if (owner == peers->self) {
+        ngx_http_imaging_peers_stat.owned++;
+        return NGX_DECLINED;
+    }
+
+    if (owner->down_until > ngx_time()) {
+        ngx_http_imaging_peers_stat.fallbacks++;
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_imaging_peers_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (entry != NULL) {
+        ctx->entry = *entry;
+        ctx->cache_variant = 1;
+    }
+
+    ctx->path = *path;
+    ctx->hash = hash;
+    ctx->owner = owner;
+
+    /* fetch <via>/<owner><uri> into memory */
+    uri.len = peers->via.len + 1 + owner->name.len + r->uri.len;
+    uri.data = ngx_pnalloc(r->pool, uri.len);
+    if (uri.data == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_cpymem(uri.data, peers->via.data, peers->via.len);
+    *p++ = '/';
+    p = ngx_cpymem(p, owner->name.data, owner->name.len);
+    ngx_memcpy(p, r->uri.data, r->uri.len);
+
+    ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t));
+    if (ps == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ps->handler = ngx_http_imaging_peers_done;
+    ps->data = ctx;
+
+    if (ngx_http_subrequest(r, &uri, &r->args, &sr, ps,
+                            NGX_HTTP_SUBREQUEST_IN_MEMORY
+                            |NGX_HTTP_SUBREQUEST_WAITED)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ngx_http_imaging_peers_mark(r, sr) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_imaging_peers_stat.forwarded++;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "imaging peer \"%V\" owns \"%V\"", &owner->name, &r->uri);
+
+    ngx_http_set_ctx(r, ctx, ngx_http_imaging_module);
+
+    /* continued by ngx_http_imaging_peers_resume once sr is done */
+    r->write_event_handler = ngx_http_imaging_peers_resume;
+
+    return NGX_DONE;
+}
+
+
+/*
+ * Fills stats with the worker's peer counters.
+ *
+ * Returns 0 if no request went through imaging_peers yet.
+ */
+ngx_uint_t
+ngx_http_imaging_peers_stats(ngx_http_imaging_peers_stats_t *stats)
+{
+    if (!ngx_http_imaging_peers_on) {
+        return 0;
+    }
+
+    *stats = ngx_http_imaging_peers_stat;
+
+    return 1;
+}
+
+
+/*
+ * The peer owning uri: the first point of the ring at or after its hash.
+ */
+static ngx_http_imaging_peer_t *
+ngx_http_imaging_peers_owner(ngx_http_imaging_peers_t *peers, ngx_str_t *uri)
+{
+    uint32_t    hash;
+    ngx_uint_t  i, j, k;
+
+    hash = ngx_crc32_long(uri->data, uri->len);
+
+    i = 0;
+    j = peers->npoints;
+
+    while (i < j) {
+        k = (i + j) / 2;
+
+        if (hash > peers->points[k].hash) {
+            i = k + 1;
+
+        } else {
+            j = k;
+        }
+    }
+
+    return peers->points[i % peers->npoints].peer;
+}
+
+
+/*
+ * Whether r came from a peer: has X-Imaging-Peer & was sent from the
+ * address of one of the peers (any port, the peer connects from one of
+ * its own).
+ */
+static ngx_uint_t
+ngx_http_imaging_peers_from_peer(ngx_http_request_t *r)
+{
+    ngx_uint_t                    i, j;
+    ngx_list_part_t              *part;
+    ngx_table_elt_t              *h;
+    ngx_http_imaging_peer_t      *peer;
+    ngx_http_imaging_loc_conf_t  *conf;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                return 0;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == ngx_http_imaging_peer_header.len
+            && ngx_strncasecmp(h[i].key.data,
+                               ngx_http_imaging_peer_header.data,
+                               ngx_http_imaging_peer_header.len)
+               == 0)
+        {
+            break;
+        }
+    }
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+    peer = conf->peers->peers.elts;
+
+    for (i = 0; i < conf->peers->peers.nelts; i++) {
+        for (j = 0; j < peer[i].naddrs; j++) {
+            if (ngx_cmp_sockaddr(r->connection->sockaddr,
+                                 r->connection->socklen,
+                                 peer[i].addrs[j].sockaddr,
+                                 peer[i].addrs[j].socklen, 0)
+                == NGX_OK)
+            {
+                return 1;
+            }
+        }
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "imaging ignored X-Imaging-Peer from a client which "
+                  "isn't a peer");
+
+    return 0;
+}
+
+
+/*
+ * Gives sr a copy of r's request headers (subrequests share their
+ * parent's) with X-Imaging-Peer added, & without conditional or range
+ * headers: a 304 or 206 from the owner would count as its failure.
+ */
+static ngx_int_t
+ngx_http_imaging_peers_mark(ngx_http_request_t *r, ngx_http_request_t *sr)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h, *header;
+
+    if (ngx_list_init(&sr->headers_in.headers, r->pool, 20,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (ngx_http_imaging_peers_skip(&header[i])) {
+            continue;
+        }
+
+        h = ngx_list_push(&sr->headers_in.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        *h = header[i];
+    }
+
+    sr->headers_in.if_modified_since = NULL;
+    sr->headers_in.if_unmodified_since = NULL;
+    sr->headers_in.if_match = NULL;
+    sr->headers_in.if_none_match = NULL;
+    sr->headers_in.range = NULL;
+    sr->headers_in.if_range = NULL;
+
+    h = ngx_list_push(&sr->headers_in.headers);
+    if (h == NULL) {
+        return NGX_ERROR;
+    }
+
+    h->hash = 1;
+    h->key = ngx_http_imaging_peer_header;
+    ngx_str_set(&h->value, "1");
+    h->lowcase_key = (u_char *) "x-imaging-peer";
+
+    return NGX_OK;
+}
+
+
+/*
+ * Whether the request header h is left out of the requests to peers.
+ */
+static ngx_uint_t
+ngx_http_imaging_peers_skip(ngx_table_elt_t *h)
+{
+    ngx_str_t  *name;
+
+    for (name = ngx_http_imaging_peer_skipped; name->len; name++) {
+        if (h->key.len == name->len
+            && ngx_strncasecmp(h->key.data, name->data, name->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Post subrequest handler, collects the variant fetched into memory.
+ */
+static ngx_int_t
+ngx_http_imaging_peers_done(ngx_http_request_t *sr, void *data, ngx_int_t rc)
+{
+    ngx_http_imaging_peers_ctx_t *ctx = data;
+
+    u_char       *p;
+    ngx_chain_t  *cl;
+
+    if (ctx->done) {
+        return rc;
+    }
+
+    ctx->done = 1;
+    ctx->status = sr->headers_out.status;
+
+    if (rc == NGX_ERROR || ctx->status == 0) {
+        /* eg: the body didn't fit subrequest_output_buffer_size */
+        ctx->status = NGX_HTTP_BAD_GATEWAY;
+    }
+
+    if (ctx->status != NGX_HTTP_OK || sr->out == NULL) {
+        return rc;
+    }
+
+    ctx->content_type = sr->headers_out.content_type;
+
+    for (cl = sr->out; cl; cl = cl->next) {
+        ctx->len += cl->buf->last - cl->buf->pos;
+    }
+
+    ctx->data = ngx_pnalloc(sr->pool, ctx->len);
+    if (ctx->data == NULL) {
+        ctx->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        return rc;
+    }
+
+    p = ctx->data;
+
+    for (cl = sr->out; cl; cl = cl->next) {
+        p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Finishes the request once the owner answered, creating the variant
+ * locally when it failed.
+ */
+static void
+ngx_http_imaging_peers_resume(ngx_http_request_t *r)
+{
+    ngx_http_imaging_peers_ctx_t  *ctx;
+    ngx_http_imaging_loc_conf_t   *conf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_imaging_module);
+
+    if (ctx == NULL || !ctx->done) {
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    if (ctx->status == NGX_HTTP_OK && ctx->len) {
+        ngx_http_imaging_peers_stat.fetched++;
+        ngx_http_finalize_request(r, ngx_http_imaging_peers_send(r, ctx));
+        return;
+    }
+
+    /* the owner rendered it & failed; so would we */
+    if (ctx->status == NGX_HTTP_NOT_FOUND) {
+        ngx_http_finalize_request(r, NGX_HTTP_NOT_FOUND);
+        return;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                  "imaging peer \"%V\" returned %ui for \"%V\", "
+                  "rendering locally",
+                  &ctx->owner->name, ctx->status, &r->uri);
+
+    if (ctx->status >= NGX_HTTP_INTERNAL_SERVER_ERROR) {
+        conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+        ctx->owner->down_until = ngx_time() + conf->peers->fail_timeout;
+    }
+
+    ngx_http_imaging_peers_stat.fallbacks++;
+
+    ngx_http_set_ctx(r, NULL, ngx_http_imaging_module);
+
+    ngx_http_finalize_request(r,
+        ngx_http_imaging_create(r, &ctx->path,
+                                ctx->cache_variant ? &ctx->entry : NULL,
+                                ctx->hash));
+}
+
+
+/*
+ * Sends the variant as it came from its owner.
+ */
+static ngx_int_t
+ngx_http_imaging_peers_send(ngx_http_request_t *r,
+    ngx_http_imaging_peers_ctx_t *ctx)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t   out;
+
+    if (ctx->content_type.len) {
+        r->headers_out.content_type = ctx->content_type;
+        r->headers_out.content_type_len = ctx->content_type.len;
+
+    } else if (ngx_http_set_content_type(r) != NGX_OK) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->pos = ctx->data;
+    b->last = ctx->data + ctx->len;
+    b->memory = 1;
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = ctx->len;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_imaging_peers_cmp(const void *one, const void *two)
+{
+    const ngx_http_imaging_peer_point_t  *first = one;
+    const ngx_http_imaging_peer_point_t  *second = two;
+
+    if (first->hash == second->hash) {
+        return 0;
+    }
+
+    return (first->hash < second->hash) ? -1 : 1;
+}
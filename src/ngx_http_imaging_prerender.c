@@ -0,0 +1,1306 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Popularity tracked rendering ahead (see imaging_prerender).
+ *
+ * Every request counts its variant, and the variant's original, in a
+ * count-min sketch in shared memory, keyed by the md5 of the uri (the key
+ * of the variant cache). The counters are halved every minute, so they
+ * follow the recent request rate. The top entries by count are kept as
+ * candidates (indexed by the same md5) along with their path, args &
+ * location. Only requests which pass the security check count, & they
+ * keep the candidate's args (its hash) up to date.
+ *
+ * When a worker has no render queued it looks at the candidates, most
+ * requested first, & renders the first one which isn't cached (anymore):
+ * a variant itself or, for an original requested at least 'hot' times a
+ * minute, its next white listed sibling which isn't. With render helpers
+ * (imaging_helpers) the render is queued for one of them like a request's,
+ * otherwise it blocks the worker like any render; either way it is
+ * aborted after imaging_render_timeout & each worker spends at most
+ * 'budget' percent of its time on it.
+ *
+ * Eg:
+ *  imaging_prerender keys_zone=imaging_prerender:1m top=64 budget=10
+ *                    hot=30r/m;
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+/* seconds */
+#define NGX_HTTP_IMAGING_PRERENDER_DECAY     60
+#define NGX_HTTP_IMAGING_PRERENDER_RECHECK   60
+#define NGX_HTTP_IMAGING_PRERENDER_RETRY     600
+/* ms between looks while there is nothing to render */
+#define NGX_HTTP_IMAGING_PRERENDER_INTERVAL  1000
+
+
+/* A candidate being rendered by a helper */
+typedef struct {
+    ngx_pool_t                              *pool;
+    ngx_str_t                                path;
+    ngx_msec_t                               start;
+    ngx_http_imaging_prerender_candidate_t   cand;
+} ngx_http_imaging_prerender_job_t;
+
+
+static ngx_int_t ngx_http_imaging_prerender_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_imaging_prerender_init_candidates(
+    ngx_http_imaging_prerender_t *prerender);
+static void ngx_http_imaging_prerender_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_http_imaging_prerender_candidate_t *
+    ngx_http_imaging_prerender_find_locked(
+    ngx_http_imaging_prerender_sh_t *sh, u_char *key);
+static ngx_http_imaging_prerender_candidate_t *
+    ngx_http_imaging_prerender_min_locked(
+    ngx_http_imaging_prerender_sh_t *sh);
+static void ngx_http_imaging_prerender_count_locked(
+    ngx_http_imaging_prerender_t *prerender, ngx_http_request_t *r,
+    ngx_str_t *uri, ngx_str_t *path, ngx_str_t *args, ngx_uint_t original);
+static ngx_int_t ngx_http_imaging_prerender_set_locked(
+    ngx_http_imaging_prerender_t *prerender,
+    ngx_http_imaging_prerender_candidate_t *cand, ngx_http_request_t *r,
+    ngx_str_t *uri, ngx_str_t *path, ngx_str_t *args);
+static void ngx_http_imaging_prerender_decay_locked(
+    ngx_http_imaging_prerender_t *prerender);
+static void ngx_http_imaging_prerender_run(ngx_event_t *ev);
+static ngx_msec_t ngx_http_imaging_prerender_finish(
+    ngx_http_imaging_prerender_t *prerender,
+    ngx_http_imaging_prerender_candidate_t *cand, ngx_str_t *path,
+    ngx_int_t rc, ngx_msec_t start);
+static void ngx_http_imaging_prerender_rendered(void *data, ngx_int_t rc);
+static ngx_int_t ngx_http_imaging_prerender_next(
+    ngx_http_imaging_prerender_t *prerender, ngx_pool_t *pool,
+    ngx_http_imaging_prerender_candidate_t *cand);
+static void ngx_http_imaging_prerender_done(
+    ngx_http_imaging_prerender_t *prerender, u_char *key, time_t next_try,
+    ngx_uint_t sibling);
+static ngx_int_t ngx_http_imaging_prerender_sibling(ngx_pool_t *pool,
+    ngx_http_imaging_prerender_candidate_t *cand, ngx_str_t *uri,
+    ngx_str_t *path);
+static ngx_int_t ngx_http_imaging_prerender_cached(ngx_pool_t *pool,
+    ngx_http_imaging_loc_conf_t *conf, ngx_str_t *uri, ngx_str_t *path);
+static ngx_int_t ngx_http_imaging_prerender_dispatch(ngx_log_t *log,
+    ngx_http_imaging_prerender_job_t *job, ngx_str_t *uri, ngx_str_t *args);
+static ngx_int_t ngx_http_imaging_prerender_render(ngx_pool_t *pool,
+    ngx_log_t *log, ngx_http_imaging_loc_conf_t *conf, ngx_str_t *uri,
+    ngx_str_t *path, ngx_str_t *args);
+
+
+/* per worker */
+static ngx_event_t                    ngx_http_imaging_prerender_event;
+static ngx_http_imaging_prerender_t  *ngx_http_imaging_prerender_zone;
+static ngx_http_imaging_main_conf_t  *ngx_http_imaging_prerender_imcf;
+
+
+/*
+ * imaging_prerender [keys_zone=name:size] [top=number] [budget=percent]
+ *     [hot=rate];
+ */
+char *
+ngx_http_imaging_prerender(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_imaging_main_conf_t *imcf = conf;
+
+    u_char                        *p;
+    size_t                         len;
+    ssize_t                        size;
+    ngx_int_t                      n, scale;
+    ngx_str_t                      s, name, *value;
+    ngx_uint_t                     i;
+    ngx_http_imaging_prerender_t  *prerender;
+
+    if (imcf->prerender != NULL) {
+        return "is duplicate";
+    }
+
+    prerender = ngx_pcalloc(cf->pool, sizeof(ngx_http_imaging_prerender_t));
+    if (prerender == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    prerender->top = 64;
+    prerender->budget = 10;
+    prerender->hot = 0;
+
+    ngx_str_set(&name, "imaging_prerender");
+    size = 1024 * 1024;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
+
+            name.data = value[i].data + 10;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid keys zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid keys zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            /* the sketch alone takes 64k */
+            if (size < 256 * 1024) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "keys zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "top=", 4) == 0) {
+
+            n = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (n == NGX_ERROR || n == 0 || n > 4096) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid top value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            prerender->top = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "budget=", 7) == 0) {
+
+            len = value[i].len - 7;
+
+            if (len && value[i].data[value[i].len - 1] == '%') {
+                len--;
+            }
+
+            n = ngx_atoi(value[i].data + 7, len);
+            if (n == NGX_ERROR || n == 0 || n > 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid budget value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            prerender->budget = n;
+
+            continue;
+        }
+
+        /* like the rate of limit_req_zone */
+        if (ngx_strncmp(value[i].data, "hot=", 4) == 0) {
+
+            len = value[i].len - 4;
+            p = value[i].data + value[i].len - 3;
+
+            scale = 1;
+
+            if (len > 3 && ngx_strncmp(p, "r/s", 3) == 0) {
+                scale = 60;
+                len -= 3;
+
+            } else if (len > 3 && ngx_strncmp(p, "r/m", 3) == 0) {
+                len -= 3;
+            }
+
+            n = ngx_atoi(value[i].data + 4, len);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid hot rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            prerender->hot = n * scale;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    prerender->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
+    if (prerender->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (prerender->shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    prerender->shm_zone->init = ngx_http_imaging_prerender_init_zone;
+    prerender->shm_zone->data = prerender;
+
+    imcf->prerender = prerender;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Sets up the sketch, reusing the old one (& its counts) across reloads.
+ */
+static ngx_int_t
+ngx_http_imaging_prerender_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_imaging_prerender_t  *oprerender = data;
+
+    size_t                         len;
+    ngx_int_t                      rc;
+    ngx_http_imaging_prerender_t  *prerender;
+
+    prerender = shm_zone->data;
+
+    if (oprerender) {
+        prerender->sh = oprerender->sh;
+        prerender->shpool = oprerender->shpool;
+
+        if (prerender->sh->top == prerender->top) {
+            return NGX_OK;
+        }
+
+        ngx_shmtx_lock(&prerender->shpool->mutex);
+        rc = ngx_http_imaging_prerender_init_candidates(prerender);
+        ngx_shmtx_unlock(&prerender->shpool->mutex);
+
+        return rc;
+    }
+
+    prerender->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        prerender->sh = prerender->shpool->data;
+        return NGX_OK;
+    }
+
+    prerender->sh = ngx_slab_alloc(prerender->shpool,
+                                   sizeof(ngx_http_imaging_prerender_sh_t));
+    if (prerender->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    prerender->shpool->data = prerender->sh;
+
+    ngx_memzero(prerender->sh, sizeof(ngx_http_imaging_prerender_sh_t));
+
+    prerender->sh->decayed = ngx_time();
+
+    if (ngx_http_imaging_prerender_init_candidates(prerender) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    len = sizeof(" in imaging prerender zone \"\"") + shm_zone->shm.name.len;
+
+    prerender->shpool->log_ctx = ngx_slab_alloc(prerender->shpool, len);
+    if (prerender->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(prerender->shpool->log_ctx, " in imaging prerender zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+/*
+ * (Re)allocates room for top candidates, dropping the current ones.
+ */
+static ngx_int_t
+ngx_http_imaging_prerender_init_candidates(
+    ngx_http_imaging_prerender_t *prerender)
+{
+    ngx_uint_t                        i;
+    ngx_http_imaging_prerender_sh_t  *sh;
+
+    sh = prerender->sh;
+
+    if (sh->candidates != NULL) {
+        for (i = 0; i < sh->ncandidates; i++) {
+            ngx_slab_free_locked(prerender->shpool, sh->candidates[i].uri);
+        }
+
+        ngx_slab_free_locked(prerender->shpool, sh->candidates);
+    }
+
+    sh->ncandidates = 0;
+    sh->top = prerender->top;
+    sh->min = NULL;
+
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                    ngx_http_imaging_prerender_rbtree_insert_value);
+
+    sh->candidates = ngx_slab_calloc_locked(prerender->shpool,
+                         prerender->top
+                         * sizeof(ngx_http_imaging_prerender_candidate_t));
+
+    return (sh->candidates == NULL) ? NGX_ERROR : NGX_OK;
+}
+
+static void
+ngx_http_imaging_prerender_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                       **p;
+    ngx_http_imaging_prerender_candidate_t   *c, *ct;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            c = (ngx_http_imaging_prerender_candidate_t *) node;
+            ct = (ngx_http_imaging_prerender_candidate_t *) temp;
+
+            p = (ngx_memcmp(c->key, ct->key, NGX_HTTP_IMAGING_CACHE_KEY_LEN)
+                 < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+/*
+ * Returns the candidate for key (an md5) or NULL.
+ */
+static ngx_http_imaging_prerender_candidate_t *
+ngx_http_imaging_prerender_find_locked(ngx_http_imaging_prerender_sh_t *sh,
+    u_char *key)
+{
+    ngx_int_t                                rc;
+    ngx_rbtree_key_t                         node_key;
+    ngx_rbtree_node_t                       *node, *sentinel;
+    ngx_http_imaging_prerender_candidate_t  *c;
+
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
+
+    node = sh->rbtree.root;
+    sentinel = sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* node_key == node->key */
+
+        c = (ngx_http_imaging_prerender_candidate_t *) node;
+
+        rc = ngx_memcmp(key, c->key, NGX_HTTP_IMAGING_CACHE_KEY_LEN);
+
+        if (rc == 0) {
+            return c;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns the least requested candidate, looked for only once it may have
+ * changed (a hit on it or a new candidate).
+ */
+static ngx_http_imaging_prerender_candidate_t *
+ngx_http_imaging_prerender_min_locked(ngx_http_imaging_prerender_sh_t *sh)
+{
+    ngx_uint_t                               i;
+    ngx_http_imaging_prerender_candidate_t  *c;
+
+    if (sh->min != NULL) {
+        return sh->min;
+    }
+
+    for (i = 0; i < sh->ncandidates; i++) {
+        c = &sh->candidates[i];
+
+        if (sh->min == NULL || c->count < sh->min->count) {
+            sh->min = c;
+        }
+    }
+
+    return sh->min;
+}
+
+
+/*
+ * Starts the worker's look for something to render ahead (from the init
+ * process handler).
+ */
+void
+ngx_http_imaging_prerender_init(ngx_cycle_t *cycle,
+    ngx_http_imaging_main_conf_t *imcf)
+{
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return;
+    }
+
+    ngx_http_imaging_prerender_zone = imcf->prerender;
+    ngx_http_imaging_prerender_imcf = imcf;
+
+    ngx_http_imaging_prerender_event.handler = ngx_http_imaging_prerender_run;
+    ngx_http_imaging_prerender_event.log = cycle->log;
+    ngx_http_imaging_prerender_event.cancelable = 1;
+
+    ngx_add_timer(&ngx_http_imaging_prerender_event,
+                  NGX_HTTP_IMAGING_PRERENDER_INTERVAL);
+}
+
+
+/*
+ * Counts a request for the variant (or original) at path & for the
+ * original of a variant. hash is the request's, a variant which fails the
+ * security check with it isn't counted.
+ */
+void
+ngx_http_imaging_prerender_track(ngx_http_request_t *r,
+    ngx_http_imaging_prerender_t *prerender, ngx_str_t *path, char *hash)
+{
+    u_char                        *actions, *ext, *action_str;
+    size_t                         tail;
+    ngx_str_t                      uri, original, none, args;
+    ngx_http_imaging_loc_conf_t   *conf;
+    ngx_http_imaging_main_conf_t  *imcf;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+    imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+    /* nothing to render ahead into */
+    if (conf->origin.len || (imcf->cache == NULL && !conf->write_to_disk)) {
+        return;
+    }
+
+    actions = (u_char *) imaging_parse_actions((const char *) path->data);
+    ext = (actions != NULL) ? (u_char *) strrchr((char *) actions, '.') : NULL;
+
+    /* a bad hash would make the candidate fail every render ahead */
+    if (ext != NULL) {
+        action_str = ngx_pnalloc(r->pool, ext - actions + 1);
+        if (action_str == NULL) {
+            return;
+        }
+
+        ngx_cpystrn(action_str, actions, ext - actions + 1);
+
+        if (!imaging_actions_allowed((const char *) action_str,
+                                     (const char *) conf->salt.data, hash,
+                                     (const char *) conf->white_list.data))
+        {
+            return;
+        }
+    }
+
+    args.data = (u_char *) hash;
+    args.len = ngx_strlen(hash);
+
+    ngx_str_null(&none);
+    ngx_str_null(&uri);
+    ngx_str_null(&original);
+
+    /* photo_t200.jpg -> photo.jpg, if the uri ends like the path */
+    tail = (ext != NULL) ? (size_t) (path->data + path->len - actions) : 0;
+
+    if (ext != NULL && r->uri.len > tail
+        && ngx_strncmp(r->uri.data + r->uri.len - tail, actions, tail) == 0)
+    {
+        uri.len = r->uri.len - (ext - actions);
+        uri.data = ngx_pnalloc(r->pool, uri.len);
+
+        original.len = path->len - (ext - actions);
+        original.data = ngx_pnalloc(r->pool, original.len + 1);
+
+        if (uri.data == NULL || original.data == NULL) {
+            return;
+        }
+
+        ngx_memcpy(ngx_cpymem(uri.data, r->uri.data, r->uri.len - tail), ext,
+                   path->data + path->len - ext);
+
+        ngx_memcpy(ngx_cpymem(original.data, path->data,
+                              actions - path->data),
+                   ext, path->data + path->len - ext + 1);
+    }
+
+    ngx_shmtx_lock(&prerender->shpool->mutex);
+
+    ngx_http_imaging_prerender_decay_locked(prerender);
+
+    prerender->sh->stats.tracked++;
+
+    if (ext == NULL) {
+        ngx_http_imaging_prerender_count_locked(prerender, r, &r->uri, path,
+                                                &none, 1);
+
+    } else {
+        ngx_http_imaging_prerender_count_locked(prerender, r, &r->uri, path,
+                                                &args, 0);
+    }
+
+    if (uri.len) {
+        ngx_http_imaging_prerender_count_locked(prerender, r, &uri, &original,
+                                                &none, 1);
+    }
+
+    ngx_shmtx_unlock(&prerender->shpool->mutex);
+}
+
+/*
+ * Copies the counters of the zone into stats.
+ */
+void
+ngx_http_imaging_prerender_stats(ngx_http_imaging_prerender_t *prerender,
+    ngx_http_imaging_prerender_stats_t *stats)
+{
+    ngx_shmtx_lock(&prerender->shpool->mutex);
+    *stats = prerender->sh->stats;
+    ngx_shmtx_unlock(&prerender->shpool->mutex);
+}
+
+
+/*
+ * Counts uri in the sketch & makes it a candidate if it is among the top
+ * ones.
+ */
+static void
+ngx_http_imaging_prerender_count_locked(ngx_http_imaging_prerender_t *prerender,
+    ngx_http_request_t *r, ngx_str_t *uri, ngx_str_t *path, ngx_str_t *args,
+    ngx_uint_t original)
+{
+    u_char                                   key[NGX_HTTP_IMAGING_CACHE_KEY_LEN];
+    uint32_t                                 hash, *counter, count;
+    ngx_md5_t                                md5;
+    ngx_uint_t                               i;
+    ngx_http_imaging_prerender_sh_t         *sh;
+    ngx_http_imaging_prerender_candidate_t  *cand, *min, *last;
+
+    sh = prerender->sh;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, uri->data, uri->len);
+    ngx_md5_final(key, &md5);
+
+    /* every row is indexed by another word of the md5 */
+    count = NGX_MAX_UINT32_VALUE;
+
+    for (i = 0; i < NGX_HTTP_IMAGING_SKETCH_DEPTH; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
+
+        counter = &sh->sketch[i][hash % NGX_HTTP_IMAGING_SKETCH_WIDTH];
+
+        if (*counter != NGX_MAX_UINT32_VALUE) {
+            (*counter)++;
+        }
+
+        if (*counter < count) {
+            count = *counter;
+        }
+    }
+
+    cand = ngx_http_imaging_prerender_find_locked(sh, key);
+
+    if (cand != NULL) {
+        cand->count = count;
+
+        if (cand == sh->min) {
+            sh->min = NULL;
+        }
+
+        /*
+         * reloaded, the location & even the path may have changed; or the
+         * hash did (eg: a new imaging_salt)
+         */
+        if (cand->cycle != ngx_cycle
+            || cand->args_len != args->len
+            || ngx_strncmp(cand->args, args->data, args->len) != 0)
+        {
+            (void) ngx_http_imaging_prerender_set_locked(prerender, cand, r,
+                                                         uri, path, args);
+        }
+
+        return;
+    }
+
+    if (sh->ncandidates < sh->top) {
+        cand = &sh->candidates[sh->ncandidates];
+
+    } else {
+        min = ngx_http_imaging_prerender_min_locked(sh);
+
+        if (min == NULL || count <= min->count) {
+            return;
+        }
+
+        cand = min;
+        ngx_rbtree_delete(&sh->rbtree, &cand->node);
+        ngx_slab_free_locked(prerender->shpool, cand->uri);
+    }
+
+    sh->min = NULL;
+
+    ngx_memzero(cand, sizeof(ngx_http_imaging_prerender_candidate_t));
+
+    if (ngx_http_imaging_prerender_set_locked(prerender, cand, r, uri, path,
+                                              args)
+        != NGX_OK)
+    {
+        /* drop the slot, the last candidate takes it */
+        if (cand != &sh->candidates[sh->ncandidates]) {
+            last = &sh->candidates[--sh->ncandidates];
+
+            if (last != cand) {
+                ngx_rbtree_delete(&sh->rbtree, &last->node);
+                *cand = *last;
+                ngx_rbtree_insert(&sh->rbtree, &cand->node);
+            }
+        }
+
+        return;
+    }
+
+    if (cand == &sh->candidates[sh->ncandidates]) {
+        sh->ncandidates++;
+    }
+
+    ngx_memcpy(cand->key, key, NGX_HTTP_IMAGING_CACHE_KEY_LEN);
+    cand->count = count;
+    cand->original = original;
+
+    ngx_memcpy((u_char *) &cand->node.key, key, sizeof(ngx_rbtree_key_t));
+    ngx_rbtree_insert(&sh->rbtree, &cand->node);
+}
+
+/*
+ * Copies the strings & location of a request into cand.
+ */
+static ngx_int_t
+ngx_http_imaging_prerender_set_locked(ngx_http_imaging_prerender_t *prerender,
+    ngx_http_imaging_prerender_candidate_t *cand, ngx_http_request_t *r,
+    ngx_str_t *uri, ngx_str_t *path, ngx_str_t *args)
+{
+    u_char  *p;
+
+    p = ngx_slab_alloc_locked(prerender->shpool,
+                              uri->len + path->len + args->len + 3);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (cand->uri != NULL) {
+        ngx_slab_free_locked(prerender->shpool, cand->uri);
+    }
+
+    cand->uri = p;
+    cand->uri_len = uri->len;
+    p = ngx_cpymem(p, uri->data, uri->len);
+    *p++ = '\0';
+
+    cand->path = p;
+    cand->path_len = path->len;
+    p = ngx_cpymem(p, path->data, path->len);
+    *p++ = '\0';
+
+    cand->args = p;
+    cand->args_len = args->len;
+    p = ngx_cpymem(p, args->data, args->len);
+    *p = '\0';
+
+    cand->cycle = (ngx_cycle_t *) ngx_cycle;
+    cand->conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+    cand->sibling = 0;
+    cand->next_try = 0;
+
+    return NGX_OK;
+}
+
+/*
+ * Halves every counter once a minute, so counts follow the request rate
+ * (about twice the requests of a minute).
+ */
+static void
+ngx_http_imaging_prerender_decay_locked(ngx_http_imaging_prerender_t *prerender)
+{
+    ngx_uint_t                        i, j;
+    ngx_http_imaging_prerender_sh_t  *sh;
+
+    sh = prerender->sh;
+
+    if (ngx_time() - sh->decayed < NGX_HTTP_IMAGING_PRERENDER_DECAY) {
+        return;
+    }
+
+    sh->decayed = ngx_time();
+
+    for (i = 0; i < NGX_HTTP_IMAGING_SKETCH_DEPTH; i++) {
+        for (j = 0; j < NGX_HTTP_IMAGING_SKETCH_WIDTH; j++) {
+            sh->sketch[i][j] >>= 1;
+        }
+    }
+
+    for (i = 0; i < sh->ncandidates; i++) {
+        sh->candidates[i].count >>= 1;
+    }
+
+    /* ties may have changed it */
+    sh->min = NULL;
+}
+
+
+/*
+ * Renders (at most) one candidate ahead, then waits long enough to stay
+ * within the budget. A render handed to a helper goes on once it replied
+ * (ngx_http_imaging_prerender_rendered).
+ */
+static void
+ngx_http_imaging_prerender_run(ngx_event_t *ev)
+{
+    time_t                                   next_try;
+    ngx_int_t                                rc;
+    ngx_msec_t                               start, delay;
+    ngx_pool_t                              *pool;
+    ngx_str_t                                uri, path, args;
+    ngx_http_imaging_prerender_t            *prerender;
+    ngx_http_imaging_prerender_job_t        *job;
+    ngx_http_imaging_scheduler_stats_t       sstats;
+    ngx_http_imaging_helpers_stats_t         hstats;
+    ngx_http_imaging_prerender_candidate_t   cand;
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    prerender = ngx_http_imaging_prerender_zone;
+    delay = NGX_HTTP_IMAGING_PRERENDER_INTERVAL;
+
+    /* requests come first */
+    if ((ngx_http_imaging_scheduler_stats(&sstats) && sstats.depth)
+        || (ngx_http_imaging_helpers_stats(&hstats)
+            && (hstats.busy || hstats.waiting)))
+    {
+        goto next;
+    }
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ev->log);
+    if (pool == NULL) {
+        goto next;
+    }
+
+    for ( ;; ) {
+        rc = ngx_http_imaging_prerender_next(prerender, pool, &cand);
+
+        if (rc == NGX_DONE) {
+            break;
+        }
+
+        if (rc != NGX_OK) {
+            continue;
+        }
+
+        uri.data = cand.uri;
+        uri.len = cand.uri_len;
+        path.data = cand.path;
+        path.len = cand.path_len;
+        args.data = cand.args;
+        args.len = cand.args_len;
+
+        if (cand.original) {
+            rc = ngx_http_imaging_prerender_sibling(pool, &cand, &uri, &path);
+
+            if (rc == NGX_DONE) {
+                /* all of its siblings were looked at */
+                ngx_http_imaging_prerender_done(prerender, cand.key,
+                    ngx_time() + NGX_HTTP_IMAGING_PRERENDER_RECHECK, 0);
+                continue;
+            }
+
+            if (rc != NGX_OK) {
+                break;
+            }
+        }
+
+        if (ngx_http_imaging_prerender_cached(pool, cand.conf, &uri, &path)
+            == NGX_OK)
+        {
+            next_try = cand.original
+                       ? 0 : ngx_time() + NGX_HTTP_IMAGING_PRERENDER_RECHECK;
+
+            ngx_http_imaging_prerender_done(prerender, cand.key, next_try,
+                                            cand.sibling + 1);
+            continue;
+        }
+
+        start = ngx_current_msec;
+
+        if (ngx_http_imaging_prerender_imcf->helpers) {
+            job = ngx_palloc(pool, sizeof(ngx_http_imaging_prerender_job_t));
+            if (job == NULL) {
+                break;
+            }
+
+            job->pool = pool;
+            job->path = path;
+            job->start = start;
+            job->cand = cand;
+
+            if (ngx_http_imaging_prerender_dispatch(ev->log, job, &uri, &args)
+                == NGX_OK)
+            {
+                /* the pool & the next look are up to the helper's reply */
+                return;
+            }
+
+            rc = NGX_ERROR;
+
+        } else {
+            rc = ngx_http_imaging_prerender_render(pool, ev->log, cand.conf,
+                                                   &uri, &path, &args);
+        }
+
+        delay = ngx_http_imaging_prerender_finish(prerender, &cand, &path, rc,
+                                                  start);
+        break;
+    }
+
+    ngx_destroy_pool(pool);
+
+next:
+
+    ngx_add_timer(ev, delay ? delay : 1);
+}
+
+/*
+ * Counts the render of cand (its variant at path) which started at start
+ * & holds cand off accordingly.
+ *
+ * Returns the delay to the next look which keeps the worker in budget.
+ */
+static ngx_msec_t
+ngx_http_imaging_prerender_finish(ngx_http_imaging_prerender_t *prerender,
+    ngx_http_imaging_prerender_candidate_t *cand, ngx_str_t *path,
+    ngx_int_t rc, ngx_msec_t start)
+{
+    time_t      next_try;
+    ngx_msec_t  delay;
+
+    ngx_time_update();
+
+    ngx_shmtx_lock(&prerender->shpool->mutex);
+
+    if (rc != NGX_OK) {
+        prerender->sh->stats.failures++;
+
+    } else if (cand->original) {
+        prerender->sh->stats.siblings++;
+
+    } else {
+        prerender->sh->stats.prerendered++;
+    }
+
+    ngx_shmtx_unlock(&prerender->shpool->mutex);
+
+    /* an original goes on with its next sibling, even after a failure */
+    if (cand->original) {
+        next_try = 0;
+
+    } else if (rc == NGX_OK) {
+        next_try = ngx_time() + NGX_HTTP_IMAGING_PRERENDER_RECHECK;
+
+    } else {
+        next_try = ngx_time() + NGX_HTTP_IMAGING_PRERENDER_RETRY;
+    }
+
+    ngx_http_imaging_prerender_done(prerender, cand->key, next_try,
+                                    cand->sibling + 1);
+
+    /* render for budget percent of the time */
+    delay = (ngx_current_msec - start)
+            * (100 - prerender->budget) / prerender->budget;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "imaging prerendered \"%V\": %i next in %Mms",
+                   path, rc, delay);
+
+    return delay;
+}
+
+/*
+ * ngx_http_imaging_helpers_background handler, the helper rendered (or
+ * failed to render) the candidate of job.
+ */
+static void
+ngx_http_imaging_prerender_rendered(void *data, ngx_int_t rc)
+{
+    ngx_http_imaging_prerender_job_t *job = data;
+
+    ngx_msec_t  delay;
+
+    delay = ngx_http_imaging_prerender_finish(ngx_http_imaging_prerender_zone,
+                                              &job->cand, &job->path, rc,
+                                              job->start);
+
+    ngx_destroy_pool(job->pool);
+
+    if (ngx_exiting || ngx_quit || ngx_terminate) {
+        return;
+    }
+
+    ngx_add_timer(&ngx_http_imaging_prerender_event, delay ? delay : 1);
+}
+
+/*
+ * Picks the most requested candidate of this cycle with something to do &
+ * copies it (strings into pool), holding it off from other workers for a
+ * while.
+ *
+ * Returns NGX_OK, NGX_DONE if there is none or NGX_ERROR.
+ */
+static ngx_int_t
+ngx_http_imaging_prerender_next(ngx_http_imaging_prerender_t *prerender,
+    ngx_pool_t *pool, ngx_http_imaging_prerender_candidate_t *cand)
+{
+    u_char                                  *p;
+    size_t                                   len;
+    time_t                                   now;
+    ngx_uint_t                               i;
+    ngx_http_imaging_prerender_sh_t         *sh;
+    ngx_http_imaging_prerender_candidate_t  *c, *best;
+
+    sh = prerender->sh;
+    now = ngx_time();
+    best = NULL;
+
+    ngx_shmtx_lock(&prerender->shpool->mutex);
+
+    for (i = 0; i < sh->ncandidates; i++) {
+        c = &sh->candidates[i];
+
+        if (c->cycle != ngx_cycle || c->next_try > now || c->count == 0) {
+            continue;
+        }
+
+        /* originals only for their siblings, when hot */
+        if (c->original
+            && (prerender->hot == 0 || c->count / 2 < prerender->hot))
+        {
+            continue;
+        }
+
+        if (best == NULL || c->count > best->count) {
+            best = c;
+        }
+    }
+
+    if (best == NULL) {
+        ngx_shmtx_unlock(&prerender->shpool->mutex);
+        return NGX_DONE;
+    }
+
+    best->next_try = now + NGX_HTTP_IMAGING_PRERENDER_RECHECK;
+
+    *cand = *best;
+
+    /* the strings in the zone may be replaced once it's unlocked */
+    len = cand->uri_len + cand->path_len + cand->args_len + 3;
+
+    p = ngx_pnalloc(pool, len);
+    if (p != NULL) {
+        ngx_memcpy(p, best->uri, len);
+    }
+
+    ngx_shmtx_unlock(&prerender->shpool->mutex);
+
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    cand->uri = p;
+    cand->path = p + cand->uri_len + 1;
+    cand->args = cand->path + cand->path_len + 1;
+
+    return NGX_OK;
+}
+
+/*
+ * Records that the worker is done with candidate key for now.
+ */
+static void
+ngx_http_imaging_prerender_done(ngx_http_imaging_prerender_t *prerender,
+    u_char *key, time_t next_try, ngx_uint_t sibling)
+{
+    ngx_http_imaging_prerender_candidate_t  *c;
+
+    ngx_shmtx_lock(&prerender->shpool->mutex);
+
+    c = ngx_http_imaging_prerender_find_locked(prerender->sh, key);
+
+    if (c != NULL) {
+        c->next_try = next_try;
+        c->sibling = sibling;
+    }
+
+    ngx_shmtx_unlock(&prerender->shpool->mutex);
+}
+
+/*
+ * Builds the uri & path of the next white listed sibling of the original
+ * cand, eg: photo.jpg -> photo_t200.jpg.
+ *
+ * Returns NGX_OK, NGX_DONE once past the last one or NGX_ERROR.
+ */
+static ngx_int_t
+ngx_http_imaging_prerender_sibling(ngx_pool_t *pool,
+    ngx_http_imaging_prerender_candidate_t *cand, ngx_str_t *uri,
+    ngx_str_t *path)
+{
+    u_char                       *p, *last, *start, *dot;
+    ngx_str_t                     action, *s, sibling;
+    ngx_uint_t                    n, i;
+    ngx_http_imaging_loc_conf_t  *conf;
+
+    conf = cand->conf;
+
+    p = conf->white_list.data;
+    last = p + conf->white_list.len;
+
+    ngx_str_null(&action);
+
+    for (n = 0; p < last; n++) {
+
+        while (p < last && *p == ' ') {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last && *p != ' ') {
+            p++;
+        }
+
+        if (p == start) {
+            break;
+        }
+
+        if (n == cand->sibling) {
+            action.data = start;
+            action.len = p - start;
+            break;
+        }
+    }
+
+    if (action.len == 0) {
+        return NGX_DONE;
+    }
+
+    for (i = 0; i < 2; i++) {
+        s = (i == 0) ? uri : path;
+
+        for (dot = s->data + s->len - 1;
+             dot > s->data && *dot != '.' && *dot != '/';
+             dot--)
+        {
+            /* void */
+        }
+
+        if (*dot != '.') {
+            return NGX_DONE;
+        }
+
+        sibling.len = s->len + 1 + action.len;
+        sibling.data = ngx_pnalloc(pool, sibling.len + 1);
+        if (sibling.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        p = ngx_cpymem(sibling.data, s->data, dot - s->data);
+        *p++ = '_';
+        p = ngx_cpymem(p, action.data, action.len);
+        p = ngx_cpymem(p, dot, s->data + s->len - dot);
+        *p = '\0';
+
+        *s = sibling;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Returns NGX_OK if the variant is in the variant cache (or beside its
+ * original without one), NGX_DECLINED if not.
+ */
+static ngx_int_t
+ngx_http_imaging_prerender_cached(ngx_pool_t *pool,
+    ngx_http_imaging_loc_conf_t *conf, ngx_str_t *uri, ngx_str_t *path)
+{
+    ngx_file_info_t                  fi;
+    ngx_http_imaging_main_conf_t    *imcf;
+    ngx_http_imaging_cache_entry_t   entry;
+
+    imcf = ngx_http_imaging_prerender_imcf;
+
+    if (imcf->cache == NULL) {
+        return (ngx_file_info(path->data, &fi) == NGX_FILE_ERROR)
+               ? NGX_DECLINED : NGX_OK;
+    }
+
+    if (ngx_http_imaging_cache_init_entry(pool, imcf->cache, &entry, uri)
+        != NGX_OK)
+    {
+        return NGX_OK;
+    }
+
+    /* the loader may not have indexed it yet */
+    if (ngx_http_imaging_cache_exists(imcf->cache, &entry)
+        || ngx_file_info(entry.file.data, &fi) != NGX_FILE_ERROR)
+    {
+        return NGX_OK;
+    }
+
+    return NGX_DECLINED;
+}
+
+/*
+ * Queues the render of the candidate of job for a render helper, into the
+ * variant cache or beside its original like a request of uri?args would.
+ */
+static ngx_int_t
+ngx_http_imaging_prerender_dispatch(ngx_log_t *log,
+    ngx_http_imaging_prerender_job_t *job, ngx_str_t *uri, ngx_str_t *args)
+{
+    ngx_msec_t                       deadline;
+    ngx_http_imaging_main_conf_t    *imcf;
+    ngx_http_imaging_cache_entry_t   entry, *e;
+
+    imcf = ngx_http_imaging_prerender_imcf;
+    e = NULL;
+
+    if (imcf->cache != NULL) {
+        if (ngx_http_imaging_cache_init_entry(job->pool, imcf->cache, &entry,
+                                              uri)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        e = &entry;
+    }
+
+    deadline = ngx_http_imaging_abort_after(job->cand.conf);
+
+    return ngx_http_imaging_helpers_background(job->pool, log, job->cand.conf,
+               &job->path, e, (char *) args->data, deadline,
+               ngx_http_imaging_prerender_rendered, job);
+}
+
+/*
+ * Creates the variant at path into the variant cache or beside its
+ * original, like a request of uri?args would.
+ */
+static ngx_int_t
+ngx_http_imaging_prerender_render(ngx_pool_t *pool, ngx_log_t *log,
+    ngx_http_imaging_loc_conf_t *conf, ngx_str_t *uri, ngx_str_t *path,
+    ngx_str_t *args)
+{
+    size_t                           data_length, content_type_len;
+    char                            *mime_type;
+    unsigned char                   *data;
+    const char                      *actions, *ext;
+    ngx_http_imaging_abort_t         abort;
+    ngx_http_imaging_main_conf_t    *imcf;
+    ngx_http_imaging_cache_entry_t   entry;
+
+    imcf = ngx_http_imaging_prerender_imcf;
+
+    data = NULL;
+    mime_type = NULL;
+    content_type_len = data_length = 0;
+
+    ngx_http_imaging_set_options(conf);
+    ngx_http_imaging_abort_start(&abort, NULL,
+                                 ngx_http_imaging_abort_after(conf));
+    imgaging_get_image_data(
+        (const char *) path->data,
+        &data, &data_length,
+        &mime_type, &content_type_len,
+        (const char *) conf->salt.data,
+        (const char *) args->data,
+        conf->quality,
+        (const char *) conf->white_list.data,
+        imcf->cache != NULL ? 0 : conf->write_to_disk
+    );
+
+    if (data == NULL) {
+        if (ngx_http_imaging_abort_finish(&abort) != NGX_OK) {
+            ngx_http_imaging_abort_count(log, path, abort.reason,
+                                         abort.wasted);
+        }
+
+        return NGX_ERROR;
+    }
+
+    (void) ngx_http_imaging_abort_finish(&abort);
+
+    if (imcf->cache != NULL
+        && ngx_http_imaging_cache_init_entry(pool, imcf->cache, &entry, uri)
+           == NGX_OK)
+    {
+        /* remember the action string so cache hits can be security checked */
+        actions = imaging_find_actions((const char *) path->data);
+        ext = (actions != NULL) ? strrchr(actions, '.') : NULL;
+        entry.actions_len = (ext != NULL) ? (size_t) (ext - actions) : 0;
+
+        /* originals are never cached */
+        if (entry.actions_len != 0) {
+            (void) ngx_http_imaging_cache_store(pool, log, imcf->cache,
+                                                &entry, data, data_length);
+        }
+    }
+
+    imaging_free(data);
+    imaging_free(mime_type);
+
+    return NGX_OK;
+}
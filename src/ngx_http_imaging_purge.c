@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Purging & invalidation of variants (see imaging_purge).
+ *
+ * A PURGE request of an original (or any of its variants) removes every
+ * variant of it: those the module wrote beside it on disk
+ * (imaging_write_to_disk, see imaging_disk_variant), its
+ * pyramid levels (imaging_pyramid_path), those in imaging_cache_path and,
+ * behind imaging_origin, the fetched original in imaging_origin_cache_path.
+ *
+ * Cached variants are also invalidated on their own: a hit whose original
+ * was modified or replaced since (its mtime or ctime is newer than the
+ * variant) is created again.
+ *
+ * Eg:
+ *  location /img/ {
+ *      imaging on;
+ *      imaging_purge on;
+ *      limit_except GET { allow 10.0.0.0/8; deny all; }
+ *  }
+ *
+ *  PURGE /img/photo.jpg -> "purged: 4"
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+#include "pyramid.h"
+
+
+static ngx_int_t ngx_http_imaging_purge_original(ngx_pool_t *pool,
+    u_char *name, size_t len, ngx_str_t *original);
+static ngx_uint_t ngx_http_imaging_purge_disk(ngx_http_request_t *r,
+    ngx_str_t *original);
+static ngx_uint_t ngx_http_imaging_purge_pyramid(ngx_http_request_t *r,
+    ngx_path_t *dir, ngx_str_t *original);
+
+
+/*
+ * Answers a PURGE request for path (an original or one of its variants).
+ */
+ngx_int_t
+ngx_http_imaging_purge_handler(ngx_http_request_t *r, ngx_str_t *path)
+{
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_str_t                       uri, original;
+    ngx_uint_t                      purged;
+    ngx_chain_t                     out;
+    ngx_http_imaging_loc_conf_t    *conf;
+    ngx_http_imaging_main_conf_t   *imcf;
+    ngx_http_imaging_cache_entry_t  entry;
+
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_imaging_module);
+    imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+    if (ngx_http_imaging_purge_original(r->pool, r->uri.data, r->uri.len,
+                                        &uri)
+        != NGX_OK)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    purged = 0;
+
+    if (imcf->cache != NULL) {
+        if (ngx_http_imaging_cache_init_entry(r->pool, imcf->cache, &entry,
+                                              &uri)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        purged += ngx_http_imaging_cache_purge(r->pool, r->connection->log,
+                                               imcf->cache, entry.original);
+    }
+
+    if (conf->origin.len) {
+        /* the next variant fetches the original again */
+        if (imcf->origin_cache != NULL) {
+            if (ngx_http_imaging_cache_init_entry(r->pool, imcf->origin_cache,
+                                                  &entry, &uri)
+                != NGX_OK)
+            {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            ngx_http_imaging_cache_remove(r->connection->log,
+                                          imcf->origin_cache, &entry);
+        }
+
+    } else {
+        if (ngx_http_imaging_purge_original(r->pool, path->data, path->len,
+                                            &original)
+            != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* nothing was written beside it otherwise */
+        if (conf->write_to_disk) {
+            purged += ngx_http_imaging_purge_disk(r, &original);
+        }
+
+        if (conf->pyramid_path != NULL) {
+            purged += ngx_http_imaging_purge_pyramid(r, conf->pyramid_path,
+                                                     &original);
+        }
+    }
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "imaging purged %ui variants of \"%V\"", purged, &uri);
+
+    b = ngx_create_temp_buf(r->pool, sizeof("purged: \n") + NGX_INT_T_LEN);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "purged: %ui\n", purged);
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * Tells whether the original of the variant at path (on disk) was modified
+ * or replaced since the variant of entry was cached. Replacing a file (eg:
+ * renaming a new one over it) moves its ctime even when its mtime is older.
+ * The original is the one a render reads (imaging_find_original).
+ */
+ngx_uint_t
+ngx_http_imaging_purge_stale(ngx_http_request_t *r, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry)
+{
+    u_char           *original;
+    ngx_file_info_t   fi;
+
+    original = ngx_pnalloc(r->pool, MaxTextExtent);
+    if (original == NULL) {
+        return 0;
+    }
+
+    if (!imaging_find_original((const char *) path->data, (char *) original)
+        || ngx_file_info(original, &fi) == NGX_FILE_ERROR)
+    {
+        return 0;
+    }
+
+    if (ngx_file_mtime(&fi) <= entry->mtime && fi.st_ctime <= entry->mtime) {
+        return 0;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "imaging variant of changed original: \"%s\"", original);
+
+    return 1;
+}
+
+
+/*
+ * Sets original (nul terminated, allocated from pool) to name without its
+ * action string (eg: "/img/photo_t200.jpg" -> "/img/photo.jpg"), or to name
+ * itself when it has none.
+ */
+static ngx_int_t
+ngx_http_imaging_purge_original(ngx_pool_t *pool, u_char *name, size_t len,
+    ngx_str_t *original)
+{
+    u_char      *p, *ext;
+    const char  *actions;
+
+    original->data = ngx_pnalloc(pool, len + 1);
+    if (original->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(original->data, name, len + 1);
+    original->len = ngx_strlen(original->data);
+
+    actions = imaging_parse_actions((const char *) original->data);
+
+    if (actions != NULL) {
+        p = (u_char *) actions;
+
+        for (ext = original->data + original->len - 1; *ext != '.'; ext--) {
+            /* void */
+        }
+
+        p = ngx_cpystrn(p, ext, original->data + original->len - ext + 1);
+        original->len = p - original->data;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Deletes the variants the module wrote beside the original (eg:
+ * "photo_t200.jpg" of "photo.jpg"). Files whose names merely look like
+ * variants (eg: "page_p2.jpg" beside "page.jpg") are originals of their own
+ * & stay.
+ *
+ * Returns the number of files deleted.
+ */
+static ngx_uint_t
+ngx_http_imaging_purge_disk(ngx_http_request_t *r, ngx_str_t *original)
+{
+    u_char      *name, *ext, *de, *file, *p, *of;
+    size_t       dir_len, name_len, base_len, ext_len, len;
+    ngx_dir_t    dir;
+    ngx_str_t    dirname;
+    ngx_uint_t   purged;
+
+    name = original->data + original->len;
+
+    while (name > original->data && name[-1] != '/') {
+        name--;
+    }
+
+    dir_len = name - original->data;
+    name_len = original->data + original->len - name;
+
+    for (ext = name + name_len - 1; ext > name && *ext != '.'; ext--) {
+        /* void */
+    }
+
+    if (dir_len == 0 || ext == name) {
+        return 0;
+    }
+
+    base_len = ext - name;
+    ext_len = name + name_len - ext;
+
+    dirname.len = dir_len - 1;
+    dirname.data = ngx_pnalloc(r->pool, dir_len);
+    if (dirname.data == NULL) {
+        return 0;
+    }
+
+    ngx_cpystrn(dirname.data, original->data, dir_len);
+
+    of = ngx_pnalloc(r->pool, MaxTextExtent);
+    if (of == NULL) {
+        return 0;
+    }
+
+    if (ngx_open_dir(&dirname, &dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      ngx_open_dir_n " \"%V\" failed", &dirname);
+        return 0;
+    }
+
+    purged = 0;
+
+    for ( ;; ) {
+        ngx_set_errno(0);
+
+        if (ngx_read_dir(&dir) == NGX_ERROR) {
+            break;
+        }
+
+        de = ngx_de_name(&dir);
+        len = ngx_de_namelen(&dir);
+
+        /* "photo_t200.jpg": the original's name with an action string */
+        if (len <= name_len || ngx_strncmp(de, name, base_len) != 0
+            || de[base_len] != '_'
+            || ngx_strncmp(de + len - ext_len, ext, ext_len) != 0)
+        {
+            continue;
+        }
+
+        file = ngx_pnalloc(r->pool, dir_len + len + 1);
+        if (file == NULL) {
+            break;
+        }
+
+        p = ngx_cpymem(file, original->data, dir_len);
+        (void) ngx_cpystrn(p, de, len + 1);
+
+        if (!imaging_disk_variant((const char *) file, (char *) of)
+            || ngx_strcmp(of, original->data) != 0)
+        {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "imaging purge: \"%s\"", file);
+
+        if (ngx_delete_file(file) == NGX_FILE_ERROR) {
+            if (ngx_errno != NGX_ENOENT) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed", file);
+            }
+
+            continue;
+        }
+
+        purged++;
+    }
+
+    (void) ngx_close_dir(&dir);
+
+    return purged;
+}
+
+
+/*
+ * Deletes the pyramid levels of original kept in dir.
+ *
+ * Returns the number of levels deleted.
+ */
+static ngx_uint_t
+ngx_http_imaging_purge_pyramid(ngx_http_request_t *r, ngx_path_t *dir,
+    ngx_str_t *original)
+{
+    int          level;
+    ngx_uint_t   purged;
+    u_char       name[MaxTextExtent];
+
+    purged = 0;
+
+    for (level = 1; level <= IMAGING_PYRAMID_MAX_LEVELS; level++) {
+        imaging_pyramid_name((const char *) dir->name.data,
+                             (const char *) original->data, level,
+                             (char *) name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            if (ngx_errno != NGX_ENOENT) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed", name);
+            }
+
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "imaging purge: \"%s\"", name);
+
+        purged++;
+    }
+
+    return purged;
+}
@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Cost aware scheduling of renders (see imaging_scheduler).
+ *
+ * Instead of rendering inside the content handler, a worker queues the
+ * render with its estimated cost (imaging_estimate_cost: the original's
+ * header & the action chain) and runs one job per turn of its event loop,
+ * the cheapest first. Everything accepted during a burst is queued before
+ * the first render starts, so a few thumbnails no longer wait behind a
+ * huge original. A job's cost is divided by 1 + (time queued / aging) so
+ * expensive jobs can't starve.
+ *
+ * Renders are blocking & a request can't change processes, so the queues
+ * are per worker. When a worker has more than backlog jobs queued it stops
+ * competing for new connections (like ngx_accept_disabled does when it
+ * runs short of connections), letting idle workers take them instead.
+ * That only has an effect with accept_mutex on.
+ *
+ * Eg:
+ *  imaging_scheduler aging=500ms backlog=16;
+ */
+#include "ngx_http_imaging_module.h"
+
+/* Graphics Magick API Wrapper */
+#include "imaging.h"
+
+
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_http_request_t              *request;
+
+    ngx_str_t                        path;
+    char                            *hash;
+    /* the variant in the variant cache (when cache_variant is set) */
+    ngx_http_imaging_cache_entry_t   entry;
+
+    double                           cost;
+    ngx_msec_t                       queued;
+
+    unsigned                         cache_variant:1;
+    unsigned                         waiting:1;
+} ngx_http_imaging_job_t;
+
+
+static ngx_http_imaging_job_t *ngx_http_imaging_scheduler_next(void);
+static void ngx_http_imaging_scheduler_run(ngx_event_t *ev);
+static void ngx_http_imaging_scheduler_cleanup(void *data);
+
+
+/* per worker */
+static ngx_queue_t                      ngx_http_imaging_jobs;
+static ngx_event_t                      ngx_http_imaging_scheduler_event;
+static ngx_http_imaging_scheduler_stats_t  ngx_http_imaging_scheduler_stat;
+static ngx_uint_t                       ngx_http_imaging_scheduler_on;
+static ngx_msec_t                       ngx_http_imaging_scheduler_aging;
+
+
+/*
+ * imaging_scheduler [aging=time] [backlog=number];
+ */
+char *
+ngx_http_imaging_scheduler(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_imaging_main_conf_t *imcf = conf;
+
+    ngx_str_t   *value, s;
+    ngx_int_t    n;
+    ngx_msec_t   aging;
+    ngx_uint_t   i;
+
+    if (imcf->scheduler) {
+        return "is duplicate";
+    }
+
+    imcf->scheduler = 1;
+    imcf->scheduler_aging = 1000;
+    imcf->scheduler_backlog = 0;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "aging=", 6) == 0) {
+
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            aging = ngx_parse_time(&s, 0);
+            if (aging == (ngx_msec_t) NGX_ERROR || aging == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid aging value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            imcf->scheduler_aging = aging;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "backlog=", 8) == 0) {
+
+            n = ngx_atoi(value[i].data + 8, value[i].len - 8);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid backlog value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            imcf->scheduler_backlog = n;
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+/*
+ * Sets up the worker's queue (from the init process handler).
+ */
+void
+ngx_http_imaging_scheduler_init(ngx_cycle_t *cycle,
+    ngx_http_imaging_main_conf_t *imcf)
+{
+    ngx_queue_init(&ngx_http_imaging_jobs);
+
+    ngx_http_imaging_scheduler_event.handler = ngx_http_imaging_scheduler_run;
+    ngx_http_imaging_scheduler_event.log = cycle->log;
+    /*
+     * a graceful shutdown waits for the queue to drain (the timer is only
+     * set while jobs are queued), every queued request is answered
+     */
+    ngx_http_imaging_scheduler_event.cancelable = 0;
+
+    ngx_http_imaging_scheduler_aging = imcf->scheduler_aging;
+    ngx_http_imaging_scheduler_on = 1;
+}
+
+
+/*
+ * Queues the render of the variant at path. entry is the variant's (missed)
+ * entry in the variant cache or NULL.
+ *
+ * Returns NGX_DONE, the request is finished once its job has run.
+ */
+ngx_int_t
+ngx_http_imaging_schedule(ngx_http_request_t *r, ngx_str_t *path,
+    ngx_http_imaging_cache_entry_t *entry, char *hash)
+{
+    ngx_pool_cleanup_t            *cln;
+    ngx_http_imaging_job_t        *job;
+    ngx_http_imaging_main_conf_t  *imcf;
+
+    imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+    job = ngx_pcalloc(r->pool, sizeof(ngx_http_imaging_job_t));
+    if (job == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cln->handler = ngx_http_imaging_scheduler_cleanup;
+    cln->data = job;
+
+    job->request = r;
+    job->path = *path;
+    job->hash = hash;
+
+    if (entry != NULL) {
+        job->entry = *entry;
+        job->cache_variant = 1;
+    }
+
+    job->cost = imaging_estimate_cost((const char *) path->data);
+    job->queued = ngx_current_msec;
+    job->waiting = 1;
+
+    ngx_queue_insert_tail(&ngx_http_imaging_jobs, &job->queue);
+
+    ngx_http_imaging_scheduler_stat.queued++;
+    ngx_http_imaging_scheduler_stat.depth++;
+
+    if (ngx_http_imaging_scheduler_stat.depth
+        > ngx_http_imaging_scheduler_stat.max_depth)
+    {
+        ngx_http_imaging_scheduler_stat.max_depth =
+            ngx_http_imaging_scheduler_stat.depth;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "imaging scheduled \"%V\" cost: %.0f", path, job->cost);
+
+    /* let idle workers take the next connections */
+    if (imcf->scheduler_backlog
+        && ngx_http_imaging_scheduler_stat.depth > imcf->scheduler_backlog)
+    {
+        ngx_accept_disabled = ngx_http_imaging_scheduler_stat.depth
+                              - imcf->scheduler_backlog;
+    }
+
+    /* run after the events of this turn (the rest of the burst) are queued */
+    if (!ngx_http_imaging_scheduler_event.timer_set) {
+        ngx_add_timer(&ngx_http_imaging_scheduler_event, 0);
+    }
+
+    r->main->count++;
+
+    return NGX_DONE;
+}
+
+
+/*
+ * Fills stats with the worker's scheduler counters.
+ *
+ * Returns 0 if the scheduler isn't in use.
+ */
+ngx_uint_t
+ngx_http_imaging_scheduler_stats(ngx_http_imaging_scheduler_stats_t *stats)
+{
+    if (!ngx_http_imaging_scheduler_on) {
+        return 0;
+    }
+
+    *stats = ngx_http_imaging_scheduler_stat;
+
+    return 1;
+}
+
+
+/*
+ * The job with the lowest aged cost.
+ */
+static ngx_http_imaging_job_t *
+ngx_http_imaging_scheduler_next(void)
+{
+    double                   score, best_score;
+    ngx_queue_t             *q;
+    ngx_http_imaging_job_t  *job, *best;
+
+    best = NULL;
+    best_score = 0.0;
+
+    for (q = ngx_queue_head(&ngx_http_imaging_jobs);
+         q != ngx_queue_sentinel(&ngx_http_imaging_jobs);
+         q = ngx_queue_next(q))
+    {
+        job = ngx_queue_data(q, ngx_http_imaging_job_t, queue);
+
+        score = job->cost
+                / (1.0 + (double) (ngx_current_msec - job->queued)
+                         / ngx_http_imaging_scheduler_aging);
+
+        /* ties go to the oldest */
+        if (best == NULL || score < best_score) {
+            best = job;
+            best_score = score;
+        }
+    }
+
+    return best;
+}
+
+
+/*
+ * Runs a single job, the next one is run on the next turn of the event
+ * loop so new requests are queued (& compete) in between.
+ */
+static void
+ngx_http_imaging_scheduler_run(ngx_event_t *ev)
+{
+    ngx_int_t                      rc;
+    ngx_msec_t                     wait;
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_imaging_job_t        *job;
+
+    if (ngx_queue_empty(&ngx_http_imaging_jobs)) {
+        return;
+    }
+
+    job = ngx_http_imaging_scheduler_next();
+
+    ngx_queue_remove(&job->queue);
+    job->waiting = 0;
+
+    ngx_http_imaging_scheduler_stat.depth--;
+    ngx_http_imaging_scheduler_stat.rendered++;
+
+    wait = ngx_current_msec - job->queued;
+    ngx_http_imaging_scheduler_stat.wait_total += wait;
+
+    if (wait > ngx_http_imaging_scheduler_stat.wait_max) {
+        ngx_http_imaging_scheduler_stat.wait_max = wait;
+    }
+
+    if (!ngx_queue_empty(&ngx_http_imaging_jobs)) {
+        ngx_add_timer(ev, 0);
+    }
+
+    r = job->request;
+    c = r->connection;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "imaging render \"%V\" waited: %M", &job->path, wait);
+
+    rc = ngx_http_imaging_render(r, &job->path,
+                                 job->cache_variant ? &job->entry : NULL,
+                                 job->hash);
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+/*
+ * Drops the job of a request which is freed before it ran.
+ */
+static void
+ngx_http_imaging_scheduler_cleanup(void *data)
+{
+    ngx_http_imaging_job_t *job = data;
+
+    if (!job->waiting) {
+        return;
+    }
+
+    ngx_queue_remove(&job->queue);
+    job->waiting = 0;
+
+    ngx_http_imaging_scheduler_stat.depth--;
+}
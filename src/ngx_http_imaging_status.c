@@ -0,0 +1,295 @@
+
+/*
+ * Copyright (C) Kit C. Dallege
+ *
+ * Status page (like stub_status) with the counters of the worker process
+ * which serves the request.
+ *
+ * Eg:
+ *  location = /imaging_status { imaging_status; }
+ */
+#include "ngx_http_imaging_module.h"
+
+/* pixel buffer pool */
+#include "pool.h"
+
+/* memory mapped originals */
+#include "mmap.h"
+
+
+#define NGX_HTTP_IMAGING_STATUS_LINE_LEN  (8 * NGX_ATOMIC_T_LEN + 128)
+#define NGX_HTTP_IMAGING_STATUS_LINES     11
+
+static ngx_int_t ngx_http_imaging_status_handler(ngx_http_request_t *r);
+static u_char *ngx_http_imaging_status_pool(u_char *p);
+static u_char *ngx_http_imaging_status_scheduler(u_char *p);
+static u_char *ngx_http_imaging_status_mmap(u_char *p);
+static u_char *ngx_http_imaging_status_negative(u_char *p,
+    ngx_http_request_t *r);
+static u_char *ngx_http_imaging_status_prerender(u_char *p,
+    ngx_http_request_t *r);
+static u_char *ngx_http_imaging_status_peers(u_char *p);
+static u_char *ngx_http_imaging_status_helpers(u_char *p);
+static u_char *ngx_http_imaging_status_abort(u_char *p);
+
+
+/*
+ * Register `ngx_http_imaging_status_handler` with the local configuration.
+ */
+char *
+ngx_http_imaging_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_imaging_status_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_imaging_status_handler(ngx_http_request_t *r)
+{
+    size_t        size;
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t   out;
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.content_type_lowcase = NULL;
+
+    if (r->method == NGX_HTTP_HEAD) {
+        r->headers_out.status = NGX_HTTP_OK;
+
+        rc = ngx_http_send_header(r);
+
+        if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+            return rc;
+        }
+    }
+
+    size = NGX_HTTP_IMAGING_STATUS_LINES * NGX_HTTP_IMAGING_STATUS_LINE_LEN;
+
+    b = ngx_create_temp_buf(r->pool, size);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    out.buf = b;
+    out.next = NULL;
+
+    b->last = ngx_sprintf(b->last, "worker: %P\n", ngx_pid);
+    b->last = ngx_http_imaging_status_pool(b->last);
+    b->last = ngx_http_imaging_status_scheduler(b->last);
+    b->last = ngx_http_imaging_status_mmap(b->last);
+    b->last = ngx_http_imaging_status_negative(b->last, r);
+    b->last = ngx_http_imaging_status_prerender(b->last, r);
+    b->last = ngx_http_imaging_status_peers(b->last);
+    b->last = ngx_http_imaging_status_helpers(b->last);
+    b->last = ngx_http_imaging_status_abort(b->last);
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/*
+ * Pixel buffer pool counters (see imaging_buffer_pool), 2 lines.
+ */
+static u_char *
+ngx_http_imaging_status_pool(u_char *p)
+{
+    imaging_pool_stats_t  stats;
+
+    if (!imaging_pool_stats(&stats)) {
+        return ngx_sprintf(p, "pool: off\n");
+    }
+
+    p = ngx_sprintf(p, "pool allocs: %uL hits: %uL misses: %uL "
+                    "huge_pages: %uL releases: %uL passthrough: %uL\n",
+                    (uint64_t) stats.allocs, (uint64_t) stats.hits,
+                    (uint64_t) stats.misses, (uint64_t) stats.huge_pages,
+                    (uint64_t) stats.releases, (uint64_t) stats.passthrough);
+
+    return ngx_sprintf(p, "pool bytes used: %uz cached: %uz max: %uz\n",
+                       stats.bytes_used, stats.bytes_cached,
+                       stats.max_cached);
+}
+
+
+/*
+ * Render scheduler counters (see imaging_scheduler), 2 lines.
+ */
+static u_char *
+ngx_http_imaging_status_scheduler(u_char *p)
+{
+    ngx_msec_t                          wait_avg;
+    ngx_http_imaging_scheduler_stats_t  stats;
+
+    if (!ngx_http_imaging_scheduler_stats(&stats)) {
+        return ngx_sprintf(p, "scheduler: off\n");
+    }
+
+    wait_avg = stats.rendered ? stats.wait_total / stats.rendered : 0;
+
+    p = ngx_sprintf(p, "scheduler queued: %ui rendered: %ui "
+                    "depth: %ui max depth: %ui\n",
+                    stats.queued, stats.rendered,
+                    stats.depth, stats.max_depth);
+
+    return ngx_sprintf(p, "scheduler wait avg: %Mms max: %Mms\n",
+                       wait_avg, stats.wait_max);
+}
+
+
+/*
+ * Memory mapped originals counters (see imaging_mmap), 1 line.
+ */
+static u_char *
+ngx_http_imaging_status_mmap(u_char *p)
+{
+    imaging_mmap_stats_t  stats;
+
+    if (!imaging_mmap_stats(&stats)) {
+        return ngx_sprintf(p, "mmap: off\n");
+    }
+
+    return ngx_sprintf(p, "mmap opens: %uL hits: %uL maps: %uL unmaps: %uL "
+                       "failures: %uL bytes mapped: %uz max: %uz\n",
+                       (uint64_t) stats.opens, (uint64_t) stats.hits,
+                       (uint64_t) stats.maps, (uint64_t) stats.unmaps,
+                       (uint64_t) stats.failures, stats.bytes_mapped,
+                       stats.max_cached);
+}
+
+
+/*
+ * Negative cache counters (see imaging_negative_cache, shared by all
+ * workers), 1 line.
+ */
+static u_char *
+ngx_http_imaging_status_negative(u_char *p, ngx_http_request_t *r)
+{
+    ngx_uint_t                          n;
+    ngx_http_imaging_main_conf_t       *imcf;
+    ngx_http_imaging_negative_stats_t   stats;
+
+    imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+    if (imcf->negative == NULL) {
+        return ngx_sprintf(p, "negative: off\n");
+    }
+
+    ngx_http_imaging_negative_stats(imcf->negative, &stats);
+
+    p = ngx_sprintf(p, "negative entries: %ui", stats.count);
+
+    for (n = IMAGING_FAILURE_MISSING; n < NGX_HTTP_IMAGING_FAILURES; n++) {
+        p = ngx_sprintf(p, " %V stored: %ui hits: %ui",
+                        ngx_http_imaging_negative_reason(n),
+                        stats.stored[n], stats.hits[n]);
+    }
+
+    return ngx_sprintf(p, "\n");
+}
+
+
+/*
+ * Rendering ahead counters (see imaging_prerender, shared by all workers),
+ * 1 line.
+ */
+static u_char *
+ngx_http_imaging_status_prerender(u_char *p, ngx_http_request_t *r)
+{
+    ngx_http_imaging_main_conf_t        *imcf;
+    ngx_http_imaging_prerender_stats_t   stats;
+
+    imcf = ngx_http_get_module_main_conf(r, ngx_http_imaging_module);
+
+    if (imcf->prerender == NULL) {
+        return ngx_sprintf(p, "prerender: off\n");
+    }
+
+    ngx_http_imaging_prerender_stats(imcf->prerender, &stats);
+
+    return ngx_sprintf(p, "prerender tracked: %ui prerendered: %ui "
+                       "siblings: %ui failures: %ui\n",
+                       stats.tracked, stats.prerendered, stats.siblings,
+                       stats.failures);
+}
+
+
+/*
+ * Peer counters (see imaging_peers), 1 line.
+ */
+static u_char *
+ngx_http_imaging_status_peers(u_char *p)
+{
+    ngx_http_imaging_peers_stats_t  stats;
+
+    if (!ngx_http_imaging_peers_stats(&stats)) {
+        return ngx_sprintf(p, "peers: off\n");
+    }
+
+    return ngx_sprintf(p, "peers owned: %ui from peers: %ui forwarded: %ui "
+                       "fetched: %ui fallbacks: %ui\n",
+                       stats.owned, stats.from_peers, stats.forwarded,
+                       stats.fetched, stats.fallbacks);
+}
+
+
+/*
+ * Render helper counters (see imaging_helpers), 1 line.
+ */
+static u_char *
+ngx_http_imaging_status_helpers(u_char *p)
+{
+    ngx_http_imaging_helpers_stats_t  stats;
+
+    if (!ngx_http_imaging_helpers_stats(&stats)) {
+        return ngx_sprintf(p, "helpers: off\n");
+    }
+
+    return ngx_sprintf(p, "helpers: %ui busy: %ui queued: %ui waiting: %ui "
+                       "rendered: %ui crashes: %ui recycled: %ui\n",
+                       stats.helpers, stats.busy, stats.queued,
+                       stats.waiting, stats.rendered, stats.crashes,
+                       stats.recycled);
+}
+
+
+/*
+ * Aborted render counters (see imaging_render_timeout), 1 line.
+ */
+static u_char *
+ngx_http_imaging_status_abort(u_char *p)
+{
+    ngx_http_imaging_abort_stats_t  stats;
+
+    ngx_http_imaging_abort_stats(&stats);
+
+    return ngx_sprintf(p, "aborted closed: %ui timeouts: %ui wasted: %Mms\n",
+                       stats.closed, stats.timeouts, stats.wasted);
+}
@@ -0,0 +1,250 @@
+/*
+ * pool.c
+ *
+ * A pool of large (pixel) buffers for a worker process.
+ *
+ * Every action creates a new full size image & destroys the previous one,
+ * which makes malloc map & unmap multi megabyte blocks over and over. Here
+ * buffers of IMAGING_POOL_MIN_SIZE and up are mapped directly, rounded up
+ * to one of a set of size classes (4 per doubling), and freed buffers are
+ * kept on a free list per class so the next request of that class reuses
+ * them. Smaller allocations are left to malloc.
+ *
+ * GraphicsMagick may allocate from OpenMP threads so the pool is locked.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "pool.h"
+
+// 4 classes per doubling from IMAGING_POOL_MIN_SIZE up to 1GB.
+#define IMAGING_POOL_STEPS      4
+#define IMAGING_POOL_CLASSES    (12 * IMAGING_POOL_STEPS + 1)
+// block header in front of every buffer (keeps buffers 64 byte aligned).
+#define IMAGING_POOL_HEADER     64
+#define IMAGING_POOL_MAGIC      0x696d67706f6f6cUL
+#define IMAGING_POOL_HUGE_PAGE  (2 * 1024 * 1024)
+
+typedef struct imaging_pool_block_s imaging_pool_block_t;
+
+struct imaging_pool_block_s {
+    unsigned long           magic;
+    imaging_pool_block_t   *self;       // tells a block from malloc memory
+    imaging_pool_block_t   *next;       // free list
+    size_t                  size;       // mapped bytes (header included)
+    int                     size_class; // -1 when too large to pool
+    int                     huge;
+};
+
+typedef struct {
+    int                     enabled;
+    int                     huge_pages;
+    size_t                  page_size;
+    imaging_pool_block_t   *free[IMAGING_POOL_CLASSES];
+    imaging_pool_stats_t    stats;
+    pthread_mutex_t         lock;
+} imaging_pool_t;
+
+static imaging_pool_t imaging_pool = {
+    0, 0, 4096, { NULL }, { 0 }, PTHREAD_MUTEX_INITIALIZER
+};
+
+/******************************************************************
+ * Utils
+ *****************************************************************/
+/*
+ * Bytes usable in size_class.
+ */
+static size_t imaging_pool_class_size(int size_class) {
+    int step = size_class % IMAGING_POOL_STEPS;
+    return ((size_t)IMAGING_POOL_MIN_SIZE << (size_class / IMAGING_POOL_STEPS)) /
+        IMAGING_POOL_STEPS * (IMAGING_POOL_STEPS + step);
+}
+
+/*
+ * Smallest class holding size or -1 when it's too large to pool.
+ */
+static int imaging_pool_class(size_t size) {
+    int size_class;
+    for (size_class = 0; size_class < IMAGING_POOL_CLASSES; size_class++) {
+        if (imaging_pool_class_size(size_class) >= size) {
+            return size_class;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the block of a pointer from imaging_pool_alloc or NULL if it
+ * came from malloc. Blocks are page aligned so the header is only read
+ * when it lies on the same page as ptr.
+ */
+static imaging_pool_block_t * imaging_pool_block(void *ptr) {
+    imaging_pool_block_t *block;
+
+    if (((uintptr_t)ptr & (imaging_pool.page_size - 1)) != IMAGING_POOL_HEADER) {
+        return NULL;
+    }
+    block = (imaging_pool_block_t *)((char *)ptr - IMAGING_POOL_HEADER);
+    if (block->magic != IMAGING_POOL_MAGIC || block->self != block) {
+        return NULL;
+    }
+    return block;
+}
+
+/*
+ * Maps a new block of at least size bytes (header included).
+ */
+static imaging_pool_block_t * imaging_pool_map(size_t size, int size_class) {
+    imaging_pool_block_t *block = MAP_FAILED;
+    int huge = 0;
+
+#ifdef MAP_HUGETLB
+    if (imaging_pool.huge_pages && size >= IMAGING_POOL_HUGE_PAGE) {
+        size = (size + IMAGING_POOL_HUGE_PAGE - 1) & ~((size_t)IMAGING_POOL_HUGE_PAGE - 1);
+        block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = (block != MAP_FAILED);
+    }
+#endif
+    if (block == MAP_FAILED) {
+        size = (size + imaging_pool.page_size - 1) & ~(imaging_pool.page_size - 1);
+        block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == MAP_FAILED) {
+            return NULL;
+        }
+#ifdef MADV_HUGEPAGE
+        // no reserved huge pages, ask for transparent ones instead.
+        if (imaging_pool.huge_pages) {
+            (void) madvise(block, size, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    block->magic = IMAGING_POOL_MAGIC;
+    block->self = block;
+    block->next = NULL;
+    block->size = size;
+    block->size_class = size_class;
+    block->huge = huge;
+    return block;
+}
+
+/******************************************************************
+ * Public API
+ *****************************************************************/
+void imaging_pool_init(size_t max_cached, int huge_pages) {
+    long page_size = sysconf(_SC_PAGESIZE);
+
+    pthread_mutex_lock(&imaging_pool.lock);
+    imaging_pool.enabled = 1;
+    imaging_pool.huge_pages = huge_pages;
+    imaging_pool.page_size = page_size > 0 ? (size_t)page_size : 4096;
+    imaging_pool.stats.max_cached = max_cached;
+    pthread_mutex_unlock(&imaging_pool.lock);
+}
+
+void * imaging_pool_alloc(size_t size) {
+    imaging_pool_block_t *block = NULL;
+    int size_class;
+
+    if (!imaging_pool.enabled || size < IMAGING_POOL_MIN_SIZE) {
+        if (imaging_pool.enabled) {
+            __sync_fetch_and_add(&imaging_pool.stats.passthrough, 1);
+        }
+        return malloc(size);
+    }
+
+    size_class = imaging_pool_class(size);
+    pthread_mutex_lock(&imaging_pool.lock);
+    imaging_pool.stats.allocs++;
+    if (size_class >= 0 && imaging_pool.free[size_class] != NULL) {
+        block = imaging_pool.free[size_class];
+        imaging_pool.free[size_class] = block->next;
+        imaging_pool.stats.bytes_cached -= block->size;
+        imaging_pool.stats.bytes_used += block->size;
+        imaging_pool.stats.hits++;
+    }
+    pthread_mutex_unlock(&imaging_pool.lock);
+
+    if (block == NULL) {
+        // map outside of the lock, it's the slow part.
+        block = imaging_pool_map(IMAGING_POOL_HEADER +
+            (size_class >= 0 ? imaging_pool_class_size(size_class) : size), size_class);
+        if (block == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&imaging_pool.lock);
+        imaging_pool.stats.bytes_used += block->size;
+        imaging_pool.stats.misses++;
+        imaging_pool.stats.huge_pages += block->huge;
+        pthread_mutex_unlock(&imaging_pool.lock);
+    }
+
+    block->next = NULL;
+    return (char *)block + IMAGING_POOL_HEADER;
+}
+
+void * imaging_pool_realloc(void *ptr, size_t size) {
+    imaging_pool_block_t *block;
+    void *resized;
+
+    if (ptr == NULL) {
+        return imaging_pool_alloc(size);
+    }
+    block = imaging_pool_block(ptr);
+    if (block == NULL) {
+        return realloc(ptr, size);
+    }
+    if (size <= block->size - IMAGING_POOL_HEADER) {
+        return ptr;
+    }
+    resized = imaging_pool_alloc(size);
+    if (resized != NULL) {
+        memcpy(resized, ptr, block->size - IMAGING_POOL_HEADER);
+        imaging_pool_free(ptr);
+    }
+    return resized;
+}
+
+void imaging_pool_free(void *ptr) {
+    imaging_pool_block_t *block;
+    int keep;
+
+    if (ptr == NULL) {
+        return;
+    }
+    block = imaging_pool_block(ptr);
+    if (block == NULL) {
+        free(ptr);
+        return;
+    }
+
+    pthread_mutex_lock(&imaging_pool.lock);
+    imaging_pool.stats.bytes_used -= block->size;
+    keep = block->size_class >= 0 &&
+        imaging_pool.stats.bytes_cached + block->size <= imaging_pool.stats.max_cached;
+    if (keep) {
+        block->next = imaging_pool.free[block->size_class];
+        imaging_pool.free[block->size_class] = block;
+        imaging_pool.stats.bytes_cached += block->size;
+    } else {
+        imaging_pool.stats.releases++;
+    }
+    pthread_mutex_unlock(&imaging_pool.lock);
+
+    if (!keep) {
+        (void) munmap(block, block->size);
+    }
+}
+
+int imaging_pool_stats(imaging_pool_stats_t *stats) {
+    pthread_mutex_lock(&imaging_pool.lock);
+    *stats = imaging_pool.stats;
+    pthread_mutex_unlock(&imaging_pool.lock);
+    return imaging_pool.enabled;
+}
@@ -0,0 +1,60 @@
+/**
+ *  pool.h
+ *
+ *  Contains function prototypes for the pixel buffer pool.
+ */
+#ifndef _IMAGING_POOL_H_INCLUDED_
+#define _IMAGING_POOL_H_INCLUDED_
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Allocations smaller than this are left to malloc. */
+#define IMAGING_POOL_MIN_SIZE (256 * 1024)
+
+/* Counters of a (per process) pool. */
+typedef struct {
+    unsigned long   allocs;         // pooled allocations
+    unsigned long   hits;           // ... served by a recycled buffer
+    unsigned long   misses;         // ... which had to map a new buffer
+    unsigned long   huge_pages;     // ... mapped with explicit huge pages
+    unsigned long   releases;       // buffers unmapped (pool full/oversize)
+    unsigned long   passthrough;    // small allocations left to malloc
+    size_t          bytes_used;     // mapped bytes handed out
+    size_t          bytes_cached;   // mapped bytes kept for reuse
+    size_t          max_cached;     // limit of bytes_cached
+} imaging_pool_stats_t;
+
+/*
+ * Enables the pool for this process. Up to max_cached bytes of freed buffers
+ * are kept, by size class, for reuse. With huge_pages buffers are mapped
+ * with MAP_HUGETLB when possible (otherwise transparent huge pages are
+ * requested through madvise).
+ *
+ * Until this is called every allocation is left to malloc.
+ */
+void imaging_pool_init(size_t max_cached, int huge_pages);
+
+/*
+ * malloc/realloc/free replacements. imaging_pool_free & imaging_pool_realloc
+ * also accept memory which came from malloc, so they are safe to use as
+ * GraphicsMagick's allocation functions.
+ */
+void * imaging_pool_alloc(size_t size);
+void * imaging_pool_realloc(void *ptr, size_t size);
+void imaging_pool_free(void *ptr);
+
+/*
+ * Copies the counters of this process' pool into stats.
+ * Returns 1 if the pool is enabled otherwise 0.
+ */
+int imaging_pool_stats(imaging_pool_stats_t *stats);
+
+#ifdef  __cplusplus
+    }
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+/*
+ * pyramid.c
+ *
+ * Persistent multi-resolution pyramids of large originals.
+ *
+ * Level n of the pyramid of "photo.jpg" is the original downscaled by 2^n
+ * (with a Lanczos filter, from the nearest larger level kept), stored
+ * losslessly in the pyramid directory as "<sha1 of its path>.<2^n>.miff"
+ * (eg: "5d41...1b2e.4.miff"), out of reach of the clients of the original.
+ * Thumbnail, resize & scale actions then start from the smallest level
+ * which is still at least their size instead of the full size original.
+ *
+ * A level is built the first time it is needed and again once the
+ * original is newer than it. Levels are written to a temporary file &
+ * renamed into place, so concurrent builds don't see partial files.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "imaging.h"
+#include "pyramid.h"
+#include <openssl/sha.h>
+
+/******************************************************************
+ * Utils
+ *****************************************************************/
+/*
+ * Returns 1 if the level name exists & isn't older than original. Replacing
+ * the original (eg: renaming a new file over it) moves its ctime even when
+ * its mtime is older, so both count.
+ */
+static int imaging_pyramid_fresh(const char *original, const char *name) {
+    struct stat original_stat, level_stat;
+
+    return stat(original, &original_stat) == 0 &&
+           stat(name, &level_stat) == 0 &&
+           level_stat.st_mtime >= original_stat.st_mtime &&
+           level_stat.st_mtime >= original_stat.st_ctime;
+}
+
+/*
+ * Writes image as the level name (through a temporary file).
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_pyramid_write(const ImageInfo *image_info, Image *image,
+    const char *name)
+{
+    ImageInfo *level_info;
+    char tmp[MaxTextExtent];
+    int status;
+
+    snprintf(tmp, sizeof(tmp), "%s.%ld", name, (long)getpid());
+    level_info = CloneImageInfo(image_info);
+    snprintf(level_info->filename, MaxTextExtent, "miff:%s", tmp);
+    (void) strcpy(image->filename, level_info->filename);
+    status = WriteImage(level_info, image) && rename(tmp, name) == 0;
+    if (!status) {
+        (void) unlink(tmp);
+    }
+    DestroyImageInfo(level_info);
+    return status;
+}
+
+/*
+ * Reads the level name as it is in the pyramid directory.
+ */
+static Image * imaging_pyramid_read(const ImageInfo *image_info,
+    const char *name, ExceptionInfo *exception)
+{
+    Image *image;
+    ImageInfo *level_info;
+
+    level_info = CloneImageInfo(image_info);
+    snprintf(level_info->filename, MaxTextExtent, "miff:%s", name);
+    image = ReadImage(level_info, exception);
+    DestroyImageInfo(level_info);
+    return image;
+}
+
+/*
+ * Builds level want of the pyramid (in dir) of the columns x rows original
+ * image_info->filename, from the nearest larger level which is fresh or
+ * the original itself. Levels in between aren't built.
+ * Returns level want or (Image *)NULL on failure.
+ */
+static Image * imaging_pyramid_build(const ImageInfo *image_info,
+    const char *dir, unsigned long columns, unsigned long rows, int want,
+    ExceptionInfo *exception)
+{
+    Image *image = (Image *)NULL;
+    Image *level_image;
+    ExceptionInfo level_exception;
+    char name[MaxTextExtent];
+    int level;
+
+    for (level = want - 1; level > 0 && image == (Image *)NULL; level--) {
+        imaging_pyramid_name(dir, image_info->filename, level, name);
+        if (imaging_pyramid_fresh(image_info->filename, name)) {
+            GetExceptionInfo(&level_exception);
+            image = imaging_pyramid_read(image_info, name, &level_exception);
+            DestroyExceptionInfo(&level_exception);
+        }
+    }
+    if (image == (Image *)NULL) {
+        image = imaging_read_image(image_info, exception);
+        if (image == (Image *)NULL) {
+            return image;
+        }
+    }
+
+    level_image = ResizeImage(image, columns >> want, rows >> want,
+        LanczosFilter, 1.0, exception);
+    DestroyImage(image);
+    if (level_image != (Image *)NULL) {
+        imaging_pyramid_name(dir, image_info->filename, want, name);
+        (void) imaging_pyramid_write(image_info, level_image, name);
+    }
+    return level_image;
+}
+
+/******************************************************************
+ * Public API
+ *****************************************************************/
+void imaging_pyramid_name(const char *dir, const char *original, int level,
+    char *name)
+{
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    char hex[SHA_DIGEST_LENGTH * 2 + 1];
+    int i;
+
+    SHA1((const unsigned char *)original, strlen(original), digest);
+    for (i = 0; i < SHA_DIGEST_LENGTH; i++) {
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    }
+    snprintf(name, MaxTextExtent, "%s/%s.%d.miff", dir, hex, 1 << level);
+}
+
+Image * imaging_pyramid_level(const ImageInfo *image_info, const char *dir,
+    unsigned long columns, unsigned long rows,
+    unsigned long width, unsigned long height,
+    ExceptionInfo *exception)
+{
+    Image *image;
+    char name[MaxTextExtent];
+    int level = 0;
+
+    // the smallest level which is still at least width x height.
+    while (level < IMAGING_PYRAMID_MAX_LEVELS &&
+           (columns >> (level + 1)) >= width && (rows >> (level + 1)) >= height &&
+           (columns >> (level + 1)) >= IMAGING_PYRAMID_MIN_SIZE &&
+           (rows >> (level + 1)) >= IMAGING_PYRAMID_MIN_SIZE) {
+        level++;
+    }
+    if (level == 0) {
+        return (Image *)NULL;
+    }
+
+    imaging_pyramid_name(dir, image_info->filename, level, name);
+    if (imaging_pyramid_fresh(image_info->filename, name)) {
+        image = imaging_pyramid_read(image_info, name, exception);
+        if (image != (Image *)NULL) {
+            return image;
+        }
+    }
+    return imaging_pyramid_build(image_info, dir, columns, rows, level, exception);
+}
@@ -0,0 +1,46 @@
+/**
+ *  pyramid.h
+ *
+ *  Contains function prototypes for the persistent pyramids of originals.
+ */
+#ifndef _IMAGING_PYRAMID_H_INCLUDED_
+#define _IMAGING_PYRAMID_H_INCLUDED_
+
+#include "imaging.h"
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Levels (1/2, 1/4 ... 1/64) kept per original at most. */
+#define IMAGING_PYRAMID_MAX_LEVELS 6
+
+/* Levels whose shorter side would be smaller than this aren't kept. */
+#define IMAGING_PYRAMID_MIN_SIZE 64
+
+/*
+ * Sets name (MaxTextExtent chars) to the file of level (1: 1/2, 2: 1/4 ...)
+ * of the pyramid of original kept in the directory dir.
+ */
+void imaging_pyramid_name(const char *dir, const char *original, int level,
+    char *name);
+
+/*
+ * Returns the smallest level of the pyramid (kept in the directory dir) of
+ * the columns x rows original image_info->filename which is still at least
+ * width x height, building that level first when it isn't there yet or the
+ * original is newer than it.
+ *
+ * Returns (Image *)NULL when no level is small enough to be worth it (or
+ * on failure), in which case the original should be read instead.
+ */
+Image * imaging_pyramid_level(const ImageInfo *image_info, const char *dir,
+    unsigned long columns, unsigned long rows,
+    unsigned long width, unsigned long height,
+    ExceptionInfo *exception);
+
+#ifdef  __cplusplus
+    }
+#endif
+
+#endif
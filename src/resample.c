@@ -0,0 +1,759 @@
+/*
+ * resample.c
+ *
+ * A separable resampler (and gaussian blur/unsharp mask filters) for 8-bit,
+ * 4 channel pixel buffers.
+ *
+ * Filter weights are precomputed once per axis in fixed point. The
+ * horizontal pass runs row by row into an intermediate buffer, the vertical
+ * pass then walks that buffer in column blocks so the rows under the filter
+ * stay in cache. SSE2/AVX2 kernels are picked at runtime when the cpu has
+ * them, otherwise plain C is used.
+ *
+ * Streams run the same passes one source row at a time: each row is
+ * resampled horizontally into a ring of as many rows as the vertical filter
+ * has taps, and output rows are computed as soon as the rows under them
+ * are in the ring.
+ *
+ * Blurs are the same two passes with gaussian weights & equal in/out
+ * sizes; sharpening adds the difference to the blurred image back onto the
+ * original (an unsharp mask).
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "resample.h"
+#include "pool.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGING_HAVE_X86 1
+#include <immintrin.h>
+#define IMAGING_TARGET(isa) __attribute__((target(isa)))
+#else
+#define IMAGING_HAVE_X86 0
+#endif
+
+// weights are fixed point with this many fractional bits.
+#define IMAGING_PRECISION_BITS 14
+// bytes of each row handled per block by the vertical pass.
+#define IMAGING_COLUMN_BLOCK 1024
+
+#define IMAGING_KERNELS_C    0
+#define IMAGING_KERNELS_SSE2 1
+#define IMAGING_KERNELS_AVX2 2
+
+/*
+ * Contributions of the input pixels to every output pixel along one axis.
+ */
+typedef struct {
+    unsigned long   size;       // number of output pixels
+    unsigned long   taps;       // stride of weights per output pixel
+    long           *start;      // first input pixel per output pixel
+    long           *count;      // number of input pixels per output pixel
+    short          *weights;    // size * taps weights
+} imaging_contrib_t;
+
+struct imaging_resample_stream_s {
+    imaging_contrib_t       horizontal, vertical;
+    unsigned char          *window;     // vertical.taps horizontally resampled rows
+    const unsigned char   **rows;       // rows under the filter of the next output row
+    size_t                  stride;     // bytes per output row
+    unsigned long           src_height;
+    unsigned long           written;    // source rows written
+    unsigned long           read;       // output rows read
+};
+
+static int imaging_kernels = -1;
+
+/******************************************************************
+ * Filters
+ *****************************************************************/
+static double imaging_filter_box(double x) {
+    return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+}
+
+static double imaging_filter_triangle(double x) {
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static double imaging_sinc(double x) {
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x = x * M_PI;
+    return sin(x) / x;
+}
+
+static double imaging_filter_lanczos(double x) {
+    return (x > -3.0 && x < 3.0) ? imaging_sinc(x) * imaging_sinc(x / 3.0) : 0.0;
+}
+
+/******************************************************************
+ * Weights
+ *****************************************************************/
+static void imaging_contrib_free(imaging_contrib_t *contrib) {
+    free(contrib->start);
+    free(contrib->count);
+    free(contrib->weights);
+}
+
+/*
+ * Precomputes the fixed point weights for resampling in_size pixels into
+ * out_size pixels. Returns 1 if successful otherwise 0.
+ */
+static int imaging_contrib_init(imaging_contrib_t *contrib,
+    unsigned long in_size, unsigned long out_size, imaging_filter_t filter)
+{
+    double (*func)(double);
+    double support, scale, filter_scale, center, sum;
+    double *k;
+    long x, xmin, xmax;
+    unsigned long i;
+
+    switch (filter) {
+    case IMAGING_FILTER_BOX:
+        func = imaging_filter_box;
+        support = 0.5;
+        break;
+    case IMAGING_FILTER_TRIANGLE:
+        func = imaging_filter_triangle;
+        support = 1.0;
+        break;
+    default:
+        func = imaging_filter_lanczos;
+        support = 3.0;
+        break;
+    }
+
+    // widen the filter when shrinking so every input pixel contributes.
+    scale = (double)in_size / out_size;
+    filter_scale = scale < 1.0 ? 1.0 : scale;
+    support = support * filter_scale;
+
+    contrib->size = out_size;
+    contrib->taps = (unsigned long)ceil(support) * 2 + 1;
+    contrib->start = malloc(out_size * sizeof(long));
+    contrib->count = malloc(out_size * sizeof(long));
+    contrib->weights = calloc(out_size * contrib->taps, sizeof(short));
+    k = malloc(contrib->taps * sizeof(double));
+    if (contrib->start == NULL || contrib->count == NULL ||
+        contrib->weights == NULL || k == NULL) {
+        imaging_contrib_free(contrib);
+        free(k);
+        return 0;
+    }
+
+    for (i = 0; i < out_size; i++) {
+        center = (i + 0.5) * scale;
+        xmin = (long)(center - support + 0.5);
+        if (xmin < 0) {
+            xmin = 0;
+        }
+        xmax = (long)(center + support + 0.5);
+        if (xmax > (long)in_size) {
+            xmax = in_size;
+        }
+        xmax -= xmin;
+        if (xmax > (long)contrib->taps) {
+            xmax = contrib->taps;
+        }
+
+        sum = 0.0;
+        for (x = 0; x < xmax; x++) {
+            k[x] = func((x + xmin - center + 0.5) / filter_scale);
+            sum += k[x];
+        }
+        // normalize & convert to fixed point.
+        for (x = 0; x < xmax; x++) {
+            if (sum != 0.0) {
+                k[x] /= sum;
+            }
+            contrib->weights[i * contrib->taps + x] =
+                (short)lrint(k[x] * (1 << IMAGING_PRECISION_BITS));
+        }
+        contrib->start[i] = xmin;
+        contrib->count[i] = xmax;
+    }
+
+    free(k);
+    return 1;
+}
+
+/*
+ * Precomputes the fixed point weights of a gaussian of sigma over size
+ * pixels (size in & out), renormalized where it is cut off at the edges.
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_contrib_gaussian(imaging_contrib_t *contrib,
+    unsigned long size, double sigma)
+{
+    double *k;
+    double sum;
+    long x, xmin, xmax, radius;
+    unsigned long i;
+
+    radius = (long)ceil(sigma * 3.0);
+    contrib->size = size;
+    contrib->taps = radius * 2 + 1;
+    contrib->start = malloc(size * sizeof(long));
+    contrib->count = malloc(size * sizeof(long));
+    contrib->weights = calloc(size * contrib->taps, sizeof(short));
+    k = malloc(contrib->taps * sizeof(double));
+    if (contrib->start == NULL || contrib->count == NULL ||
+        contrib->weights == NULL || k == NULL) {
+        imaging_contrib_free(contrib);
+        free(k);
+        return 0;
+    }
+
+    for (i = 0; i < size; i++) {
+        xmin = (long)i - radius;
+        if (xmin < 0) {
+            xmin = 0;
+        }
+        xmax = (long)i + radius + 1;
+        if (xmax > (long)size) {
+            xmax = size;
+        }
+        xmax -= xmin;
+
+        sum = 0.0;
+        for (x = 0; x < xmax; x++) {
+            k[x] = exp(-((double)(x + xmin - (long)i) * (x + xmin - (long)i)) /
+                       (2.0 * sigma * sigma));
+            sum += k[x];
+        }
+        for (x = 0; x < xmax; x++) {
+            contrib->weights[i * contrib->taps + x] =
+                (short)lrint(k[x] / sum * (1 << IMAGING_PRECISION_BITS));
+        }
+        contrib->start[i] = xmin;
+        contrib->count[i] = xmax;
+    }
+
+    free(k);
+    return 1;
+}
+
+static inline unsigned char imaging_clip8(int value) {
+    value >>= IMAGING_PRECISION_BITS;
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+/*
+ * Packs two weights into the 16-bit pairs _mm_madd_epi16 expects.
+ */
+static inline int imaging_pack_weights(short k0, short k1) {
+    return (int)(((unsigned int)(unsigned short)k1 << 16) | (unsigned short)k0);
+}
+
+static inline int imaging_load32(const unsigned char *p) {
+    int value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+/******************************************************************
+ * Kernels: C
+ *****************************************************************/
+static void imaging_horizontal_c(const unsigned char *src, unsigned char *dst,
+    const imaging_contrib_t *contrib)
+{
+    unsigned long i;
+    long x;
+    int r, g, b, a;
+    const short *k;
+    const unsigned char *p;
+
+    for (i = 0; i < contrib->size; i++) {
+        r = g = b = a = 1 << (IMAGING_PRECISION_BITS - 1);
+        k = contrib->weights + i * contrib->taps;
+        p = src + contrib->start[i] * IMAGING_RESAMPLE_CHANNELS;
+        for (x = 0; x < contrib->count[i]; x++, p += IMAGING_RESAMPLE_CHANNELS) {
+            r += p[0] * k[x];
+            g += p[1] * k[x];
+            b += p[2] * k[x];
+            a += p[3] * k[x];
+        }
+        dst[0] = imaging_clip8(r);
+        dst[1] = imaging_clip8(g);
+        dst[2] = imaging_clip8(b);
+        dst[3] = imaging_clip8(a);
+        dst += IMAGING_RESAMPLE_CHANNELS;
+    }
+}
+
+/*
+ * Computes bytes [from, to) of one output row out of the rows under the
+ * filter with the given weights.
+ */
+static void imaging_vertical_c(const unsigned char **rows, const short *k,
+    long count, unsigned char *dst, size_t from, size_t to)
+{
+    size_t i;
+    long t;
+    int sum;
+
+    for (i = from; i < to; i++) {
+        sum = 1 << (IMAGING_PRECISION_BITS - 1);
+        for (t = 0; t < count; t++) {
+            sum += rows[t][i] * k[t];
+        }
+        dst[i] = imaging_clip8(sum);
+    }
+}
+
+/*
+ * dst = src + (src - dst) * amount, amount in 8.8 fixed point.
+ */
+static void imaging_unsharp_c(const unsigned char *src, unsigned char *dst,
+    int amount, size_t from, size_t to)
+{
+    size_t i;
+    int value;
+
+    for (i = from; i < to; i++) {
+        value = (src[i] * 256 + (src[i] - dst[i]) * amount + 128) >> 8;
+        dst[i] = value < 0 ? 0 : (value > 255 ? 255 : value);
+    }
+}
+
+/******************************************************************
+ * Kernels: SSE2
+ *****************************************************************/
+#if IMAGING_HAVE_X86
+IMAGING_TARGET("sse2")
+static void imaging_horizontal_sse2(const unsigned char *src,
+    unsigned char *dst, const imaging_contrib_t *contrib)
+{
+    unsigned long i;
+    long x, count;
+    const short *k;
+    const unsigned char *p;
+    __m128i sss, pix, w;
+    const __m128i zero = _mm_setzero_si128();
+
+    for (i = 0; i < contrib->size; i++) {
+        sss = _mm_set1_epi32(1 << (IMAGING_PRECISION_BITS - 1));
+        k = contrib->weights + i * contrib->taps;
+        p = src + contrib->start[i] * IMAGING_RESAMPLE_CHANNELS;
+        count = contrib->count[i];
+        // two pixels per step: interleave to r0 r1 g0 g1 b0 b1 a0 a1.
+        for (x = 0; x + 1 < count; x += 2, p += 2 * IMAGING_RESAMPLE_CHANNELS) {
+            pix = _mm_unpacklo_epi8(_mm_cvtsi32_si128(imaging_load32(p)),
+                                    _mm_cvtsi32_si128(imaging_load32(p + 4)));
+            pix = _mm_unpacklo_epi8(pix, zero);
+            w = _mm_set1_epi32(imaging_pack_weights(k[x], k[x + 1]));
+            sss = _mm_add_epi32(sss, _mm_madd_epi16(pix, w));
+        }
+        for (; x < count; x++, p += IMAGING_RESAMPLE_CHANNELS) {
+            pix = _mm_unpacklo_epi8(_mm_cvtsi32_si128(imaging_load32(p)), zero);
+            pix = _mm_unpacklo_epi16(pix, zero);
+            w = _mm_set1_epi32(imaging_pack_weights(k[x], 0));
+            sss = _mm_add_epi32(sss, _mm_madd_epi16(pix, w));
+        }
+        sss = _mm_srai_epi32(sss, IMAGING_PRECISION_BITS);
+        sss = _mm_packs_epi32(sss, sss);
+        sss = _mm_packus_epi16(sss, sss);
+        *(int *)dst = _mm_cvtsi128_si32(sss);
+        dst += IMAGING_RESAMPLE_CHANNELS;
+    }
+}
+
+IMAGING_TARGET("sse2")
+static void imaging_vertical_sse2(const unsigned char **rows, const short *k,
+    long count, unsigned char *dst, size_t from, size_t to)
+{
+    size_t i = from;
+    long t;
+    __m128i s0, s1, s2, s3, a, b, lo, hi, w;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i half = _mm_set1_epi32(1 << (IMAGING_PRECISION_BITS - 1));
+
+    for (; i + 16 <= to; i += 16) {
+        s0 = s1 = s2 = s3 = half;
+        // two rows per step: interleave their bytes and madd with both weights.
+        for (t = 0; t < count; t += 2) {
+            a = _mm_loadu_si128((const __m128i *)(rows[t] + i));
+            if (t + 1 < count) {
+                b = _mm_loadu_si128((const __m128i *)(rows[t + 1] + i));
+                w = _mm_set1_epi32(imaging_pack_weights(k[t], k[t + 1]));
+            } else {
+                b = zero;
+                w = _mm_set1_epi32(imaging_pack_weights(k[t], 0));
+            }
+            lo = _mm_unpacklo_epi8(a, b);
+            hi = _mm_unpackhi_epi8(a, b);
+            s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+            s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+            s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+            s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+        }
+        s0 = _mm_packs_epi32(_mm_srai_epi32(s0, IMAGING_PRECISION_BITS),
+                             _mm_srai_epi32(s1, IMAGING_PRECISION_BITS));
+        s2 = _mm_packs_epi32(_mm_srai_epi32(s2, IMAGING_PRECISION_BITS),
+                             _mm_srai_epi32(s3, IMAGING_PRECISION_BITS));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(s0, s2));
+    }
+    imaging_vertical_c(rows, k, count, dst, i, to);
+}
+
+IMAGING_TARGET("sse2")
+static void imaging_unsharp_sse2(const unsigned char *src, unsigned char *dst,
+    int amount, size_t from, size_t to)
+{
+    size_t i = from;
+    __m128i a, b, d, lo, hi;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(128);
+    // madd of (src, src - dst) pairs with (256, amount).
+    const __m128i w = _mm_set1_epi32(imaging_pack_weights(256, (short)amount));
+
+    for (; i + 16 <= to; i += 16) {
+        a = _mm_loadu_si128((const __m128i *)(src + i));
+        b = _mm_loadu_si128((const __m128i *)(dst + i));
+        // low 8 bytes.
+        d = _mm_sub_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        lo = _mm_unpacklo_epi8(a, zero);
+        lo = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(lo, d), w), round), 8),
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(lo, d), w), round), 8));
+        // high 8 bytes.
+        d = _mm_sub_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+        hi = _mm_unpackhi_epi8(a, zero);
+        hi = _mm_packs_epi32(
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(hi, d), w), round), 8),
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(hi, d), w), round), 8));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    imaging_unsharp_c(src, dst, amount, i, to);
+}
+
+/******************************************************************
+ * Kernels: AVX2
+ *****************************************************************/
+IMAGING_TARGET("avx2")
+static void imaging_vertical_avx2(const unsigned char **rows, const short *k,
+    long count, unsigned char *dst, size_t from, size_t to)
+{
+    size_t i = from;
+    long t;
+    __m256i s0, s1, s2, s3, a, b, lo, hi, w;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i half = _mm256_set1_epi32(1 << (IMAGING_PRECISION_BITS - 1));
+
+    // unpack/pack work within 128-bit lanes so the byte order comes back out.
+    for (; i + 32 <= to; i += 32) {
+        s0 = s1 = s2 = s3 = half;
+        for (t = 0; t < count; t += 2) {
+            a = _mm256_loadu_si256((const __m256i *)(rows[t] + i));
+            if (t + 1 < count) {
+                b = _mm256_loadu_si256((const __m256i *)(rows[t + 1] + i));
+                w = _mm256_set1_epi32(imaging_pack_weights(k[t], k[t + 1]));
+            } else {
+                b = zero;
+                w = _mm256_set1_epi32(imaging_pack_weights(k[t], 0));
+            }
+            lo = _mm256_unpacklo_epi8(a, b);
+            hi = _mm256_unpackhi_epi8(a, b);
+            s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(_mm256_unpacklo_epi8(lo, zero), w));
+            s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(_mm256_unpackhi_epi8(lo, zero), w));
+            s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(_mm256_unpacklo_epi8(hi, zero), w));
+            s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(_mm256_unpackhi_epi8(hi, zero), w));
+        }
+        s0 = _mm256_packs_epi32(_mm256_srai_epi32(s0, IMAGING_PRECISION_BITS),
+                                _mm256_srai_epi32(s1, IMAGING_PRECISION_BITS));
+        s2 = _mm256_packs_epi32(_mm256_srai_epi32(s2, IMAGING_PRECISION_BITS),
+                                _mm256_srai_epi32(s3, IMAGING_PRECISION_BITS));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_packus_epi16(s0, s2));
+    }
+    imaging_vertical_sse2(rows, k, count, dst, i, to);
+}
+#endif
+
+/******************************************************************
+ * Dispatch
+ *****************************************************************/
+static void imaging_detect_kernels(void) {
+    imaging_kernels = IMAGING_KERNELS_C;
+#if IMAGING_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        imaging_kernels = IMAGING_KERNELS_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        imaging_kernels = IMAGING_KERNELS_SSE2;
+    }
+#endif
+}
+
+const char * imaging_resample_kernels(void) {
+    static const char *names[] = { "c", "sse2", "avx2" };
+    if (imaging_kernels < 0) {
+        imaging_detect_kernels();
+    }
+    return names[imaging_kernels];
+}
+
+static void imaging_horizontal(const unsigned char *src, unsigned char *dst,
+    const imaging_contrib_t *contrib)
+{
+#if IMAGING_HAVE_X86
+    if (imaging_kernels >= IMAGING_KERNELS_SSE2) {
+        imaging_horizontal_sse2(src, dst, contrib);
+        return;
+    }
+#endif
+    imaging_horizontal_c(src, dst, contrib);
+}
+
+static void imaging_vertical(const unsigned char **rows, const short *k,
+    long count, unsigned char *dst, size_t from, size_t to)
+{
+#if IMAGING_HAVE_X86
+    if (imaging_kernels == IMAGING_KERNELS_AVX2) {
+        imaging_vertical_avx2(rows, k, count, dst, from, to);
+        return;
+    }
+    if (imaging_kernels == IMAGING_KERNELS_SSE2) {
+        imaging_vertical_sse2(rows, k, count, dst, from, to);
+        return;
+    }
+#endif
+    imaging_vertical_c(rows, k, count, dst, from, to);
+}
+
+static void imaging_unsharp(const unsigned char *src, unsigned char *dst,
+    int amount, size_t from, size_t to)
+{
+#if IMAGING_HAVE_X86
+    if (imaging_kernels >= IMAGING_KERNELS_SSE2) {
+        imaging_unsharp_sse2(src, dst, amount, from, to);
+        return;
+    }
+#endif
+    imaging_unsharp_c(src, dst, amount, from, to);
+}
+
+/*
+ * Runs the horizontal then the vertical pass with the given weights.
+ * Returns 1 if successful otherwise 0.
+ */
+static int imaging_separable(
+    const unsigned char *src, unsigned long src_width, unsigned long src_height,
+    unsigned char *dst, unsigned long dst_width, unsigned long dst_height,
+    const imaging_contrib_t *horizontal, const imaging_contrib_t *vertical)
+{
+    unsigned char *tmp;
+    const unsigned char **rows;
+    size_t src_stride, dst_stride, from, to;
+    unsigned long y;
+    long t;
+
+    src_stride = src_width * IMAGING_RESAMPLE_CHANNELS;
+    dst_stride = dst_width * IMAGING_RESAMPLE_CHANNELS;
+    tmp = imaging_pool_alloc(src_height * dst_stride);
+    rows = malloc(vertical->taps * sizeof(unsigned char *));
+    if (tmp == NULL || rows == NULL) {
+        imaging_pool_free(tmp);
+        free(rows);
+        return 0;
+    }
+
+    // horizontal pass: every source row into the intermediate buffer.
+    for (y = 0; y < src_height; y++) {
+        imaging_horizontal(src + y * src_stride, tmp + y * dst_stride, horizontal);
+    }
+
+    // vertical pass: one block of columns at a time for all output rows.
+    for (from = 0; from < dst_stride; from = to) {
+        to = from + IMAGING_COLUMN_BLOCK;
+        if (to > dst_stride) {
+            to = dst_stride;
+        }
+        for (y = 0; y < dst_height; y++) {
+            for (t = 0; t < vertical->count[y]; t++) {
+                rows[t] = tmp + (vertical->start[y] + t) * dst_stride;
+            }
+            imaging_vertical(rows, vertical->weights + y * vertical->taps,
+                             vertical->count[y], dst + y * dst_stride, from, to);
+        }
+    }
+
+    imaging_pool_free(tmp);
+    free(rows);
+    return 1;
+}
+
+/******************************************************************
+ * Public API
+ *****************************************************************/
+int imaging_resample(
+    const unsigned char *src, unsigned long src_width, unsigned long src_height,
+    unsigned char *dst, unsigned long dst_width, unsigned long dst_height,
+    imaging_filter_t filter)
+{
+    imaging_contrib_t horizontal, vertical;
+    int status;
+
+    if (src_width == 0 || src_height == 0 || dst_width == 0 || dst_height == 0) {
+        return 0;
+    }
+    if (imaging_kernels < 0) {
+        imaging_detect_kernels();
+    }
+
+    if (!imaging_contrib_init(&horizontal, src_width, dst_width, filter)) {
+        return 0;
+    }
+    if (!imaging_contrib_init(&vertical, src_height, dst_height, filter)) {
+        imaging_contrib_free(&horizontal);
+        return 0;
+    }
+    status = imaging_separable(src, src_width, src_height,
+        dst, dst_width, dst_height, &horizontal, &vertical);
+    imaging_contrib_free(&horizontal);
+    imaging_contrib_free(&vertical);
+    return status;
+}
+
+int imaging_blur(const unsigned char *src, unsigned char *dst,
+    unsigned long width, unsigned long height, double sigma)
+{
+    imaging_contrib_t horizontal, vertical;
+    int status;
+
+    if (width == 0 || height == 0 || sigma <= 0.0) {
+        return 0;
+    }
+    if (imaging_kernels < 0) {
+        imaging_detect_kernels();
+    }
+
+    if (!imaging_contrib_gaussian(&horizontal, width, sigma)) {
+        return 0;
+    }
+    if (!imaging_contrib_gaussian(&vertical, height, sigma)) {
+        imaging_contrib_free(&horizontal);
+        return 0;
+    }
+    status = imaging_separable(src, width, height, dst, width, height,
+        &horizontal, &vertical);
+    imaging_contrib_free(&horizontal);
+    imaging_contrib_free(&vertical);
+    return status;
+}
+
+int imaging_sharpen(const unsigned char *src, unsigned char *dst,
+    unsigned long width, unsigned long height, double sigma, double amount)
+{
+    size_t size, from, to;
+    int fixed;
+
+    if (amount < 0.0 || amount > IMAGING_SHARPEN_MAX_AMOUNT ||
+        !imaging_blur(src, dst, width, height, sigma)) {
+        return 0;
+    }
+    // add the detail the blur took out back on top of src (in cache sized blocks).
+    fixed = (int)lrint(amount * 256);
+    size = width * height * IMAGING_RESAMPLE_CHANNELS;
+    for (from = 0; from < size; from = to) {
+        to = from + IMAGING_COLUMN_BLOCK;
+        if (to > size) {
+            to = size;
+        }
+        imaging_unsharp(src, dst, fixed, from, to);
+    }
+    return 1;
+}
+
+imaging_resample_stream_t * imaging_resample_stream_create(
+    unsigned long src_width, unsigned long src_height,
+    unsigned long dst_width, unsigned long dst_height,
+    imaging_filter_t filter)
+{
+    imaging_resample_stream_t *stream;
+
+    if (src_width == 0 || src_height == 0 || dst_width == 0 || dst_height == 0) {
+        return NULL;
+    }
+    if (imaging_kernels < 0) {
+        imaging_detect_kernels();
+    }
+
+    stream = calloc(1, sizeof(imaging_resample_stream_t));
+    if (stream == NULL) {
+        return NULL;
+    }
+    if (!imaging_contrib_init(&stream->horizontal, src_width, dst_width, filter)) {
+        free(stream);
+        return NULL;
+    }
+    if (!imaging_contrib_init(&stream->vertical, src_height, dst_height, filter)) {
+        imaging_contrib_free(&stream->horizontal);
+        free(stream);
+        return NULL;
+    }
+
+    stream->stride = dst_width * IMAGING_RESAMPLE_CHANNELS;
+    stream->src_height = src_height;
+    stream->window = imaging_pool_alloc(stream->vertical.taps * stream->stride);
+    stream->rows = malloc(stream->vertical.taps * sizeof(unsigned char *));
+    if (stream->window == NULL || stream->rows == NULL) {
+        imaging_resample_stream_destroy(stream);
+        return NULL;
+    }
+    return stream;
+}
+
+int imaging_resample_stream_write(imaging_resample_stream_t *stream,
+    const unsigned char *row)
+{
+    const imaging_contrib_t *vertical = &stream->vertical;
+
+    if (stream->written >= stream->src_height) {
+        return 0;
+    }
+    // the row would replace one the next output row still needs.
+    if (stream->read < vertical->size &&
+        stream->written >= vertical->start[stream->read] + vertical->taps) {
+        return 0;
+    }
+    imaging_horizontal(row,
+        stream->window + (stream->written % vertical->taps) * stream->stride,
+        &stream->horizontal);
+    stream->written++;
+    return 1;
+}
+
+int imaging_resample_stream_read(imaging_resample_stream_t *stream,
+    unsigned char *row)
+{
+    const imaging_contrib_t *vertical = &stream->vertical;
+    unsigned long y = stream->read;
+    long t;
+
+    if (y >= vertical->size ||
+        stream->written < (unsigned long)(vertical->start[y] + vertical->count[y])) {
+        return 0;
+    }
+    for (t = 0; t < vertical->count[y]; t++) {
+        stream->rows[t] = stream->window +
+            ((vertical->start[y] + t) % vertical->taps) * stream->stride;
+    }
+    imaging_vertical(stream->rows, vertical->weights + y * vertical->taps,
+                     vertical->count[y], row, 0, stream->stride);
+    stream->read++;
+    return 1;
+}
+
+void imaging_resample_stream_destroy(imaging_resample_stream_t *stream) {
+    if (stream == NULL) {
+        return;
+    }
+    imaging_pool_free(stream->window);
+    free(stream->rows);
+    imaging_contrib_free(&stream->horizontal);
+    imaging_contrib_free(&stream->vertical);
+    free(stream);
+}
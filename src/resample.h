@@ -0,0 +1,101 @@
+/**
+ *  resample.h
+ *
+ *  Contains function prototypes for the 8-bit separable resampler.
+ */
+#ifndef _IMAGING_RESAMPLE_H_INCLUDED_
+#define _IMAGING_RESAMPLE_H_INCLUDED_
+
+#include <stddef.h>
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+/* Number of (interleaved) channels in the buffers the resampler works on. */
+#define IMAGING_RESAMPLE_CHANNELS 4
+
+typedef enum {
+    IMAGING_FILTER_BOX,
+    IMAGING_FILTER_TRIANGLE,
+    IMAGING_FILTER_LANCZOS
+} imaging_filter_t;
+
+/*
+ * Resamples the src_width x src_height 8-bit, 4 channel buffer src into the
+ * dst_width x dst_height buffer dst.
+ *
+ * Returns 1 if successful otherwise 0.
+ */
+int imaging_resample(
+    const unsigned char *src, unsigned long src_width, unsigned long src_height,
+    unsigned char *dst, unsigned long dst_width, unsigned long dst_height,
+    imaging_filter_t filter);
+
+/* Largest amount imaging_sharpen takes (keeps its fixed point in range). */
+#define IMAGING_SHARPEN_MAX_AMOUNT 16.0
+
+/*
+ * Blurs the width x height 8-bit, 4 channel buffer src into dst with a
+ * gaussian of sigma (in pixels).
+ *
+ * Returns 1 if successful otherwise 0.
+ */
+int imaging_blur(const unsigned char *src, unsigned char *dst,
+    unsigned long width, unsigned long height, double sigma);
+
+/*
+ * Sharpens the width x height 8-bit, 4 channel buffer src into dst with an
+ * unsharp mask: dst = src + (src - blur(src, sigma)) * amount, where amount
+ * is between 0 and IMAGING_SHARPEN_MAX_AMOUNT.
+ *
+ * Returns 1 if successful otherwise 0.
+ */
+int imaging_sharpen(const unsigned char *src, unsigned char *dst,
+    unsigned long width, unsigned long height, double sigma, double amount);
+
+/*
+ * Resamples a src_width x src_height image into dst_width x dst_height one
+ * row at a time, keeping only the rows under the vertical filter (a rolling
+ * window) instead of the whole image.
+ */
+typedef struct imaging_resample_stream_s imaging_resample_stream_t;
+
+/*
+ * Returns a new stream or NULL on failure.
+ */
+imaging_resample_stream_t * imaging_resample_stream_create(
+    unsigned long src_width, unsigned long src_height,
+    unsigned long dst_width, unsigned long dst_height,
+    imaging_filter_t filter);
+
+/*
+ * Feeds the next src_width pixel row of the source into stream. Every
+ * output row which is ready has to be read before writing the next row.
+ *
+ * Returns 1 if successful otherwise 0.
+ */
+int imaging_resample_stream_write(imaging_resample_stream_t *stream,
+    const unsigned char *row);
+
+/*
+ * Computes the next dst_width pixel output row into row once every source
+ * row under its filter was written.
+ *
+ * Returns 1 if a row was read otherwise 0.
+ */
+int imaging_resample_stream_read(imaging_resample_stream_t *stream,
+    unsigned char *row);
+
+void imaging_resample_stream_destroy(imaging_resample_stream_t *stream);
+
+/*
+ * Name of the kernels picked for this cpu ("avx2", "sse2" or "c").
+ */
+const char * imaging_resample_kernels(void);
+
+#ifdef  __cplusplus
+    }
+#endif
+
+#endif
@@ -2,12 +2,69 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 // GraphicsMagick.
 #include <magick/api.h>
 #include <imaging.h>
 
 static int NUMBER_OF_ITERATIONS = 1000;
+static int PROFILE_ITERATIONS = 50;
+
+// encoder profiles compared by bytes per variant & encode time.
+static const struct {
+    const char *name;
+    imaging_jpeg_profile_t profile;
+} JPEG_PROFILES[] = {
+    { "baseline", { 0, 0, IMAGING_SUBSAMPLING_DEFAULT, 0, 0, 0, 0 } },
+    { "optimize", { 0, 1, IMAGING_SUBSAMPLING_DEFAULT, 0, 0, 0, 0 } },
+    { "progressive", { 1, 0, IMAGING_SUBSAMPLING_DEFAULT, 0, 0, 0, 0 } },
+    { "progressive optimize", { 1, 1, IMAGING_SUBSAMPLING_DEFAULT, 0, 0, 0, 0 } },
+    { "subsampling=444", { 0, 0, IMAGING_SUBSAMPLING_444, 0, 0, 0, 0 } },
+    { "subsampling=422", { 0, 0, IMAGING_SUBSAMPLING_422, 0, 0, 0, 0 } },
+    { "small=160000:60", { 0, 0, IMAGING_SUBSAMPLING_DEFAULT, 160000, 60, 0, 0 } },
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// prints the average bytes & time of creating filepath with each profile.
+static void benchmark_profiles(const char *filepath) {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length, bytes;
+    double start, elapsed;
+    int i, p;
+
+    printf("%s\n", filepath);
+    for (p = 0; p < sizeof(JPEG_PROFILES) / sizeof(JPEG_PROFILES[0]); ++p) {
+        imaging_set_jpeg_profile(&JPEG_PROFILES[p].profile);
+        bytes = 0;
+        start = now_ms();
+        for (i = 0; i < PROFILE_ITERATIONS; ++i) {
+            imgaging_get_image_data(
+                filepath,
+                &data, &data_length,
+                &content_type, &content_type_length,
+                "", "", 70, "", 0
+            );
+            if (data == NULL) {
+                printf("%s was NULL!\n", filepath);
+                return;
+            }
+            bytes += data_length;
+            free(data);
+            free(content_type);
+        }
+        elapsed = now_ms() - start;
+        printf("  %-22s %8zu bytes %8.2f ms\n", JPEG_PROFILES[p].name,
+            bytes / PROFILE_ITERATIONS, elapsed / PROFILE_ITERATIONS);
+    }
+    imaging_set_jpeg_profile(NULL);
+}
 
 int main(void) {
     (void) imaging_initialize();
@@ -34,6 +91,10 @@ int main(void) {
         free(data);
         free(content_type);
     }
+
+    // size/CPU tradeoff of the encoder profiles.
+    benchmark_profiles("docroot/img/lg-image_t200.jpg");
+    benchmark_profiles("docroot/img/lg-image_r500x500.jpg");
     (void) imaging_destory();
     return EXIT_SUCCESS;
 }
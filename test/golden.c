@@ -0,0 +1,353 @@
+/*
+ * Golden image & performance regression suite for the Imaging library.
+ *
+ * Renders every case (a variant with a golden in docroot/img/cmp) through
+ * every pipeline, compares it to its golden by PSNR & SSIM against the
+ * case's thresholds, and measures its render time (best of ITERATIONS) &
+ * output bytes.
+ *
+ *  ./golden            checks accuracy, & performance against golden.baseline
+ *  ./golden record     checks accuracy & (re)writes golden.baseline
+ *
+ * Exits non zero when a case is less accurate than its thresholds, or is
+ * more than TIME_TOLERANCE slower / BYTES_TOLERANCE bigger than in the
+ * baseline. Record the baseline on the machine the suite runs on, before
+ * the change being measured.
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// GraphicsMagick.
+#include <magick/api.h>
+#include <imaging.h>
+
+static const char *BASELINE = "golden.baseline";
+static int ITERATIONS = 5;
+// slower / bigger than the baseline by more than this fails.
+static double TIME_TOLERANCE = 0.25;
+static double BYTES_TOLERANCE = 0.05;
+
+// variants with a golden & the accuracy they have to keep.
+static const struct {
+    const char *variant;
+    double min_psnr;
+    double min_ssim;
+} CASES[] = {
+    { "scaled.insidechurch_t120.jpg", 28.0, 0.85 },
+    { "scaled.insidechurch_t190.jpg", 29.0, 0.88 },
+    { "scaled.insidechurch_t198.jpg", 29.0, 0.88 },
+    { "scaled.insidechurch_t200.jpg", 29.0, 0.88 },
+    { "scaled.insidechurch_t300.jpg", 30.0, 0.90 },
+    { "scaled.insidechurch_t320.jpg", 30.0, 0.90 },
+    { "scaled.insidechurch_t653.jpg", 31.0, 0.92 },
+    { "scaled.insidechurch_t653x653.jpg", 31.0, 0.92 },
+    { "scaled.insidechurch_t655.jpg", 31.0, 0.92 },
+    { "scaled.insidechurch_tx50.jpg", 26.0, 0.80 },
+};
+
+// the ways a variant can be created.
+static const struct {
+    const char *name;
+    imaging_resampler_t resampler;
+    int jpeg_direct;
+    unsigned long stream_pixels;
+} PIPELINES[] = {
+    { "default", IMAGING_RESAMPLER_DEFAULT, 0, 0 },
+    { "fast", IMAGING_RESAMPLER_FAST, 0, 0 },
+    { "jpeg_direct", IMAGING_RESAMPLER_DEFAULT, 1, 0 },
+    { "stream", IMAGING_RESAMPLER_DEFAULT, 0, 1 },
+};
+
+#define NUM_CASES (sizeof(CASES) / sizeof(CASES[0]))
+#define NUM_PIPELINES (sizeof(PIPELINES) / sizeof(PIPELINES[0]))
+
+typedef struct {
+    size_t bytes;
+    double ms;
+} golden_result_t;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Returns the 8-bit RGB pixels of image (malloc'd) or NULL.
+ */
+static unsigned char * golden_rgb(Image *image, ExceptionInfo *exception) {
+    const PixelPacket *p;
+    unsigned char *rgb, *q;
+    unsigned long x;
+    long y;
+
+    rgb = malloc(image->columns * image->rows * 3);
+    if (rgb == NULL) {
+        return NULL;
+    }
+    for (q = rgb, y = 0; y < (long)image->rows; y++) {
+        p = AcquireImagePixels(image, 0, y, image->columns, 1, exception);
+        if (p == NULL) {
+            free(rgb);
+            return NULL;
+        }
+        for (x = 0; x < image->columns; x++, p++) {
+            *q++ = ScaleQuantumToChar(p->red);
+            *q++ = ScaleQuantumToChar(p->green);
+            *q++ = ScaleQuantumToChar(p->blue);
+        }
+    }
+    return rgb;
+}
+
+/*
+ * PSNR (dB) of the RGB of b against a, 99 when they are identical.
+ */
+static double golden_psnr(const unsigned char *a, const unsigned char *b, size_t n) {
+    double diff, sum = 0.0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        diff = (double)a[i] - b[i];
+        sum += diff * diff;
+    }
+    if (sum == 0.0) {
+        return 99.0;
+    }
+    return 10.0 * log10(255.0 * 255.0 / (sum / n));
+}
+
+static double golden_luma(const unsigned char *rgb) {
+    return 0.299 * rgb[0] + 0.587 * rgb[1] + 0.114 * rgb[2];
+}
+
+/*
+ * Mean SSIM of the luma of b against a, over 8x8 windows (stride 4).
+ */
+static double golden_ssim(const unsigned char *a, const unsigned char *b,
+    unsigned long columns, unsigned long rows)
+{
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    double sa, sb, saa, sbb, sab, la, lb, ma, mb, va, vb, cov, sum = 0.0;
+    unsigned long x, y, i, j, windows = 0;
+    size_t o;
+
+    if (columns < 8 || rows < 8) {
+        return 0.0;
+    }
+    for (y = 0; y + 8 <= rows; y += 4) {
+        for (x = 0; x + 8 <= columns; x += 4) {
+            sa = sb = saa = sbb = sab = 0.0;
+            for (j = y; j < y + 8; j++) {
+                for (i = x; i < x + 8; i++) {
+                    o = (j * columns + i) * 3;
+                    la = golden_luma(a + o);
+                    lb = golden_luma(b + o);
+                    sa += la;
+                    sb += lb;
+                    saa += la * la;
+                    sbb += lb * lb;
+                    sab += la * lb;
+                }
+            }
+            ma = sa / 64;
+            mb = sb / 64;
+            va = saa / 64 - ma * ma;
+            vb = sbb / 64 - mb * mb;
+            cov = sab / 64 - ma * mb;
+            sum += ((2 * ma * mb + c1) * (2 * cov + c2)) /
+                   ((ma * ma + mb * mb + c1) * (va + vb + c2));
+            windows++;
+        }
+    }
+    return sum / windows;
+}
+
+/*
+ * Compares the encoded variant in data to the image stored at golden.
+ * Returns 1 if they could be compared (psnr & ssim are set) otherwise 0.
+ */
+static int golden_compare(const unsigned char *data, size_t data_length,
+    const char *golden, double *psnr, double *ssim)
+{
+    ImageInfo *image_info;
+    ExceptionInfo exception;
+    Image *image, *reference;
+    unsigned char *a = NULL, *b = NULL;
+    int status = 0;
+
+    image_info = CloneImageInfo((ImageInfo *) NULL);
+    GetExceptionInfo(&exception);
+    image = BlobToImage(image_info, data, data_length, &exception);
+    (void) strcpy(image_info->filename, golden);
+    reference = ReadImage(image_info, &exception);
+    if (image != NULL && reference != NULL &&
+        image->columns == reference->columns && image->rows == reference->rows) {
+        a = golden_rgb(reference, &exception);
+        b = golden_rgb(image, &exception);
+    }
+    if (a != NULL && b != NULL) {
+        *psnr = golden_psnr(a, b, image->columns * image->rows * 3);
+        *ssim = golden_ssim(a, b, image->columns, image->rows);
+        status = 1;
+    }
+
+    // memory cleanup
+    free(a);
+    free(b);
+    if (image != NULL) {
+        DestroyImage(image);
+    }
+    if (reference != NULL) {
+        DestroyImage(reference);
+    }
+    DestroyImageInfo(image_info);
+    DestroyExceptionInfo(&exception);
+    return status;
+}
+
+/*
+ * Reads the baseline into results. Returns 1 if there is one otherwise 0.
+ */
+static int golden_read_baseline(golden_result_t results[NUM_PIPELINES][NUM_CASES]) {
+    char pipeline[64], variant[256];
+    golden_result_t result;
+    size_t p, c;
+    FILE *fp;
+
+    fp = fopen(BASELINE, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (fscanf(fp, "%63s %255s %zu %lf", pipeline, variant,
+                  &result.bytes, &result.ms) == 4) {
+        for (p = 0; p < NUM_PIPELINES; p++) {
+            for (c = 0; c < NUM_CASES; c++) {
+                if (strcmp(pipeline, PIPELINES[p].name) == 0 &&
+                    strcmp(variant, CASES[c].variant) == 0) {
+                    results[p][c] = result;
+                }
+            }
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+static int golden_write_baseline(golden_result_t results[NUM_PIPELINES][NUM_CASES]) {
+    size_t p, c;
+    FILE *fp;
+
+    fp = fopen(BASELINE, "w");
+    if (fp == NULL) {
+        return 0;
+    }
+    for (p = 0; p < NUM_PIPELINES; p++) {
+        for (c = 0; c < NUM_CASES; c++) {
+            fprintf(fp, "%s %s %zu %.3f\n", PIPELINES[p].name, CASES[c].variant,
+                results[p][c].bytes, results[p][c].ms);
+        }
+    }
+    fclose(fp);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    static golden_result_t results[NUM_PIPELINES][NUM_CASES];
+    static golden_result_t baseline[NUM_PIPELINES][NUM_CASES];
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length, p, c;
+    char filepath[256], golden[256];
+    double start, elapsed, psnr, ssim;
+    int i, record, have_baseline, failures = 0;
+    const char *verdict;
+
+    record = (argc > 1 && strcmp(argv[1], "record") == 0);
+    have_baseline = !record && golden_read_baseline(baseline);
+
+    (void) imaging_initialize();
+    printf("%-12s %-34s %7s %6s %8s %9s\n",
+        "pipeline", "variant", "psnr", "ssim", "bytes", "ms");
+
+    for (p = 0; p < NUM_PIPELINES; p++) {
+        imaging_set_resampler(PIPELINES[p].resampler);
+        imaging_set_jpeg_direct(PIPELINES[p].jpeg_direct);
+        imaging_set_stream_pixels(PIPELINES[p].stream_pixels);
+
+        for (c = 0; c < NUM_CASES; c++) {
+            sprintf(filepath, "docroot/img/%s", CASES[c].variant);
+            sprintf(golden, "docroot/img/cmp/%s", CASES[c].variant);
+            results[p][c].ms = -1.0;
+            psnr = ssim = 0.0;
+
+            for (i = 0; i < ITERATIONS; ++i) {
+                data = NULL;
+                start = now_ms();
+                imgaging_get_image_data(
+                    filepath,
+                    &data, &data_length,
+                    &content_type, &content_type_length,
+                    "", "", 70, "", 0
+                );
+                elapsed = now_ms() - start;
+                if (data == NULL) {
+                    break;
+                }
+                if (results[p][c].ms < 0 || elapsed < results[p][c].ms) {
+                    results[p][c].ms = elapsed;
+                }
+                results[p][c].bytes = data_length;
+                if (i == 0 && !golden_compare(data, data_length, golden, &psnr, &ssim)) {
+                    psnr = ssim = 0.0;
+                }
+                imaging_free(data);
+                imaging_free(content_type);
+            }
+
+            verdict = "ok";
+            if (data == NULL) {
+                verdict = "FAILED to create";
+            } else if (psnr < CASES[c].min_psnr || ssim < CASES[c].min_ssim) {
+                verdict = "FAILED accuracy";
+            } else if (have_baseline && baseline[p][c].ms > 0 &&
+                       results[p][c].ms > baseline[p][c].ms * (1.0 + TIME_TOLERANCE)) {
+                verdict = "FAILED time";
+            } else if (have_baseline && baseline[p][c].bytes > 0 &&
+                       results[p][c].bytes > baseline[p][c].bytes * (1.0 + BYTES_TOLERANCE)) {
+                verdict = "FAILED bytes";
+            }
+            if (strcmp(verdict, "ok") != 0) {
+                failures++;
+            }
+            printf("%-12s %-34s %7.2f %6.4f %8zu %9.3f %s\n",
+                PIPELINES[p].name, CASES[c].variant, psnr, ssim,
+                results[p][c].bytes, results[p][c].ms, verdict);
+        }
+    }
+    imaging_set_resampler(IMAGING_RESAMPLER_DEFAULT);
+    imaging_set_jpeg_direct(0);
+    imaging_set_stream_pixels(0);
+    (void) imaging_destory();
+
+    if (record) {
+        if (!golden_write_baseline(results)) {
+            printf("couldn't write %s\n", BASELINE);
+            return EXIT_FAILURE;
+        }
+        printf("recorded %s\n", BASELINE);
+    } else if (!have_baseline) {
+        printf("no %s, performance not checked (run ./golden record)\n", BASELINE);
+    }
+
+    if (failures > 0) {
+        printf("%d of %d cases FAILED\n", failures, (int)(NUM_PIPELINES * NUM_CASES));
+        return EXIT_FAILURE;
+    }
+    printf("ALL %d CASES PASSED\n", (int)(NUM_PIPELINES * NUM_CASES));
+    return EXIT_SUCCESS;
+}
@@ -7,9 +7,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
 
 // GraphicsMagick.
 #include <imaging.h>
+#include <pool.h>
+#include <pyramid.h>
+#include <mmap.h>
 #include <magick/api.h>
 
 
@@ -29,6 +35,510 @@ mu_test_type test_explodeFilePath() {
 }
 
 
+// Tests for: const char * imaging_find_actions(const char *filepath);
+mu_test_type test_imaging_find_actions() {
+    const char *filepath = "docroot/img/scaled.insidechurch_t200.jpg";
+    mu_assert("actions of an existing original",
+        imaging_find_actions(filepath) == filepath + strlen("docroot/img/scaled.insidechurch"));
+    mu_assert("no original means no actions",
+        imaging_find_actions("docroot/img/missing_t200.jpg") == NULL);
+    mu_return_success;
+}
+
+// Tests for: const char * imaging_parse_actions(const char *filepath);
+mu_test_type test_imaging_parse_actions() {
+    const char *filepath = "/img/my_photo_t200_b5-red.jpg";
+    mu_assert("actions found by syntax alone",
+        imaging_parse_actions(filepath) == filepath + strlen("/img/my_photo"));
+    mu_assert("an original has no actions",
+        imaging_parse_actions("/img/my_photo.jpg") == NULL);
+    mu_assert("no extension means no actions",
+        imaging_parse_actions("/img/photo_t200") == NULL);
+    mu_return_success;
+}
+
+// Tests for: imaging_snap_actions
+mu_test_type test_imaging_snap_actions() {
+    static const unsigned long buckets[] = { 64, 120, 200, 320 };
+    char snapped[64];
+    const char *actions = "_t197x150_c100x90_fsharp1.5_sx50";
+
+    mu_assert("rounded up", imaging_snap_actions("_t197.jpg", 5,
+        buckets, 4, snapped, sizeof(snapped)) == 5 && strcmp(snapped, "_t200") == 0);
+    mu_assert("only resampling sizes", imaging_snap_actions(actions, strlen(actions),
+        buckets, 4, snapped, sizeof(snapped)) > 0 &&
+        strcmp(snapped, "_t200x152_c100x90_fsharp1.5_sx64") == 0);
+    mu_assert("aspect kept", imaging_snap_actions("_r100x300", 9,
+        buckets, 4, snapped, sizeof(snapped)) > 0 &&
+        strcmp(snapped, "_r120x360") == 0);
+    mu_assert("aspect kept down to the largest", imaging_snap_actions("_s1000x500", 10,
+        buckets, 4, snapped, sizeof(snapped)) > 0 &&
+        strcmp(snapped, "_s320x160") == 0);
+    mu_assert("down to the largest", imaging_snap_actions("_r1000", 6,
+        buckets, 4, snapped, sizeof(snapped)) > 0 && strcmp(snapped, "_r320") == 0);
+    mu_assert("a bucket stays", imaging_snap_actions("_t120_b5-red", 12,
+        buckets, 4, snapped, sizeof(snapped)) > 0 && strcmp(snapped, "_t120_b5-red") == 0);
+    mu_assert("too small", imaging_snap_actions("_t197", 5,
+        buckets, 4, snapped, 4) == 0);
+    mu_return_success;
+}
+
+// Tests for: imaging_actions_hash
+mu_test_type test_imaging_actions_hash() {
+    char hash[IMAGING_HASH_LENGTH + 1];
+
+    imaging_actions_hash("_t200", "salt", hash);
+    mu_assert("hex sha1", strlen(hash) == IMAGING_HASH_LENGTH);
+    mu_assert("passes the check", imaging_actions_allowed("_t200", "salt", hash, ""));
+    mu_assert("only for its actions", !imaging_actions_allowed("_t201", "salt", hash, ""));
+    mu_return_success;
+}
+
+// Tests for: imaging_estimate_cost
+mu_test_type test_imaging_estimate_cost() {
+    double thumbnail, sharpened;
+    thumbnail = imaging_estimate_cost("docroot/img/lg-image_t100.jpg");
+    sharpened = imaging_estimate_cost("docroot/img/lg-image_fsharp1.5.jpg");
+    mu_assert("a thumbnail has a cost", thumbnail > 0.0);
+    mu_assert("filtering the original costs more than a thumbnail",
+        sharpened > thumbnail);
+    mu_assert("thumbnail of a thumbnail costs less than a filter",
+        imaging_estimate_cost("docroot/img/lg-image_t100_fsharp1.5.jpg") < sharpened);
+    mu_assert("no original has no cost",
+        imaging_estimate_cost("docroot/img/missing_t100.jpg") == 0.0);
+    mu_return_success;
+}
+
+// Tests for: imaging_get_meta
+mu_test_type test_imaging_get_meta() {
+    imaging_meta_t meta;
+
+    mu_assert("described", imaging_get_meta("docroot/img/lg-image_t200.jpg",
+        "", "", "", &meta) == IMAGING_FAILURE_NONE);
+    mu_assert("original size", meta.width == 1280 && meta.height == 1024);
+    mu_assert("original format", strcmp(meta.format, "JPEG") == 0 && meta.frames == 1);
+    mu_assert("thumbnail size", meta.output_width == 200 && meta.output_height == 160);
+
+    mu_assert("chain", imaging_get_meta("docroot/img/lg-image_c400x300_b5-red.jpg",
+        "", "", "", &meta) == IMAGING_FAILURE_NONE);
+    mu_assert("crop & border size", meta.output_width == 410 && meta.output_height == 310);
+
+    mu_assert("original", imaging_get_meta("docroot/img/lg-image.jpg",
+        "", "", "", &meta) == IMAGING_FAILURE_NONE);
+    mu_assert("original is unchanged", meta.output_width == 1280 && meta.output_height == 1024);
+
+    mu_assert("no original", imaging_get_meta("docroot/img/missing_t200.jpg",
+        "", "", "", &meta) == IMAGING_FAILURE_MISSING);
+    mu_assert("wrong hash", imaging_get_meta("docroot/img/lg-image_t200.jpg",
+        "salt", "bad-hash", "", &meta) == IMAGING_FAILURE_FORBIDDEN);
+    mu_assert("white listed", imaging_get_meta("docroot/img/lg-image_t200.jpg",
+        "salt", "", "t200", &meta) == IMAGING_FAILURE_NONE);
+    mu_assert("bad action", imaging_get_meta("docroot/img/lg-image_fbogus.jpg",
+        "", "", "", &meta) == IMAGING_FAILURE_INVALID);
+    mu_return_success;
+}
+
+// Tests for: oversized borders (rejected, not wrapped into bogus sizes)
+mu_test_type test_imaging_border_max() {
+    imaging_meta_t meta;
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+
+    mu_assert("overflowing border", imaging_get_meta(
+        "docroot/img/lg-image_b999999999999999999-red.jpg",
+        "", "", "", &meta) == IMAGING_FAILURE_INVALID);
+    mu_assert("too wide border", imaging_get_meta(
+        "docroot/img/lg-image_b1001-red.jpg",
+        "", "", "", &meta) == IMAGING_FAILURE_INVALID);
+    mu_assert("widest border", imaging_get_meta(
+        "docroot/img/lg-image_b1000-red.jpg",
+        "", "", "", &meta) == IMAGING_FAILURE_NONE &&
+        meta.output_width == 3280 && meta.output_height == 3024);
+
+    imgaging_get_image_data("docroot/img/lg-image_b1001-red.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "", "", 70, "", 0);
+    mu_assert("too wide border isn't rendered", data == NULL);
+    mu_return_success;
+}
+
+// Tests for: imaging_passthrough
+mu_test_type test_imaging_passthrough() {
+    char original[MaxTextExtent];
+
+    mu_assert("crop clamped to the image", imaging_passthrough("docroot/img/lg-image_c5000.jpg",
+        "", "", "", original) && strcmp(original, "docroot/img/lg-image.jpg") == 0);
+    mu_assert("resize & thumbnail to its size", imaging_passthrough(
+        "docroot/img/lg-image_r1280x1024_t1280.jpg", "", "", "", original));
+    mu_assert("a smaller thumbnail", !imaging_passthrough("docroot/img/lg-image_t200.jpg",
+        "", "", "", original));
+    mu_assert("thumbnails upscale", !imaging_passthrough("docroot/img/lg-image_t2000.jpg",
+        "", "", "", original));
+    mu_assert("a border changes it", !imaging_passthrough("docroot/img/lg-image_c5000_b5-red.jpg",
+        "", "", "", original));
+    mu_assert("wrong hash", !imaging_passthrough("docroot/img/lg-image_c5000.jpg",
+        "salt", "bad-hash", "", original));
+    mu_assert("no original", !imaging_passthrough("docroot/img/missing_c5000.jpg",
+        "", "", "", original));
+    mu_return_success;
+}
+
+// Returns 1 if the JPEG in data has a progressive (SOF2) frame otherwise 0.
+static int is_progressive(const unsigned char *data, size_t data_length) {
+    size_t i;
+    for (i = 2; i + 3 < data_length; i += 2 + ((data[i + 2] << 8) | data[i + 3])) {
+        if (data[i] != 0xFF || data[i + 1] == 0xDA) {
+            return 0;
+        }
+        if (data[i + 1] == 0xC2) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Tests for: imaging_set_jpeg_profile
+mu_test_type test_imaging_jpeg_profile() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length, baseline_length;
+    imaging_jpeg_profile_t profile = {
+        1, 1, IMAGING_SUBSAMPLING_420, 0, 0, 0, 0
+    };
+    int direct;
+
+    for (direct = 0; direct <= 1; direct++) {
+        imaging_set_jpeg_direct(direct);
+
+        imaging_set_jpeg_profile(NULL);
+        imgaging_get_image_data("docroot/img/lg-image_t200.jpg",
+            &data, &data_length, &content_type, &content_type_length,
+            "", "", 70, "", 0);
+        mu_assert("baseline variant created", data != NULL);
+        mu_assert("baseline by default", !is_progressive(data, data_length));
+        baseline_length = data_length;
+        imaging_free(data);
+        imaging_free(content_type);
+
+        imaging_set_jpeg_profile(&profile);
+        imgaging_get_image_data("docroot/img/lg-image_t200.jpg",
+            &data, &data_length, &content_type, &content_type_length,
+            "", "", 70, "", 0);
+        mu_assert("progressive variant created", data != NULL);
+        mu_assert("progressive profile", is_progressive(data, data_length));
+        imaging_free(data);
+        imaging_free(content_type);
+
+        // thumbnails are a small size class with a lower quality.
+        profile.progressive = 0;
+        profile.optimize = 0;
+        profile.small_pixels = 200 * 200;
+        profile.small_quality = 20;
+        imaging_set_jpeg_profile(&profile);
+        imgaging_get_image_data("docroot/img/lg-image_t200.jpg",
+            &data, &data_length, &content_type, &content_type_length,
+            "", "", 70, "", 0);
+        mu_assert("small variant created", data != NULL);
+        mu_assert("small quality used", data_length < baseline_length);
+        imaging_free(data);
+        imaging_free(content_type);
+
+        profile.progressive = profile.optimize = 1;
+        profile.small_pixels = profile.small_quality = 0;
+    }
+    imaging_set_jpeg_profile(NULL);
+    imaging_set_jpeg_direct(0);
+    mu_return_success;
+}
+
+// Tests for: imaging_use_mmap
+mu_test_type test_imaging_mmap() {
+    unsigned char *data = NULL, *mapped = NULL;
+    char *content_type = NULL;
+    size_t data_length, mapped_length, content_type_length;
+    imaging_mmap_stats_t stats;
+    int i;
+
+    mu_assert("mapping is off by default", !imaging_mmap_stats(&stats));
+    imgaging_get_image_data("docroot/img/lg-image_t200_b5-red.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "", "", 70, "", 0);
+    mu_assert("read variant created", data != NULL);
+    imaging_free(content_type);
+
+    imaging_use_mmap(64 * 1024 * 1024);
+    for (i = 0; i < 2; ++i) {
+        imgaging_get_image_data("docroot/img/lg-image_t200_b5-red.jpg",
+            &mapped, &mapped_length, &content_type, &content_type_length,
+            "", "", 70, "", 0);
+        mu_assert("mapped variant created", mapped != NULL);
+        mu_assert("mapped original decodes the same",
+            mapped_length == data_length && memcmp(mapped, data, data_length) == 0);
+        imaging_free(mapped);
+        imaging_free(content_type);
+    }
+    imaging_free(data);
+    mu_assert("mapping is enabled", imaging_mmap_stats(&stats));
+    mu_assert("original mapped once", stats.maps == 1);
+    mu_assert("mapping reused", stats.hits == 1);
+    mu_return_success;
+}
+
+// Tests for: imaging_last_failure
+mu_test_type test_imaging_last_failure() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+
+    imgaging_get_image_data("docroot/img/no-such-image_t200.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "salt", "", 70, "", 0);
+    mu_assert("no original", data == NULL &&
+        imaging_last_failure() == IMAGING_FAILURE_MISSING);
+
+    imgaging_get_image_data("docroot/img/lg-image_t200.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "salt", "bad-hash", 70, "", 0);
+    mu_assert("wrong hash", data == NULL &&
+        imaging_last_failure() == IMAGING_FAILURE_FORBIDDEN);
+
+    imgaging_get_image_data("docroot/img/lg-image_fbogus.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "", "", 70, "", 0);
+    mu_assert("unknown filter", data == NULL &&
+        imaging_last_failure() == IMAGING_FAILURE_INVALID);
+
+    imgaging_get_image_data("docroot/img/lg-image_t200.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "", "", 70, "", 0);
+    mu_assert("created", data != NULL &&
+        imaging_last_failure() == IMAGING_FAILURE_NONE);
+    imaging_free(data);
+    imaging_free(content_type);
+    mu_return_success;
+}
+
+// abort handler of test_imaging_abort: stops the render on call abort_after.
+static int abort_calls, abort_after;
+static int abort_handler(void *data) {
+    (void) data;
+    return ++abort_calls >= abort_after;
+}
+
+// Tests for: imaging_set_abort
+mu_test_type test_imaging_abort() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    struct stat st;
+
+    // asked while rendering, which goes on when it says so.
+    abort_calls = 0;
+    abort_after = 1000000;
+    imaging_set_abort(abort_handler, NULL);
+    imgaging_get_image_data("docroot/img/lg-image_t210.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "", "", 70, "", 0);
+    mu_assert("not aborted", data != NULL && abort_calls > 1);
+    imaging_free(data);
+    imaging_free(content_type);
+
+    // stopped part way, nothing written beside the original.
+    data = NULL;
+    abort_calls = 0;
+    abort_after = 3;
+    imgaging_get_image_data("docroot/img/lg-image_t211.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "", "", 70, "", 1);
+    mu_assert("aborted", data == NULL &&
+        imaging_last_failure() == IMAGING_FAILURE_ABORTED);
+    mu_assert("not written", stat("docroot/img/lg-image_t211.jpg", &st) != 0);
+
+    // the libjpeg-turbo pipelines stop too (& don't fall back).
+    abort_calls = 0;
+    abort_after = 2;
+    imaging_set_jpeg_direct(1);
+    imgaging_get_image_data("docroot/img/lg-image_t212.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "", "", 70, "", 0);
+    imaging_set_jpeg_direct(0);
+    mu_assert("direct aborted", data == NULL &&
+        imaging_last_failure() == IMAGING_FAILURE_ABORTED);
+
+    imaging_set_abort(NULL, NULL);
+    mu_return_success;
+}
+
+// Tests for: imaging_ctx_set_abort (each context has its own)
+mu_test_type test_imaging_ctx_abort() {
+    imaging_ctx_t *ctx, *other;
+    imaging_params_t params = { "", "", 70, 0 };
+    imaging_result_t result;
+    const char *variant = "docroot/img/lg-image_t213.jpg";
+
+    ctx = imaging_ctx_create();
+    other = imaging_ctx_create();
+    mu_assert("contexts created", ctx != NULL && other != NULL);
+
+    // stopped on its own context only.
+    abort_calls = 0;
+    abort_after = 1;
+    imaging_ctx_set_abort(ctx, abort_handler, NULL);
+    mu_assert("aborted", imaging_ctx_render(ctx, variant, strlen(variant),
+        "", 0, &params, &result) == IMAGING_ERROR_ABORTED);
+    mu_assert("other rendered", imaging_ctx_render(other, variant,
+        strlen(variant), "", 0, &params, &result) == IMAGING_OK);
+    imaging_free(result.data);
+
+    // the default context's handler isn't asked either.
+    imaging_ctx_set_abort(ctx, NULL, NULL);
+    imaging_set_abort(abort_handler, NULL);
+    abort_calls = 0;
+    mu_assert("default's handler not asked", imaging_ctx_render(ctx, variant,
+        strlen(variant), "", 0, &params, &result) == IMAGING_OK &&
+        abort_calls == 0);
+    imaging_free(result.data);
+    imaging_set_abort(NULL, NULL);
+
+    imaging_ctx_destroy(other);
+    imaging_ctx_destroy(ctx);
+    mu_return_success;
+}
+
+// Tests for: imaging_ctx_render (one context reused across renders)
+mu_test_type test_imaging_ctx() {
+    imaging_ctx_t *ctx;
+    imaging_params_t params = { "", "", 70, 0 };
+    imaging_result_t result;
+    const char *variant = "docroot/img/lg-image_t200.jpg";
+    int i;
+
+    ctx = imaging_ctx_create();
+    mu_assert("context created", ctx != NULL);
+
+    for (i = 0; i < 2; i++) {
+        mu_assert("rendered", imaging_ctx_render(ctx, variant, strlen(variant),
+            "", 0, &params, &result) == IMAGING_OK);
+        mu_assert("has data", result.data != NULL && result.data_length > 0);
+        mu_assert("is a jpeg", strcmp(result.content_type, "image/jpeg") == 0);
+        mu_assert("is timed", result.timings.total > 0);
+        imaging_free(result.data);
+    }
+
+    variant = "docroot/img/no-such-image_t200.jpg";
+    mu_assert("no original", imaging_ctx_render(ctx, variant, strlen(variant),
+        "", 0, &params, &result) == IMAGING_ERROR_MISSING && result.data == NULL);
+
+    variant = "docroot/img/lg-image_fbogus.jpg";
+    mu_assert("unknown filter", imaging_ctx_render(ctx, variant, strlen(variant),
+        "", 0, &params, &result) == IMAGING_ERROR_ACTION);
+
+    params.salt = "salt";
+    variant = "docroot/img/lg-image_t200.jpg";
+    mu_assert("wrong hash", imaging_ctx_render(ctx, variant, strlen(variant),
+        "bad-hash", 8, &params, &result) == IMAGING_ERROR_FORBIDDEN);
+
+    mu_assert("empty path", imaging_ctx_render(ctx, variant, 0,
+        "", 0, &params, &result) == IMAGING_ERROR_PATH);
+
+    imaging_ctx_destroy(ctx);
+    mu_return_success;
+}
+
+// Tests for: imaging_ctx_render_blob (the context's settings, errors & abort)
+mu_test_type test_imaging_ctx_render_blob() {
+    imaging_ctx_t *ctx;
+    imaging_params_t params = { "", "", 70, 0, IMAGING_RESAMPLER_FAST };
+    imaging_result_t result;
+    unsigned char *original;
+    size_t original_length;
+    const char *variant = "/origin/lg-image_t200.jpg";
+    const char *plain = "/origin/lg-image.jpg";
+    FILE *fp;
+
+    fp = fopen("docroot/img/lg-image.jpg", "rb");
+    mu_assert("original is readable", fp != NULL);
+    fseek(fp, 0, SEEK_END);
+    original_length = ftell(fp);
+    rewind(fp);
+    original = malloc(original_length);
+    original_length = fread(original, 1, original_length, fp);
+    fclose(fp);
+
+    ctx = imaging_ctx_create();
+    mu_assert("context created", ctx != NULL);
+
+    // after a render from disk, whose file name the context still has.
+    mu_assert("rendered from disk", imaging_ctx_render(ctx,
+        "docroot/img/lg-image_t100.jpg", strlen("docroot/img/lg-image_t100.jpg"),
+        "", 0, &params, &result) == IMAGING_OK);
+    imaging_free(result.data);
+    mu_assert("rendered from memory", imaging_ctx_render_blob(ctx, variant,
+        strlen(variant), original, original_length, "", 0, &params,
+        &result) == IMAGING_OK);
+    mu_assert("is a jpeg", result.data != NULL &&
+        strcmp(result.content_type, "image/jpeg") == 0);
+    mu_assert("is timed", result.timings.total > 0);
+    imaging_free(result.data);
+
+    mu_assert("no actions", imaging_ctx_render_blob(ctx, plain, strlen(plain),
+        original, original_length, "", 0, &params, &result) == IMAGING_ERROR_PATH);
+    mu_assert("not an image", imaging_ctx_render_blob(ctx, variant,
+        strlen(variant), (const unsigned char *) "junk", 4, "", 0, &params,
+        &result) == IMAGING_ERROR_DECODE && imaging_ctx_message(ctx)[0] != '\0');
+
+    // stopped by the context's own handler.
+    abort_calls = 0;
+    abort_after = 1;
+    imaging_ctx_set_abort(ctx, abort_handler, NULL);
+    mu_assert("aborted", imaging_ctx_render_blob(ctx, variant, strlen(variant),
+        original, original_length, "", 0, &params, &result) == IMAGING_ERROR_ABORTED);
+    imaging_ctx_set_abort(ctx, NULL, NULL);
+
+    params.salt = "salt";
+    mu_assert("wrong hash", imaging_ctx_render_blob(ctx, variant,
+        strlen(variant), original, original_length, "bad-hash", 8, &params,
+        &result) == IMAGING_ERROR_FORBIDDEN);
+
+    free(original);
+    imaging_ctx_destroy(ctx);
+    mu_return_success;
+}
+
+// Tests for: imaging_get_image_data_from_blob (an original fetched from an origin)
+mu_test_type test_imaging_get_image_data_from_blob() {
+    unsigned char *data = NULL, *original;
+    char *content_type = NULL;
+    size_t data_length, content_type_length, original_length;
+    FILE *fp;
+
+    fp = fopen("docroot/img/lg-image.jpg", "rb");
+    mu_assert("original is readable", fp != NULL);
+    fseek(fp, 0, SEEK_END);
+    original_length = ftell(fp);
+    rewind(fp);
+    original = malloc(original_length);
+    original_length = fread(original, 1, original_length, fp);
+    fclose(fp);
+
+    // the variant's path doesn't exist, only its name matters.
+    imaging_get_image_data_from_blob(
+        "/origin/lg-image_t200.jpg",
+        original, original_length,
+        &data, &data_length,
+        &content_type, &content_type_length,
+        "", "",
+        70, ""
+    );
+    free(original);
+    mu_assert("variant created from memory", data != NULL);
+    mu_assert("variant is a jpeg", strcmp(content_type, "image/jpeg") == 0);
+    imaging_free(data);
+    imaging_free(content_type);
+    mu_return_success;
+}
+
 // Tests for: imaging_get_image_data
 mu_test_type test_imaging_get_image_data() {
     unsigned char *data = NULL;
@@ -102,6 +612,535 @@ mu_test_type test_imaging_get_image_data() {
     mu_return_success;
 }
 
+// Mean absolute difference (0-255 per channel) between the encoded image in
+// data and the image stored at golden. Returns 255.0 if they can't be compared.
+static double mean_error_to_golden(const unsigned char *data, size_t data_length, const char *golden) {
+    ImageInfo *image_info;
+    ExceptionInfo exception;
+    Image *image, *reference;
+    const PixelPacket *p, *q;
+    unsigned long x;
+    long y;
+    double error = 255.0, sum = 0.0;
+
+    image_info = CloneImageInfo((ImageInfo *) NULL);
+    GetExceptionInfo(&exception);
+    image = BlobToImage(image_info, data, data_length, &exception);
+    (void) strcpy(image_info->filename, golden);
+    reference = ReadImage(image_info, &exception);
+    if (image != NULL && reference != NULL &&
+        image->columns == reference->columns && image->rows == reference->rows) {
+        for (y = 0; y < (long)image->rows; y++) {
+            p = AcquireImagePixels(image, 0, y, image->columns, 1, &exception);
+            q = AcquireImagePixels(reference, 0, y, reference->columns, 1, &exception);
+            for (x = 0; x < image->columns; x++, p++, q++) {
+                sum += abs(ScaleQuantumToChar(p->red) - ScaleQuantumToChar(q->red));
+                sum += abs(ScaleQuantumToChar(p->green) - ScaleQuantumToChar(q->green));
+                sum += abs(ScaleQuantumToChar(p->blue) - ScaleQuantumToChar(q->blue));
+            }
+        }
+        error = sum / (image->columns * image->rows * 3);
+    }
+    if (image != NULL) {
+        DestroyImage(image);
+    }
+    if (reference != NULL) {
+        DestroyImage(reference);
+    }
+    DestroyImageInfo(image_info);
+    DestroyExceptionInfo(&exception);
+    return error;
+}
+
+// church thumbnails with goldens in docroot/img/cmp.
+static const char *church_variants[] = {
+    "scaled.insidechurch_t120.jpg",
+    "scaled.insidechurch_t190.jpg",
+    "scaled.insidechurch_t198.jpg",
+    "scaled.insidechurch_t200.jpg",
+    "scaled.insidechurch_t300.jpg",
+    "scaled.insidechurch_t320.jpg",
+    "scaled.insidechurch_t653.jpg",
+    "scaled.insidechurch_t653x653.jpg",
+    "scaled.insidechurch_t655.jpg",
+    "scaled.insidechurch_tx50.jpg",
+};
+
+/*
+ * Creates every church variant and compares it to its golden.
+ * Returns NULL if all are within tolerance otherwise the failure.
+ */
+static char * church_variants_within(double tolerance) {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    char golden[256];
+    size_t data_length, content_type_length;
+    char filepath[256];
+    double error;
+    int i;
+    int num_of_variants = sizeof(church_variants) / sizeof(char *);
+
+    for (i = 0; i < num_of_variants; ++i) {
+        sprintf(filepath, "docroot/img/%s", church_variants[i]);
+        sprintf(golden, "docroot/img/cmp/%s", church_variants[i]);
+        data = NULL;
+        imgaging_get_image_data(
+            filepath,
+            &data, &data_length,
+            &content_type, &content_type_length,
+            "", "",
+            70, "", 0
+        );
+        if (data == NULL) {
+            return "failed to create an image";
+        }
+        error = mean_error_to_golden(data, data_length, golden);
+        free(data);
+        free(content_type);
+        if (error > tolerance) {
+            printf("%s differs from its golden by %.2f\n", church_variants[i], error);
+            return "outside the tolerance of the goldens";
+        }
+        tests_run++;
+        printf(".");
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+// Tests for: imaging_set_resampler(IMAGING_RESAMPLER_FAST)
+mu_test_type test_imaging_resampler_fast() {
+    char *message;
+
+    imaging_set_resampler(IMAGING_RESAMPLER_FAST);
+    message = church_variants_within(4.0);
+    imaging_set_resampler(IMAGING_RESAMPLER_DEFAULT);
+    mu_assert(message, message == NULL);
+    mu_return_success;
+}
+
+// Tests for: imaging_set_crop_tolerance(8)
+mu_test_type test_imaging_crop_tolerance() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    ImageInfo *image_info;
+    ExceptionInfo exception;
+    Image *image;
+    unsigned long columns = 0, rows = 0;
+    int i;
+    // lossless (the centered box moves by 8px) & regular (misaligned) crops.
+    const char *files[] = {
+        "docroot/img/lg-image_c400x400.jpg",
+        "docroot/img/lg-image_c401x333.jpg",
+    };
+    const long tolerances[] = { 8, 0 };
+    const unsigned long sizes[][2] = { { 400, 400 }, { 401, 333 } };
+
+    for (i = 0; i < 2; ++i) {
+        imaging_set_crop_tolerance(tolerances[i]);
+        data = NULL;
+        imgaging_get_image_data(
+            files[i],
+            &data, &data_length,
+            &content_type, &content_type_length,
+            "", "",
+            70, "", 0
+        );
+        imaging_set_crop_tolerance(-1);
+        mu_assert("crop failed to create an image", data != NULL);
+        mu_assert("crop is a JPEG", strcmp(content_type, "image/jpeg") == 0);
+
+        image_info = CloneImageInfo((ImageInfo *) NULL);
+        GetExceptionInfo(&exception);
+        image = BlobToImage(image_info, data, data_length, &exception);
+        if (image != NULL) {
+            columns = image->columns;
+            rows = image->rows;
+            DestroyImage(image);
+        }
+        DestroyImageInfo(image_info);
+        DestroyExceptionInfo(&exception);
+        free(data);
+        free(content_type);
+        mu_assert("crop has the requested size",
+            columns == sizes[i][0] && rows == sizes[i][1]);
+    }
+    mu_return_success;
+}
+
+// Tests for: imaging_use_pool (enables the pool for the rest of the run)
+mu_test_type test_imaging_buffer_pool() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    imaging_pool_stats_t stats;
+    void *buffer, *reused;
+    int i;
+
+    imaging_use_pool(64 * 1024 * 1024, 0);
+    buffer = imaging_pool_alloc(IMAGING_POOL_MIN_SIZE * 2);
+    imaging_pool_free(buffer);
+    reused = imaging_pool_alloc(IMAGING_POOL_MIN_SIZE * 2 - 1);
+    mu_assert("freed buffers are reused", reused == buffer);
+    imaging_pool_free(reused);
+
+    // every render after the first recycles the resampler's pixel buffers.
+    imaging_set_resampler(IMAGING_RESAMPLER_FAST);
+    for (i = 0; i < 3; ++i) {
+        data = NULL;
+        imgaging_get_image_data(
+            "docroot/img/lg-image_t400.jpg",
+            &data, &data_length,
+            &content_type, &content_type_length,
+            "", "",
+            70, "", 0
+        );
+        if (data == NULL) {
+            imaging_set_resampler(IMAGING_RESAMPLER_DEFAULT);
+            mu_assert("pooled render failed to create an image", 0);
+        }
+        imaging_free(data);
+        imaging_free(content_type);
+    }
+    imaging_set_resampler(IMAGING_RESAMPLER_DEFAULT);
+    mu_assert("pool is enabled", imaging_pool_stats(&stats));
+    mu_assert("pool was hit", stats.hits > 1);
+    mu_return_success;
+}
+
+// Tests for: imaging_set_jpeg_direct(1)
+mu_test_type test_imaging_jpeg_direct() {
+    char *message;
+
+    imaging_set_jpeg_direct(1);
+    message = church_variants_within(4.0);
+    imaging_set_jpeg_direct(0);
+    mu_assert(message, message == NULL);
+    mu_return_success;
+}
+
+// Tests for: imaging_action_filter
+mu_test_type test_imaging_action_filter() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    const char *files[] = {
+        "docroot/img/lg-image_t400_fsharp.jpg",
+        "docroot/img/lg-image_t400_fsharp1.5.jpg",
+        "docroot/img/lg-image_t400_fblur2.jpg",
+        "docroot/img/lg-image_fblur0.5_t200.jpg",
+    };
+    int i;
+    int num_of_files = sizeof(files) / sizeof(char *);
+
+    for (i = 0; i < num_of_files; ++i) {
+        data = NULL;
+        imgaging_get_image_data(
+            files[i],
+            &data, &data_length,
+            &content_type, &content_type_length,
+            "", "",
+            70, "", 0
+        );
+        if (data == NULL) {
+            printf("%s was NULL!\n", files[i]);
+            mu_assert("filter failed to create an image", 0);
+        }
+        free(data);
+        free(content_type);
+    }
+
+    // unknown filters & amounts out of range aren't created.
+    data = NULL;
+    imgaging_get_image_data(
+        "docroot/img/lg-image_t400_fbogus.jpg",
+        &data, &data_length,
+        &content_type, &content_type_length,
+        "", "",
+        70, "", 0
+    );
+    mu_assert("unknown filter should fail", data == NULL);
+    imgaging_get_image_data(
+        "docroot/img/lg-image_t400_fblur99.jpg",
+        &data, &data_length,
+        &content_type, &content_type_length,
+        "", "",
+        70, "", 0
+    );
+    mu_assert("blur beyond the maximum should fail", data == NULL);
+    mu_return_success;
+}
+
+// Tests for: imaging_action_placeholder
+mu_test_type test_imaging_action_placeholder() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    ImageInfo *image_info;
+    ExceptionInfo exception;
+    Image *image;
+    unsigned long columns, rows;
+    int i;
+    // GraphicsMagick (size hinted decode) & libjpeg-turbo (DCT scaled) paths.
+    const char *files[] = {
+        "docroot/img/lg-image_p.jpg",
+        "docroot/img/lg-image_p20.jpg",
+        "docroot/img/lg-image_p.jpg",
+        "docroot/img/lg-image_c400x800_p.jpg",
+    };
+    const int direct[] = { 0, 0, 1, 0 };
+    const unsigned long sizes[][2] = { { 32, 26 }, { 20, 16 }, { 32, 26 }, { 16, 32 } };
+
+    for (i = 0; i < 4; ++i) {
+        imaging_set_jpeg_direct(direct[i]);
+        data = NULL;
+        imgaging_get_image_data(
+            files[i],
+            &data, &data_length,
+            &content_type, &content_type_length,
+            "", "",
+            70, "", 0
+        );
+        imaging_set_jpeg_direct(0);
+        mu_assert("placeholder failed to create an image", data != NULL);
+
+        columns = rows = 0;
+        image_info = CloneImageInfo((ImageInfo *) NULL);
+        GetExceptionInfo(&exception);
+        image = BlobToImage(image_info, data, data_length, &exception);
+        if (image != NULL) {
+            columns = image->columns;
+            rows = image->rows;
+            DestroyImage(image);
+        }
+        DestroyImageInfo(image_info);
+        DestroyExceptionInfo(&exception);
+        free(data);
+        free(content_type);
+        if (columns != sizes[i][0] || rows != sizes[i][1]) {
+            printf("%s is %lux%lu!\n", files[i], columns, rows);
+            mu_assert("placeholder has the wrong size", 0);
+        }
+    }
+
+    // placeholders are small.
+    data = NULL;
+    imgaging_get_image_data(
+        "docroot/img/lg-image_p65.jpg",
+        &data, &data_length,
+        &content_type, &content_type_length,
+        "", "",
+        70, "", 0
+    );
+    mu_assert("placeholder beyond the maximum should fail", data == NULL);
+    mu_return_success;
+}
+
+// Tests for: variants on disk which are older than their original
+mu_test_type test_imaging_stale_variant() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    const char *variant = "docroot/img/lg-image_t120.jpg";
+    struct utimbuf old = { 1, 1 };
+    struct stat st;
+    int i;
+
+    // written to disk, then made older than the original.
+    for (i = 0; i < 2; ++i) {
+        data = NULL;
+        imgaging_get_image_data(
+            variant,
+            &data, &data_length,
+            &content_type, &content_type_length,
+            "", "",
+            70, "", 1
+        );
+        mu_assert("variant failed to create an image", data != NULL);
+        free(data);
+        free(content_type);
+        if (i == 0) {
+            mu_assert("variant was written", utime(variant, &old) == 0);
+        }
+    }
+
+    // created (& written) again rather than served as it was.
+    i = stat(variant, &st);
+    remove(variant);
+    mu_assert("stale variant was created again", i == 0 && st.st_mtime > 1);
+    mu_return_success;
+}
+
+// Copies the file from to to, returns 1 if successful otherwise 0.
+static int copy_file(const char *from, const char *to) {
+    char buffer[8192];
+    size_t n;
+    FILE *in, *out;
+    int ok = 1;
+
+    in = fopen(from, "rb");
+    out = fopen(to, "wb");
+    if (in == NULL || out == NULL) {
+        ok = 0;
+    }
+    while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        ok = fwrite(buffer, 1, n, out) == n;
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    return ok;
+}
+
+// Tests for: originals named like a variant of an (newer) original
+mu_test_type test_imaging_stale_lookalike() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    const char *original = "docroot/img/lookalike.jpg";
+    const char *lookalike = "docroot/img/lookalike_photo.jpg";
+    struct utimbuf old = { 1, 1 };
+    int ok;
+
+    // "_photo" isn't an action, lookalike_photo.jpg is an original itself.
+    ok = copy_file("docroot/img/lg-image.jpg", lookalike) &&
+         utime(lookalike, &old) == 0 &&
+         copy_file("docroot/img/lg-image.jpg", original);
+    if (ok) {
+        imgaging_get_image_data(
+            lookalike,
+            &data, &data_length,
+            &content_type, &content_type_length,
+            "", "",
+            70, "", 0
+        );
+    }
+    remove(lookalike);
+    remove(original);
+    mu_assert("originals were copied", ok);
+    mu_assert("original named like a variant was served", data != NULL);
+    free(data);
+    free(content_type);
+    mu_return_success;
+}
+
+// Tests for: imaging_disk_variant, imaging_find_original
+mu_test_type test_imaging_disk_variant() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    char original[MaxTextExtent];
+    const char *variant = "docroot/img/lg-image_t120.jpg";
+    const char *lookalike = "docroot/img/lg-image_p2.jpg";
+    char tmp[MaxTextExtent];
+    struct stat st;
+    int written, copied, found, left;
+
+    imgaging_get_image_data(
+        variant,
+        &data, &data_length,
+        &content_type, &content_type_length,
+        "", "",
+        70, "", 1
+    );
+    free(data);
+    free(content_type);
+    written = imaging_disk_variant(variant, original) &&
+              strcmp(original, "docroot/img/lg-image.jpg") == 0;
+    found = imaging_find_original(variant, original) &&
+            strcmp(original, "docroot/img/lg-image.jpg") == 0;
+    // written through a temporary file renamed into place.
+    snprintf(tmp, sizeof(tmp), "%s.%ld", variant, (long)getpid());
+    left = stat(tmp, &st) == 0;
+    remove(variant);
+    mu_assert("variant written to disk names its original", written);
+    mu_assert("original of variant was found", found);
+    mu_assert("no temporary file is left", !left);
+
+    // named like a variant, but not written by the module: an original.
+    copied = copy_file("docroot/img/lg-image.jpg", lookalike);
+    written = imaging_disk_variant(lookalike, original);
+    found = imaging_find_original(lookalike, original);
+    remove(lookalike);
+    mu_assert("original was copied", copied);
+    mu_assert("original named like a variant isn't one", !written && !found);
+    mu_return_success;
+}
+
+// Tests for: imaging_set_stream_pixels
+mu_test_type test_imaging_stream_pixels() {
+    char *message;
+
+    // stream every original, whatever its size.
+    imaging_set_stream_pixels(1);
+    message = church_variants_within(4.0);
+    imaging_set_stream_pixels(0);
+    mu_assert(message, message == NULL);
+    mu_return_success;
+}
+
+// Tests for: imaging_set_pyramid_pixels
+// Removes the pyramid levels of original from the "pyramids" directory,
+// returns how many there were.
+static int remove_pyramid(const char *original) {
+    char level[MaxTextExtent];
+    int i, removed;
+
+    for (i = 1, removed = 0; i <= IMAGING_PYRAMID_MAX_LEVELS; i++) {
+        imaging_pyramid_name("pyramids", original, i, level);
+        removed += (remove(level) == 0);
+    }
+    return removed;
+}
+
+mu_test_type test_imaging_pyramid_pixels() {
+    char *message;
+    int built;
+
+    // the variants build the levels they need, the rest read them.
+    (void) mkdir("pyramids", 0755);
+    imaging_set_pyramid_path("pyramids");
+    imaging_set_pyramid_pixels(1);
+    message = church_variants_within(4.0);
+    imaging_set_pyramid_pixels(0);
+    imaging_set_pyramid_path(NULL);
+    built = remove_pyramid("docroot/img/scaled.insidechurch.jpg");
+    (void) rmdir("pyramids");
+    mu_assert(message, message == NULL);
+    mu_assert("pyramid levels were built", built > 0);
+    mu_assert("nothing beside the original",
+        !IsAccessible("docroot/img/scaled.insidechurch.jpg.2.miff"));
+    mu_return_success;
+}
+
+// A thumbnail 1 pixel wide of a wide original (0 rows high before clamping).
+mu_test_type test_imaging_pyramid_one_pixel() {
+    unsigned char *data = NULL;
+    char *content_type = NULL;
+    size_t data_length, content_type_length;
+    int built;
+
+    (void) mkdir("pyramids", 0755);
+    imaging_set_pyramid_path("pyramids");
+    imaging_set_pyramid_pixels(1);
+    imgaging_get_image_data("docroot/img/lg-image_t1.jpg",
+        &data, &data_length, &content_type, &content_type_length,
+        "", "", 70, "", 0);
+    imaging_set_pyramid_pixels(0);
+    imaging_set_pyramid_path(NULL);
+    built = remove_pyramid("docroot/img/lg-image.jpg");
+    (void) rmdir("pyramids");
+    mu_assert("a 1x1 thumbnail", data != NULL && imaging_last_failure() == IMAGING_FAILURE_NONE);
+    mu_assert("only the level needed is built", built == 1);
+    imaging_free(data);
+    free(content_type);
+    mu_return_success;
+}
+
 mu_test_type test_imaging_get_image_data_hash() {
     unsigned char *data = NULL;
     char *content_type = NULL;
@@ -161,11 +1200,39 @@ mu_test_type test_imaging_get_image_data_white_list() {
 mu_test_type all_tests(){
     //explodeFilePath
     mu_run_test(test_explodeFilePath);
+    mu_run_test(test_imaging_find_actions);
     
     //GetImageData
     mu_run_test(test_imaging_get_image_data);
     mu_run_test(test_imaging_get_image_data_hash);
     mu_run_test(test_imaging_get_image_data_white_list);
+    mu_run_test(test_imaging_action_filter);
+    mu_run_test(test_imaging_action_placeholder);
+    mu_run_test(test_imaging_stale_variant);
+    mu_run_test(test_imaging_stale_lookalike);
+    mu_run_test(test_imaging_disk_variant);
+    mu_run_test(test_imaging_resampler_fast);
+    mu_run_test(test_imaging_jpeg_direct);
+    mu_run_test(test_imaging_stream_pixels);
+    mu_run_test(test_imaging_pyramid_pixels);
+    mu_run_test(test_imaging_pyramid_one_pixel);
+    mu_run_test(test_imaging_crop_tolerance);
+    mu_run_test(test_imaging_buffer_pool);
+    mu_run_test(test_imaging_parse_actions);
+    mu_run_test(test_imaging_snap_actions);
+    mu_run_test(test_imaging_actions_hash);
+    mu_run_test(test_imaging_ctx_render_blob);
+    mu_run_test(test_imaging_get_image_data_from_blob);
+    mu_run_test(test_imaging_estimate_cost);
+    mu_run_test(test_imaging_get_meta);
+    mu_run_test(test_imaging_border_max);
+    mu_run_test(test_imaging_passthrough);
+    mu_run_test(test_imaging_jpeg_profile);
+    mu_run_test(test_imaging_mmap);
+    mu_run_test(test_imaging_last_failure);
+    mu_run_test(test_imaging_abort);
+    mu_run_test(test_imaging_ctx_abort);
+    mu_run_test(test_imaging_ctx);
     mu_return_success;
 }
 